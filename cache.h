@@ -0,0 +1,563 @@
+#ifndef MASSDNS_CACHE_H
+#define MASSDNS_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "casefold.h"
+#include "dns.h"
+#include "hashmap.h"
+#include "security.h"
+#include "timed_ring.h"
+
+// Answer cache: The record sets of accepted replies are kept by owner name and type until their TTL expires, and
+// negative replies by the name and type of the question for the negative TTL of RFC 2308. Lookups are answered from
+// the cache by following CNAME records from one record set to the next, so that names sharing a CNAME target only
+// resolve the target once. NS record sets of the authority section are kept as well. Record data is kept with names
+// uncompressed, so that answers can be assembled into a packet of their own. The cache has a fixed capacity and
+// evicts record sets by the clock algorithm, preferring expired ones.
+
+#define CACHE_DATA_SIZE 0x200 // Record data of a record set, larger record sets are not cached
+#define CACHE_MAX_CHAIN 8 // Maximum number of CNAME records followed for an answer
+
+typedef struct
+{
+    size_t hits; // Lookups that have been answered from the cache
+    size_t chained; // Hits that have been assembled from several record sets
+    size_t misses;
+    size_t expired; // Record sets that have been found but have expired
+    size_t stored; // Record sets that have been added or refreshed
+    size_t evictions;
+} cache_stats_t;
+
+typedef struct
+{
+    dns_name_t name; // Case-folded owner name in wire format
+    uint16_t type;
+} cache_key_t;
+
+typedef struct
+{
+    cache_key_t key;
+    bool referenced; // Second chance within the clock eviction
+    bool negative; // The name or type does not exist, rcode tells which one
+    uint8_t rcode;
+    uint16_t count;
+    uint16_t length;
+    uint64_t expires; // Monotonic time in seconds
+    size_t reply; // Number of the reply the record set has been filled from
+    uint8_t data[CACHE_DATA_SIZE]; // Record data preceded by its length in network byte order for each record
+} cache_entry_t;
+
+typedef struct
+{
+    cache_entry_t *entries;
+    size_t capacity;
+    size_t used;
+    size_t hand; // Next entry to be considered for eviction
+    size_t replies; // Replies that have been stored
+    Hashmap *index;
+    cache_stats_t stats;
+} cache_t;
+
+int cache_hash_key(void *key)
+{
+    cache_key_t *cache_key = key;
+    return (int) hash_bytes(cache_key->name.name, cache_key->name.length, cache_key->type);
+}
+
+bool cache_keys_eq(void *key1, void *key2)
+{
+    cache_key_t *cache_key1 = key1;
+    cache_key_t *cache_key2 = key2;
+    return cache_key1->type == cache_key2->type && cache_key1->name.length == cache_key2->name.length
+           && memcmp(cache_key1->name.name, cache_key2->name.name, cache_key1->name.length) == 0;
+}
+
+static inline uint64_t cache_now()
+{
+    return monotonic_ns() / TIMED_RING_S;
+}
+
+bool cache_init(cache_t *cache, size_t capacity)
+{
+    bzero(cache, sizeof(*cache));
+    cache->index = hashmapCreate(capacity, cache_hash_key, cache_keys_eq);
+    if(cache->index == NULL)
+    {
+        return false;
+    }
+    cache->entries = safe_calloc(capacity * sizeof(*cache->entries));
+    cache->capacity = capacity;
+    return true;
+}
+
+void cache_free(cache_t *cache)
+{
+    if(cache->index)
+    {
+        hashmapFree(cache->index);
+    }
+    free(cache->entries);
+    cache->index = NULL;
+    cache->entries = NULL;
+}
+
+// Sets the key to the case-folded wire format of a name. Returns false if the name is malformed.
+bool cache_key_set(cache_key_t *key, uint8_t *name, size_t length, uint16_t type)
+{
+    if(length == 0 || length > sizeof(key->name.name))
+    {
+        return false;
+    }
+    casefold(key->name.name, name, length);
+    key->name.length = (uint8_t) length;
+    key->type = type;
+    return true;
+}
+
+// Returns the record set of a key unless it does not exist or has expired.
+cache_entry_t *cache_get(cache_t *cache, cache_key_t *key, uint64_t now)
+{
+    cache_entry_t *entry = hashmapGet(cache->index, key);
+    if(entry == NULL)
+    {
+        return NULL;
+    }
+    if(entry->expires <= now)
+    {
+        // Record sets that have not been cached completely have expired at zero.
+        cache->stats.expired += entry->expires != 0;
+        return NULL;
+    }
+    entry->referenced = true;
+    return entry;
+}
+
+// Returns the record set of a key for being filled, which is either the existing one or a new one replacing the record
+// set chosen by the clock algorithm. Expired record sets are evicted without a second chance and record sets filled
+// from the current reply are skipped. Returns NULL if every record set has been filled from the current reply.
+cache_entry_t *cache_insert(cache_t *cache, cache_key_t *key, uint64_t now)
+{
+    cache_entry_t *entry = hashmapGet(cache->index, key);
+    if(entry != NULL)
+    {
+        return entry;
+    }
+    if(cache->used < cache->capacity)
+    {
+        entry = cache->entries + cache->used++;
+    }
+    else
+    {
+        // Two rounds suffice for finding an entry whose second chance has been used up within the first round.
+        for(size_t i = 0; i < 2 * cache->capacity; i++)
+        {
+            cache_entry_t *candidate = cache->entries + cache->hand;
+            cache->hand = (cache->hand + 1) % cache->capacity;
+            if(candidate->reply == cache->replies)
+            {
+                continue;
+            }
+            if(candidate->referenced && candidate->expires > now)
+            {
+                candidate->referenced = false;
+                continue;
+            }
+            hashmapRemove(cache->index, &candidate->key);
+            cache->stats.evictions++;
+            entry = candidate;
+            break;
+        }
+        if(entry == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    entry->key = *key;
+    entry->referenced = false;
+    entry->reply = SIZE_MAX;
+    hashmapPut(cache->index, &entry->key, entry);
+    return entry;
+}
+
+// Marks a record set as expired, which keeps further records of the set within the same reply from being added.
+void cache_invalidate(cache_entry_t *entry)
+{
+    entry->expires = 0;
+    entry->referenced = false;
+}
+
+// Copies record data to dst, expanding the names within the data of the well-known types that may be compressed as
+// listed by RFC 3597, section 4. Returns the length of the copy or zero if it does not fit or is malformed. The data of
+// the types that consist of a single name must not contain anything else, as it is taken as a name when answering.
+size_t cache_copy_data(dns_record_view_t *rec, uint8_t *begin, uint8_t *end, uint8_t *dst, size_t size)
+{
+    uint8_t *data_end = rec->data + rec->length;
+    size_t prefix = 0;
+    size_t names = 1;
+    bool trailing = true; // Whether data may follow the names
+    switch(rec->type)
+    {
+        case DNS_REC_NS:
+        case DNS_REC_CNAME:
+        case DNS_REC_PTR:
+        case DNS_REC_DNAME:
+            trailing = false;
+            break;
+        case DNS_REC_MX:
+            prefix = 2;
+            break;
+        case DNS_REC_SRV:
+            prefix = 6;
+            break;
+        case DNS_REC_SOA:
+            names = 2;
+            break;
+        default:
+            if(rec->length > size)
+            {
+                return 0;
+            }
+            memcpy(dst, rec->data, rec->length);
+            return rec->length;
+    }
+
+    uint8_t name[0xFF];
+    uint8_t *next = rec->data + prefix;
+    size_t length = prefix;
+    if(next > data_end || prefix > size)
+    {
+        return 0;
+    }
+    memcpy(dst, rec->data, prefix);
+    for(size_t i = 0; i < names; i++)
+    {
+        size_t name_len = dns_wire_name_expand(begin, end, next, name, &next);
+        if(name_len == 0 || next > data_end || length + name_len > size)
+        {
+            return 0;
+        }
+        memcpy(dst + length, name, name_len);
+        length += name_len;
+    }
+    if((!trailing && next != data_end) || length + (size_t) (data_end - next) > size)
+    {
+        return 0;
+    }
+    memcpy(dst + length, next, (size_t) (data_end - next));
+    return length + (size_t) (data_end - next);
+}
+
+// Negative TTL of a reply, which is the minimum of the TTL and the MINIMUM field of the SOA record within the
+// authority section. Returns zero if there is no SOA record.
+uint32_t cache_negative_ttl(dns_head_t *head, uint8_t *begin, size_t len, uint8_t *next)
+{
+    dns_record_iter_t iter;
+    dns_record_view_t rec;
+
+    dns_record_iter_init(&iter, begin, len, next, &head->header);
+    while(dns_record_iter_next(&iter, &rec))
+    {
+        if(rec.section == DNS_SECTION_AUTHORITY && rec.type == DNS_REC_SOA && rec.length >= 22)
+        {
+            uint32_t minimum = ntohl(*(uint32_t *) (rec.data + rec.length - 4));
+            return rec.ttl < minimum ? rec.ttl : minimum;
+        }
+    }
+    return 0;
+}
+
+// Appends a record to the record set, which is reset if it has been filled from a previous reply. Duplicate records
+// are dropped, which occur if the NS record set of a zone is within both the answer and the authority section.
+void cache_append(cache_t *cache, cache_entry_t *entry, dns_record_view_t *rec, uint8_t *begin, uint8_t *end,
+                  uint64_t now)
+{
+    if(entry->reply != cache->replies)
+    {
+        entry->reply = cache->replies;
+        entry->negative = false;
+        entry->rcode = DNS_RCODE_OK;
+        entry->count = 0;
+        entry->length = 0;
+        entry->expires = UINT64_MAX;
+        cache->stats.stored++;
+    }
+    else if(entry->expires <= now)
+    {
+        return; // A previous record of the set has not been cached.
+    }
+    if(rec->ttl == 0 || entry->length + 2 > sizeof(entry->data))
+    {
+        cache_invalidate(entry);
+        return;
+    }
+
+    uint8_t *record = entry->data + entry->length;
+    size_t length = cache_copy_data(rec, begin, end, record + 2, sizeof(entry->data) - entry->length - 2);
+    if(length == 0 && rec->length != 0)
+    {
+        cache_invalidate(entry);
+        return;
+    }
+    for(uint8_t *other = entry->data; other < record; other += 2 + ntohs(*(uint16_t *) other))
+    {
+        if(ntohs(*(uint16_t *) other) == length && memcmp(other + 2, record + 2, length) == 0)
+        {
+            return;
+        }
+    }
+    *(uint16_t *) record = htons((uint16_t) length);
+    entry->length += (uint16_t) (length + 2);
+    entry->count++;
+    if(now + rec->ttl < entry->expires)
+    {
+        entry->expires = now + rec->ttl;
+    }
+}
+
+// Adds a record of a reply to the record set of its owner name, which is in uncompressed wire format. Returns false if
+// the name is malformed.
+bool cache_store_record(cache_t *cache, dns_record_view_t *rec, uint8_t *name, size_t name_len, uint8_t *begin,
+                        uint8_t *end, uint64_t now)
+{
+    cache_key_t key;
+    if(!cache_key_set(&key, name, name_len, rec->type))
+    {
+        return false;
+    }
+    cache_entry_t *entry = cache_insert(cache, &key, now);
+    if(entry != NULL)
+    {
+        cache_append(cache, entry, rec, begin, end, now);
+    }
+    return true;
+}
+
+// Adds the record sets of an accepted reply, whose question has been parsed up to the first record at next.
+void cache_store(cache_t *cache, dns_head_t *head, uint8_t *begin, size_t len, uint8_t *next)
+{
+    dns_record_iter_t iter;
+    dns_record_view_t rec;
+    cache_key_t key;
+    uint8_t name[0xFF];
+    uint64_t now = cache_now();
+    uint8_t *end = begin + len;
+
+    if(head->header.tc || (head->header.rcode != DNS_RCODE_OK && head->header.rcode != DNS_RCODE_NXDOMAIN))
+    {
+        return;
+    }
+    cache->replies++;
+
+    if(head->header.ans_count == 0)
+    {
+        uint32_t ttl = cache_negative_ttl(head, begin, len, next);
+        size_t name_len = dns_wire_name_expand(begin, end, begin + DNS_HEADER_SIZE, name, NULL);
+        if(ttl == 0 || !cache_key_set(&key, name, name_len, head->question.type))
+        {
+            return;
+        }
+        cache_entry_t *entry = cache_insert(cache, &key, now);
+        if(entry == NULL)
+        {
+            return;
+        }
+        entry->reply = cache->replies;
+        entry->negative = true;
+        entry->rcode = head->header.rcode;
+        entry->count = 0;
+        entry->length = 0;
+        entry->expires = now + ttl;
+        cache->stats.stored++;
+    }
+
+    dns_record_iter_init(&iter, begin, len, next, &head->header);
+    while(dns_record_iter_next(&iter, &rec))
+    {
+        if(rec.class != DNS_CLS_IN || (rec.section != DNS_SECTION_ANSWER
+                                       && (rec.section != DNS_SECTION_AUTHORITY || rec.type != DNS_REC_NS)))
+        {
+            continue;
+        }
+        size_t name_len = dns_wire_name_expand(begin, end, rec.name, name, NULL);
+        if(!cache_store_record(cache, &rec, name, name_len, begin, end, now))
+        {
+            break;
+        }
+    }
+}
+
+// Adds the record sets of a referral: the NS record set of the delegated zone from the authority section and the
+// addresses of its name servers from the additional section. Addresses are only accepted for names within the
+// bailiwick, which is the zone of the server that has sent the referral. Names are in uncompressed wire format.
+void cache_store_referral(cache_t *cache, dns_head_t *head, uint8_t *begin, size_t len, uint8_t *next,
+                          uint8_t *zone, size_t zone_len, uint8_t *bailiwick, size_t bailiwick_len)
+{
+    dns_record_iter_t iter;
+    dns_record_view_t rec;
+    uint8_t name[0xFF];
+    uint64_t now = cache_now();
+    uint8_t *end = begin + len;
+
+    cache->replies++;
+    dns_record_iter_init(&iter, begin, len, next, &head->header);
+    while(dns_record_iter_next(&iter, &rec))
+    {
+        bool delegation = rec.section == DNS_SECTION_AUTHORITY && rec.type == DNS_REC_NS;
+        bool glue = rec.section == DNS_SECTION_ADDITIONAL && (rec.type == DNS_REC_A || rec.type == DNS_REC_AAAA);
+        if(rec.class != DNS_CLS_IN || (!delegation && !glue))
+        {
+            continue;
+        }
+        size_t name_len = dns_wire_name_expand(begin, end, rec.name, name, NULL);
+        if(name_len == 0)
+        {
+            break;
+        }
+        if(delegation ? name_len != zone_len || !casefold_eq(name, zone, zone_len)
+                      : dns_wire_name_in_zone(name, name_len, bailiwick, bailiwick_len) == NULL)
+        {
+            continue;
+        }
+        cache_store_record(cache, &rec, name, name_len, begin, end, now);
+    }
+}
+
+// Appends a resource record to an answer packet. Returns false if the packet is full.
+static bool cache_write_record(uint8_t **pos, uint8_t *end, uint8_t *owner, size_t owner_len, uint16_t type,
+                               uint32_t ttl, uint8_t *data, uint16_t length)
+{
+    if(*pos + owner_len + 10 + length > end)
+    {
+        return false;
+    }
+    memcpy(*pos, owner, owner_len);
+    *pos += owner_len;
+    *(uint16_t *) *pos = htons(type);
+    *(uint16_t *) (*pos + 2) = htons(DNS_CLS_IN);
+    *(uint32_t *) (*pos + 4) = htonl(ttl);
+    *(uint16_t *) (*pos + 8) = htons(length);
+    memcpy(*pos + 10, data, length);
+    *pos += 10 + length;
+    return true;
+}
+
+// Assembles a reply to a question from the cache, following CNAME records. The question name is in wire format.
+// Returns the length of the reply within the buffer or zero if the cache cannot answer the question.
+size_t cache_answer(cache_t *cache, uint8_t *qname, size_t qname_len, uint16_t type, bool rd, uint8_t *buf,
+                    size_t size)
+{
+    cache_key_t key;
+    uint64_t now = cache_now();
+    uint8_t *end = buf + size;
+    uint8_t *pos = buf + DNS_HEADER_SIZE;
+    uint16_t answers = 0;
+    uint8_t rcode = DNS_RCODE_OK;
+
+    if(DNS_HEADER_SIZE + qname_len + 4 > size || !cache_key_set(&key, qname, qname_len, type))
+    {
+        return 0;
+    }
+    memcpy(pos, qname, qname_len);
+    pos += qname_len;
+    *(uint16_t *) pos = htons(type);
+    *(uint16_t *) (pos + 2) = htons(DNS_CLS_IN);
+    pos += 4;
+
+    // The owner of the first record set is the question name, later ones are written in full once and referred to
+    // by a compression pointer afterwards.
+    uint8_t owner[0xFF];
+    size_t owner_len = 2;
+    owner[0] = 0xC0;
+    owner[1] = DNS_HEADER_SIZE;
+
+    size_t hops = 0;
+    while(true)
+    {
+        cache_entry_t *entry = cache_get(cache, &key, now);
+        bool alias = false;
+        if(entry == NULL && type != DNS_REC_CNAME)
+        {
+            key.type = DNS_REC_CNAME;
+            entry = cache_get(cache, &key, now);
+            key.type = type;
+            alias = true;
+            if(entry != NULL && (entry->negative || entry->count != 1))
+            {
+                entry = NULL;
+            }
+        }
+        if(entry == NULL)
+        {
+            cache->stats.misses++;
+            return 0;
+        }
+        if(entry->negative)
+        {
+            rcode = entry->rcode;
+            break;
+        }
+
+        uint32_t ttl = (uint32_t) (entry->expires - now);
+        uint8_t *record = entry->data;
+        for(uint16_t i = 0; i < entry->count; i++)
+        {
+            uint16_t length = ntohs(*(uint16_t *) record);
+            uint8_t *written = pos;
+            if(!cache_write_record(&pos, end, owner, owner_len, entry->key.type, ttl, record + 2, length))
+            {
+                cache->stats.misses++;
+                return 0;
+            }
+            answers++;
+            if(i == 0 && owner_len > 2 && written - buf < 0x4000)
+            {
+                owner_len = 2;
+                owner[0] = (uint8_t) (0xC0 | ((written - buf) >> 8));
+                owner[1] = (uint8_t) (written - buf);
+            }
+            record += 2 + length;
+        }
+        if(!alias)
+        {
+            break;
+        }
+
+        // Continue with the target of the CNAME record, which is the only record of its set.
+        if(++hops > CACHE_MAX_CHAIN)
+        {
+            cache->stats.misses++;
+            return 0;
+        }
+        owner_len = ntohs(*(uint16_t *) entry->data);
+        if(owner_len > sizeof(owner))
+        {
+            cache->stats.misses++;
+            return 0;
+        }
+        memcpy(owner, entry->data + 2, owner_len);
+        if(!cache_key_set(&key, owner, owner_len, type))
+        {
+            cache->stats.misses++;
+            return 0;
+        }
+    }
+
+    cache->stats.hits++;
+    if(hops > 0)
+    {
+        cache->stats.chained++;
+    }
+    bzero(buf, DNS_HEADER_SIZE);
+    buf[2] = (uint8_t) (0x80 | (rd ? 0x01 : 0x00));
+    buf[3] = (uint8_t) (0x80 | rcode);
+    *(uint16_t *) (buf + 4) = htons(1);
+    *(uint16_t *) (buf + 6) = htons(answers);
+    return (size_t) (pos - buf);
+}
+
+#endif //MASSDNS_CACHE_H
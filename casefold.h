@@ -0,0 +1,175 @@
+#ifndef MASSDNS_CASEFOLD_H
+#define MASSDNS_CASEFOLD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+// Case folding of DNS names as specified by RFC 4343: Only the ASCII letters A to Z are folded, independent of the
+// locale, and all other bytes are left untouched. Blocks of 32 or 16 bytes are processed using AVX2 or SSE2 if the
+// compiler targets them, shorter strings eight bytes at a time within a 64-bit word.
+
+static inline uint8_t casefold_byte(uint8_t c)
+{
+    return (uint8_t) (c | (((unsigned int) (c - 'A') < 26) << 5));
+}
+
+static inline uint64_t casefold_word(uint64_t word)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t low = word & (0x7F * ones);
+
+    // The highest bit of each byte is set if the byte is at least 'A' and at most 'Z' respectively.
+    uint64_t from_a = low + (0x80 - 'A') * ones;
+    uint64_t beyond_z = low + (0x80 - 'Z' - 1) * ones;
+    uint64_t letters = (from_a ^ beyond_z) & ~word & (0x80 * ones);
+    return word | (letters >> 2);
+}
+
+#if defined(__AVX2__)
+static inline __m256i casefold_avx2(__m256i v)
+{
+    // After subtracting 'A' + 128 with wrap-around, the letters are exactly the bytes below -128 + 26.
+    __m256i shifted = _mm256_sub_epi8(v, _mm256_set1_epi8((char) ('A' + 128)));
+    __m256i letters = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), shifted);
+    return _mm256_or_si256(v, _mm256_and_si256(letters, _mm256_set1_epi8(0x20)));
+}
+#endif
+
+#if defined(__SSE2__)
+static inline __m128i casefold_sse2(__m128i v)
+{
+    __m128i shifted = _mm_sub_epi8(v, _mm_set1_epi8((char) ('A' + 128)));
+    __m128i letters = _mm_cmpgt_epi8(_mm_set1_epi8(-128 + 26), shifted);
+    return _mm_or_si128(v, _mm_and_si128(letters, _mm_set1_epi8(0x20)));
+}
+#endif
+
+static inline uint64_t casefold_load_word(const uint8_t *src)
+{
+    uint64_t word;
+    memcpy(&word, src, sizeof(word));
+    return casefold_word(word);
+}
+
+// Writes the folded bytes of src to dst, which may be equal to src. If the length is not a multiple of the block size,
+// the last block overlaps with the previous one, which is harmless as folding is idempotent.
+void casefold(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    if(len >= 32)
+    {
+        for(; i + 32 <= len; i += 32)
+        {
+            _mm256_storeu_si256((__m256i *) (dst + i), casefold_avx2(_mm256_loadu_si256((const __m256i *) (src + i))));
+        }
+        if(i < len)
+        {
+            _mm256_storeu_si256((__m256i *) (dst + len - 32),
+                                casefold_avx2(_mm256_loadu_si256((const __m256i *) (src + len - 32))));
+        }
+        return;
+    }
+#endif
+#if defined(__SSE2__)
+    if(len >= 16)
+    {
+        for(; i + 16 <= len; i += 16)
+        {
+            _mm_storeu_si128((__m128i *) (dst + i), casefold_sse2(_mm_loadu_si128((const __m128i *) (src + i))));
+        }
+        if(i < len)
+        {
+            _mm_storeu_si128((__m128i *) (dst + len - 16),
+                             casefold_sse2(_mm_loadu_si128((const __m128i *) (src + len - 16))));
+        }
+        return;
+    }
+#endif
+    if(len >= 8)
+    {
+        uint64_t word;
+        for(; i + 8 <= len; i += 8)
+        {
+            word = casefold_load_word(src + i);
+            memcpy(dst + i, &word, sizeof(word));
+        }
+        if(i < len)
+        {
+            word = casefold_load_word(src + len - 8);
+            memcpy(dst + len - 8, &word, sizeof(word));
+        }
+        return;
+    }
+    for(; i < len; i++)
+    {
+        dst[i] = casefold_byte(src[i]);
+    }
+}
+
+// Compares two byte strings of the same length, ignoring the case of letters. Like casefold, the last block may
+// overlap with the previous one.
+bool casefold_eq(const uint8_t *a, const uint8_t *b, size_t len)
+{
+#if defined(__AVX2__)
+    if(len >= 32)
+    {
+        for(size_t i = 0; i < len; i += 32)
+        {
+            size_t at = i + 32 <= len ? i : len - 32;
+            __m256i va = casefold_avx2(_mm256_loadu_si256((const __m256i *) (a + at)));
+            __m256i vb = casefold_avx2(_mm256_loadu_si256((const __m256i *) (b + at)));
+            if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != -1)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+#endif
+#if defined(__SSE2__)
+    if(len >= 16)
+    {
+        for(size_t i = 0; i < len; i += 16)
+        {
+            size_t at = i + 16 <= len ? i : len - 16;
+            __m128i va = casefold_sse2(_mm_loadu_si128((const __m128i *) (a + at)));
+            __m128i vb = casefold_sse2(_mm_loadu_si128((const __m128i *) (b + at)));
+            if(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+#endif
+    if(len >= 8)
+    {
+        for(size_t i = 0; i < len; i += 8)
+        {
+            size_t at = i + 8 <= len ? i : len - 8;
+            if(casefold_load_word(a + at) != casefold_load_word(b + at))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    for(size_t i = 0; i < len; i++)
+    {
+        if(casefold_byte(a[i]) != casefold_byte(b[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif //MASSDNS_CASEFOLD_H
@@ -0,0 +1,77 @@
+#ifndef MASSDNS_CONSENSUS_H
+#define MASSDNS_CONSENSUS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dns.h"
+#include "hashmap.h"
+
+// Consensus mode: Every name is sent to several distinct resolvers at once. Each reply is reduced to a vote, which is
+// a hash of the response code and the set of answers, so that a lookup occupies a fixed amount of memory regardless
+// of the size of the replies. The first answer set shared by a strict majority of the resolvers is the result, and
+// resolvers that vote differently are scored as disagreeing.
+
+#define CONSENSUS_MAX 16 // Maximum number of resolvers a single name is sent to
+#define CONSENSUS_FLAG_MIN_VOTES 16 // Votes of a resolver required before it may be flagged
+#define CONSENSUS_FLAG_PERCENT 10 // Share of disagreeing votes above which a resolver is flagged
+#define CONSENSUS_UNASSIGNED UINT32_MAX // Resolver index of a vote that has not been sent yet
+
+typedef enum
+{
+    CONSENSUS_VOTE_PENDING, // To be sent with the next transmission
+    CONSENSUS_VOTE_SENT,
+    CONSENSUS_VOTE_ANSWERED
+} consensus_vote_state_t;
+
+typedef struct
+{
+    uint64_t hash; // Hash of the response code and the answer set once answered
+    uint32_t resolver; // Index within the resolver list
+    uint8_t state;
+} consensus_vote_t;
+
+// Hashes the response code and the answer records of a reply independent of the order of the records.
+uint64_t consensus_reply_hash(dns_head_t *head, uint8_t *begin, size_t len, uint8_t *next)
+{
+    dns_record_iter_t iter;
+    dns_record_view_t rec;
+    uint64_t sum = 0;
+
+    dns_record_iter_init(&iter, begin, len, next, &head->header);
+    while(dns_record_iter_next(&iter, &rec) && rec.section == DNS_SECTION_ANSWER)
+    {
+        sum += dns_record_view_hash(&rec, begin, begin + len);
+    }
+    return hash_bytes(&sum, sizeof(sum), head->header.rcode);
+}
+
+// Number of answered votes with the specified hash
+size_t consensus_count(consensus_vote_t *votes, size_t count, uint64_t hash)
+{
+    size_t result = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(votes[i].state == CONSENSUS_VOTE_ANSWERED && votes[i].hash == hash)
+        {
+            result++;
+        }
+    }
+    return result;
+}
+
+// Whether the resolver has been assigned to any vote apart from the one with the excluded index
+bool consensus_resolver_used(consensus_vote_t *votes, size_t count, uint32_t resolver, size_t excluded)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        if(i != excluded && votes[i].resolver == resolver)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif //MASSDNS_CONSENSUS_H
@@ -9,6 +9,9 @@
 #include <inttypes.h>
 #include <ctype.h>
 
+#include "casefold.h"
+#include "hashmap.h"
+
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #define max(a, b) ((a) > (b) ? (a) : (b))
 #define elements(a) (sizeof(a) / sizeof((a)[0]))
@@ -44,6 +47,7 @@ typedef enum
     DNS_REC_NSEC3 = 50,
     DNS_REC_NSEC3PARAM = 51,
     DNS_REC_OPENPGPKEY = 61,
+    DNS_REC_OPT = 41,
     DNS_REC_PTR = 12,
     DNS_REC_RP = 17,
     DNS_REC_RRSIG = 46,
@@ -550,6 +554,9 @@ typedef enum
 } dns_opcode;
 
 const size_t DNS_PACKET_MINIMUM_SIZE = 17; // as we handle them
+const size_t DNS_HEADER_SIZE = 12;
+#define DNS_NAME_STR_SIZE (0xFF * 4) // Text form of a name with every byte escaped
+#define DNS_DATA_STR_SIZE 0x40000 // Text form of record data of the maximum length with every byte escaped
 // 12 bytes header + 1 byte question name + 2 bytes question class + 2 bytes question type
 
 typedef struct
@@ -621,6 +628,44 @@ typedef struct
     dns_filtered_body_t body;
 } dns_pkt_t;
 
+// Record within a packet, which refers to the owner name and the data within the packet instead of copying them.
+typedef struct
+{
+    uint8_t *name; // Owner name in wire format, possibly compressed
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t length;
+    uint8_t *data;
+    dns_section_t section;
+} dns_record_view_t;
+
+#define DNS_EDNS_FLAG_DO 0x8000 // DNSSEC OK flag within the TTL field of the OPT record
+#define DNS_EDNS_OPTION_COOKIE 10
+#define DNS_COOKIE_CLIENT_SIZE 8
+#define DNS_COOKIE_MAX_SIZE 40 // Client cookie followed by a server cookie of up to 32 bytes (RFC 7873)
+
+// EDNS information of a packet from its OPT pseudo-record
+typedef struct
+{
+    bool present;
+    uint16_t udp_size;
+    uint8_t extended_rcode; // Upper eight bits of the twelve-bit response code
+    uint8_t version;
+    bool dnssec_ok;
+    uint8_t cookie_len; // Zero if the packet does not have a cookie option
+    uint8_t cookie[DNS_COOKIE_MAX_SIZE];
+} dns_edns_t;
+
+typedef struct
+{
+    uint8_t *begin; // Beginning of the packet, which compression pointers are relative to
+    const uint8_t *end; // exclusive
+    uint8_t *next; // First byte of the next record
+    dns_header_t *header;
+    uint16_t index; // Index of the next record over all sections
+} dns_record_iter_t;
+
 typedef struct
 {
     uint8_t length;
@@ -648,15 +693,12 @@ static inline bool is_valid_label_char(int c)
 
 static bool parse_name(uint8_t *begin, uint8_t *buf, const uint8_t *end, uint8_t *name, uint8_t *len, uint8_t **next)
 {
-    static uint8_t first;
-    static int label_type;
-    static int label_len;
-    static int name_len;
-    static uint8_t *pointer;
+    uint8_t first;
+    int label_type;
+    int label_len = 0;
+    int name_len = 0;
+    uint8_t *pointer = NULL;
 
-    label_len = 0;
-    pointer = NULL;
-    name_len = 0;
     while (true)
     {
         if (buf >= end)
@@ -667,6 +709,10 @@ static bool parse_name(uint8_t *begin, uint8_t *buf, const uint8_t *end, uint8_t
         label_type = (first & 0xC0);
         if (label_type == 0xC0) // Compressed
         {
+            if (buf + 2 > end)
+            {
+                return false;
+            }
             if (next && !pointer)
             {
                 *next = buf + 2;
@@ -733,7 +779,7 @@ static inline void dns_buffer_set_id(uint8_t *buf, uint16_t id)
 
 char *dns_class2str(dns_class cls)
 {
-    static char numbuf[16];
+    static _Thread_local char numbuf[16];
 
     switch(cls)
     {
@@ -755,7 +801,7 @@ char *dns_class2str(dns_class cls)
 
 char *dns_opcode2str(dns_opcode opcode)
 {
-    static char numbuf[16];
+    static _Thread_local char numbuf[16];
 
     switch(opcode)
     {
@@ -777,7 +823,7 @@ char *dns_opcode2str(dns_opcode opcode)
 
 char *dns_rcode2str(dns_rcode rcode)
 {
-    static char numbuf[16];
+    static _Thread_local char numbuf[16];
 
     switch (rcode)
     {
@@ -825,7 +871,7 @@ char *dns_rcode2str(dns_rcode rcode)
 
 char *dns_record_type2str(dns_record_type type)
 {
-    static char numbuf[16];
+    static _Thread_local char numbuf[16];
 
     switch (type)
     {
@@ -883,6 +929,8 @@ char *dns_record_type2str(dns_record_type type)
             return "NSEC3PARAM";
         case DNS_REC_OPENPGPKEY:
             return "OPENPGPKEY";
+        case DNS_REC_OPT:
+            return "OPT";
         case DNS_REC_PTR:
             return "PTR";
         case DNS_REC_RRSIG:
@@ -917,15 +965,10 @@ char *dns_record_type2str(dns_record_type type)
 
 ssize_t dns_str2namebuf(const char *name, uint8_t *buffer)
 {
-    static uint8_t *bufname;
-    static uint8_t *lenptr;
-    static uint8_t total_len;
-    static uint8_t label_len;
-
-    lenptr = buffer; // points to the byte containing the label length
-    bufname = buffer + 1; // points to the first byte of the actual name
-    total_len = 0;
-    label_len = 0;
+    uint8_t *lenptr = buffer; // points to the byte containing the label length
+    uint8_t *bufname = buffer + 1; // points to the first byte of the actual name
+    uint8_t total_len = 0;
+    uint8_t label_len = 0;
 
     while (true)
     {
@@ -971,7 +1014,7 @@ ssize_t dns_str2namebuf(const char *name, uint8_t *buffer)
 
 ssize_t dns_question_create_from_name(uint8_t *buffer, dns_name_t *name, dns_record_type type, uint16_t id)
 {
-    static uint8_t *aftername;
+    uint8_t *aftername;
 
     memcpy(buffer + 12, name->name, name->length);
     aftername = buffer + 12 + name->length;
@@ -980,13 +1023,14 @@ ssize_t dns_question_create_from_name(uint8_t *buffer, dns_name_t *name, dns_rec
     *((uint16_t *) aftername) = htons(type);
     *((uint16_t *) (aftername + 2)) = htons(DNS_CLS_IN);
     *((uint16_t *) (buffer + 4)) = htons(0x0001);
+    bzero(buffer + 6, 6); // The buffer may hold a previous message with records
     return aftername + 4 - buffer;
 }
 
 // Requires a buffer of at least 272 bytes to be supplied
 static ssize_t dns_question_create(uint8_t *buffer, char *name, dns_record_type type, uint16_t id)
 {
-    static uint8_t *aftername;
+    uint8_t *aftername;
 
     ssize_t name_len = dns_str2namebuf(name, buffer + 12);
     if(name_len < 0)
@@ -1000,9 +1044,61 @@ static ssize_t dns_question_create(uint8_t *buffer, char *name, dns_record_type
     *((uint16_t *) aftername) = htons(type);
     *((uint16_t *) (aftername + 2)) = htons(DNS_CLS_IN);
     *((uint16_t *) (buffer + 4)) = htons(0x0001);
+    bzero(buffer + 6, 6); // The buffer may hold a previous message with records
     return aftername + 4 - buffer;
 }
 
+// Appends an OPT record (RFC 6891) to a question of the specified length within a buffer of the specified size. The
+// cookie consists of the client cookie and the server cookie, if known, and is left out if its length is zero. Returns
+// the new length of the question or -1 if the record does not fit.
+ssize_t dns_question_add_edns(uint8_t *buffer, size_t len, size_t size, uint16_t udp_size, bool dnssec_ok,
+                              const uint8_t *cookie, size_t cookie_len)
+{
+    size_t options_len = cookie_len > 0 ? 4 + cookie_len : 0;
+    if(cookie_len > DNS_COOKIE_MAX_SIZE || len + 11 + options_len > size)
+    {
+        return -1;
+    }
+    uint8_t *record = buffer + len;
+    record[0] = 0; // The owner is the root
+    *((uint16_t *) (record + 1)) = htons(DNS_REC_OPT);
+    *((uint16_t *) (record + 3)) = htons(udp_size);
+    *((uint32_t *) (record + 5)) = htonl(dnssec_ok ? DNS_EDNS_FLAG_DO : 0); // Extended rcode and version zero
+    *((uint16_t *) (record + 9)) = htons((uint16_t) options_len);
+    if(cookie_len > 0)
+    {
+        *((uint16_t *) (record + 11)) = htons(DNS_EDNS_OPTION_COOKIE);
+        *((uint16_t *) (record + 13)) = htons((uint16_t) cookie_len);
+        memcpy(record + 15, cookie, cookie_len);
+    }
+    *((uint16_t *) (buffer + 10)) = htons(1);
+    return (ssize_t) (len + 11 + options_len);
+}
+
+// Appends a resource record to a message of the specified length within a buffer of the specified size and counts it
+// within its section, which must not precede the sections of the records already contained. The owner is given in wire
+// format and may end with a compression pointer. Returns the new length of the message or -1 if the record does not fit.
+ssize_t dns_message_add_record(uint8_t *buffer, size_t len, size_t size, dns_section_t section, const uint8_t *owner,
+                               size_t owner_len, dns_record_type type, uint16_t cls, uint32_t ttl, const uint8_t *data,
+                               uint16_t data_len)
+{
+    if(section == DNS_SECTION_QUESTION || len + owner_len + 10 + data_len > size)
+    {
+        return -1;
+    }
+    uint8_t *record = buffer + len;
+    memcpy(record, owner, owner_len);
+    record += owner_len;
+    *((uint16_t *) record) = htons(type);
+    *((uint16_t *) (record + 2)) = htons(cls);
+    *((uint32_t *) (record + 4)) = htonl(ttl);
+    *((uint16_t *) (record + 8)) = htons(data_len);
+    memcpy(record + 10, data, data_len);
+    uint16_t *count = (uint16_t *) (buffer + 4 + 2 * section);
+    *count = htons((uint16_t) (ntohs(*count) + 1));
+    return (ssize_t) (len + owner_len + 10 + data_len);
+}
+
 bool dns_send_question(uint8_t *buffer, char *name, dns_record_type type, uint16_t id, int fd, struct sockaddr_storage *addr)
 {
     ssize_t result = dns_question_create(buffer, name, type, id);
@@ -1021,11 +1117,10 @@ bool dns_send_question(uint8_t *buffer, char *name, dns_record_type type, uint16
 
 bool dns_parse_question(uint8_t *buf, size_t len, dns_head_t *head, uint8_t **body_begin)
 {
-    static uint8_t *end; // exclusive
-    static bool name_parsed;
-    static uint8_t *qname_end;
+    uint8_t *end = buf + len; // exclusive
+    bool name_parsed;
+    uint8_t *qname_end;
 
-    end = buf + len;
     if (len < DNS_PACKET_MINIMUM_SIZE)
     {
         return false;
@@ -1051,12 +1146,12 @@ bool dns_parse_question(uint8_t *buf, size_t len, dns_head_t *head, uint8_t **bo
     {
         return false;
     }
-    name_parsed = parse_name(buf, buf + 12, end, head->question.name.name, &head->question.name.length, &qname_end);
-    if (qname_end + 2 > end)
+    name_parsed = parse_name(buf, buf + DNS_HEADER_SIZE, end, head->question.name.name, &head->question.name.length, &qname_end);
+    if (!name_parsed)
     {
         return false;
     }
-    if (!name_parsed)
+    if (qname_end + 4 > end)
     {
         return false;
     }
@@ -1075,14 +1170,7 @@ bool dns_names_eq(dns_name_t *name1, dns_name_t *name2)
     {
         return false;
     }
-    for(uint8_t i = 0; i < name1->length; i++)
-    {
-        if(tolower(name1->name[i]) != tolower(name2->name[i]))
-        {
-            return false;
-        }
-    }
-    return true;
+    return casefold_eq(name1->name, name2->name, name1->length);
 }
 
 bool dns_raw_names_eq(dns_name_t *name1, dns_name_t *name2)
@@ -1090,6 +1178,22 @@ bool dns_raw_names_eq(dns_name_t *name1, dns_name_t *name2)
     return name1->length == name2->length && memcmp(name1->name, name2->name, name1->length) == 0;
 }
 
+dns_section_t dns_get_section(uint16_t index, dns_header_t *header)
+{
+    if(index < header->ans_count)
+    {
+        return DNS_SECTION_ANSWER;
+    }
+    else if(index < header->ans_count + header->auth_count)
+    {
+        return DNS_SECTION_AUTHORITY;
+    }
+    else
+    {
+        return DNS_SECTION_ADDITIONAL;
+    }
+}
+
 bool dns_parse_record_raw(uint8_t *begin, uint8_t *buf, const uint8_t *end, uint8_t **next, dns_record_t *record)
 {
     if (!parse_name(begin, buf, end, record->name.name, &record->name.length, next))
@@ -1159,10 +1263,9 @@ bool dns_parse_record(uint8_t *begin, uint8_t *buf, const uint8_t *end, uint8_t
 
 bool dns_parse_body(uint8_t *buf, uint8_t *begin, const uint8_t *end, dns_pkt_t *packet)
 {
-    static uint8_t *next;
-    static uint16_t i;
+    uint8_t *next = buf;
+    uint16_t i;
 
-    next = buf;
     for (i = 0; i < min(packet->head.header.ans_count, elements(packet->body.ans) - 1); i++)
     {
         if (!dns_parse_record(begin, next, end, &next, &packet->body.ans[i]))
@@ -1205,6 +1308,282 @@ bool dns_parse_reply(uint8_t *buf, size_t len, dns_pkt_t *packet)
     return dns_parse_body(body_begin, buf, buf + len, packet);
 }
 
+// Advances past a name without decompressing it. Compression pointers are validated when the name is used.
+static bool skip_name(uint8_t *buf, const uint8_t *end, uint8_t **next)
+{
+    size_t name_len = 0;
+    while(buf < end)
+    {
+        uint8_t label_type = (uint8_t) (*buf & 0xC0);
+        if(label_type == 0xC0) // Compressed, the name ends with the pointer
+        {
+            if(buf + 2 > end)
+            {
+                return false;
+            }
+            *next = buf + 2;
+            return true;
+        }
+        else if(label_type != 0x00)
+        {
+            return false;
+        }
+        uint8_t label_len = *buf;
+        name_len += label_len + 1;
+        if(name_len >= 0xFF)
+        {
+            return false;
+        }
+        if(label_len == 0)
+        {
+            *next = buf + 1;
+            return true;
+        }
+        buf += label_len + 1;
+    }
+    return false;
+}
+
+void dns_record_iter_init(dns_record_iter_t *iter, uint8_t *begin, size_t len, uint8_t *first, dns_header_t *header)
+{
+    iter->begin = begin;
+    iter->end = begin + len;
+    iter->next = first;
+    iter->header = header;
+    iter->index = 0;
+}
+
+// Parses the fixed fields of the next record. Returns false at the end of the packet or at a malformed record.
+bool dns_record_iter_next(dns_record_iter_t *iter, dns_record_view_t *record)
+{
+    uint8_t *fields;
+    if(!skip_name(iter->next, iter->end, &fields) || fields + 10 > iter->end)
+    {
+        return false;
+    }
+    record->name = iter->next;
+    record->type = ntohs((*(uint16_t *) fields));
+    record->class = ntohs((*(uint16_t *) (fields + 2)));
+    record->ttl = ntohl((*(uint32_t *) (fields + 4)));
+    record->length = ntohs((*(uint16_t *) (fields + 8)));
+    record->data = fields + 10;
+    if(record->data + record->length > iter->end)
+    {
+        return false;
+    }
+    record->section = dns_get_section(iter->index++, iter->header);
+    iter->next = record->data + record->length;
+    return true;
+}
+
+// Whether a record is the OPT pseudo-record, which does not carry any data of the zone
+static inline bool dns_record_view_is_opt(dns_record_view_t *rec)
+{
+    return rec->type == DNS_REC_OPT && rec->section == DNS_SECTION_ADDITIONAL;
+}
+
+// Parses the OPT record within the additional section of a packet whose question has been parsed up to next, which
+// tells whether the packet uses EDNS. Returns false if the packet has several OPT records or a malformed one.
+bool dns_parse_edns(uint8_t *begin, size_t len, uint8_t *next, dns_header_t *header, dns_edns_t *edns)
+{
+    dns_record_iter_t iter;
+    dns_record_view_t rec;
+
+    edns->present = false;
+    edns->cookie_len = 0;
+    dns_record_iter_init(&iter, begin, len, next, header);
+    while(dns_record_iter_next(&iter, &rec))
+    {
+        if(!dns_record_view_is_opt(&rec))
+        {
+            continue;
+        }
+        if(edns->present || rec.name[0] != 0)
+        {
+            return false;
+        }
+        edns->present = true;
+        edns->udp_size = rec.class;
+        edns->extended_rcode = (uint8_t) (rec.ttl >> 24);
+        edns->version = (uint8_t) (rec.ttl >> 16);
+        edns->dnssec_ok = (rec.ttl & DNS_EDNS_FLAG_DO) != 0;
+
+        uint8_t *options_end = rec.data + rec.length;
+        for(uint8_t *option = rec.data; option < options_end;)
+        {
+            if(option + 4 > options_end)
+            {
+                return false;
+            }
+            uint16_t code = ntohs(*((uint16_t *) option));
+            uint16_t length = ntohs(*((uint16_t *) (option + 2)));
+            if(option + 4 + length > options_end)
+            {
+                return false;
+            }
+            if(code == DNS_EDNS_OPTION_COOKIE && length >= DNS_COOKIE_CLIENT_SIZE && length <= DNS_COOKIE_MAX_SIZE)
+            {
+                memcpy(edns->cookie, option + 4, length);
+                edns->cookie_len = (uint8_t) length;
+            }
+            option += 4 + length;
+        }
+    }
+    return true;
+}
+
+// Twelve-bit response code consisting of the extended response code of the OPT record and the one of the header
+static inline uint16_t dns_edns_rcode(dns_header_t *header, dns_edns_t *edns)
+{
+    return (uint16_t) (edns->present ? (edns->extended_rcode << 4) | header->rcode : header->rcode);
+}
+
+// Decompresses the owner name of a record obtained from the iterator.
+bool dns_record_view_name(dns_record_iter_t *iter, dns_record_view_t *record, dns_name_t *name)
+{
+    return parse_name(iter->begin, record->name, iter->end, name->name, &name->length, NULL);
+}
+
+// Follows compression pointers until the next label, which may only point backwards as within parse_name.
+static bool resolve_name_pointers(uint8_t *begin, const uint8_t *end, uint8_t **name)
+{
+    while((**name & 0xC0) == 0xC0)
+    {
+        if(*name + 2 > end)
+        {
+            return false;
+        }
+        uint8_t *pointer = begin + (htons(*((uint16_t *) *name)) & 0x3FFF);
+        if(pointer >= *name)
+        {
+            return false;
+        }
+        *name = pointer;
+    }
+    return true;
+}
+
+// Compares two names within a packet in wire format, ignoring the case of letters like dns_names_eq.
+bool dns_wire_names_eq(uint8_t *begin, const uint8_t *end, uint8_t *name1, uint8_t *name2)
+{
+    size_t name_len = 0;
+    while(true)
+    {
+        if(name1 >= end || name2 >= end
+           || !resolve_name_pointers(begin, end, &name1) || !resolve_name_pointers(begin, end, &name2))
+        {
+            return false;
+        }
+        if(name1 == name2) // Both names end with the same labels within the packet
+        {
+            return true;
+        }
+        uint8_t label_len = *name1;
+        if(label_len != *name2 || label_len > 0x3F)
+        {
+            return false;
+        }
+        if(label_len == 0)
+        {
+            return true;
+        }
+        name_len += label_len + 1;
+        if(name_len >= 0xFF || name1 + label_len + 1 > end || name2 + label_len + 1 > end)
+        {
+            return false;
+        }
+        if(!casefold_eq(name1 + 1, name2 + 1, label_len))
+        {
+            return false;
+        }
+        name1 += label_len + 1;
+        name2 += label_len + 1;
+    }
+}
+
+// Copies a name within a packet to dst in uncompressed wire format, which requires 0xFF bytes. Returns the length of
+// the copy or zero if the name is malformed. If next is not NULL, it is set to the first byte following the name.
+size_t dns_wire_name_expand(uint8_t *begin, const uint8_t *end, uint8_t *name, uint8_t *dst, uint8_t **next)
+{
+    size_t name_len = 0;
+    bool followed = false;
+    while(true)
+    {
+        if(name >= end)
+        {
+            return 0;
+        }
+        if((*name & 0xC0) == 0xC0)
+        {
+            if(next != NULL && !followed)
+            {
+                *next = name + 2;
+            }
+            followed = true;
+            if(!resolve_name_pointers(begin, end, &name) || name >= end)
+            {
+                return 0;
+            }
+        }
+        uint8_t label_len = *name;
+        if(label_len > 0x3F || name + label_len + 1 > end || name_len + label_len + 1 > 0xFF)
+        {
+            return 0;
+        }
+        memcpy(dst + name_len, name, label_len + 1);
+        name_len += label_len + 1;
+        if(label_len == 0)
+        {
+            if(next != NULL && !followed)
+            {
+                *next = name + 1;
+            }
+            return name_len;
+        }
+        name += label_len + 1;
+    }
+}
+
+// Number of labels of an uncompressed name in wire format, not counting the root label.
+size_t dns_wire_name_labels(const uint8_t *name)
+{
+    size_t labels = 0;
+    for(; *name != 0; name += *name + 1)
+    {
+        labels++;
+    }
+    return labels;
+}
+
+// Suffix of an uncompressed name in wire format that consists of its last labels.
+uint8_t *dns_wire_name_suffix(uint8_t *name, size_t labels)
+{
+    for(size_t skip = dns_wire_name_labels(name) - labels; skip > 0; skip--)
+    {
+        name += *name + 1;
+    }
+    return name;
+}
+
+// Returns the suffix of an uncompressed name in wire format that equals the zone ignoring case, or NULL if the name is
+// not within the zone.
+uint8_t *dns_wire_name_in_zone(uint8_t *name, size_t name_len, const uint8_t *zone, size_t zone_len)
+{
+    uint8_t *end = name + name_len;
+    for(uint8_t *suffix = name; suffix < end; suffix += *suffix + 1)
+    {
+        if((size_t) (end - suffix) == zone_len)
+        {
+            return casefold_eq(suffix, zone, zone_len) ? suffix : NULL;
+        }
+        if(*suffix == 0)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
 void dns_buf_set_qr(uint8_t *buf, bool value)
 {
     buf[2] &= 0x7F;
@@ -1217,6 +1596,24 @@ void dns_buf_set_rd(uint8_t *buf, bool value)
     buf[2] |= value;
 }
 
+void dns_buf_set_aa(uint8_t *buf, bool value)
+{
+    buf[2] &= 0xFB;
+    buf[2] |= value << 2;
+}
+
+void dns_buf_set_tc(uint8_t *buf, bool value)
+{
+    buf[2] &= 0xFD;
+    buf[2] |= value << 1;
+}
+
+void dns_buf_set_ra(uint8_t *buf, bool value)
+{
+    buf[3] &= 0x7F;
+    buf[3] |= value << 7;
+}
+
 void dns_buf_set_rcode(uint8_t *buf, uint8_t code)
 {
     buf[3] &= 0xF0;
@@ -1269,7 +1666,7 @@ bool dns_print_readable(char **buf, size_t buflen, const uint8_t *source, size_t
             }
             *((*buf)++) = '\\';
             *((*buf)++) = 'x';
-            char hex1 = (char)((source[i] >> 8) & 0xF);
+            char hex1 = (char)((source[i] >> 4) & 0xF);
             char hex2 = (char)(source[i] & 0xF);
             *((*buf)++) = (char)(hex1 + (hex1 < 10 ? '0' : ('a' - 10)));
             *((*buf)++) = (char)(hex2 + (hex2 < 10 ? '0' : ('a' - 10)));
@@ -1279,98 +1676,121 @@ bool dns_print_readable(char **buf, size_t buflen, const uint8_t *source, size_t
     return true;
 }
 
-char* dns_name2str(dns_name_t *name)
+// Writes the text form of a name to a caller-owned buffer of at least one byte, DNS_NAME_STR_SIZE bytes always suffice.
+char* dns_name2str_r(dns_name_t *name, char *buf, size_t len)
 {
-    static char buf[0xFF * 4];
-
     char *ptr = buf;
-    dns_print_readable(&ptr, sizeof(buf), name->name, name->length);
+    dns_print_readable(&ptr, len, name->name, name->length);
     return buf;
 }
 
+// Not reentrant, the returned buffer is overwritten by the next call.
+char* dns_name2str(dns_name_t *name)
+{
+    static char buf[DNS_NAME_STR_SIZE];
+    return dns_name2str_r(name, buf, sizeof(buf));
+}
+
 void dns_question2str(dns_question_t *question, char *buf, size_t len)
 {
+    char name[DNS_NAME_STR_SIZE];
+
     snprintf(buf, len, "%s %s %s",
-             dns_name2str(&question->name),
+             dns_name2str_r(&question->name, name, sizeof(name)),
              dns_class2str((dns_class)question->class),
              dns_record_type2str(question->type));
 }
 
-char* dns_raw_record_data2str(dns_record_t *record, uint8_t *begin, uint8_t *end)
+// Appends a character to a string that is being formatted, the buffer always remains terminated.
+static inline bool dns_str_append(char **ptr, char *buf_end, char c)
 {
-    static char buf[0xFFFF0];
-    static dns_name_t name;
+    if(*ptr >= buf_end - 1)
+    {
+        return false;
+    }
+    *((*ptr)++) = c;
+    **ptr = 0;
+    return true;
+}
 
+// Writes the text form of the record data to a caller-owned buffer of at least one byte. The text is truncated if the
+// buffer is too small, DNS_DATA_STR_SIZE bytes always suffice.
+char* dns_record_view_data2str_r(dns_record_view_t *record, uint8_t *begin, uint8_t *end, char *buf, size_t len)
+{
+    dns_name_t name;
     char *ptr = buf;
+    char *buf_end = buf + len;
+    int written;
 
+    *buf = 0;
     switch(record->type)
     {
         case DNS_REC_NS:
         case DNS_REC_CNAME:
         case DNS_REC_DNAME:
         case DNS_REC_PTR:
-            parse_name(begin, record->data.raw, end, name.name, &name.length, NULL);
-            dns_print_readable(&ptr, sizeof(buf), name.name, name.length);
+            if(!parse_name(begin, record->data, end, name.name, &name.length, NULL))
+            {
+                goto raw;
+            }
+            dns_print_readable(&ptr, (size_t)(buf_end - ptr), name.name, name.length);
             break;
         case DNS_REC_MX:
-            if(record->length < 3)
+            if(record->length < 3 || !parse_name(begin, record->data + 2, end, name.name, &name.length, NULL))
             {
                 goto raw;
             }
-            parse_name(begin, record->data.raw + 2, end, name.name, &name.length, NULL);
-            int no = sprintf(buf, "%" PRIu16 " ", ntohs(*((uint16_t*)record->data.raw)));
-            ptr += no;
-            dns_print_readable(&ptr, sizeof(buf), name.name, name.length);
+            written = snprintf(ptr, (size_t)(buf_end - ptr), "%" PRIu16 " ", ntohs(*((uint16_t*)record->data)));
+            if(written < 0 || written >= buf_end - ptr)
+            {
+                break;
+            }
+            ptr += written;
+            dns_print_readable(&ptr, (size_t)(buf_end - ptr), name.name, name.length);
             break;
         case DNS_REC_TXT:
         {
-            uint8_t *record_end = record->data.raw + record->length;
-            uint8_t *data_ptr = record->data.raw;
+            uint8_t *record_end = record->data + record->length;
+            uint8_t *data_ptr = record->data;
             while(data_ptr < record_end)
             {
                 uint8_t length = *(data_ptr++);
-                if (data_ptr + length <= record_end)
-                {
-                    *(ptr++) = '"';
-                    dns_print_readable(&ptr, sizeof(buf), data_ptr, length);
-                    data_ptr += length;
-                    *(ptr++) = '"';
-                    *(ptr++) = ' ';
-                }
-                else
+                if(data_ptr + length > record_end
+                   || !dns_str_append(&ptr, buf_end, '"')
+                   || !dns_print_readable(&ptr, (size_t)(buf_end - ptr), data_ptr, length)
+                   || !dns_str_append(&ptr, buf_end, '"')
+                   || !dns_str_append(&ptr, buf_end, ' '))
                 {
                     break;
                 }
+                data_ptr += length;
             }
-            *ptr = 0;
             break;
         }
         case DNS_REC_SOA:
         {
             uint8_t *next;
             // We have 5 32-bit values plus two names.
-            if (record->length < 22)
+            if (record->length < 22 || !parse_name(begin, record->data, end, name.name, &name.length, &next))
             {
                 goto raw;
             }
+            dns_print_readable(&ptr, (size_t)(buf_end - ptr), name.name, name.length);
+            dns_str_append(&ptr, buf_end, ' ');
 
-            parse_name(begin, record->data.raw, end, name.name, &name.length, &next);
-            dns_print_readable(&ptr, sizeof(buf), name.name, name.length);
-            *(ptr++) = ' ';
-
-            if(next + 20 >= record->data.raw + record->length)
+            if(next + 20 >= record->data + record->length
+               || !parse_name(begin, next, end, name.name, &name.length, &next))
             {
                 goto raw;
             }
-            parse_name(begin, next, end, name.name, &name.length, &next);
-            dns_print_readable(&ptr, sizeof(buf), name.name, name.length);
-            *(ptr++) = ' ';
-            if(next + 20 > record->data.raw + record->length)
+            dns_print_readable(&ptr, (size_t)(buf_end - ptr), name.name, name.length);
+            dns_str_append(&ptr, buf_end, ' ');
+            if(next + 20 > record->data + record->length)
             {
                 goto raw;
             }
 
-            sprintf(ptr, "%" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32,
+            snprintf(ptr, (size_t)(buf_end - ptr), "%" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32,
                     ntohl(*((uint32_t*)next)),
                     ntohl(*(((uint32_t*)next) + 1)),
                     ntohl(*(((uint32_t*)next) + 2)),
@@ -1383,57 +1803,77 @@ char* dns_raw_record_data2str(dns_record_t *record, uint8_t *begin, uint8_t *end
             {
                 goto raw;
             }
-            inet_ntop(AF_INET, record->data.raw, buf, sizeof(buf));
+            if(inet_ntop(AF_INET, record->data, buf, (socklen_t) len) == NULL)
+            {
+                *buf = 0;
+            }
             break;
         case DNS_REC_AAAA:
             if(record->length != 16)
             {
                 goto raw;
             }
-            inet_ntop(AF_INET6, record->data.raw, buf, sizeof(buf));
+            if(inet_ntop(AF_INET6, record->data, buf, (socklen_t) len) == NULL)
+            {
+                *buf = 0;
+            }
             break;
         case DNS_REC_CAA:
-            if(record->length < 2 || record->data.raw[1] < 1 || record->data.raw[1] > 15
-               || record->data.raw[1] + 2 > record->length)
+            if(record->length < 2 || record->data[1] < 1 || record->data[1] > 15
+               || record->data[1] + 2 > record->length)
             {
                 goto raw;
             }
-            int written = sprintf(ptr, "%" PRIu8 " ", (uint8_t)(record->data.raw[0] >> 7));
-            if(written < 0)
+            written = snprintf(ptr, (size_t)(buf_end - ptr), "%" PRIu8 " ", (uint8_t)(record->data[0] >> 7));
+            if(written < 0 || written >= buf_end - ptr)
             {
-                return buf;
+                break;
             }
             ptr += written;
-            dns_print_readable(&ptr, sizeof(buf), record->data.raw + 2, record->data.raw[1]);
-            *(ptr++) = ' ';
-            *(ptr++) = '"';
-            dns_print_readable(&ptr, sizeof(buf), record->data.raw + 2 + record->data.raw[1],
-                               (size_t)(record->length - record->data.raw[1] - 2));
-            *(ptr++) = '"';
-            *ptr = 0;
+            dns_print_readable(&ptr, (size_t)(buf_end - ptr), record->data + 2, record->data[1]);
+            if(dns_str_append(&ptr, buf_end, ' ') && dns_str_append(&ptr, buf_end, '"')
+               && dns_print_readable(&ptr, (size_t)(buf_end - ptr), record->data + 2 + record->data[1],
+                                     (size_t)(record->length - record->data[1] - 2)))
+            {
+                dns_str_append(&ptr, buf_end, '"');
+            }
             break;
         raw:
         default:
-            dns_print_readable(&ptr, sizeof(buf), record->data.raw, record->length);
-            *ptr = 0;
+            ptr = buf; // Discard partially formatted data
+            dns_print_readable(&ptr, len, record->data, record->length);
     }
     return buf;
 }
 
-dns_section_t dns_get_section(uint16_t index, dns_header_t *header)
+// Not reentrant, the returned buffer is overwritten by the next call.
+char* dns_record_view_data2str(dns_record_view_t *record, uint8_t *begin, uint8_t *end)
 {
-    if(index < header->ans_count)
-    {
-        return DNS_SECTION_ANSWER;
-    }
-    else if(index < header->ans_count + header->auth_count)
-    {
-        return DNS_SECTION_AUTHORITY;
-    }
-    else
-    {
-        return DNS_SECTION_ADDITIONAL;
-    }
+    static char buf[DNS_DATA_STR_SIZE];
+    return dns_record_view_data2str_r(record, begin, end, buf, sizeof(buf));
+}
+
+#define DNS_HASH_DATA_SIZE 0x1000 // Longer record data is hashed by its prefix only
+
+// Hashes the type and the case-folded text form of the record data, which does not depend on name compression. The
+// owner name and the TTL are left out, so that equal answers from different sources have equal hashes.
+uint64_t dns_record_view_hash(dns_record_view_t *record, uint8_t *begin, uint8_t *end)
+{
+    char data[DNS_HASH_DATA_SIZE];
+
+    dns_record_view_data2str_r(record, begin, end, data, sizeof(data));
+    size_t len = strlen(data);
+    casefold((uint8_t*)data, (uint8_t*)data, len);
+    return hash_bytes(data, len, record->type);
+}
+
+char* dns_raw_record_data2str(dns_record_t *record, uint8_t *begin, uint8_t *end)
+{
+    dns_record_view_t view;
+    view.type = record->type;
+    view.length = record->length;
+    view.data = record->data.raw;
+    return dns_record_view_data2str(&view, begin, end);
 }
 
 char *dns_section2str(dns_section_t section)
@@ -1463,51 +1903,88 @@ bool dns_in_zone(dns_name_t *name, dns_name_t *zone)
 
 }
 
-void dns_print_packet(FILE *f, dns_pkt_t *packet, uint8_t *begin, size_t len, uint8_t *next)
+// Prints the packet to the file similar to dig. The caller-owned buffer holds the question and record data in text form,
+// which are truncated if it is smaller than DNS_DATA_STR_SIZE bytes.
+void dns_print_packet_r(FILE *f, dns_head_t *head, uint8_t *begin, size_t len, uint8_t *next, char *buf,
+                        size_t buf_len)
 {
-    static char buf[0xFFFF];
-    static dns_record_t rec;
+    char name_buf[DNS_NAME_STR_SIZE];
+    dns_name_t name;
+    dns_record_iter_t iter;
+    dns_record_view_t rec;
+    dns_edns_t edns;
 
+    if(!dns_parse_edns(begin, len, next, &head->header, &edns))
+    {
+        edns.present = false;
+    }
     fprintf(f,
              ";; ->>HEADER<<- opcode: %s, status: %s, id: %"PRIu16"\n"
-             ";; flags: %s%s%s%s%s; QUERY: %" PRIu16 ", ANSWER: %" PRIu16 ", AUTHORITY: %" PRIu16 ", ADDITIONAL: %" PRIu16 "\n\n"
-             ";; QUESTION SECTION:\n",
-             dns_opcode2str((dns_opcode)packet->head.header.opcode),
-             dns_rcode2str((dns_rcode)packet->head.header.rcode),
-             packet->head.header.id,
-             packet->head.header.qr ? "qr " : "",
-             packet->head.header.ad ? "ad " : "",
-             packet->head.header.aa ? "aa " : "",
-             packet->head.header.rd ? "rd " : "",
-             packet->head.header.ra ? "ra " : "",
-             packet->head.header.q_count,
-             packet->head.header.ans_count,
-             packet->head.header.auth_count,
-             packet->head.header.add_count
+             ";; flags: %s%s%s%s%s; QUERY: %" PRIu16 ", ANSWER: %" PRIu16 ", AUTHORITY: %" PRIu16 ", ADDITIONAL: %" PRIu16 "\n\n",
+             dns_opcode2str((dns_opcode)head->header.opcode),
+             dns_rcode2str((dns_rcode)dns_edns_rcode(&head->header, &edns)),
+             head->header.id,
+             head->header.qr ? "qr " : "",
+             head->header.ad ? "ad " : "",
+             head->header.aa ? "aa " : "",
+             head->header.rd ? "rd " : "",
+             head->header.ra ? "ra " : "",
+             head->header.q_count,
+             head->header.ans_count,
+             head->header.auth_count,
+             head->header.add_count
     );
 
-    dns_question2str(&packet->head.question, buf, sizeof(buf));
+    // The OPT record is shown as a pseudo-section like dig does, the cookie in hexadecimal.
+    if(edns.present)
+    {
+        fprintf(f, ";; OPT PSEUDOSECTION:\n; EDNS: version: %" PRIu8 ", flags:%s; udp: %" PRIu16 "\n",
+                edns.version, edns.dnssec_ok ? " do" : "", edns.udp_size);
+        if(edns.cookie_len > 0)
+        {
+            fprintf(f, "; COOKIE: ");
+            for(uint8_t i = 0; i < edns.cookie_len; i++)
+            {
+                fprintf(f, "%02x", edns.cookie[i]);
+            }
+            fprintf(f, "\n");
+        }
+        fprintf(f, "\n");
+    }
+    fprintf(f, ";; QUESTION SECTION:\n");
+
+    dns_question2str(&head->question, buf, buf_len);
     fprintf(f, "%s\n", buf);
 
-    uint16_t i = 0;
     dns_section_t section = DNS_SECTION_QUESTION;
-    while(dns_parse_record_raw(begin, next, begin + len, &next, &rec))
+    dns_record_iter_init(&iter, begin, len, next, &head->header);
+    while(dns_record_iter_next(&iter, &rec) && dns_record_view_name(&iter, &rec, &name))
     {
-        dns_section_t new_section = dns_get_section(i++, &packet->head.header);
-        if(new_section != section)
+        if(dns_record_view_is_opt(&rec))
+        {
+            continue;
+        }
+        if(rec.section != section)
         {
-            fprintf(f, "\n;; %s SECTION:\n", dns_section2str(new_section));
-            section = new_section;
+            fprintf(f, "\n;; %s SECTION:\n", dns_section2str(rec.section));
+            section = rec.section;
         }
         fprintf(f,
                 "%s %" PRIu32 " %s %s %s\n",
-                dns_name2str(&rec.name),
+                dns_name2str_r(&name, name_buf, sizeof(name_buf)),
                 rec.ttl,
                 dns_class2str((dns_class)rec.class),
                 dns_record_type2str((dns_record_type) rec.type),
-                dns_raw_record_data2str(&rec, begin, begin + len));
+                dns_record_view_data2str_r(&rec, begin, begin + len, buf, buf_len));
     }
     fprintf(f, "\n\n");
 }
 
+// Not reentrant, uses a static buffer.
+void dns_print_packet(FILE *f, dns_head_t *head, uint8_t *begin, size_t len, uint8_t *next)
+{
+    static char buf[DNS_DATA_STR_SIZE];
+    dns_print_packet_r(f, head, begin, len, next, buf, sizeof(buf));
+}
+
 #endif //MASSRESOLVER_DNS_H
@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 // http://www.cse.yorku.ca/~oz/hash.html
@@ -39,6 +40,87 @@ int hash_string(void *str)
     return (int) hash_djb2((unsigned char *) str);
 }
 
+// Multiplies two 64-bit values, leaving the lower half of the product in a and the upper half in b (wyhash's mum).
+static inline void hash_mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t) *a * *b;
+    *a = (uint64_t) product;
+    *b = (uint64_t) (product >> 64);
+#else
+    uint64_t ha = *a >> 32, la = (uint32_t) *a, hb = *b >> 32, lb = (uint32_t) *b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32);
+    uint64_t lo = t + (rm1 << 32);
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+    *a = lo;
+#endif
+}
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+    hash_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t hash_read8(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_read4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Hash of a byte string following the construction of wyhash (https://github.com/wangyi-fudan/wyhash), which processes
+// 16 bytes per multiplication and therefore hashes typical domain names with two to three multiplications.
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed)
+{
+    static const uint64_t secret[] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL};
+    const uint8_t *p = data;
+    uint64_t a;
+    uint64_t b;
+
+    seed ^= hash_mix(seed ^ secret[0], secret[1]);
+    if(len <= 16)
+    {
+        if(len >= 4)
+        {
+            a = (hash_read4(p) << 32) | hash_read4(p + ((len >> 3) << 2));
+            b = (hash_read4(p + len - 4) << 32) | hash_read4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if(len > 0)
+        {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t i = len;
+        while(i > 16)
+        {
+            seed = hash_mix(hash_read8(p) ^ secret[1], hash_read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hash_read8(p + i - 16);
+        b = hash_read8(p + i - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    hash_mum(&a, &b);
+    return hash_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
 
 typedef struct Entry Entry;
 struct Entry {
@@ -90,15 +172,16 @@ Hashmap* hashmapCreate(size_t initialCapacity,
 __attribute__((no_sanitize("integer")))
 #endif
 static inline int hashKey(Hashmap* map, void* key) {
-    int h = map->hash(key);
+    // Computed without sign, as shifting into the sign bit is undefined.
+    unsigned int h = (unsigned int) map->hash(key);
     // We apply this secondary hashing discovered by Doug Lea to defend
     // against bad hashes.
     h += ~(h << 9);
-    h ^= (((unsigned int) h) >> 14);
+    h ^= (h >> 14);
     h += (h << 4);
-    h ^= (((unsigned int) h) >> 10);
+    h ^= (h >> 10);
        
-    return h;
+    return (int) h;
 }
 size_t hashmapSize(Hashmap* map) {
     return map->size;
@@ -0,0 +1,114 @@
+#ifndef MASSDNS_HISTOGRAM_H
+#define MASSDNS_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Log-linear histogram similar to HDR histograms: Values are grouped by their most significant bit, each group is
+// divided into HISTOGRAM_SUB_COUNT linear buckets. Percentiles therefore have a relative error of at most 1/8.
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 32 // Larger values are accounted in the last bucket
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+static inline size_t histogram_index(uint64_t value)
+{
+    if(value < HISTOGRAM_SUB_COUNT)
+    {
+        return (size_t)value;
+    }
+    size_t msb = 63 - (size_t)__builtin_clzll(value);
+    if(msb >= HISTOGRAM_MAX_BITS)
+    {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    size_t shift = msb - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_COUNT + (size_t)(value >> shift) - HISTOGRAM_SUB_COUNT;
+}
+
+// Smallest value that is accounted in the bucket with the specified index
+static inline uint64_t histogram_bucket_start(size_t index)
+{
+    if(index < 2 * HISTOGRAM_SUB_COUNT)
+    {
+        return index;
+    }
+    size_t shift = index / HISTOGRAM_SUB_COUNT - 1;
+    return ((uint64_t)(index % HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_COUNT)) << shift;
+}
+
+static inline uint64_t histogram_bucket_width(size_t index)
+{
+    if(index < 2 * HISTOGRAM_SUB_COUNT)
+    {
+        return 1;
+    }
+    return ((uint64_t)1) << (index / HISTOGRAM_SUB_COUNT - 1);
+}
+
+static inline void histogram_add(histogram_t *histogram, uint64_t value)
+{
+    histogram->counts[histogram_index(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if(value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+void histogram_clear(histogram_t *histogram)
+{
+    bzero(histogram, sizeof(*histogram));
+}
+
+void histogram_merge(histogram_t *dst, histogram_t *src)
+{
+    for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if(src->max > dst->max)
+    {
+        dst->max = src->max;
+    }
+}
+
+// Returns the value below which the specified percentage (0 to 100) of the samples fall, zero if there are none.
+uint64_t histogram_percentile(histogram_t *histogram, double percentile)
+{
+    if(histogram->count == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100 * histogram->count + 0.5);
+    if(rank == 0)
+    {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if(seen >= rank)
+        {
+            // Report the middle of the bucket, but never more than the maximum value observed
+            uint64_t value = histogram_bucket_start(i) + (histogram_bucket_width(i) - 1) / 2;
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+#endif //MASSDNS_HISTOGRAM_H
@@ -0,0 +1,31 @@
+#ifndef MASSDNS_LOOKUP_H
+#define MASSDNS_LOOKUP_H
+
+#include "casefold.h"
+#include "dns.h"
+#include "hashmap.h"
+
+// Key of the hash map containing the lookups in flight
+typedef struct
+{
+    dns_name_t name;
+    dns_record_type type;
+} lookup_key_t;
+
+// Hashes the case-folded name with the DNS type as the seed, so that names differing in case only collide
+int hash_lookup_key(void *key)
+{
+    lookup_key_t *lookup_key = key;
+    uint8_t folded[sizeof(lookup_key->name.name)];
+
+    casefold(folded, lookup_key->name.name, lookup_key->name.length);
+    return (int) hash_bytes(folded, lookup_key->name.length, lookup_key->type);
+}
+
+bool cmp_lookup(void *lookup1, void *lookup2)
+{
+    return dns_names_eq(&((lookup_key_t *) lookup1)->name, &((lookup_key_t *) lookup2)->name);
+    //return strcasecmp(((lookup_key_t *) lookup1)->domain,((lookup_key_t *) lookup2)->domain) == 0;
+}
+
+#endif //MASSDNS_LOOKUP_H
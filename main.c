@@ -1,8 +1,6 @@
 #define _GNU_SOURCE
 
-#ifdef DEBUG
 #include <sys/resource.h>
-#endif
 
 #include "massdns.h"
 #include "string.h"
@@ -12,6 +10,7 @@
 #include "dns.h"
 #include "list.h"
 #include "flow.h"
+#include "output.h"
 #include <unistd.h>
 #include <pwd.h>
 #include <grp.h>
@@ -22,6 +21,9 @@
 #endif
 #include <limits.h>
 #include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #ifdef PCAP_SUPPORT
 #include <net/ethernet.h>
@@ -39,32 +41,82 @@ void print_help()
 #ifdef HAVE_EPOLL
                     "      --busy-poll        Use busy-wait polling instead of epoll.\n"
 #endif
+                    "      --cache            Answer repeated names and names sharing CNAME targets from a cache of\n"
+                    "                         the specified number of record sets, which are kept for their TTL.\n"
                     "  -c  --resolve-count    Number of resolves for a name before giving up. (Default: 50)\n"
+                    "      --consensus        Send each name to the specified number of distinct resolvers and only\n"
+                    "                         write the reply shared by the majority of them.\n"
+                    "      --cookies          Send DNS cookies and retry with the server cookie on BADCOOKIE. Implies\n"
+                    "                         --edns.\n"
+                    "      --dnssec           Set the DNSSEC OK bit to request DNSSEC records. Implies --edns.\n"
                     "      --drop-group       Group to drop privileges to when running as root. (Default: nogroup)\n"
                     "      --drop-user        User to drop privileges to when running as root. (Default: nobody)\n"
+                    "      --edns             Add an OPT record advertising the specified UDP payload size of at least\n"
+                    "                         512 bytes. Resolvers without EDNS are queried without it. (Default size\n"
+                    "                         with --cookies or --dnssec: 1232)\n"
                     "      --flush            Flush the output file whenever a response was received.\n"
                     "  -h  --help             Show this help.\n"
                     "  -i  --interval         Interval in milliseconds to wait between multiple resolves of the same\n"
                     "                         domain. (Default: 500)\n"
+                    "      --iterative        Follow referrals from the resolvers, which are taken as root servers,\n"
+                    "                         down to the authoritative servers. Implies --norecurse and a cache of\n"
+                    "                         delegations. (Default cache size: 65536)\n"
                     "  -l  --error-log        Error log file path. (Default: /dev/stderr)\n"
+                    "      --latency-aware    Pick the better of two random resolvers based on their round-trip time\n"
+                    "                         and number of in-flight queries.\n"
+                    "      --metrics          Serve metrics in the Prometheus text format over HTTP on the specified\n"
+                    "                         address and port or Unix socket path.\n"
+                    "      --no-tcp-fallback  Write truncated replies instead of repeating their queries over TCP.\n"
                     "      --norecurse        Use non-recursive queries. Useful for DNS cache snooping.\n"
                     "  -o  --output           Flags for output formatting.\n"
                     "      --predictable      Use resolvers incrementally. Useful for resolver tests.\n"
                     "      --processes        Number of processes to be used for resolving. (Default: 1)\n"
                     "  -q  --quiet            Quiet mode.\n"
+                    "      --raw-ports        Range of source ports in raw transmit mode. (Default: 1024-65535)\n"
+                    "      --raw-source       Send queries through raw sockets from random addresses within the\n"
+                    "                         specified prefix and capture their replies. Can be specified once for\n"
+                    "                         IPv4 and once for IPv6. Requires CAP_NET_RAW.\n"
                     "      --rcvbuf           Size of the receive buffer in bytes.\n"
+                    "      --resolver-stats   Write per-resolver statistics to the specified file at exit and on SIGUSR1.\n"
+                    "      --resolver-stats-format\n"
+                    "                         Format of the resolver statistics, ndjson or csv. (Default: ndjson)\n"
                     "      --retry            Unacceptable DNS response codes. (Default: REFUSED)\n"
                     "  -r  --resolvers        Text file containing DNS resolvers.\n"
                     "      --root             Do not drop privileges when running as root. Not recommended.\n"
+                    "      --rto              Derive the retry interval from the round-trip times of each resolver\n"
+                    "                         and back off exponentially. Until a resolver has replied, the\n"
+                    "                         interval is used, limited to --rto-min and --rto-max.\n"
+                    "      --rto-max          Maximum retry interval in milliseconds. (Default: 2000)\n"
+                    "      --rto-min          Minimum retry interval in milliseconds. (Default: 50)\n"
+                    "      --server-rate      Maximum number of queries per second sent to a single authoritative\n"
+                    "                         server by all processes in iterative mode, 0 for none. (Default: 100)\n"
                     "  -s  --hashmap-size     Number of concurrent lookups. (Default: 10000)\n"
                     "      --sndbuf           Size of the send buffer in bytes.\n"
                     "      --sticky           Do not switch the resolver when retrying.\n"
                     "      --socket-count     Socket count per process. (Default: 1)\n"
+                    "      --summary          Write a JSON summary of the run to the specified file at exit.\n"
+                    "      --tcp              Send all queries over a few long-lived pipelined TCP connections to each\n"
+                    "                         resolver. Useful for bulk resolution through a local resolver.\n"
+                    "      --tcp-connections  Number of TCP connections to a single resolver per process. (Default: 2)\n"
+                    "      --trusted-rate     Maximum number of queries per second sent to the trusted resolvers by all\n"
+                    "                         processes. (Default: 1000)\n"
+                    "      --trusted-resolvers\n"
+                    "                         Text file containing trusted resolvers. Names with a positive reply are\n"
+                    "                         resolved again using these and only their replies are written.\n"
                     "  -t  --type             Record type to be resolved. (Default: A)\n"
 #ifdef PCAP_SUPPORT
                     "      --use-pcap         Enable pcap usage.\n"
 #endif
+                    "      --validate-resolvers\n"
+                    "                         Probe the resolvers for correct answers, NXDOMAIN hijacking, wildcards\n"
+                    "                         and rate limits instead of resolving the domain list. Usable resolvers\n"
+                    "                         are written to the output file, ranked by capacity. Names from the\n"
+                    "                         domain list are used as known names if supplied.\n"
                     "      --verify-ip        Verify IP addresses of incoming replies.\n"
+                    "      --wildcard         Detect wildcards by probing a random label below the parent zone of each\n"
+                    "                         name and drop replies that only consist of wildcard answers.\n"
+                    "      --wildcard-cache   Number of zones whose wildcard probe results are cached. (Default: 16384)\n"
+                    "      --wildcard-skip    Like --wildcard, but do not resolve names below zones with a wildcard.\n"
                     "  -w  --outfile          Write to the specified output file instead of standard output.\n"
                     "\n"
                     "Output flags:\n"
@@ -106,9 +158,37 @@ void cleanup()
         hashmapFree(context.resolver_map);
     }
 
+    if(context.iterative.index)
+    {
+        hashmapFree(context.iterative.index);
+    }
+
     timed_ring_destroy(&context.ring);
 
+    for(size_t i = 0; i < context.tcp.used; i++)
+    {
+        tcp_connection_free(context.tcp.connections + i);
+    }
+    free(context.tcp.connections);
+
+    if(context.raw.enabled)
+    {
+#ifdef __linux__
+        raw_ring_free(&context.raw.ring);
+#endif
+        int descriptors[] = {context.raw.socket4, context.raw.socket6, context.raw.capture.descriptor};
+        for(size_t i = 0; i < sizeof(descriptors) / sizeof(*descriptors); i++)
+        {
+            if(descriptors[i] >= 0)
+            {
+                close(descriptors[i]);
+            }
+        }
+    }
+
     free(context.resolvers.data);
+    free(context.trusted.resolvers.data);
+    free(context.iterative.servers.data);
 
     free(context.sockets.interfaces4.data);
     free(context.sockets.interfaces6.data);
@@ -127,24 +207,46 @@ void cleanup()
     {
         fclose(context.logfile);
     }
+    if(context.resolver_stats_file)
+    {
+        fclose(context.resolver_stats_file);
+    }
+    if(context.summary_file)
+    {
+        fclose(context.summary_file);
+    }
 
-    free(context.stat_messages);
-
-
-    free(context.lookup_pool.data);
-    free(context.lookup_space);
-    
-    for (size_t i = 0; i < context.cmd_args.num_processes * 2; i++)
+    if(context.metrics.listening)
     {
-        if(context.sockets.pipes && context.sockets.pipes[i] >= 0)
+        for(size_t i = 0; i < METRICS_MAX_CONNECTIONS; i++)
+        {
+            if(context.metrics.connections[i].open)
+            {
+                close(context.metrics.connections[i].info.descriptor);
+                free(context.metrics.connections[i].response);
+            }
+        }
+        close(context.metrics.listener.descriptor);
+        if(context.metrics.unix_path)
         {
-            close(context.sockets.pipes[i]);
+            unlink(context.metrics.unix_path);
         }
     }
-    free(context.sockets.pipes);
-    free(context.sockets.master_pipes_read);
+
+    if(context.stat_messages)
+    {
+        munmap(context.stat_messages, context.cmd_args.num_processes * sizeof(*context.stat_messages));
+    }
+    free(context.validation.states);
+    free(context.validation.queue);
+    wildcard_cache_free(&context.wildcard);
+    cache_free(&context.cache);
+
+    free(context.lookup_pool.data);
+    free(context.lookup_space);
+    free(context.consensus_votes);
+
     free(context.pids);
-    free(context.done);
 }
 
 void log_msg(const char* format, ...)
@@ -253,6 +355,8 @@ buffer_t massdns_resolvers_from_file(char *filename)
             trim_end(line);
             resolver_t *resolver = safe_calloc(sizeof(*resolver));
             struct sockaddr_storage *addr = &resolver->address;
+            // Assume a pessimistic round-trip time until the first reply has been measured
+            resolver->rtt_ewma = context.cmd_args.interval_ms * (uint64_t)TIMED_RING_MS;
             if (str_to_addr(line, 53, addr))
             {
                 if((addr->ss_family == AF_INET && context.sockets.interfaces4.len > 0)
@@ -279,31 +383,39 @@ buffer_t massdns_resolvers_from_file(char *filename)
         clean_exit(EXIT_FAILURE);
     }
 
-    if(context.cmd_args.verify_ip)
+    single_list_free_with_elements(list);
+    return resolvers;
+}
+
+// Replies can only be attributed to resolvers by their address if we have a resolver map.
+void resolver_map_add(buffer_t *resolvers)
+{
+    if(!context.cmd_args.verify_ip && !context.cmd_args.resolver_stats && !context.cmd_args.validate_resolvers)
+    {
+        return;
+    }
+    if(!context.resolver_map)
     {
-        context.resolver_map = hashmapCreate(resolvers.len, hash_address, addresses_equal);
+        context.resolver_map = hashmapCreate(resolvers->len, hash_address, addresses_equal);
         if(!context.resolver_map)
         {
             log_msg("Failed to create resolver lookup map: %s\n", strerror(errno));
             abort();
         }
+    }
 
-        for (size_t i = 0; i < resolvers.len; i++)
-        {
-            resolver_t *resolver = ((resolver_t*)resolvers.data) + i;
+    for (size_t i = 0; i < resolvers->len; i++)
+    {
+        resolver_t *resolver = ((resolver_t*)resolvers->data) + i;
 
-            errno = 0;
-            hashmapPut(context.resolver_map, &resolver->address, resolver);
-            if (errno != 0)
-            {
-                log_msg("Error putting resolver into hashmap: %s\n", strerror(errno));
-                abort();
-            }
+        errno = 0;
+        hashmapPut(context.resolver_map, &resolver->address, resolver);
+        if (errno != 0)
+        {
+            log_msg("Error putting resolver into hashmap: %s\n", strerror(errno));
+            abort();
         }
     }
-
-    single_list_free_with_elements(list);
-    return resolvers;
 }
 
 void set_sndbuf(int fd)
@@ -425,25 +537,30 @@ bool next_query(char **qname)
 }
 
 
-// This is the djb2 hashing method treating the DNS type as two extra characters
-int hash_lookup_key(void *key)
+static inline uint64_t timeval_us(struct timeval *tv)
 {
-    unsigned long hash = 5381;
-    uint8_t *entry = ((lookup_key_t *)key)->name.name;
-    int c;
-    while ((c = *entry++) != 0)
+    return (uint64_t)tv->tv_sec * 1000000 + (uint64_t)tv->tv_usec;
+}
+
+// Change the state and account the CPU time consumed since the previous transition to the state that is left.
+void set_state(state_t state)
+{
+    struct rusage usage;
+    if(context.state < STATE_DONE && getrusage(RUSAGE_SELF, &usage) == 0)
     {
-        hash = ((hash << 5) + hash) + tolower(c); /* hash * 33 + c */
+        uint64_t user = timeval_us(&usage.ru_utime);
+        uint64_t system = timeval_us(&usage.ru_stime);
+        context.stats.state_cpu_user_us[context.state] += user - context.stats.cpu_user_mark_us;
+        context.stats.state_cpu_system_us[context.state] += system - context.stats.cpu_system_mark_us;
+        context.stats.cpu_user_mark_us = user;
+        context.stats.cpu_system_mark_us = system;
     }
-    hash = ((hash << 5) + hash) + ((((lookup_key_t *)key)->type & 0xFF00) >> 8);
-    hash = ((hash << 5) + hash) + (((lookup_key_t *)key)->type & 0x00FF);
-    hash = ((hash << 5) + hash) + ((lookup_key_t *)key)->name.length;
-    return (int)hash;
+    context.state = state;
 }
 
 void end_warmup()
 {
-    context.state = STATE_QUERYING;
+    set_state(STATE_QUERYING);
     if(context.cmd_args.extreme <= 1 && !context.cmd_args.busypoll)
     {
         // Reduce our CPU load from epoll interrupts by removing the EPOLLOUT event
@@ -487,9 +604,18 @@ lookup_t *new_lookup(const char *qname, dns_record_type type, bool *new)
     lookup_t *value = &entry->value;
     bzero(value, sizeof(*value));
 
-    value->ring_entry = timed_ring_add(&context.ring, context.cmd_args.interval_ms * TIMED_RING_MS, value);
     urandom_get(&value->transaction, sizeof(value->transaction));
     value->key = key;
+    value->tcp = context.cmd_args.tcp;
+    if(context.cmd_args.consensus)
+    {
+        value->votes = context.consensus_votes + (size_t) (entry - context.lookup_space) * context.cmd_args.consensus;
+        for(size_t i = 0; i < context.cmd_args.consensus; i++)
+        {
+            value->votes[i].state = CONSENSUS_VOTE_PENDING;
+            value->votes[i].resolver = CONSENSUS_UNASSIGNED;
+        }
+    }
 
     errno = 0;
     hashmapPut(context.map, key, value);
@@ -509,386 +635,3411 @@ lookup_t *new_lookup(const char *qname, dns_record_type type, bool *new)
     return value;
 }
 
-void send_query(lookup_t *lookup)
+// Update the moving average of the round-trip time with a weight of 1/8 for the new sample
+void resolver_update_rtt(resolver_t *resolver, uint64_t rtt_ns)
 {
-    static uint8_t query_buffer[0x200];
-
-    // Choose random resolver
-    // Pool of resolvers cannot be empty due to check after parsing resolvers.
-    if(!context.cmd_args.sticky || lookup->resolver == NULL)
-    {
-        if(context.cmd_args.predictable_resolver)
-        {
-            lookup->resolver = ((resolver_t *) context.resolvers.data) + context.lookup_index % context.resolvers.len;
-        }
-        else
-        {
-            lookup->resolver = ((resolver_t *) context.resolvers.data) + urandom_size_t() % context.resolvers.len;
-        }
-    }
+    resolver->rtt_ewma = (uint64_t)((int64_t)resolver->rtt_ewma + ((int64_t)rtt_ns - (int64_t)resolver->rtt_ewma) / 8);
+}
 
-    // We need to select the correct socket pool: IPv4 socket pool for IPv4 resolver/IPv6 socket pool for IPv6 resolver
-    buffer_t *interfaces;
-    if(lookup->resolver->address.ss_family == AF_INET)
+// Round-trip time estimation according to RFC 6298. Neither timeouts nor replies to retransmissions must be passed as
+// samples (Karn's algorithm).
+void resolver_update_rto(resolver_t *resolver, uint64_t rtt_ns)
+{
+    if(resolver->srtt == 0)
     {
-        interfaces = &context.sockets.interfaces4;
+        resolver->srtt = rtt_ns;
+        resolver->rttvar = rtt_ns / 2;
     }
     else
     {
-        interfaces = &context.sockets.interfaces6;
+        uint64_t deviation = resolver->srtt > rtt_ns ? resolver->srtt - rtt_ns : rtt_ns - resolver->srtt;
+        resolver->rttvar = (3 * resolver->rttvar + deviation) / 4;
+        resolver->srtt = (7 * resolver->srtt + rtt_ns) / 8;
     }
+}
 
-    if(lookup->socket == NULL)
+// Time to wait for a reply to the latest transmission of a lookup before retrying
+uint64_t lookup_timeout(lookup_t *lookup)
+{
+    uint64_t interval = context.cmd_args.interval_ms * (uint64_t)TIMED_RING_MS;
+    if(!context.cmd_args.adaptive_timeout)
     {
-        // Pick a random socket from that pool
-        // Pool of sockets cannot be empty due to check when parsing resolvers. Socket creation must have succeeded.
-        size_t socket_index = urandom_size_t() % interfaces->len;
-        lookup->socket = (socket_info_t *) interfaces->data + socket_index;
+        return interval;
     }
-
-    ssize_t result = dns_question_create(query_buffer, (char*)lookup->key->name.name, lookup->key->type,
-                                                   lookup->transaction);
-    if (result < DNS_PACKET_MINIMUM_SIZE)
+    uint64_t rto_min = context.cmd_args.rto_min_ms * (uint64_t)TIMED_RING_MS;
+    uint64_t rto_max = context.cmd_args.rto_max_ms * (uint64_t)TIMED_RING_MS;
+    uint64_t rto = interval;
+    if(lookup->resolver != NULL && lookup->resolver->srtt != 0)
     {
-        log_msg("Failed to create DNS question for query \"%s\".", lookup->key->name.name);
-        return;
+        rto = lookup->resolver->srtt + max(TIMED_RING_MS, 4 * lookup->resolver->rttvar);
     }
+    rto = max(rto, rto_min);
 
-    // Set or unset the QD bit based on user preference
-    dns_buf_set_rd(query_buffer, !context.cmd_args.norecurse);
-    
-    errno = 0;
-    ssize_t sent = sendto(lookup->socket->descriptor, query_buffer, (size_t) result, 0,
-                          (struct sockaddr *) &lookup->resolver->address,
-                          sockaddr_storage_size(&lookup->resolver->address));
-    if(sent != result)
+    // Exponential backoff, doubling the timeout for every previous try
+    for(unsigned char i = 0; i < lookup->tries && rto < rto_max; i++)
     {
-        if(errno != EAGAIN && errno != EWOULDBLOCK)
-        {
-            log_msg("Error sending: %s\n", strerror(errno));
-        }
+        rto *= 2;
     }
+    rto = min(rto, rto_max);
+
+    // Add a jitter of up to 25% so that retries of simultaneous lookups do not occur in bursts
+    return rto + (rto / 4 == 0 ? 0 : urandom_size_t() % (rto / 4));
 }
 
-#define STAT_IDX_OK 0
-#define STAT_IDX_NXDOMAIN 1
-#define STAT_IDX_SERVFAIL 2
-#define STAT_IDX_REFUSED 3
-#define STAT_IDX_FORMERR 4
-
-void my_stats_to_msg(stats_exchange_t *stats_msg)
-{
-    stats_msg->finished = context.stats.finished;
-    stats_msg->finished_success = context.stats.finished_success;
-    stats_msg->fork_index = context.fork_index;
-    stats_msg->mismatch_domain = context.stats.mismatch_domain;
-    stats_msg->mismatch_id = context.stats.mismatch_id;
-    stats_msg->numdomains = context.stats.numdomains;
-    stats_msg->numreplies = context.stats.numreplies;
-    stats_msg->all_rcodes[STAT_IDX_OK] = context.stats.all_rcodes[DNS_RCODE_OK];
-    stats_msg->all_rcodes[STAT_IDX_NXDOMAIN] = context.stats.all_rcodes[DNS_RCODE_NXDOMAIN];
-    stats_msg->all_rcodes[STAT_IDX_SERVFAIL] = context.stats.all_rcodes[DNS_RCODE_SERVFAIL];
-    stats_msg->all_rcodes[STAT_IDX_REFUSED] = context.stats.all_rcodes[DNS_RCODE_REFUSED];
-    stats_msg->all_rcodes[STAT_IDX_FORMERR] = context.stats.all_rcodes[DNS_RCODE_FORMERR];
-    stats_msg->final_rcodes[STAT_IDX_OK] = context.stats.final_rcodes[DNS_RCODE_OK];
-    stats_msg->final_rcodes[STAT_IDX_NXDOMAIN] = context.stats.final_rcodes[DNS_RCODE_NXDOMAIN];
-    stats_msg->final_rcodes[STAT_IDX_SERVFAIL] = context.stats.final_rcodes[DNS_RCODE_SERVFAIL];
-    stats_msg->final_rcodes[STAT_IDX_REFUSED] = context.stats.final_rcodes[DNS_RCODE_REFUSED];
-    stats_msg->final_rcodes[STAT_IDX_FORMERR] = context.stats.final_rcodes[DNS_RCODE_FORMERR];
-    stats_msg->current_rate = context.stats.current_rate;
-    stats_msg->success_rate = context.stats.success_rate;
-    stats_msg->numparsed = context.stats.numparsed;
-    stats_msg->done = (context.state >= STATE_DONE);
-    for(size_t i = 0; i <= context.cmd_args.resolve_count; i++)
+// Record a transmission of a lookup
+static inline void lookup_mark_sent(lookup_t *lookup)
+{
+    lookup->sent_ns = monotonic_ns();
+    if(lookup->first_sent_ns == 0)
     {
-        stats_msg->timeouts[i] = context.stats.timeouts[i];
+        lookup->first_sent_ns = lookup->sent_ns;
     }
 }
 
-void send_stats()
+static inline uint64_t resolver_cost(resolver_t *resolver)
 {
-    static stats_exchange_t stats_msg;
-    
-    my_stats_to_msg(&stats_msg);
+    return (resolver->rtt_ewma + 1) * (resolver->inflight + 1);
+}
 
-    if(write(context.sockets.write_pipe.descriptor, &stats_msg, sizeof(stats_msg)) != sizeof(stats_msg))
+// Power of two choices: Sample two distinct resolvers and take the one which is expected to answer faster.
+resolver_t *choose_resolver_p2c(buffer_t *resolvers)
+{
+    resolver_t *data = (resolver_t *) resolvers->data;
+    size_t first = urandom_size_t() % resolvers->len;
+    if(resolvers->len == 1)
     {
-        log_msg("Could not send stats atomically.\n");
+        return data;
     }
+
+    // The second sample is drawn from the other resolvers, so that there always is a choice.
+    size_t second = (first + 1 + urandom_size_t() % (resolvers->len - 1)) % resolvers->len;
+    return resolver_cost(data + first) <= resolver_cost(data + second) ? data + first : data + second;
 }
 
-void check_progress()
+void lookup_set_resolver(lookup_t *lookup, resolver_t *resolver)
 {
-    static struct timespec last_time;
-    static char timeouts[4096];
-    static struct timespec now;
-    static const char* stats_format = "\033[H\033[2J" // Clear screen (probably simplest and most portable solution)
-            "Processed queries: %zu\n"
-            "Received packets: %zu\n"
-            "Progress: %.2f%% (%02lld h %02lld min %02lld sec / %02lld h %02lld min %02lld sec)\n"
-            "Current incoming rate: %zu pps, average: %zu pps\n"
-            "Current success rate: %zu pps, average: %zu pps\n"
-            "Finished total: %zu, success: %zu (%.2f%%)\n"
-            "Mismatched domains: %zu (%.2f%%), IDs: %zu (%.2f%%)\n"
-            "Failures: %s\n"
-            "Response: | Success:               | Total:\n"
-            "OK:       | %12zu (%6.2f%%) | %12zu (%6.2f%%)\n"
-            "NXDOMAIN: | %12zu (%6.2f%%) | %12zu (%6.2f%%)\n"
-            "SERVFAIL: | %12zu (%6.2f%%) | %12zu (%6.2f%%)\n"
-            "REFUSED:  | %12zu (%6.2f%%) | %12zu (%6.2f%%)\n"
-            "FORMERR:  | %12zu (%6.2f%%) | %12zu (%6.2f%%)\n";
+    if(lookup->resolver != NULL)
+    {
+        lookup->resolver->inflight--;
+    }
+    lookup->resolver = resolver;
+    resolver->inflight++;
+}
 
-    clock_gettime(CLOCK_MONOTONIC, &now);
+// The socket pool of the protocol of the resolver: IPv4 socket pool for IPv4 resolver/IPv6 socket pool for IPv6 resolver
+buffer_t *resolver_interfaces(resolver_t *resolver)
+{
+    return resolver->address.ss_family == AF_INET ? &context.sockets.interfaces4 : &context.sockets.interfaces6;
+}
 
-    time_t elapsed_ns = (now.tv_sec - last_time.tv_sec) * 1000000000 + (now.tv_nsec - last_time.tv_nsec);
-    size_t rate_pps = elapsed_ns == 0 ? 0 : context.stats.current_rate * TIMED_RING_S / elapsed_ns;
-    size_t rate_success = elapsed_ns == 0 ? 0 : context.stats.success_rate * TIMED_RING_S / elapsed_ns;
-    last_time = now;
+// Pick a random socket from the pool of the resolver
+// Pool of sockets cannot be empty due to check when parsing resolvers. Socket creation must have succeeded.
+socket_info_t *resolver_socket(resolver_t *resolver)
+{
+    buffer_t *interfaces = resolver_interfaces(resolver);
+    return (socket_info_t *) interfaces->data + urandom_size_t() % interfaces->len;
+}
 
-    // Send the stats of the child to the parent process
-    if(context.cmd_args.num_processes > 1 && context.fork_index != 0)
-    {
-        send_stats();
-        goto end_stats;
-    }
+// TCP: Lookups whose reply has been truncated are repeated over a small pool of pipelined connections to their
+// resolver, which are shared by all lookups and kept open until the resolver closes them. In TCP mode, all lookups are
+// sent this way. Queries are queued and written in batches once per iteration of the event loop, replies are passed to
+// do_read like replies over UDP. Queries of connections that fail are sent again once their lookups time out.
 
-    if(context.cmd_args.quiet)
+void do_read(uint8_t *offset, size_t len, struct sockaddr_storage *recvaddr);
+
+// Register a new connection for reading or update the registration of an existing one, which is registered for
+// writing as long as it is being established or has queries that could not be written.
+void tcp_watch(tcp_connection_t *connection, bool registered)
+{
+    connection->watching_writes = tcp_connection_blocked(connection);
+#ifdef HAVE_EPOLL
+    if(context.cmd_args.busypoll)
     {
         return;
     }
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.data.ptr = &connection->info;
+    ev.events = EPOLLIN | (connection->watching_writes ? EPOLLOUT : 0);
+    if(epoll_ctl(context.epollfd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, connection->info.descriptor, &ev) != 0)
+    {
+        log_msg("Failed to add epoll event: %s\n", strerror(errno));
+    }
+#endif
+}
 
-    // Go on with printing stats.
-
-    float progress = context.state == STATE_DONE ? 1 : 0;
-    if(context.domainfile_size > 0) // If the domain file is not a real file, the progress cannot be estimated.
+// Remove a connection from the pool of its resolver and close it.
+void tcp_close(tcp_connection_t *connection)
+{
+    resolver_t *resolver = connection->owner;
+    for(tcp_connection_t **link = &resolver->tcp; *link != NULL; link = &(*link)->next)
     {
-        // Get a rough estimate of the progress, only roughly proportional to the number of domains.
-        // Will be very inaccurate if the domain file is sorted per domain name length.
-        long int domain_file_position = ftell(context.domainfile);
-        if (domain_file_position >= 0)
+        if(*link == connection)
         {
-            progress = domain_file_position / (float)context.domainfile_size;
+            *link = connection->next;
+            break;
         }
     }
-
-    time_t total_elapsed_ns = (now.tv_sec - context.stats.start_time.tv_sec) * 1000000000
-        + (now.tv_nsec - context.stats.start_time.tv_nsec); // since last output
-    long long elapsed = now.tv_sec - context.stats.start_time.tv_sec; // resolution of one second should be okay
-    long long sec = elapsed % 60;
-    long long min = (elapsed / 60) % 60;
-    long long h = elapsed / 3600;
-
-    long long estimated_time = progress == 0 ? 0 : (long long)(elapsed / progress);
-    if(estimated_time < elapsed)
+    if(!connection->established)
     {
-        estimated_time = elapsed;
+        // Resolvers that refuse connections are not asked over TCP any more.
+        resolver->no_tcp = true;
+        context.stats.tcp_failures++;
     }
-    long long prog_sec = estimated_time % 60;
-    long long prog_min = (estimated_time / 60) % 60;
-    long long prog_h = (estimated_time / 3600);
-
-#define stats_percent(a, b) ((b) == 0 ? 0 : (a) / (float) (b) * 100)
-#define stat_abs_share(a, b) a, stats_percent(a, b)
-#define rcode_stat(code) stat_abs_share(context.stats.final_rcodes[(code)], context.stats.finished_success),\
-        stat_abs_share(context.stats.all_rcodes[(code)], context.stats.numparsed)
-#define rcode_stat_multi(code) stat_abs_share(context.stat_messages[0].final_rcodes[(code)], \
-    context.stat_messages[0].finished_success),\
-        stat_abs_share(context.stat_messages[0].all_rcodes[(code)], context.stat_messages[0].numparsed)
-    
-    if(context.cmd_args.num_processes == 1)
+    else if(connection->pending > 0)
     {
-        size_t average_pps = elapsed == 0 ? rate_pps : context.stats.numreplies * TIMED_RING_S / total_elapsed_ns;
-        size_t average_success = elapsed == 0 ? rate_success : context.stats.finished_success * TIMED_RING_S / total_elapsed_ns;
+        context.stats.tcp_failures++;
+    }
+    tcp_connection_close(connection);
+}
 
-        // Print the detailed timeout stats (number of tries before timeout) to the timeouts buffer.
-        int offset = 0;
-        for (size_t i = 0; i <= context.cmd_args.resolve_count; i++)
+tcp_connection_t *tcp_connect(resolver_t *resolver)
+{
+    tcp_connection_t *connection = NULL;
+    for(size_t i = 0; i < context.tcp.used && connection == NULL; i++)
+    {
+        if(context.tcp.connections[i].state == TCP_CLOSED)
         {
-            float share = stats_percent(context.stats.timeouts[i], context.stats.finished);
-            int result = snprintf(timeouts + offset, sizeof(timeouts) - offset, "%zu: %.2f%%, ", i, share);
-            if (result <= 0 || result >= sizeof(timeouts) - offset)
-            {
-                break;
-            }
-            offset += result;
+            connection = context.tcp.connections + i;
         }
-
-        fprintf(stderr,
-                stats_format,
-                context.stats.numdomains,
-                context.stats.numreplies,
-                progress * 100, h, min, sec, prog_h, prog_min, prog_sec, rate_pps, average_pps,
-                rate_success, average_success,
-                context.stats.finished,
-                stat_abs_share(context.stats.finished_success, context.stats.finished),
-                stat_abs_share(context.stats.mismatch_domain, context.stats.numparsed),
-                stat_abs_share(context.stats.mismatch_id, context.stats.numparsed),
-                timeouts,
-
-                rcode_stat(DNS_RCODE_OK),
-                rcode_stat(DNS_RCODE_NXDOMAIN),
-                rcode_stat(DNS_RCODE_SERVFAIL),
-                rcode_stat(DNS_RCODE_REFUSED),
-                rcode_stat(DNS_RCODE_FORMERR)
-        );
     }
-    else
+    if(connection == NULL)
     {
-        my_stats_to_msg(&context.stat_messages[0]);
-
-        for(size_t j = 1; j < context.cmd_args.num_processes; j++)
-        {
-            for (size_t i = 0; i <= context.cmd_args.resolve_count; i++)
-            {
-                context.stat_messages[0].timeouts[i] += context.stat_messages[j].timeouts[i];
-            }
-            context.stat_messages[0].numreplies += context.stat_messages[j].numreplies;
-            context.stat_messages[0].numparsed += context.stat_messages[j].numparsed;
-            context.stat_messages[0].numdomains += context.stat_messages[j].numdomains;
-            context.stat_messages[0].mismatch_id += context.stat_messages[j].mismatch_id;
-            context.stat_messages[0].mismatch_domain += context.stat_messages[j].mismatch_domain;
-            context.stat_messages[0].finished_success += context.stat_messages[j].finished_success;
-            context.stat_messages[0].finished += context.stat_messages[j].finished;
-            for(size_t i = 0; i < 5; i++)
-            {
-                context.stat_messages[0].all_rcodes[i] += context.stat_messages[j].all_rcodes[i];
-            }
-            for(size_t i = 0; i < 5; i++)
-            {
-                context.stat_messages[0].final_rcodes[i] += context.stat_messages[j].final_rcodes[i];
-            }
-            rate_pps += context.stat_messages[j].current_rate;
-            rate_success += context.stat_messages[j].success_rate;
-        }
-
-        size_t average_pps = elapsed == 0 ? rate_pps :
-                             context.stat_messages[0].numreplies * TIMED_RING_S / total_elapsed_ns;
-        size_t average_success = elapsed == 0 ? rate_pps :
-                             context.stat_messages[0].finished_success * TIMED_RING_S / total_elapsed_ns;
-
-
-        // Print the detailed timeout stats (number of tries before timeout) to the timeouts buffer.
-        int offset = 0;
-        for (size_t i = 0; i <= context.cmd_args.resolve_count; i++)
+        if(context.tcp.used >= TCP_MAX_CONNECTIONS)
         {
-            float share = stats_percent(context.stat_messages[0].timeouts[i], context.stat_messages[0].finished);
-            int result = snprintf(timeouts + offset, sizeof(timeouts) - offset, "%zu: %.2f%%, ", i, share);
-            if (result <= 0 || result >= sizeof(timeouts) - offset)
-            {
-                break;
-            }
-            offset += result;
+            return NULL;
         }
-
-        fprintf(stderr,
-                stats_format,
-                context.stat_messages[0].numdomains,
-                context.stat_messages[0].numreplies,
-                progress * 100, h, min, sec, prog_h, prog_min, prog_sec, rate_pps, average_pps,
-                rate_success, average_success,
-                context.stat_messages[0].finished,
-                stat_abs_share(context.stat_messages[0].finished_success, context.stat_messages[0].finished),
-                stat_abs_share(context.stat_messages[0].mismatch_domain, context.stat_messages[0].numparsed),
-                stat_abs_share(context.stat_messages[0].mismatch_id, context.stat_messages[0].numparsed),
-                timeouts,
-
-                rcode_stat_multi(STAT_IDX_OK),
-                rcode_stat_multi(STAT_IDX_NXDOMAIN),
-                rcode_stat_multi(STAT_IDX_SERVFAIL),
-                rcode_stat_multi(STAT_IDX_REFUSED),
-                rcode_stat_multi(STAT_IDX_FORMERR)
-        );
+        connection = context.tcp.connections + context.tcp.used++;
     }
-
-end_stats:
-    context.stats.current_rate = 0;
-    context.stats.success_rate = 0;
-    // Call this function in about one second again
-    timed_ring_add(&context.ring, TIMED_RING_S, check_progress);
+    context.stats.tcp_connections++;
+    if(!tcp_connection_open(connection, &resolver->address))
+    {
+        resolver->no_tcp = true;
+        context.stats.tcp_failures++;
+        return NULL;
+    }
+    connection->owner = resolver;
+    connection->next = resolver->tcp;
+    resolver->tcp = connection;
+    tcp_watch(connection, false);
+    return connection;
 }
 
-void done()
+// The connection with the fewest unanswered queries, unless all of them are saturated and the pool is not full yet.
+tcp_connection_t *tcp_choose(resolver_t *resolver)
 {
-    context.done[context.fork_index] = true;
-    if(context.fork_index != 0 || context.cmd_args.num_processes == 1)
+    tcp_connection_t *best = NULL;
+    size_t count = 0;
+    for(tcp_connection_t *connection = resolver->tcp; connection != NULL; connection = connection->next)
     {
-        context.state = STATE_DONE;
+        count++;
+        if(best == NULL || connection->pending < best->pending)
+        {
+            best = connection;
+        }
+    }
+    if(best != NULL && (best->pending < TCP_PIPELINE_DEPTH || count >= context.cmd_args.tcp_connections))
+    {
+        return best;
+    }
+    tcp_connection_t *connection = tcp_connect(resolver);
+    return connection != NULL ? connection : best;
+}
+
+void tcp_flush(tcp_connection_t *connection)
+{
+    if(!tcp_connection_flush(connection))
+    {
+        tcp_close(connection);
+    }
+    else if(tcp_connection_blocked(connection) != connection->watching_writes)
+    {
+        tcp_watch(connection, true);
+    }
+}
+
+// Queue a query on a connection to the resolver, which is written by tcp_flush_all. Returns false if no connection is
+// available.
+bool tcp_send(resolver_t *resolver, uint8_t *packet, size_t len)
+{
+    tcp_connection_t *connection = tcp_choose(resolver);
+    if(connection == NULL)
+    {
+        return false;
+    }
+    tcp_connection_queue(connection, packet, len);
+    return true;
+}
+
+// Write the queries that have been queued since the previous iteration of the event loop. Connections that are being
+// established or whose socket is full are written once they become writable.
+void tcp_flush_all()
+{
+    for(size_t i = 0; i < context.tcp.used; i++)
+    {
+        tcp_connection_t *connection = context.tcp.connections + i;
+        if(connection->state == TCP_OPEN && !connection->watching_writes && connection->out_len > 0)
+        {
+            tcp_flush(connection);
+        }
+    }
+}
+
+void tcp_message(tcp_connection_t *connection, uint8_t *message, size_t len)
+{
+    context.stats.tcp_replies++;
+    do_read(message, len, &((resolver_t *) connection->owner)->address);
+}
+
+void tcp_handle(tcp_connection_t *connection)
+{
+    if(connection->state == TCP_CONNECTING)
+    {
+        if(!tcp_connection_finish(connection))
+        {
+            tcp_close(connection);
+            return;
+        }
+        if(connection->state == TCP_CONNECTING)
+        {
+            return;
+        }
+    }
+    if(connection->state != TCP_OPEN)
+    {
+        return; // Closed while handling a previous event
+    }
+    tcp_flush(connection);
+    if(connection->state == TCP_OPEN && !tcp_connection_receive(connection, tcp_message))
+    {
+        tcp_close(connection);
+    }
+}
+
+// Busy-wait polling of all connections
+void tcp_poll()
+{
+    for(size_t i = 0; i < context.tcp.used; i++)
+    {
+        tcp_handle(context.tcp.connections + i);
+    }
+}
+
+// Appends the OPT record to a question for the resolver. The client cookie of a resolver is chosen randomly when it is
+// queried for the first time and is followed by the latest server cookie the resolver has sent.
+ssize_t query_add_edns(uint8_t *buffer, size_t len, size_t size, resolver_t *resolver)
+{
+    if(context.cmd_args.cookies && resolver->cookie_len == 0)
+    {
+        urandom_get(resolver->cookie, DNS_COOKIE_CLIENT_SIZE);
+        resolver->cookie_len = DNS_COOKIE_CLIENT_SIZE;
+    }
+    return dns_question_add_edns(buffer, len, size, context.cmd_args.edns_size, context.cmd_args.dnssec_ok,
+                                 resolver->cookie, context.cmd_args.cookies ? resolver->cookie_len : 0);
+}
+
+// Raw transmit mode: Queries to resolvers of an address family with a source prefix are sent through a raw socket from
+// random addresses within the prefix and random ports, and their replies are captured. Every process uses its own share
+// of the source ports, which are those congruent to its index, so that it only handles replies to its own queries.
+
+raw_prefix_t *raw_prefix(sa_family_t family)
+{
+    raw_prefix_t *prefix = family == AF_INET ? &context.cmd_args.raw_prefix4 : &context.cmd_args.raw_prefix6;
+    return prefix->present ? prefix : NULL;
+}
+
+// Send a query to the resolver from a random source address and port. Returns false if there is no source prefix for
+// the address family of the resolver, which is then queried through the UDP sockets.
+bool raw_send(resolver_t *resolver, uint8_t *payload, size_t len)
+{
+    static uint8_t packet[RAW_HEADER_SPACE + 0x200];
+    static uint8_t random[16 + sizeof(size_t)];
+    static uint8_t source[16];
+    static struct sockaddr_storage destination;
+
+    raw_prefix_t *prefix = raw_prefix(resolver->address.ss_family);
+    if(prefix == NULL)
+    {
+        return false;
+    }
+    urandom_get(random, sizeof(random));
+    size_t port_index;
+    memcpy(&port_index, random + 16, sizeof(port_index));
+    uint16_t port = (uint16_t) (context.cmd_args.raw_port_first + (port_index % context.raw.port_count)
+                                * context.cmd_args.num_processes + context.fork_index);
+    raw_prefix_pick(prefix, random, source);
+    size_t packet_len = raw_packet_build(packet, source, port, &resolver->address, payload, len);
+
+    // Raw sockets of IPv6 interpret the port of the destination as protocol, the port is contained in the packet.
+    destination = resolver->address;
+    ((struct sockaddr_in *) &destination)->sin_port = 0;
+    errno = 0;
+    ssize_t sent = sendto(prefix->family == AF_INET ? context.raw.socket4 : context.raw.socket6, packet, packet_len, 0,
+                          (struct sockaddr *) &destination, sockaddr_storage_size(&destination));
+    if(sent != (ssize_t) packet_len)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            log_msg("Error sending: %s\n", strerror(errno));
+        }
+    }
+    else
+    {
+        context.stats.qsent++;
+        resolver->stats.qsent++;
+    }
+    return true;
+}
+
+// Whether a captured datagram is destined to an address and a source port of this process
+bool raw_datagram_ours(raw_datagram_t *datagram)
+{
+    raw_prefix_t *prefix = raw_prefix(datagram->source.ss_family);
+    uint16_t port = datagram->destination_port;
+    return prefix != NULL && port >= context.cmd_args.raw_port_first && port <= context.cmd_args.raw_port_last
+           && (port - context.cmd_args.raw_port_first) % context.cmd_args.num_processes == context.fork_index
+           && raw_prefix_contains(prefix, datagram->destination);
+}
+
+// Pass a captured IP packet to do_read if it is a reply to a query of this process. Captured by pcap, replies to the
+// UDP sockets are passed on as well.
+void raw_receive(uint8_t *packet, size_t len)
+{
+    static raw_datagram_t datagram;
+
+    // Queries are captured as well if the resolver is within the prefix, they are told apart by the QR bit.
+    if(!raw_packet_parse(packet, len, &datagram) || (context.raw.enabled && !raw_datagram_ours(&datagram))
+       || datagram.payload_len < DNS_PACKET_MINIMUM_SIZE || (datagram.payload[2] & 0x80) == 0)
+    {
+        return;
+    }
+    do_read(datagram.payload, datagram.payload_len, &datagram.source);
+}
+
+#ifdef __linux__
+// Unless the ring is used, several packets are read at once, as the filter may not have been attached.
+void raw_capture_read()
+{
+    static uint8_t packet[RAW_CAPTURE_SIZE];
+    static struct sockaddr_ll from;
+    static socklen_t fromlen;
+
+    if(context.raw.ring.map != NULL)
+    {
+        raw_ring_read(&context.raw.ring, raw_receive);
+        return;
+    }
+    for(size_t i = 0; i < RAW_CAPTURE_BATCH; i++)
+    {
+        fromlen = sizeof(from);
+        ssize_t len = recvfrom(context.raw.capture.descriptor, packet, sizeof(packet), 0, (struct sockaddr *) &from,
+                               &fromlen);
+        if(len < 0)
+        {
+            return;
+        }
+        // Packets that are sent are captured as well.
+        if(from.sll_pkttype != PACKET_OUTGOING)
+        {
+            raw_receive(packet, (size_t) len);
+        }
+    }
+}
+#endif
+
+// Send the question of a lookup with the specified transaction ID to the resolver.
+void query_send(lookup_t *lookup, resolver_t *resolver, socket_info_t *socket, uint16_t transaction)
+{
+    static uint8_t query_buffer[0x200];
+
+    ssize_t result = dns_question_create(query_buffer, (char*)lookup->key->name.name, lookup->key->type, transaction);
+    if (result < DNS_PACKET_MINIMUM_SIZE)
+    {
+        log_msg("Failed to create DNS question for query \"%s\".", lookup->key->name.name);
+        return;
+    }
+
+    // Set or unset the QD bit based on user preference
+    dns_buf_set_rd(query_buffer, !context.cmd_args.norecurse);
+
+    lookup->edns = false;
+    if(context.cmd_args.edns_size && !resolver->no_edns)
+    {
+        ssize_t edns_result = query_add_edns(query_buffer, (size_t) result, sizeof(query_buffer), resolver);
+        lookup->edns = edns_result >= 0;
+        result = lookup->edns ? edns_result : result;
+    }
+
+    // Queries that cannot be queued time out and are sent again.
+    if(lookup->tcp && !resolver->no_tcp)
+    {
+        if(tcp_send(resolver, query_buffer, (size_t) result))
+        {
+            context.stats.qsent++;
+            resolver->stats.qsent++;
+        }
+        return;
+    }
+
+    if(context.raw.enabled && raw_send(resolver, query_buffer, (size_t) result))
+    {
+        return;
+    }
+
+    errno = 0;
+    ssize_t sent = sendto(socket->descriptor, query_buffer, (size_t) result, 0,
+                          (struct sockaddr *) &resolver->address, sockaddr_storage_size(&resolver->address));
+    if(sent != result)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            log_msg("Error sending: %s\n", strerror(errno));
+        }
+    }
+    else
+    {
+        context.stats.qsent++;
+        resolver->stats.qsent++;
+    }
+}
+
+// Consensus mode: The votes of a lookup are sent to distinct resolvers. The transaction ID of vote i is the
+// transaction ID of the lookup plus i.
+
+uint32_t consensus_choose_resolver(consensus_vote_t *votes, size_t index)
+{
+    size_t count = context.cmd_args.consensus;
+
+    // There are at least as many resolvers as votes, so the linear search finds an unused one if random draws fail.
+    for(size_t attempt = 0; attempt < 8; attempt++)
+    {
+        uint32_t resolver = (uint32_t) (urandom_size_t() % context.resolvers.len);
+        if(!consensus_resolver_used(votes, count, resolver, index))
+        {
+            return resolver;
+        }
+    }
+    uint32_t resolver = (uint32_t) (urandom_size_t() % context.resolvers.len);
+    while(consensus_resolver_used(votes, count, resolver, index))
+    {
+        resolver = (uint32_t) ((resolver + 1) % context.resolvers.len);
+    }
+    return resolver;
+}
+
+// Sends the votes of a lookup that are pending, which are all of them for the first transmission and those that
+// have timed out or have been answered with an unacceptable response code for retries.
+void consensus_send(lookup_t *lookup)
+{
+    size_t count = context.cmd_args.consensus;
+
+    lookup->ring_entry = timed_ring_add(&context.ring, lookup_timeout(lookup), lookup);
+    lookup_mark_sent(lookup);
+    for(size_t i = 0; i < count; i++)
+    {
+        consensus_vote_t *vote = lookup->votes + i;
+        if(vote->state != CONSENSUS_VOTE_PENDING)
+        {
+            continue;
+        }
+        if(!context.cmd_args.sticky || vote->resolver == CONSENSUS_UNASSIGNED)
+        {
+            vote->resolver = consensus_choose_resolver(lookup->votes, i);
+        }
+        resolver_t *resolver = (resolver_t *) context.resolvers.data + vote->resolver;
+        resolver->inflight++;
+        vote->state = CONSENSUS_VOTE_SENT;
+        query_send(lookup, resolver, resolver_socket(resolver), (uint16_t) (lookup->transaction + i));
+    }
+}
+
+// Iterative mode: Lookups are sent to the servers of the closest enclosing zone whose name servers are known and
+// follow referrals down to the authoritative servers of the name. The starting servers are the resolvers, usually
+// the root servers. Delegations and the addresses of their name servers are kept within the answer cache. Servers
+// learned from referrals are tracked within a table of fixed capacity, which holds their rate limit and statistics.
+// Name servers that have been delegated without glue are resolved by lookups of their own, which are not written.
+
+void send_query(lookup_t *lookup);
+void lookup_done(lookup_t *lookup);
+
+// Returns the tracked server with the specified address, adding it to the table. Servers are evicted by the clock
+// algorithm, skipping servers with lookups in flight. Returns NULL if every server has lookups in flight.
+resolver_t *iterative_server(struct sockaddr_storage *address)
+{
+    buffer_t *servers = &context.iterative.servers;
+    resolver_t *server = hashmapGet(context.iterative.index, address);
+    if(server != NULL)
+    {
+        server->referenced = true;
+        return server;
+    }
+    if(servers->len < ITERATIVE_MAX_SERVERS)
+    {
+        server = (resolver_t *) servers->data + servers->len++;
+    }
+    else
+    {
+        // Two rounds suffice for finding a server whose second chance has been used up within the first round.
+        for(size_t i = 0; i < 2 * ITERATIVE_MAX_SERVERS; i++)
+        {
+            resolver_t *candidate = (resolver_t *) servers->data + context.iterative.hand;
+            context.iterative.hand = (context.iterative.hand + 1) % ITERATIVE_MAX_SERVERS;
+            if(candidate->inflight > 0)
+            {
+                continue;
+            }
+            if(candidate->referenced)
+            {
+                candidate->referenced = false;
+                continue;
+            }
+            hashmapRemove(context.iterative.index, &candidate->address);
+            server = candidate;
+            break;
+        }
+        if(server == NULL)
+        {
+            return NULL;
+        }
+    }
+    bzero(server, sizeof(*server));
+    server->address = *address;
+    server->rtt_ewma = context.cmd_args.interval_ms * (uint64_t)TIMED_RING_MS;
+    hashmapPut(context.iterative.index, &server->address, server);
+    return server;
+}
+
+// Adds the servers of the cached addresses of a name server to the candidates. Returns the new number of candidates.
+size_t iterative_add_addresses(resolver_t **candidates, size_t count, uint8_t *host, size_t host_len, uint16_t type,
+                               uint64_t now)
+{
+    cache_key_t key;
+    struct sockaddr_storage address;
+
+    if(!cache_key_set(&key, host, host_len, type))
+    {
+        return count;
+    }
+    cache_entry_t *entry = cache_get(&context.cache, &key, now);
+    if(entry == NULL || entry->negative)
+    {
+        return count;
+    }
+    uint8_t *record = entry->data;
+    for(uint16_t i = 0; i < entry->count && count < ITERATIVE_MAX_CANDIDATES; i++)
+    {
+        uint16_t length = ntohs(*(uint16_t *) record);
+        bzero(&address, sizeof(address));
+        if(type == DNS_REC_A && length == sizeof(struct in_addr))
+        {
+            struct sockaddr_in *addr4 = (struct sockaddr_in *) &address;
+            addr4->sin_family = AF_INET;
+            addr4->sin_port = htons(53);
+            memcpy(&addr4->sin_addr, record + 2, length);
+        }
+        else if(type == DNS_REC_AAAA && length == sizeof(struct in6_addr))
+        {
+            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *) &address;
+            addr6->sin6_family = AF_INET6;
+            addr6->sin6_port = htons(53);
+            memcpy(&addr6->sin6_addr, record + 2, length);
+        }
+        record += 2 + length;
+        if(address.ss_family == AF_UNSPEC)
+        {
+            continue;
+        }
+        resolver_t *server = iterative_server(&address);
+        if(server != NULL)
+        {
+            candidates[count++] = server;
+        }
+    }
+    return count;
+}
+
+// Prefers the server whose rate limit permits sending first and, among those, the one expected to answer fastest.
+// Candidates are considered from a random offset, so that ties are spread over the servers.
+resolver_t *iterative_pick(resolver_t **candidates, size_t count)
+{
+    uint64_t now = monotonic_ns();
+    size_t offset = urandom_size_t() % count;
+    resolver_t *best = NULL;
+    uint64_t best_next = 0;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        resolver_t *candidate = candidates[(offset + i) % count];
+        uint64_t next = max(candidate->next_ns, now);
+        if(best == NULL || next < best_next || (next == best_next && resolver_cost(candidate) < resolver_cost(best)))
+        {
+            best = candidate;
+            best_next = next;
+        }
+    }
+    return best;
+}
+
+// Chooses a server of the closest enclosing zone of the name whose name servers are within the cache and sets the zone
+// of the lookup to it. If the name servers of that zone do not have any known addresses, NULL is returned and glueless
+// is set to their NS record set.
+resolver_t *iterative_choose(lookup_t *lookup, cache_entry_t **glueless)
+{
+    resolver_t *candidates[ITERATIVE_MAX_CANDIDATES];
+    uint8_t qname[0xFF];
+    cache_key_t key;
+    uint64_t now = cache_now();
+
+    *glueless = NULL;
+    ssize_t qname_len = dns_str2namebuf((char *) lookup->key->name.name, qname);
+    if(qname_len <= 0)
+    {
+        return NULL;
+    }
+    for(lookup->zone_labels = (uint8_t) dns_wire_name_labels(qname); lookup->zone_labels > 0; lookup->zone_labels--)
+    {
+        uint8_t *zone = dns_wire_name_suffix(qname, lookup->zone_labels);
+        if(!cache_key_set(&key, zone, (size_t) (qname + qname_len - zone), DNS_REC_NS))
+        {
+            continue;
+        }
+        cache_entry_t *ns = cache_get(&context.cache, &key, now);
+        if(ns == NULL || ns->negative)
+        {
+            continue;
+        }
+
+        size_t count = 0;
+        uint8_t *record = ns->data;
+        for(uint16_t i = 0; i < ns->count; i++)
+        {
+            uint16_t length = ntohs(*(uint16_t *) record);
+            if(context.sockets.interfaces4.len > 0)
+            {
+                count = iterative_add_addresses(candidates, count, record + 2, length, DNS_REC_A, now);
+            }
+            if(context.sockets.interfaces6.len > 0)
+            {
+                count = iterative_add_addresses(candidates, count, record + 2, length, DNS_REC_AAAA, now);
+            }
+            record += 2 + length;
+        }
+        if(count == 0)
+        {
+            *glueless = ns;
+            return NULL;
+        }
+        return iterative_pick(candidates, count);
+    }
+
+    // The root zone is served by the starting servers, of which two random ones are compared.
+    candidates[0] = ((resolver_t *) context.resolvers.data) + urandom_size_t() % context.resolvers.len;
+    candidates[1] = ((resolver_t *) context.resolvers.data) + urandom_size_t() % context.resolvers.len;
+    return iterative_pick(candidates, 2);
+}
+
+// Reserves the next slot within the rate limit of a server (GCRA) and returns the time to wait until the slot. Slots
+// are reserved up to ITERATIVE_MAX_WAIT_MS ahead, which is within the span of the timed ring. Beyond that, reserved is
+// set to false and that time is returned, after which the lookup tries again.
+uint64_t iterative_rate_wait(resolver_t *server, bool *reserved)
+{
+    uint64_t now = monotonic_ns();
+    uint64_t next = max(server->next_ns, now);
+    uint64_t burst = ITERATIVE_BURST_MS * (uint64_t)TIMED_RING_MS;
+    uint64_t horizon = ITERATIVE_MAX_WAIT_MS * (uint64_t)TIMED_RING_MS;
+
+    *reserved = next <= now + burst + horizon;
+    if(!*reserved)
+    {
+        return horizon;
+    }
+    server->next_ns = next + context.iterative.interval_ns;
+    return next > now + burst ? next - now - burst : 0;
+}
+
+// Starts or joins the address lookup of a name server of a zone that has been delegated without glue. The lookup is
+// sent again once the name server lookup has finished. Only deeper lookups are joined, so that lookups never wait for
+// each other. Returns false if none of the name servers can be looked up.
+bool iterative_resolve_ns(lookup_t *lookup, cache_entry_t *ns)
+{
+    lookup_key_t key;
+    bool new = false;
+
+    if(ns == NULL || lookup->iterative_depth >= ITERATIVE_MAX_DEPTH || lookup->glueless >= ITERATIVE_MAX_GLUELESS)
+    {
+        return false;
+    }
+    uint8_t *record = ns->data;
+    for(uint16_t i = 0; i < ns->count; i++, record += 2 + ntohs(*(uint16_t *) record))
+    {
+        uint8_t *host = record + 2;
+        if(!parse_name(host, host, host + ntohs(*(uint16_t *) record), key.name.name, &key.name.length, NULL))
+        {
+            continue;
+        }
+        key.type = DNS_REC_A;
+        lookup_t *child = hashmapGet(context.map, &key);
+        if(child == NULL)
+        {
+            if(hashmapSize(context.map) >= context.cmd_args.hashmap_size)
+            {
+                return false;
+            }
+            child = new_lookup((char *) key.name.name, DNS_REC_A, &new);
+            child->iterative_child = true;
+            child->iterative_depth = (uint8_t) (lookup->iterative_depth + 1);
+            context.stats.iterative_glueless++;
+        }
+        else if(child->iterative_depth <= lookup->iterative_depth)
+        {
+            continue;
+        }
+
+        lookup->glueless++;
+        lookup->iterative_next = child->iterative_waiting;
+        child->iterative_waiting = lookup;
+        if(new)
+        {
+            send_query(child);
+        }
+        return true;
+    }
+    return false;
+}
+
+void iterative_transmit(lookup_t *lookup)
+{
+    lookup->socket = resolver_socket(lookup->resolver);
+    lookup->ring_entry = timed_ring_add(&context.ring, lookup_timeout(lookup), lookup);
+    lookup_mark_sent(lookup);
+    query_send(lookup, lookup->resolver, lookup->socket, lookup->transaction);
+}
+
+// Sends a lookup to a server of the closest known zone. If the rate limit of the server does not permit sending it right
+// away, the lookup is delayed and sent again by its timer.
+void iterative_send(lookup_t *lookup)
+{
+    cache_entry_t *glueless;
+    bool reserved = lookup->delayed && lookup->reserved;
+    uint8_t zone_labels = lookup->zone_labels;
+
+    lookup->delayed = false;
+    resolver_t *server = iterative_choose(lookup, &glueless);
+    if(reserved && (server == NULL || lookup->zone_labels <= zone_labels))
+    {
+        // The reserved slot is used unless another lookup has been referred to a closer zone meanwhile.
+        lookup->zone_labels = zone_labels;
+        iterative_transmit(lookup);
+        return;
+    }
+    if(server == NULL)
+    {
+        if(!iterative_resolve_ns(lookup, glueless))
+        {
+            context.stats.iterative_failed++;
+            lookup_done(lookup);
+        }
+        return;
+    }
+    lookup_set_resolver(lookup, server);
+    uint64_t wait = iterative_rate_wait(server, &lookup->reserved);
+    if(wait > 0)
+    {
+        context.stats.iterative_delayed++;
+        lookup->delayed = true;
+        lookup->ring_entry = timed_ring_add(&context.ring, wait, lookup);
+        return;
+    }
+    iterative_transmit(lookup);
+}
+
+void send_query(lookup_t *lookup)
+{
+    if(context.cmd_args.iterative)
+    {
+        iterative_send(lookup);
+        return;
+    }
+    if(context.cmd_args.consensus)
+    {
+        consensus_send(lookup);
+        return;
+    }
+
+    // Choose random resolver, verifications are resolved by the trusted resolvers
+    // Pool of resolvers cannot be empty due to check after parsing resolvers.
+    buffer_t *resolvers = lookup->verifying ? &context.trusted.resolvers : &context.resolvers;
+    if(!context.cmd_args.sticky || lookup->resolver == NULL)
+    {
+        if(context.cmd_args.predictable_resolver)
+        {
+            lookup_set_resolver(lookup, ((resolver_t *) resolvers->data) + context.lookup_index % resolvers->len);
+        }
+        else if(context.cmd_args.latency_aware)
+        {
+            lookup_set_resolver(lookup, choose_resolver_p2c(resolvers));
+        }
+        else
+        {
+            lookup_set_resolver(lookup, ((resolver_t *) resolvers->data) + urandom_size_t() % resolvers->len);
+        }
+    }
+
+    if(lookup->socket == NULL)
+    {
+        lookup->socket = resolver_socket(lookup->resolver);
+    }
+
+    // The timeout depends on the chosen resolver if it is adaptive
+    lookup->ring_entry = timed_ring_add(&context.ring, lookup_timeout(lookup), lookup);
+
+    lookup_mark_sent(lookup);
+    query_send(lookup, lookup->resolver, lookup->socket, lookup->transaction);
+}
+
+#define stats_store(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define stats_load(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+void stats_store_histogram(histogram_t *dst, histogram_t *src)
+{
+    for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        stats_store(dst->counts[i], src->counts[i]);
+    }
+    stats_store(dst->count, src->count);
+    stats_store(dst->sum, src->sum);
+    stats_store(dst->max, src->max);
+}
+
+void stats_load_histogram(histogram_t *dst, histogram_t *src)
+{
+    for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        dst->counts[i] += stats_load(src->counts[i]);
+    }
+    dst->count += stats_load(src->count);
+    dst->sum += stats_load(src->sum);
+    dst->max = max(dst->max, stats_load(src->max));
+}
+
+void stats_store_wildcard(wildcard_stats_t *dst, wildcard_stats_t *src)
+{
+    stats_store(dst->hits, src->hits);
+    stats_store(dst->misses, src->misses);
+    stats_store(dst->evictions, src->evictions);
+    stats_store(dst->uncached, src->uncached);
+    stats_store(dst->probes, src->probes);
+    stats_store(dst->found, src->found);
+    stats_store(dst->filtered, src->filtered);
+    stats_store(dst->skipped, src->skipped);
+}
+
+void stats_load_wildcard(wildcard_stats_t *dst, wildcard_stats_t *src)
+{
+    dst->hits += stats_load(src->hits);
+    dst->misses += stats_load(src->misses);
+    dst->evictions += stats_load(src->evictions);
+    dst->uncached += stats_load(src->uncached);
+    dst->probes += stats_load(src->probes);
+    dst->found += stats_load(src->found);
+    dst->filtered += stats_load(src->filtered);
+    dst->skipped += stats_load(src->skipped);
+}
+
+void stats_store_cache(cache_stats_t *dst, cache_stats_t *src)
+{
+    stats_store(dst->hits, src->hits);
+    stats_store(dst->chained, src->chained);
+    stats_store(dst->misses, src->misses);
+    stats_store(dst->expired, src->expired);
+    stats_store(dst->stored, src->stored);
+    stats_store(dst->evictions, src->evictions);
+}
+
+void stats_load_cache(cache_stats_t *dst, cache_stats_t *src)
+{
+    dst->hits += stats_load(src->hits);
+    dst->chained += stats_load(src->chained);
+    dst->misses += stats_load(src->misses);
+    dst->expired += stats_load(src->expired);
+    dst->stored += stats_load(src->stored);
+    dst->evictions += stats_load(src->evictions);
+}
+
+// Store the counters of this process within the specified slot.
+void stats_fill(stats_exchange_t *slot)
+{
+    size_t timer_bucket_max;
+    size_t timers = timed_ring_occupancy(&context.ring, &timer_bucket_max);
+
+    stats_store(slot->numdomains, context.stats.numdomains);
+    stats_store(slot->qsent, context.stats.qsent);
+    stats_store(slot->numreplies, context.stats.numreplies);
+    stats_store(slot->numparsed, context.stats.numparsed);
+    stats_store(slot->finished, context.stats.finished);
+    stats_store(slot->finished_success, context.stats.finished_success);
+    stats_store(slot->mismatch_domain, context.stats.mismatch_domain);
+    stats_store(slot->mismatch_id, context.stats.mismatch_id);
+    stats_store(slot->current_rate, context.stats.current_rate);
+    stats_store(slot->success_rate, context.stats.success_rate);
+    stats_store(slot->inflight, context.map ? (size_t)hashmapSize(context.map) : 0);
+    stats_store(slot->pool_free, context.lookup_pool.len);
+    stats_store(slot->timers, timers);
+    stats_store(slot->timer_bucket_max, timer_bucket_max);
+    for(size_t i = 0; i <= context.cmd_args.resolve_count; i++)
+    {
+        stats_store(slot->timeouts[i], context.stats.timeouts[i]);
+        stats_store(slot->try_replies[i], context.stats.try_replies[i]);
+        stats_store(slot->try_rtt_sum[i], context.stats.try_rtt_sum[i]);
+    }
+    stats_store_histogram(&slot->rtt, &context.stats.rtt);
+    for(size_t i = 0; i < STATS_RTT_TRIES; i++)
+    {
+        stats_store_histogram(&slot->try_rtt[i], &context.stats.try_rtt[i]);
+    }
+    for(size_t i = 0; i < STATS_RCODES; i++)
+    {
+        stats_store(slot->all_rcodes[i], context.stats.all_rcodes[i]);
+        stats_store(slot->final_rcodes[i], context.stats.final_rcodes[i]);
+    }
+    for(size_t i = 0; i < STATE_DONE; i++)
+    {
+        stats_store(slot->state_cpu_user_us[i], context.stats.state_cpu_user_us[i]);
+        stats_store(slot->state_cpu_system_us[i], context.stats.state_cpu_system_us[i]);
+    }
+    stats_store_wildcard(&slot->wildcard, &context.wildcard.stats);
+    stats_store_cache(&slot->cache, &context.cache.stats);
+    stats_store(slot->verify_started, context.stats.verify_started);
+    stats_store(slot->verified, context.stats.verified);
+    stats_store(slot->verify_rejected, context.stats.verify_rejected);
+    stats_store(slot->verify_failed, context.stats.verify_failed);
+    stats_store(slot->consensus_decided, context.stats.consensus_decided);
+    stats_store(slot->consensus_split, context.stats.consensus_split);
+    stats_store(slot->consensus_disagreements, context.stats.consensus_disagreements);
+    stats_store(slot->iterative_referrals, context.stats.iterative_referrals);
+    stats_store(slot->iterative_lame, context.stats.iterative_lame);
+    stats_store(slot->iterative_glueless, context.stats.iterative_glueless);
+    stats_store(slot->iterative_delayed, context.stats.iterative_delayed);
+    stats_store(slot->iterative_failed, context.stats.iterative_failed);
+    stats_store(slot->edns_replies, context.stats.edns_replies);
+    stats_store(slot->edns_truncated, context.stats.edns_truncated);
+    stats_store(slot->edns_fallbacks, context.stats.edns_fallbacks);
+    stats_store(slot->edns_badcookie, context.stats.edns_badcookie);
+    stats_store(slot->tcp_fallbacks, context.stats.tcp_fallbacks);
+    stats_store(slot->tcp_replies, context.stats.tcp_replies);
+    stats_store(slot->tcp_connections, context.stats.tcp_connections);
+    stats_store(slot->tcp_failures, context.stats.tcp_failures);
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        stats_store(slot->maxrss_kb, (size_t)usage.ru_maxrss);
+        stats_store(slot->maxrss_total_kb, (size_t)usage.ru_maxrss);
+    }
+}
+
+// Publish the counters of this process to its slot within the shared statistics region.
+void stats_publish()
+{
+    stats_exchange_t *slot = context.stat_messages + context.fork_index;
+
+    stats_fill(slot);
+
+    // The release order makes the counters above visible to a process that observes the flag.
+    __atomic_store_n(&slot->done, context.state >= STATE_WAIT_CHILDREN, __ATOMIC_RELEASE);
+}
+
+// Sum up the counters that all processes have published.
+void stats_aggregate(stats_exchange_t *total)
+{
+    bzero(total, sizeof(*total));
+    for(size_t j = 0; j < context.cmd_args.num_processes; j++)
+    {
+        stats_exchange_t *slot = context.stat_messages + j;
+
+        total->numdomains += stats_load(slot->numdomains);
+        total->qsent += stats_load(slot->qsent);
+        total->numreplies += stats_load(slot->numreplies);
+        total->numparsed += stats_load(slot->numparsed);
+        total->finished += stats_load(slot->finished);
+        total->finished_success += stats_load(slot->finished_success);
+        total->mismatch_domain += stats_load(slot->mismatch_domain);
+        total->mismatch_id += stats_load(slot->mismatch_id);
+        total->current_rate += stats_load(slot->current_rate);
+        total->success_rate += stats_load(slot->success_rate);
+        total->inflight += stats_load(slot->inflight);
+        total->pool_free += stats_load(slot->pool_free);
+        total->timers += stats_load(slot->timers);
+        total->timer_bucket_max = max(total->timer_bucket_max, stats_load(slot->timer_bucket_max));
+        for(size_t i = 0; i <= context.cmd_args.resolve_count; i++)
+        {
+            total->timeouts[i] += stats_load(slot->timeouts[i]);
+            total->try_replies[i] += stats_load(slot->try_replies[i]);
+            total->try_rtt_sum[i] += stats_load(slot->try_rtt_sum[i]);
+        }
+        stats_load_histogram(&total->rtt, &slot->rtt);
+        for(size_t i = 0; i < STATS_RTT_TRIES; i++)
+        {
+            stats_load_histogram(&total->try_rtt[i], &slot->try_rtt[i]);
+        }
+        for(size_t i = 0; i < STATS_RCODES; i++)
+        {
+            total->all_rcodes[i] += stats_load(slot->all_rcodes[i]);
+            total->final_rcodes[i] += stats_load(slot->final_rcodes[i]);
+        }
+        for(size_t i = 0; i < STATE_DONE; i++)
+        {
+            total->state_cpu_user_us[i] += stats_load(slot->state_cpu_user_us[i]);
+            total->state_cpu_system_us[i] += stats_load(slot->state_cpu_system_us[i]);
+        }
+        total->maxrss_kb = max(total->maxrss_kb, stats_load(slot->maxrss_kb));
+        total->maxrss_total_kb += stats_load(slot->maxrss_total_kb);
+        stats_load_wildcard(&total->wildcard, &slot->wildcard);
+        stats_load_cache(&total->cache, &slot->cache);
+        total->verify_started += stats_load(slot->verify_started);
+        total->verified += stats_load(slot->verified);
+        total->verify_rejected += stats_load(slot->verify_rejected);
+        total->verify_failed += stats_load(slot->verify_failed);
+        total->consensus_decided += stats_load(slot->consensus_decided);
+        total->consensus_split += stats_load(slot->consensus_split);
+        total->consensus_disagreements += stats_load(slot->consensus_disagreements);
+        total->iterative_referrals += stats_load(slot->iterative_referrals);
+        total->iterative_lame += stats_load(slot->iterative_lame);
+        total->iterative_glueless += stats_load(slot->iterative_glueless);
+        total->iterative_delayed += stats_load(slot->iterative_delayed);
+        total->iterative_failed += stats_load(slot->iterative_failed);
+        total->edns_replies += stats_load(slot->edns_replies);
+        total->edns_truncated += stats_load(slot->edns_truncated);
+        total->edns_fallbacks += stats_load(slot->edns_fallbacks);
+        total->edns_badcookie += stats_load(slot->edns_badcookie);
+        total->tcp_fallbacks += stats_load(slot->tcp_fallbacks);
+        total->tcp_replies += stats_load(slot->tcp_replies);
+        total->tcp_connections += stats_load(slot->tcp_connections);
+        total->tcp_failures += stats_load(slot->tcp_failures);
+    }
+}
+
+// Obtain the counters of all processes, which are up to date for the calling process only.
+void stats_snapshot(stats_exchange_t *total)
+{
+    if(context.cmd_args.num_processes > 1)
+    {
+        stats_publish();
+        stats_aggregate(total);
+    }
+    else
+    {
+        bzero(total, sizeof(*total));
+        stats_fill(total);
+    }
+}
+
+bool stats_processes_done()
+{
+    for(size_t j = 0; j < context.cmd_args.num_processes; j++)
+    {
+        if(!__atomic_load_n(&context.stat_messages[j].done, __ATOMIC_ACQUIRE))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Print the latency percentiles of a histogram in milliseconds to the buffer.
+void format_latency(char *buf, size_t buflen, histogram_t *histogram)
+{
+    snprintf(buf, buflen, "p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, p99.9 %.2f ms",
+             histogram_percentile(histogram, 50) / 1000.0, histogram_percentile(histogram, 90) / 1000.0,
+             histogram_percentile(histogram, 99) / 1000.0, histogram_percentile(histogram, 99.9) / 1000.0);
+}
+
+// Print the latency percentiles for each try with a histogram to the buffer.
+void format_try_percentiles(char *buf, size_t buflen, histogram_t *try_rtt)
+{
+    int offset = 0;
+    buf[0] = 0;
+    for (size_t i = 0; i < STATS_RTT_TRIES; i++)
+    {
+        if(try_rtt[i].count == 0)
+        {
+            continue;
+        }
+        int result = snprintf(buf + offset, buflen - offset, "%zu%s: %.2f/%.2f/%.2f/%.2f, ", i,
+                              i == STATS_RTT_TRIES - 1 ? "+" : "",
+                              histogram_percentile(try_rtt + i, 50) / 1000.0,
+                              histogram_percentile(try_rtt + i, 90) / 1000.0,
+                              histogram_percentile(try_rtt + i, 99) / 1000.0,
+                              histogram_percentile(try_rtt + i, 99.9) / 1000.0);
+        if (result <= 0 || result >= buflen - offset)
+        {
+            break;
+        }
+        offset += result;
+    }
+}
+
+// Print the number of replies and their average latency by the number of previous tries to the buffer.
+void format_try_latencies(char *buf, size_t buflen, size_t *try_replies, uint64_t *try_rtt_sum, size_t count)
+{
+    int offset = 0;
+    buf[0] = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if(try_replies[i] == 0)
+        {
+            continue;
+        }
+        int result = snprintf(buf + offset, buflen - offset, "%zu: %zu (%.2f ms), ", i, try_replies[i],
+                              try_rtt_sum[i] / (double)try_replies[i] / TIMED_RING_MS);
+        if (result <= 0 || result >= buflen - offset)
+        {
+            break;
+        }
+        offset += result;
+    }
+}
+
+void check_progress()
+{
+    static struct timespec last_time;
+    static char timeouts[4096];
+    static char try_latencies[4096];
+    static char latency[256];
+    static char try_percentiles[1024];
+    static struct timespec now;
+    static stats_exchange_t total;
+    static size_t last_replies;
+    static size_t last_success;
+    static const char* stats_format = "\033[H\033[2J" // Clear screen (probably simplest and most portable solution)
+            "Processed queries: %zu\n"
+            "Received packets: %zu\n"
+            "Progress: %.2f%% (%02lld h %02lld min %02lld sec / %02lld h %02lld min %02lld sec)\n"
+            "Current incoming rate: %zu pps, average: %zu pps\n"
+            "Current success rate: %zu pps, average: %zu pps\n"
+            "Finished total: %zu, success: %zu (%.2f%%)\n"
+            "Mismatched domains: %zu (%.2f%%), IDs: %zu (%.2f%%)\n"
+            "Failures: %s\n"
+            "Replies per try: %s\n"
+            "Latency: %s\n"
+            "Latency per try (p50/p90/p99/p99.9 ms): %s\n"
+            "Response: | Success:               | Total:\n"
+            "OK:       | %12zu (%6.2f%%) | %12zu (%6.2f%%)\n"
+            "NXDOMAIN: | %12zu (%6.2f%%) | %12zu (%6.2f%%)\n"
+            "SERVFAIL: | %12zu (%6.2f%%) | %12zu (%6.2f%%)\n"
+            "REFUSED:  | %12zu (%6.2f%%) | %12zu (%6.2f%%)\n"
+            "FORMERR:  | %12zu (%6.2f%%) | %12zu (%6.2f%%)\n";
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    time_t elapsed_ns = (now.tv_sec - last_time.tv_sec) * 1000000000 + (now.tv_nsec - last_time.tv_nsec);
+    size_t rate_pps = elapsed_ns == 0 ? 0 : context.stats.current_rate * TIMED_RING_S / elapsed_ns;
+    size_t rate_success = elapsed_ns == 0 ? 0 : context.stats.success_rate * TIMED_RING_S / elapsed_ns;
+    last_time = now;
+
+    // Children only publish their stats for the parent process
+    if(context.cmd_args.num_processes > 1 && context.fork_index != 0)
+    {
+        stats_publish();
+        goto end_stats;
+    }
+
+    // The peak rates for the summary require the stats to be collected in quiet mode as well
+    if(context.cmd_args.quiet && !context.cmd_args.summary)
+    {
+        return;
+    }
+
+    if(context.cmd_args.num_processes > 1)
+    {
+        stats_publish();
+        stats_aggregate(&total);
+
+        // The processes publish their counters at different times, so the rates are derived from the totals.
+        rate_pps = elapsed_ns == 0 ? 0 : (total.numreplies - last_replies) * TIMED_RING_S / elapsed_ns;
+        rate_success = elapsed_ns == 0 ? 0 : (total.finished_success - last_success) * TIMED_RING_S / elapsed_ns;
+        last_replies = total.numreplies;
+        last_success = total.finished_success;
+    }
+    context.stats.peak_rate = max(context.stats.peak_rate, rate_pps);
+    context.stats.peak_success_rate = max(context.stats.peak_success_rate, rate_success);
+
+    if(context.cmd_args.quiet)
+    {
+        goto end_stats;
+    }
+
+    if(context.cmd_args.validate_resolvers)
+    {
+        fprintf(stderr, "\033[H\033[2J"
+                        "Validated resolvers: %zu/%zu, usable: %zu\n"
+                        "Probes sent: %zu, replies: %zu, in flight: %zu\n",
+                context.validation.finished, context.resolvers.len, context.validation.usable,
+                context.stats.qsent, context.stats.numparsed, context.validation.outstanding);
+        goto end_stats;
+    }
+
+    // Go on with printing stats.
+
+    float progress = context.state == STATE_DONE ? 1 : 0;
+    if(context.domainfile_size > 0) // If the domain file is not a real file, the progress cannot be estimated.
+    {
+        // Get a rough estimate of the progress, only roughly proportional to the number of domains.
+        // Will be very inaccurate if the domain file is sorted per domain name length.
+        long int domain_file_position = ftell(context.domainfile);
+        if (domain_file_position >= 0)
+        {
+            progress = domain_file_position / (float)context.domainfile_size;
+        }
+    }
+
+    time_t total_elapsed_ns = (now.tv_sec - context.stats.start_time.tv_sec) * 1000000000
+        + (now.tv_nsec - context.stats.start_time.tv_nsec); // since last output
+    long long elapsed = now.tv_sec - context.stats.start_time.tv_sec; // resolution of one second should be okay
+    long long sec = elapsed % 60;
+    long long min = (elapsed / 60) % 60;
+    long long h = elapsed / 3600;
+
+    long long estimated_time = progress == 0 ? 0 : (long long)(elapsed / progress);
+    if(estimated_time < elapsed)
+    {
+        estimated_time = elapsed;
+    }
+    long long prog_sec = estimated_time % 60;
+    long long prog_min = (estimated_time / 60) % 60;
+    long long prog_h = (estimated_time / 3600);
+
+#define stats_percent(a, b) ((b) == 0 ? 0 : (a) / (float) (b) * 100)
+#define stat_abs_share(a, b) a, stats_percent(a, b)
+#define rcode_stat(code) stat_abs_share(context.stats.final_rcodes[(code)], context.stats.finished_success),\
+        stat_abs_share(context.stats.all_rcodes[(code)], context.stats.numparsed)
+#define rcode_stat_multi(code) stat_abs_share(total.final_rcodes[(code)], total.finished_success),\
+        stat_abs_share(total.all_rcodes[(code)], total.numparsed)
+    
+    if(context.cmd_args.num_processes == 1)
+    {
+        size_t average_pps = elapsed == 0 ? rate_pps : context.stats.numreplies * TIMED_RING_S / total_elapsed_ns;
+        size_t average_success = elapsed == 0 ? rate_success : context.stats.finished_success * TIMED_RING_S / total_elapsed_ns;
+
+        // Print the detailed timeout stats (number of tries before timeout) to the timeouts buffer.
+        int offset = 0;
+        for (size_t i = 0; i <= context.cmd_args.resolve_count; i++)
+        {
+            float share = stats_percent(context.stats.timeouts[i], context.stats.finished);
+            int result = snprintf(timeouts + offset, sizeof(timeouts) - offset, "%zu: %.2f%%, ", i, share);
+            if (result <= 0 || result >= sizeof(timeouts) - offset)
+            {
+                break;
+            }
+            offset += result;
+        }
+        format_try_latencies(try_latencies, sizeof(try_latencies), context.stats.try_replies,
+                             context.stats.try_rtt_sum, context.cmd_args.resolve_count);
+        format_latency(latency, sizeof(latency), &context.stats.rtt);
+        format_try_percentiles(try_percentiles, sizeof(try_percentiles), context.stats.try_rtt);
+
+        fprintf(stderr,
+                stats_format,
+                context.stats.numdomains,
+                context.stats.numreplies,
+                progress * 100, h, min, sec, prog_h, prog_min, prog_sec, rate_pps, average_pps,
+                rate_success, average_success,
+                context.stats.finished,
+                stat_abs_share(context.stats.finished_success, context.stats.finished),
+                stat_abs_share(context.stats.mismatch_domain, context.stats.numparsed),
+                stat_abs_share(context.stats.mismatch_id, context.stats.numparsed),
+                timeouts,
+                try_latencies,
+                latency,
+                try_percentiles,
+
+                rcode_stat(DNS_RCODE_OK),
+                rcode_stat(DNS_RCODE_NXDOMAIN),
+                rcode_stat(DNS_RCODE_SERVFAIL),
+                rcode_stat(DNS_RCODE_REFUSED),
+                rcode_stat(DNS_RCODE_FORMERR)
+        );
+    }
+    else
+    {
+        size_t average_pps = elapsed == 0 ? rate_pps :
+                             total.numreplies * TIMED_RING_S / total_elapsed_ns;
+        size_t average_success = elapsed == 0 ? rate_pps :
+                             total.finished_success * TIMED_RING_S / total_elapsed_ns;
+
+
+        // Print the detailed timeout stats (number of tries before timeout) to the timeouts buffer.
+        int offset = 0;
+        for (size_t i = 0; i <= context.cmd_args.resolve_count; i++)
+        {
+            float share = stats_percent(total.timeouts[i], total.finished);
+            int result = snprintf(timeouts + offset, sizeof(timeouts) - offset, "%zu: %.2f%%, ", i, share);
+            if (result <= 0 || result >= sizeof(timeouts) - offset)
+            {
+                break;
+            }
+            offset += result;
+        }
+        format_try_latencies(try_latencies, sizeof(try_latencies), total.try_replies,
+                             total.try_rtt_sum,
+                             context.cmd_args.resolve_count);
+        format_latency(latency, sizeof(latency), &total.rtt);
+        format_try_percentiles(try_percentiles, sizeof(try_percentiles), total.try_rtt);
+
+        fprintf(stderr,
+                stats_format,
+                total.numdomains,
+                total.numreplies,
+                progress * 100, h, min, sec, prog_h, prog_min, prog_sec, rate_pps, average_pps,
+                rate_success, average_success,
+                total.finished,
+                stat_abs_share(total.finished_success, total.finished),
+                stat_abs_share(total.mismatch_domain, total.numparsed),
+                stat_abs_share(total.mismatch_id, total.numparsed),
+                timeouts,
+                try_latencies,
+                latency,
+                try_percentiles,
+
+                rcode_stat_multi(DNS_RCODE_OK),
+                rcode_stat_multi(DNS_RCODE_NXDOMAIN),
+                rcode_stat_multi(DNS_RCODE_SERVFAIL),
+                rcode_stat_multi(DNS_RCODE_REFUSED),
+                rcode_stat_multi(DNS_RCODE_FORMERR)
+        );
+    }
+    if(context.cmd_args.trusted_resolvers)
+    {
+        stats_exchange_t *counters = &total;
+        if(context.cmd_args.num_processes == 1)
+        {
+            counters->verify_started = context.stats.verify_started;
+            counters->verified = context.stats.verified;
+            counters->verify_rejected = context.stats.verify_rejected;
+            counters->verify_failed = context.stats.verify_failed;
+        }
+        fprintf(stderr, "Verifications: %zu, verified: %zu (%.2f%%), rejected: %zu, failed: %zu\n",
+                counters->verify_started, stat_abs_share(counters->verified, counters->verify_started),
+                counters->verify_rejected, counters->verify_failed);
+    }
+    if(context.cmd_args.consensus)
+    {
+        stats_exchange_t *counters = &total;
+        if(context.cmd_args.num_processes == 1)
+        {
+            counters->consensus_decided = context.stats.consensus_decided;
+            counters->consensus_split = context.stats.consensus_split;
+            counters->consensus_disagreements = context.stats.consensus_disagreements;
+        }
+        fprintf(stderr, "Consensus: decided: %zu (%.2f%%), split: %zu, disagreeing replies: %zu\n",
+                stat_abs_share(counters->consensus_decided, counters->consensus_decided + counters->consensus_split),
+                counters->consensus_split, counters->consensus_disagreements);
+    }
+    if(context.cmd_args.iterative)
+    {
+        stats_exchange_t *counters = &total;
+        if(context.cmd_args.num_processes == 1)
+        {
+            counters->iterative_referrals = context.stats.iterative_referrals;
+            counters->iterative_lame = context.stats.iterative_lame;
+            counters->iterative_glueless = context.stats.iterative_glueless;
+            counters->iterative_delayed = context.stats.iterative_delayed;
+            counters->iterative_failed = context.stats.iterative_failed;
+        }
+        fprintf(stderr, "Iterative: referrals: %zu, lame replies: %zu, name server lookups: %zu, rate delays: %zu, "
+                        "failed: %zu\n",
+                counters->iterative_referrals, counters->iterative_lame, counters->iterative_glueless,
+                counters->iterative_delayed, counters->iterative_failed);
+    }
+    if(context.cmd_args.edns_size)
+    {
+        stats_exchange_t *counters = &total;
+        if(context.cmd_args.num_processes == 1)
+        {
+            counters->edns_replies = context.stats.edns_replies;
+            counters->edns_truncated = context.stats.edns_truncated;
+            counters->edns_fallbacks = context.stats.edns_fallbacks;
+            counters->edns_badcookie = context.stats.edns_badcookie;
+        }
+        fprintf(stderr, "EDNS: replies with OPT: %zu, truncated: %zu, fallbacks: %zu, bad cookies: %zu\n",
+                counters->edns_replies, counters->edns_truncated, counters->edns_fallbacks, counters->edns_badcookie);
+    }
+    if(context.cmd_args.tcp_fallback || context.cmd_args.tcp)
+    {
+        stats_exchange_t *counters = &total;
+        if(context.cmd_args.num_processes == 1)
+        {
+            counters->tcp_fallbacks = context.stats.tcp_fallbacks;
+            counters->tcp_replies = context.stats.tcp_replies;
+            counters->tcp_connections = context.stats.tcp_connections;
+            counters->tcp_failures = context.stats.tcp_failures;
+        }
+        // Only shown once replies have been truncated, which is rare for the common record types.
+        if(counters->tcp_fallbacks > 0 || context.cmd_args.tcp)
+        {
+            fprintf(stderr, "TCP: truncated lookups: %zu, replies: %zu, connections: %zu, failures: %zu\n",
+                    counters->tcp_fallbacks, counters->tcp_replies, counters->tcp_connections,
+                    counters->tcp_failures);
+        }
+    }
+    if(context.cmd_args.wildcard)
+    {
+        wildcard_stats_t *wildcard = context.cmd_args.num_processes == 1 ? &context.wildcard.stats : &total.wildcard;
+        fprintf(stderr,
+                "Wildcards: probed zones: %zu, found: %zu, filtered replies: %zu, skipped names: %zu\n"
+                "Wildcard cache: hits: %zu (%.2f%%), misses: %zu, evictions: %zu, unchecked names: %zu\n",
+                wildcard->probes, wildcard->found, wildcard->filtered, wildcard->skipped,
+                stat_abs_share(wildcard->hits, wildcard->hits + wildcard->misses), wildcard->misses,
+                wildcard->evictions, wildcard->uncached);
+    }
+    if(context.cmd_args.cache_size)
+    {
+        cache_stats_t *cache = context.cmd_args.num_processes == 1 ? &context.cache.stats : &total.cache;
+        fprintf(stderr, "Answer cache: hits: %zu (%.2f%%), chained: %zu, stored: %zu, expired: %zu, evictions: %zu\n",
+                stat_abs_share(cache->hits, cache->hits + cache->misses), cache->chained, cache->stored,
+                cache->expired, cache->evictions);
+    }
+
+end_stats:
+    context.stats.current_rate = 0;
+    context.stats.success_rate = 0;
+    // Call this function in about one second again. Children publish more often, so that the rates derived from the
+    // totals by the main process are not distorted by counters that have been published up to a second ago.
+    timed_ring_add(&context.ring, context.fork_index != 0 ? TIMED_RING_S / 10 : TIMED_RING_S, check_progress);
+}
+
+void done()
+{
+    if(context.fork_index != 0 || context.cmd_args.num_processes == 1)
+    {
+        set_state(STATE_DONE);
+    }
+    else
+    {
+        set_state(STATE_WAIT_CHILDREN);
+    }
+    if(context.cmd_args.num_processes > 1)
+    {
+        stats_publish();
+        if(context.fork_index == 0 && stats_processes_done())
+        {
+            set_state(STATE_DONE);
+        }
+    }
+    check_progress();
+}
+
+void lookup_free(lookup_t *lookup)
+{
+    if(lookup->resolver != NULL)
+    {
+        lookup->resolver->inflight--;
+    }
+    hashmapRemove(context.map, lookup->key);
+
+    // Return lookup to pool.
+    // According to ISO/IEC 9899:TC2 §6.7.2.1 (13), structs are not padded at the beginning
+    ((lookup_key_t**)context.lookup_pool.data)[context.lookup_pool.len++] = lookup->key;
+}
+
+// Wildcard detection: New lookups below a zone that is not within the cache wait for a probe of the zone. Replies
+// to lookups below zones with a wildcard are dropped if they only consist of wildcard answers.
+
+bool wildcard_probe_start(wildcard_zone_t *zone)
+{
+    static char name[0x100];
+    bool new;
+    uint64_t label;
+
+    urandom_get(&label, sizeof(label));
+    if(snprintf(name, sizeof(name), "%016" PRIx64 ".%s", label, zone->zone.name) >= sizeof(name) - 1)
+    {
+        return false;
+    }
+    lookup_t *probe = new_lookup(name, context.cmd_args.record_type, &new);
+    if(!new)
+    {
+        return false;
+    }
+    probe->wildcard_probe = zone;
+    send_query(probe);
+    return true;
+}
+
+// Decides whether a new lookup is sent right away. Otherwise, it waits for the probe of its zone or it has been
+// released because the zone has a wildcard and such names are skipped.
+bool wildcard_admit(lookup_t *lookup)
+{
+    dns_name_t zone_name;
+
+    if(!wildcard_parent(&zone_name, &lookup->key->name))
+    {
+        return true;
+    }
+    wildcard_zone_t *zone = wildcard_cache_get(&context.wildcard, &zone_name);
+    if(zone == NULL)
+    {
+        zone = wildcard_cache_insert(&context.wildcard, &zone_name);
+        if(zone == NULL)
+        {
+            return true;
+        }
+        if(!wildcard_probe_start(zone))
+        {
+            zone->state = WILDCARD_NONE;
+        }
+    }
+
+    if(zone->state == WILDCARD_PROBING)
+    {
+        lookup->wildcard_next = zone->waiting;
+        zone->waiting = lookup;
+        return false;
+    }
+    if(zone->state == WILDCARD_FOUND && context.cmd_args.wildcard_skip)
+    {
+        context.wildcard.stats.skipped++;
+        context.stats.finished++;
+        lookup_free(lookup);
+        return false;
+    }
+    return true;
+}
+
+// Called when a probe is finished, either by an acceptable reply that has been learned or by giving up.
+void wildcard_probe_done(lookup_t *probe)
+{
+    wildcard_zone_t *zone = probe->wildcard_probe;
+
+    // Probes are not accounted as finished lookups, so they are removed from the retry statistics.
+    context.stats.timeouts[probe->tries]--;
+    if(zone->state == WILDCARD_PROBING)
+    {
+        zone->state = WILDCARD_NONE;
+    }
+
+    lookup_t *lookup = zone->waiting;
+    zone->waiting = NULL;
+    while(lookup != NULL)
+    {
+        lookup_t *next = lookup->wildcard_next;
+        if(zone->state == WILDCARD_FOUND && context.cmd_args.wildcard_skip)
+        {
+            context.wildcard.stats.skipped++;
+            context.stats.finished++;
+            lookup_free(lookup);
+        }
+        else
+        {
+            send_query(lookup);
+        }
+        lookup = next;
+    }
+}
+
+bool wildcard_filter(lookup_t *lookup, dns_head_t *head, uint8_t *offset, size_t len, uint8_t *next)
+{
+    dns_name_t zone_name;
+
+    if(!wildcard_parent(&zone_name, &lookup->key->name))
+    {
+        return false;
+    }
+    wildcard_zone_t *zone = wildcard_cache_find(&context.wildcard, &zone_name);
+    if(zone == NULL || !wildcard_zone_matches(zone, head, offset, len, next))
+    {
+        return false;
+    }
+    context.wildcard.stats.filtered++;
+    return true;
+}
+
+// Verification: Positive replies are resolved once more by the trusted resolvers and only their replies are written.
+// Queries to the trusted resolvers are limited by the generic cell rate algorithm, lookups exceeding the rate wait
+// within a queue that is drained by a timer.
+
+// Returns the time to wait before the next query may be sent to the trusted resolvers. If it is zero, the query has
+// been accounted for.
+uint64_t verify_rate_wait()
+{
+    uint64_t now = monotonic_ns();
+    uint64_t next = max(context.trusted.next_ns, now);
+    uint64_t burst = TRUSTED_BURST_MS * (uint64_t)TIMED_RING_MS;
+
+    if(next > now + burst)
+    {
+        return next - now - burst;
+    }
+    context.trusted.next_ns = next + context.trusted.interval_ns;
+    return 0;
+}
+
+void verify_drain()
+{
+    context.trusted.drain_scheduled = false;
+    while(context.trusted.queue_head != NULL)
+    {
+        uint64_t wait = verify_rate_wait();
+        if(wait > 0)
+        {
+            context.trusted.drain_scheduled = true;
+            timed_ring_add(&context.ring, wait, verify_drain);
+            return;
+        }
+        lookup_t *lookup = context.trusted.queue_head;
+        context.trusted.queue_head = lookup->verify_next;
+        send_query(lookup);
+    }
+}
+
+// Sends the query of a lookup to the trusted resolvers or queues it if the rate does not permit sending it right away.
+void verify_send(lookup_t *lookup)
+{
+    lookup->verify_next = NULL;
+    if(context.trusted.queue_head == NULL)
+    {
+        uint64_t wait = verify_rate_wait();
+        if(wait == 0)
+        {
+            send_query(lookup);
+            return;
+        }
+        context.trusted.queue_head = lookup;
+        if(!context.trusted.drain_scheduled)
+        {
+            context.trusted.drain_scheduled = true;
+            timed_ring_add(&context.ring, wait, verify_drain);
+        }
+    }
+    else
+    {
+        context.trusted.queue_tail->verify_next = lookup;
+    }
+    context.trusted.queue_tail = lookup;
+}
+
+bool verify_required(lookup_t *lookup, dns_head_t *head)
+{
+    return context.cmd_args.trusted_resolvers && !lookup->verifying && head->header.rcode == DNS_RCODE_OK
+           && head->header.ans_count > 0;
+}
+
+// Passes a lookup with a positive reply on to the trusted resolvers. The tries start over.
+void verify_start(lookup_t *lookup)
+{
+    context.stats.verify_started++;
+    context.stats.timeouts[lookup->tries]--;
+    context.stats.timeouts[0]++;
+    lookup->tries = 0;
+    lookup->first_sent_ns = 0;
+    lookup->verifying = true;
+    if(lookup->resolver != NULL)
+    {
+        lookup->resolver->inflight--;
+        lookup->resolver = NULL;
+    }
+    lookup->socket = NULL; // The trusted resolvers may use another protocol
+    urandom_get(&lookup->transaction, sizeof(lookup->transaction));
+    verify_send(lookup);
+}
+
+// Answer cache: Names are looked up within the cache before they are resolved. Cached answers are written like
+// replies of the unspecified address.
+bool cache_respond(const char *qname)
+{
+    static uint8_t reply[0x1000];
+    static struct sockaddr_storage unspecified = {.ss_family = AF_INET};
+    uint8_t name[0x100];
+    dns_head_t head;
+    uint8_t *next;
+
+    ssize_t name_len = dns_str2namebuf(qname, name);
+    if(name_len <= 0)
+    {
+        return false;
+    }
+    size_t len = cache_answer(&context.cache, name, (size_t) name_len, context.cmd_args.record_type,
+                              !context.cmd_args.norecurse, reply, sizeof(reply));
+    if(len == 0 || !dns_parse_question(reply, len, &head, &next))
+    {
+        return false;
+    }
+    context.stats.timeouts[0]++;
+    context.stats.finished++;
+    context.stats.finished_success++;
+    context.stats.final_rcodes[head.header.rcode]++;
+    output_packet(&head, reply, len, next, &unspecified, time(NULL));
+    if(context.cmd_args.flush)
+    {
+        fflush(context.outfile);
+    }
+    return true;
+}
+
+void can_send()
+{
+    char *qname;
+    bool new;
+
+    // Probes are sent as soon as the previous phase of a resolver has finished.
+    if(context.cmd_args.validate_resolvers)
+    {
+        return;
+    }
+
+    // A new name may require a wildcard probe in addition to its own lookup. In iterative mode, a share of the hash map
+    // is kept for the lookups of name servers without glue.
+    size_t reserve = context.cmd_args.wildcard ? 1 : 0;
+    if(context.cmd_args.iterative)
+    {
+        reserve += context.cmd_args.hashmap_size / 4;
+    }
+    while (hashmapSize(context.map) + reserve < context.cmd_args.hashmap_size && context.state <= STATE_QUERYING)
+    {
+        if(!next_query(&qname))
+        {
+            set_state(STATE_COOLDOWN); // We will not create any new queries
+            break;
+        }
+        context.stats.numdomains++;
+        if(context.cmd_args.cache_size && cache_respond(qname))
+        {
+            continue;
+        }
+        lookup_t *lookup = new_lookup(qname, context.cmd_args.record_type, &new);
+        if(!new)
+        {
+            continue;
+        }
+        if(context.cmd_args.wildcard && !wildcard_admit(lookup))
+        {
+            continue;
+        }
+        send_query(lookup);
+    }
+
+    // Names that have not been resolved, such as cached ones, do not finish any lookup.
+    if(context.state == STATE_COOLDOWN && hashmapSize(context.map) == 0)
+    {
+        done();
+    }
+}
+
+bool is_unacceptable(dns_head_t *head)
+{
+    return context.cmd_args.retry_codes[head->header.rcode];
+}
+
+void lookup_done(lookup_t *lookup)
+{
+    lookup_t *waiting = lookup->iterative_waiting;
+    if(lookup->wildcard_probe)
+    {
+        wildcard_probe_done(lookup);
+    }
+    else if(lookup->iterative_child)
+    {
+        // Name server lookups are not accounted as finished lookups, so they are removed from the retry statistics.
+        context.stats.timeouts[lookup->tries]--;
+    }
+    else
+    {
+        context.stats.finished++;
+    }
+    lookup_free(lookup);
+
+    // Lookups waiting for a name server continue with the address that has been cached, if any.
+    while(waiting != NULL)
+    {
+        lookup_t *next = waiting->iterative_next;
+        send_query(waiting);
+        waiting = next;
+    }
+
+
+    // When transmission is not aggressive, we only start a new lookup after another one has finished.
+    // When our transmission is very aggressive, we also start a new lookup, although we listen for EPOLLOUT
+    // events as well.
+    if(context.cmd_args.extreme == 0 || context.cmd_args.extreme == 2)
+    {
+        can_send();
+    }
+
+    if(context.state == STATE_COOLDOWN && hashmapSize(context.map) <= 0)
+    {
+        done();
+    }
+}
+
+bool retry(lookup_t *lookup)
+{
+    context.stats.timeouts[lookup->tries]--;
+    context.stats.timeouts[++lookup->tries]++;
+    if(lookup->tries < context.cmd_args.resolve_count)
+    {
+        if(lookup->verifying)
+        {
+            verify_send(lookup);
+        }
+        else
+        {
+            send_query(lookup);
+        }
+        return true;
+    }
+    if(lookup->verifying)
+    {
+        context.stats.verify_failed++;
+    }
+    return false;
+}
+
+void resolver_count_reply(resolver_t *resolver, dns_header_t *header)
+{
+    resolver->stats.numreplies++;
+    switch(header->rcode)
+    {
+        case DNS_RCODE_OK:
+            resolver->stats.noerr++;
+            if(header->ans_count > 0)
+            {
+                resolver->stats.answers++;
+            }
+            break;
+        case DNS_RCODE_FORMERR:
+            resolver->stats.formerr++;
+            break;
+        case DNS_RCODE_SERVFAIL:
+            resolver->stats.servfail++;
+            break;
+        case DNS_RCODE_NXDOMAIN:
+            resolver->stats.nxdomain++;
+            break;
+        case DNS_RCODE_NOTIMP:
+            resolver->stats.notimp++;
+            break;
+        case DNS_RCODE_REFUSED:
+            resolver->stats.refused++;
+            break;
+        case DNS_RCODE_YXDOMAIN:
+            resolver->stats.yxdomain++;
+            break;
+        case DNS_RCODE_YXRRSET:
+            resolver->stats.yxrrset++;
+            break;
+        case 8: // NXRRSET
+            resolver->stats.nxrrset++;
+            break;
+        case DNS_RCODE_NOTAUTH:
+            resolver->stats.notauth++;
+            break;
+        case DNS_RCODE_NOTZONE:
+            resolver->stats.notzone++;
+            break;
+        default:
+            resolver->stats.other++;
+    }
+}
+
+static volatile sig_atomic_t resolver_stats_requested = 0;
+
+void request_resolver_stats(int sig)
+{
+    resolver_stats_requested = 1;
+}
+
+void resolver_stats_open()
+{
+    static char filename[8192];
+
+    if(!context.cmd_args.resolver_stats)
+    {
+        return;
+    }
+
+    // Every process writes the statistics of its own resolvers
+    if(context.cmd_args.num_processes > 1)
+    {
+        snprintf(filename, sizeof(filename), "%s%zd", context.cmd_args.resolver_stats, context.fork_index);
+    }
+    else
+    {
+        snprintf(filename, sizeof(filename), "%s", context.cmd_args.resolver_stats);
+    }
+    context.resolver_stats_file = fopen(filename, "w");
+    if(!context.resolver_stats_file)
+    {
+        log_msg("Failed to open resolver statistics file: %s\n", strerror(errno));
+        clean_exit(EXIT_FAILURE);
+    }
+    if(context.cmd_args.resolver_stats_csv)
+    {
+        fprintf(context.resolver_stats_file, "time,resolver,qsent,numreplies,answers,noerr,formerr,servfail,nxdomain,"
+                                             "notimp,refused,yxdomain,yxrrset,nxrrset,notauth,notzone,other,timeout,"
+                                             "mismatch,fakereplies,consensus_votes,capacity,ratelimit_burst,inflight,rtt_avg_ms,"
+                                             "srtt_ms,rtt_samples,rtt_p50_ms,rtt_p90_ms,rtt_p99_ms,rtt_p999_ms,rtt_max_ms\n");
+    }
+}
+
+void resolver_stats_write_group(buffer_t *resolvers, time_t now)
+{
+    for(size_t i = 0; i < resolvers->len; i++)
+    {
+        resolver_t *resolver = ((resolver_t*)resolvers->data) + i;
+        resolver_stats_t *stats = &resolver->stats;
+        const char *format = context.cmd_args.resolver_stats_csv ?
+            "%lu,%s,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,"
+            "%.3f,%.3f,%" PRIu64 ",%.3f,%.3f,%.3f,%.3f,%.3f\n"
+            :
+            "{\"time\":%lu,\"resolver\":\"%s\",\"qsent\":%zu,\"numreplies\":%zu,\"answers\":%zu,"
+            "\"noerr\":%zu,\"formerr\":%zu,\"servfail\":%zu,\"nxdomain\":%zu,\"notimp\":%zu,\"refused\":%zu,"
+            "\"yxdomain\":%zu,\"yxrrset\":%zu,\"nxrrset\":%zu,\"notauth\":%zu,\"notzone\":%zu,\"other\":%zu,"
+            "\"timeout\":%zu,\"mismatch\":%zu,\"fakereplies\":%zu,\"consensus_votes\":%zu,\"capacity\":%zu,"
+            "\"ratelimit_burst\":%zu,\"inflight\":%zu,\"rtt_avg_ms\":%.3f,"
+            "\"srtt_ms\":%.3f,\"rtt_samples\":%" PRIu64 ",\"rtt_p50_ms\":%.3f,\"rtt_p90_ms\":%.3f,"
+            "\"rtt_p99_ms\":%.3f,\"rtt_p999_ms\":%.3f,\"rtt_max_ms\":%.3f}\n";
+
+        fprintf(context.resolver_stats_file, format,
+                now,
+                sockaddr2str(&resolver->address),
+                stats->qsent,
+                stats->numreplies,
+                stats->answers,
+                stats->noerr,
+                stats->formerr,
+                stats->servfail,
+                stats->nxdomain,
+                stats->notimp,
+                stats->refused,
+                stats->yxdomain,
+                stats->yxrrset,
+                stats->nxrrset,
+                stats->notauth,
+                stats->notzone,
+                stats->other,
+                stats->timeout,
+                stats->mismatch,
+                stats->fakereplies,
+                stats->consensus_votes,
+                stats->capacity,
+                stats->ratelimit_burst,
+                resolver->inflight,
+                resolver->rtt.count == 0 ? 0 : resolver->rtt.sum / (double)resolver->rtt.count / 1000,
+                resolver->srtt / (double)TIMED_RING_MS,
+                resolver->rtt.count,
+                histogram_percentile(&resolver->rtt, 50) / 1000.0,
+                histogram_percentile(&resolver->rtt, 90) / 1000.0,
+                histogram_percentile(&resolver->rtt, 99) / 1000.0,
+                histogram_percentile(&resolver->rtt, 99.9) / 1000.0,
+                resolver->rtt.max / 1000.0);
+    }
+}
+
+// Append a snapshot of the counters of all resolvers, including the trusted ones, to the resolver statistics file.
+void resolver_stats_write()
+{
+    if(!context.resolver_stats_file)
+    {
+        return;
+    }
+
+    time_t now = time(NULL);
+    resolver_stats_write_group(&context.resolvers, now);
+    resolver_stats_write_group(&context.trusted.resolvers, now);
+    resolver_stats_write_group(&context.iterative.servers, now);
+    fflush(context.resolver_stats_file);
+}
+
+// The summary is written by the main process only, once all processes have finished.
+void summary_open()
+{
+    if(!context.cmd_args.summary || context.fork_index != 0)
+    {
+        return;
+    }
+    context.summary_file = fopen(context.cmd_args.summary, "w");
+    if(!context.summary_file)
+    {
+        log_msg("Failed to open summary file: %s\n", strerror(errno));
+        clean_exit(EXIT_FAILURE);
+    }
+}
+
+void summary_write()
+{
+    static stats_exchange_t total;
+    static const char *state_names[] = {"warmup", "querying", "cooldown", "wait_children"};
+    struct timespec now;
+
+    if(!context.summary_file)
+    {
+        return;
+    }
+
+    stats_snapshot(&total);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double wall_time = (now.tv_sec - context.stats.start_time.tv_sec)
+                       + (now.tv_nsec - context.stats.start_time.tv_nsec) / (double)TIMED_RING_S;
+    FILE *f = context.summary_file;
+
+    fprintf(f, "{\"processes\":%zu,\"wall_time_s\":%.3f,\"queries\":%zu,\"packets_sent\":%zu,\"replies\":%zu,"
+               "\"parsed\":%zu,\"finished\":%zu,\"success\":%zu,\"success_rate\":%.4f,\"mismatch_domain\":%zu,"
+               "\"mismatch_id\":%zu,\"average_pps\":%.1f,\"peak_pps\":%zu,\"average_success_pps\":%.1f,"
+               "\"peak_success_pps\":%zu,",
+            context.cmd_args.num_processes, wall_time, total.numdomains, total.qsent, total.numreplies,
+            total.numparsed, total.finished, total.finished_success,
+            total.finished == 0 ? 0 : total.finished_success / (double)total.finished,
+            total.mismatch_domain, total.mismatch_id,
+            wall_time == 0 ? 0 : total.numreplies / wall_time, context.stats.peak_rate,
+            wall_time == 0 ? 0 : total.finished_success / wall_time, context.stats.peak_success_rate);
+
+    // Replies by response code, final ones being those that finished a lookup
+    fprintf(f, "\"rcodes\":{");
+    bool first = true;
+    for(size_t i = 0; i < STATS_RCODES; i++)
+    {
+        if(total.all_rcodes[i] == 0)
+        {
+            continue;
+        }
+        fprintf(f, "%s\"%s\":{\"final\":%zu,\"all\":%zu}", first ? "" : ",", dns_rcode2str((dns_rcode)i),
+                total.final_rcodes[i], total.all_rcodes[i]);
+        first = false;
+    }
+
+    // Lookups and replies by the number of retries
+    fprintf(f, "},\"retries\":[");
+    for(size_t i = 0; i <= context.cmd_args.resolve_count; i++)
+    {
+        fprintf(f, "%s%zu", i == 0 ? "" : ",", total.timeouts[i]);
+    }
+    fprintf(f, "],\"replies_per_try\":[");
+    for(size_t i = 0; i <= context.cmd_args.resolve_count; i++)
+    {
+        fprintf(f, "%s%zu", i == 0 ? "" : ",", total.try_replies[i]);
+    }
+
+    fprintf(f, "],\"latency_ms\":{\"avg\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f},"
+               "\"maxrss_kb\":%zu,\"maxrss_total_kb\":%zu,\"cpu_s\":{",
+            total.rtt.count == 0 ? 0 : total.rtt.sum / (double)total.rtt.count / 1000,
+            histogram_percentile(&total.rtt, 50) / 1000.0, histogram_percentile(&total.rtt, 90) / 1000.0,
+            histogram_percentile(&total.rtt, 99) / 1000.0, histogram_percentile(&total.rtt, 99.9) / 1000.0,
+            total.rtt.max / 1000.0, total.maxrss_kb, total.maxrss_total_kb);
+
+    // CPU time of all processes by the state in which it has been spent, setup is accounted to the warmup
+    uint64_t user = 0;
+    uint64_t system = 0;
+    for(size_t i = 0; i < STATE_DONE; i++)
+    {
+        fprintf(f, "\"%s\":{\"user\":%.3f,\"system\":%.3f},", state_names[i],
+                total.state_cpu_user_us[i] / 1000000.0, total.state_cpu_system_us[i] / 1000000.0);
+        user += total.state_cpu_user_us[i];
+        system += total.state_cpu_system_us[i];
+    }
+    fprintf(f, "\"total\":{\"user\":%.3f,\"system\":%.3f}}", user / 1000000.0, system / 1000000.0);
+
+    if(context.cmd_args.wildcard)
+    {
+        fprintf(f, ",\"wildcard\":{\"probes\":%zu,\"found\":%zu,\"filtered\":%zu,\"skipped\":%zu,\"cache_hits\":%zu,"
+                   "\"cache_misses\":%zu,\"cache_evictions\":%zu,\"unchecked\":%zu}",
+                total.wildcard.probes, total.wildcard.found, total.wildcard.filtered, total.wildcard.skipped,
+                total.wildcard.hits, total.wildcard.misses, total.wildcard.evictions, total.wildcard.uncached);
+    }
+    if(context.cmd_args.cache_size)
+    {
+        fprintf(f, ",\"cache\":{\"hits\":%zu,\"chained\":%zu,\"misses\":%zu,\"stored\":%zu,\"expired\":%zu,"
+                   "\"evictions\":%zu}",
+                total.cache.hits, total.cache.chained, total.cache.misses, total.cache.stored, total.cache.expired,
+                total.cache.evictions);
+    }
+    if(context.cmd_args.trusted_resolvers)
+    {
+        fprintf(f, ",\"verification\":{\"started\":%zu,\"verified\":%zu,\"rejected\":%zu,\"failed\":%zu}",
+                total.verify_started, total.verified, total.verify_rejected, total.verify_failed);
+    }
+    if(context.cmd_args.consensus)
+    {
+        fprintf(f, ",\"consensus\":{\"votes\":%zu,\"decided\":%zu,\"split\":%zu,\"disagreements\":%zu}",
+                context.cmd_args.consensus, total.consensus_decided, total.consensus_split,
+                total.consensus_disagreements);
+    }
+    if(context.cmd_args.iterative)
+    {
+        fprintf(f, ",\"iterative\":{\"referrals\":%zu,\"lame\":%zu,\"glueless\":%zu,\"delayed\":%zu,\"failed\":%zu}",
+                total.iterative_referrals, total.iterative_lame, total.iterative_glueless, total.iterative_delayed,
+                total.iterative_failed);
+    }
+    if(context.cmd_args.edns_size)
+    {
+        fprintf(f, ",\"edns\":{\"udp_size\":%" PRIu16 ",\"dnssec_ok\":%s,\"cookies\":%s,\"replies\":%zu,"
+                   "\"truncated\":%zu,\"fallbacks\":%zu,\"badcookie\":%zu}",
+                context.cmd_args.edns_size, context.cmd_args.dnssec_ok ? "true" : "false",
+                context.cmd_args.cookies ? "true" : "false", total.edns_replies, total.edns_truncated,
+                total.edns_fallbacks, total.edns_badcookie);
+    }
+    if(context.cmd_args.tcp_fallback || context.cmd_args.tcp)
+    {
+        fprintf(f, ",\"tcp\":{\"fallbacks\":%zu,\"replies\":%zu,\"connections\":%zu,\"failures\":%zu}",
+                total.tcp_fallbacks, total.tcp_replies, total.tcp_connections, total.tcp_failures);
+    }
+    fprintf(f, "}\n");
+    fflush(f);
+}
+
+// Metrics endpoint: Counters and gauges are served in the Prometheus text format over HTTP/1.0 by the main process.
+
+void metrics_write(FILE *f, const char *name, const char *type, const char *help, size_t value)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %zu\n", name, help, name, type, name, value);
+}
+
+void metrics_write_header(FILE *f, const char *name, const char *type, const char *help)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Write the quantiles of a histogram with microsecond samples in seconds.
+void metrics_write_summary(FILE *f, const char *name, const char *label, histogram_t *histogram)
+{
+    static const char *quantiles[] = {"0.5", "0.9", "0.99", "0.999"};
+    static const double percentiles[] = {50, 90, 99, 99.9};
+
+    for(size_t i = 0; i < sizeof(percentiles) / sizeof(*percentiles); i++)
+    {
+        fprintf(f, "%s{%s%squantile=\"%s\"} %.6f\n", name, label ? label : "", label ? "," : "", quantiles[i],
+                histogram_percentile(histogram, percentiles[i]) / 1000000.0);
+    }
+    fprintf(f, "%s_sum%s%s%s %.6f\n", name, label ? "{" : "", label ? label : "", label ? "}" : "",
+            histogram->sum / 1000000.0);
+    fprintf(f, "%s_count%s%s%s %" PRIu64 "\n", name, label ? "{" : "", label ? label : "", label ? "}" : "",
+            histogram->count);
+}
+
+void metrics_render(FILE *f)
+{
+    static stats_exchange_t total;
+    static char label[32];
+
+    stats_snapshot(&total);
+
+    metrics_write(f, "massdns_domains_total", "counter", "Domains read from the domain list.", total.numdomains);
+    metrics_write(f, "massdns_queries_sent_total", "counter", "Queries sent, including retries.", total.qsent);
+    metrics_write(f, "massdns_replies_total", "counter", "Replies received.", total.numreplies);
+    metrics_write(f, "massdns_replies_parsed_total", "counter", "Replies with a parseable question.", total.numparsed);
+
+    metrics_write_header(f, "massdns_replies_by_rcode_total", "counter", "Parsed replies by response code.");
+    for(size_t i = 0; i < STATS_RCODES; i++)
+    {
+        fprintf(f, "massdns_replies_by_rcode_total{rcode=\"%s\"} %zu\n", dns_rcode2str((dns_rcode)i),
+                total.all_rcodes[i]);
+    }
+
+    metrics_write(f, "massdns_lookups_finished_total", "counter", "Lookups that have been given up or succeeded.",
+                  total.finished);
+    metrics_write_header(f, "massdns_lookups_succeeded_total", "counter",
+                         "Lookups finished by an acceptable reply, by response code.");
+    for(size_t i = 0; i < STATS_RCODES; i++)
+    {
+        fprintf(f, "massdns_lookups_succeeded_total{rcode=\"%s\"} %zu\n", dns_rcode2str((dns_rcode)i),
+                total.final_rcodes[i]);
+    }
+
+    metrics_write_header(f, "massdns_mismatches_total", "counter",
+                         "Replies that could not be matched to a lookup, by the mismatching field.");
+    fprintf(f, "massdns_mismatches_total{field=\"domain\"} %zu\n", total.mismatch_domain);
+    fprintf(f, "massdns_mismatches_total{field=\"id\"} %zu\n", total.mismatch_id);
+
+    metrics_write_header(f, "massdns_lookups_by_retries", "gauge",
+                         "Lookups by the number of retries they have required so far, including finished lookups.");
+    for(size_t i = 0; i <= context.cmd_args.resolve_count; i++)
+    {
+        fprintf(f, "massdns_lookups_by_retries{retries=\"%zu\"} %zu\n", i, total.timeouts[i]);
+    }
+
+    metrics_write_header(f, "massdns_replies_by_try_total", "counter",
+                         "Matched replies by the number of previous transmissions of the lookup.");
+    for(size_t i = 0; i <= context.cmd_args.resolve_count; i++)
+    {
+        fprintf(f, "massdns_replies_by_try_total{try=\"%zu\"} %zu\n", i, total.try_replies[i]);
+    }
+    metrics_write_header(f, "massdns_reply_latency_seconds_total", "counter",
+                         "Sum of the latencies of matched replies since the first transmission, by try.");
+    for(size_t i = 0; i <= context.cmd_args.resolve_count; i++)
+    {
+        fprintf(f, "massdns_reply_latency_seconds_total{try=\"%zu\"} %.9f\n", i,
+                total.try_rtt_sum[i] / (double)TIMED_RING_S);
+    }
+
+    metrics_write_header(f, "massdns_reply_rtt_seconds", "summary",
+                         "Round-trip time of matched replies to lookups that have not been retried.");
+    metrics_write_summary(f, "massdns_reply_rtt_seconds", NULL, &total.rtt);
+    metrics_write_header(f, "massdns_reply_rtt_by_try_seconds", "summary",
+                         "Latency of matched replies since the first transmission by the number of previous "
+                         "transmissions, the last one includes later tries.");
+    for(size_t i = 0; i < STATS_RTT_TRIES; i++)
+    {
+        snprintf(label, sizeof(label), "try=\"%zu\"", i);
+        metrics_write_summary(f, "massdns_reply_rtt_by_try_seconds", label, total.try_rtt + i);
+    }
+
+    metrics_write(f, "massdns_lookups_in_flight", "gauge", "Lookups awaiting a reply.", total.inflight);
+    metrics_write(f, "massdns_lookup_pool_free", "gauge", "Unused lookups within the pool.", total.pool_free);
+    metrics_write(f, "massdns_timers", "gauge", "Occupied entries of the timed ring, including cancelled ones.",
+                  total.timers);
+    metrics_write(f, "massdns_timer_bucket_max", "gauge", "Occupied entries of the fullest timed ring bucket.",
+                  total.timer_bucket_max);
+    metrics_write(f, "massdns_processes", "gauge", "Number of resolving processes.", context.cmd_args.num_processes);
+
+    if(context.cmd_args.trusted_resolvers)
+    {
+        metrics_write_header(f, "massdns_verifications_total", "counter",
+                             "Positive replies resolved again by the trusted resolvers, by result.");
+        fprintf(f, "massdns_verifications_total{result=\"verified\"} %zu\n", total.verified);
+        fprintf(f, "massdns_verifications_total{result=\"rejected\"} %zu\n", total.verify_rejected);
+        fprintf(f, "massdns_verifications_total{result=\"failed\"} %zu\n", total.verify_failed);
+        metrics_write(f, "massdns_verifications_started_total", "counter",
+                      "Positive replies passed on to the trusted resolvers.", total.verify_started);
+    }
+
+    if(context.cmd_args.consensus)
+    {
+        metrics_write_header(f, "massdns_consensus_lookups_total", "counter",
+                             "Lookups resolved by several resolvers, by whether a majority has agreed.");
+        fprintf(f, "massdns_consensus_lookups_total{result=\"decided\"} %zu\n", total.consensus_decided);
+        fprintf(f, "massdns_consensus_lookups_total{result=\"split\"} %zu\n", total.consensus_split);
+        metrics_write(f, "massdns_consensus_disagreements_total", "counter",
+                      "Replies that differ from the reply of the majority.", total.consensus_disagreements);
+    }
+
+    if(context.cmd_args.iterative)
+    {
+        metrics_write(f, "massdns_iterative_referrals_total", "counter", "Referrals that have been followed.",
+                      total.iterative_referrals);
+        metrics_write(f, "massdns_iterative_lame_total", "counter",
+                      "Replies of servers that are not authoritative for the zone they have been asked for.",
+                      total.iterative_lame);
+        metrics_write(f, "massdns_iterative_glueless_total", "counter",
+                      "Lookups of name servers that have been delegated without glue.", total.iterative_glueless);
+        metrics_write(f, "massdns_iterative_delayed_total", "counter",
+                      "Times queries have been held back by the rate limit of their server.", total.iterative_delayed);
+        metrics_write(f, "massdns_iterative_failed_total", "counter", "Lookups that have run out of servers to ask.",
+                      total.iterative_failed);
+    }
+
+    if(context.cmd_args.edns_size)
+    {
+        metrics_write(f, "massdns_edns_replies_total", "counter", "Replies with an OPT record.", total.edns_replies);
+        metrics_write(f, "massdns_edns_truncated_total", "counter", "Replies with the TC bit set.",
+                      total.edns_truncated);
+        metrics_write(f, "massdns_edns_fallbacks_total", "counter",
+                      "Resolvers that have rejected EDNS and are queried without it.", total.edns_fallbacks);
+        metrics_write(f, "massdns_edns_badcookie_total", "counter",
+                      "Replies with the BADCOOKIE response code that have been retried.", total.edns_badcookie);
+    }
+
+    if(context.cmd_args.tcp_fallback || context.cmd_args.tcp)
+    {
+        metrics_write(f, "massdns_tcp_fallbacks_total", "counter",
+                      "Lookups that have been repeated over TCP because of a truncated reply.", total.tcp_fallbacks);
+        metrics_write(f, "massdns_tcp_replies_total", "counter", "Replies received over TCP.", total.tcp_replies);
+        metrics_write(f, "massdns_tcp_connections_total", "counter", "TCP connections that have been opened.",
+                      total.tcp_connections);
+        metrics_write(f, "massdns_tcp_failures_total", "counter",
+                      "TCP connections that have been refused or closed with unanswered queries.", total.tcp_failures);
+    }
+
+    if(context.cmd_args.wildcard)
+    {
+        metrics_write(f, "massdns_wildcard_probes_total", "counter", "Zones probed for a wildcard.",
+                      total.wildcard.probes);
+        metrics_write(f, "massdns_wildcard_found_total", "counter", "Probes that have revealed a wildcard.",
+                      total.wildcard.found);
+        metrics_write(f, "massdns_wildcard_filtered_total", "counter",
+                      "Replies dropped for only consisting of wildcard answers.", total.wildcard.filtered);
+        metrics_write(f, "massdns_wildcard_skipped_total", "counter",
+                      "Names not resolved because their zone has a wildcard.", total.wildcard.skipped);
+        metrics_write_header(f, "massdns_wildcard_cache_lookups_total", "counter",
+                             "Zone lookups of new names within the wildcard cache, by result.");
+        fprintf(f, "massdns_wildcard_cache_lookups_total{result=\"hit\"} %zu\n", total.wildcard.hits);
+        fprintf(f, "massdns_wildcard_cache_lookups_total{result=\"miss\"} %zu\n", total.wildcard.misses);
+        metrics_write(f, "massdns_wildcard_cache_evictions_total", "counter", "Zones evicted from the wildcard cache.",
+                      total.wildcard.evictions);
+        metrics_write(f, "massdns_wildcard_unchecked_total", "counter",
+                      "Names not checked because every cached zone was being probed.", total.wildcard.uncached);
+    }
+
+    if(context.cmd_args.cache_size)
+    {
+        metrics_write_header(f, "massdns_cache_lookups_total", "counter", "Lookups within the answer cache, by result.");
+        fprintf(f, "massdns_cache_lookups_total{result=\"hit\"} %zu\n", total.cache.hits);
+        fprintf(f, "massdns_cache_lookups_total{result=\"miss\"} %zu\n", total.cache.misses);
+        metrics_write(f, "massdns_cache_chained_total", "counter",
+                      "Cache hits assembled from several record sets by following CNAME records.", total.cache.chained);
+        metrics_write(f, "massdns_cache_stored_total", "counter", "Record sets added to or refreshed within the cache.",
+                      total.cache.stored);
+        metrics_write(f, "massdns_cache_expired_total", "counter", "Record sets found after their TTL has expired.",
+                      total.cache.expired);
+        metrics_write(f, "massdns_cache_evictions_total", "counter", "Record sets evicted from the answer cache.",
+                      total.cache.evictions);
+    }
+}
+
+void metrics_close(metrics_connection_t *connection)
+{
+    close(connection->info.descriptor);
+    free(connection->response);
+    connection->response = NULL;
+    connection->open = false;
+}
+
+// Register a new connection for reading or an existing one for writing the response.
+void metrics_watch(metrics_connection_t *connection, bool writing)
+{
+#ifdef HAVE_EPOLL
+    if(context.cmd_args.busypoll)
+    {
+        return;
+    }
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.data.ptr = &connection->info;
+    ev.events = writing ? EPOLLOUT : EPOLLIN;
+    if(epoll_ctl(context.epollfd, writing ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, connection->info.descriptor, &ev) != 0)
+    {
+        log_msg("Failed to add epoll event: %s\n", strerror(errno));
+        metrics_close(connection);
+    }
+#endif
+}
+
+void metrics_respond(metrics_connection_t *connection)
+{
+    char *body = NULL;
+    size_t body_len = 0;
+    bool found = startswith(connection->request, "GET /metrics ", true) || startswith(connection->request, "GET / ", true);
+
+    FILE *f = open_memstream(&body, &body_len);
+    if(f == NULL)
+    {
+        metrics_close(connection);
+        return;
+    }
+    if(found)
+    {
+        metrics_render(f);
+    }
+    else
+    {
+        fprintf(f, "Not found\n");
+    }
+    fclose(f);
+
+    f = open_memstream(&connection->response, &connection->response_len);
+    if(f == NULL)
+    {
+        free(body);
+        metrics_close(connection);
+        return;
+    }
+    fprintf(f, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+               "Connection: close\r\n\r\n", found ? "200 OK" : "404 Not Found", body_len);
+    fwrite(body, 1, body_len, f);
+    fclose(f);
+    free(body);
+    connection->response_sent = 0;
+
+    metrics_watch(connection, true);
+}
+
+// Read the request until the end of the header, then write the response without blocking.
+void metrics_serve(metrics_connection_t *connection)
+{
+    if(connection->response == NULL)
+    {
+        ssize_t received = recv(connection->info.descriptor, connection->request + connection->request_len,
+                                sizeof(connection->request) - 1 - connection->request_len, 0);
+        if(received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            metrics_close(connection);
+            return;
+        }
+        if(received < 0)
+        {
+            return;
+        }
+        connection->request_len += (size_t)received;
+        connection->request[connection->request_len] = 0;
+        if(strstr(connection->request, "\r\n\r\n") == NULL && strstr(connection->request, "\n\n") == NULL
+           && connection->request_len < sizeof(connection->request) - 1)
+        {
+            return;
+        }
+        metrics_respond(connection);
+        if(!connection->open)
+        {
+            return;
+        }
+    }
+
+    ssize_t sent = send(connection->info.descriptor, connection->response + connection->response_sent,
+                        connection->response_len - connection->response_sent, MSG_NOSIGNAL);
+    if(sent < 0)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            metrics_close(connection);
+        }
+        return;
+    }
+    connection->response_sent += (size_t)sent;
+    if(connection->response_sent >= connection->response_len)
+    {
+        metrics_close(connection);
+    }
+}
+
+void metrics_accept()
+{
+    while(true)
+    {
+        int fd = accept(context.metrics.listener.descriptor, NULL, NULL);
+        if(fd < 0)
+        {
+            return;
+        }
+
+        // Replace the oldest connection if all are in use
+        metrics_connection_t *connection = NULL;
+        for(size_t i = 0; i < METRICS_MAX_CONNECTIONS; i++)
+        {
+            metrics_connection_t *candidate = context.metrics.connections + i;
+            if(!candidate->open)
+            {
+                connection = candidate;
+                break;
+            }
+            if(connection == NULL || candidate->accepted_ns < connection->accepted_ns)
+            {
+                connection = candidate;
+            }
+        }
+        if(connection->open)
+        {
+            metrics_close(connection);
+        }
+
+        connection->open = true;
+        connection->info.descriptor = fd;
+        connection->info.type = SOCKET_TYPE_METRICS;
+        connection->request_len = 0;
+        connection->accepted_ns = monotonic_ns();
+        socket_noblock(&connection->info);
+        metrics_watch(connection, false);
+    }
+}
+
+// Close the metrics connections that have exceeded their time. Returns whether a connection is still open.
+bool metrics_close_expired()
+{
+    bool open = false;
+    uint64_t now = monotonic_ns();
+    for(size_t i = 0; i < METRICS_MAX_CONNECTIONS; i++)
+    {
+        metrics_connection_t *connection = context.metrics.connections + i;
+        if(connection->open && now - connection->accepted_ns > METRICS_TIMEOUT_MS * (uint64_t)TIMED_RING_MS)
+        {
+            metrics_close(connection);
+        }
+        open |= connection->open;
+    }
+    return open;
+}
+
+// Periodically close expired metrics connections when they are served on events, as idle clients do not cause any.
+void metrics_expire()
+{
+    metrics_close_expired();
+    timed_ring_add(&context.ring, TIMED_RING_S, metrics_expire);
+}
+
+// Accept and serve metrics connections, closing those that have exceeded their time.
+void metrics_poll()
+{
+    if(!context.metrics.listening)
+    {
+        return;
+    }
+    metrics_accept();
+    if(!metrics_close_expired())
+    {
+        return;
+    }
+    for(size_t i = 0; i < METRICS_MAX_CONNECTIONS; i++)
+    {
+        metrics_connection_t *connection = context.metrics.connections + i;
+        if(connection->open)
+        {
+            metrics_serve(connection);
+        }
+    }
+}
+
+void metrics_handle(socket_info_t *info)
+{
+    if(info == &context.metrics.listener)
+    {
+        metrics_accept();
+    }
+    else
+    {
+        metrics_serve((metrics_connection_t*)info);
+    }
+}
+
+void metrics_setup()
+{
+    static struct sockaddr_storage addr;
+    static struct sockaddr_un unix_addr;
+
+    // Only the main process serves the metrics, it aggregates the counters of all processes.
+    if(!context.cmd_args.metrics || context.fork_index != 0)
+    {
+        return;
+    }
+
+    struct sockaddr *bind_addr;
+    socklen_t bind_addr_len;
+    if(strchr(context.cmd_args.metrics, '/') != NULL)
+    {
+        if(strlen(context.cmd_args.metrics) >= sizeof(unix_addr.sun_path))
+        {
+            log_msg("The metrics socket path is too long.\n");
+            clean_exit(EXIT_FAILURE);
+        }
+        unix_addr.sun_family = AF_UNIX;
+        strcpy(unix_addr.sun_path, context.cmd_args.metrics);
+
+        // Remove a stale socket of a previous run, but never any other file
+        struct stat st;
+        if(stat(unix_addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        {
+            unlink(unix_addr.sun_path);
+        }
+        bind_addr = (struct sockaddr*)&unix_addr;
+        bind_addr_len = sizeof(unix_addr);
+    }
+    else
+    {
+        if(!str_to_addr(context.cmd_args.metrics, 0, &addr))
+        {
+            log_msg("Invalid metrics address: %s\n", context.cmd_args.metrics);
+            clean_exit(EXIT_FAILURE);
+        }
+        bind_addr = (struct sockaddr*)&addr;
+        bind_addr_len = sockaddr_storage_size(&addr);
+    }
+
+    context.metrics.listener.descriptor = socket(bind_addr->sa_family, SOCK_STREAM, 0);
+    context.metrics.listener.type = SOCKET_TYPE_METRICS;
+    if(context.metrics.listener.descriptor < 0)
+    {
+        log_msg("Failed to create metrics socket: %s\n", strerror(errno));
+        clean_exit(EXIT_FAILURE);
+    }
+    int reuse = 1;
+    setsockopt(context.metrics.listener.descriptor, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if(bind(context.metrics.listener.descriptor, bind_addr, bind_addr_len) != 0
+       || listen(context.metrics.listener.descriptor, METRICS_MAX_CONNECTIONS) != 0)
+    {
+        log_msg("Failed to listen for metrics requests on %s: %s\n", context.cmd_args.metrics, strerror(errno));
+        close(context.metrics.listener.descriptor);
+        clean_exit(EXIT_FAILURE);
+    }
+    if(bind_addr->sa_family == AF_UNIX)
+    {
+        context.metrics.unix_path = context.cmd_args.metrics;
+    }
+    socket_noblock(&context.metrics.listener);
+    context.metrics.listening = true;
+
+#ifdef HAVE_EPOLL
+    if(!context.cmd_args.busypoll)
+    {
+        struct epoll_event ev;
+        bzero(&ev, sizeof(ev));
+        ev.data.ptr = &context.metrics.listener;
+        ev.events = EPOLLIN;
+        if (epoll_ctl(context.epollfd, EPOLL_CTL_ADD, context.metrics.listener.descriptor, &ev) != 0)
+        {
+            log_msg("Failed to add epoll event: %s\n", strerror(errno));
+            clean_exit(EXIT_FAILURE);
+        }
+        timed_ring_add(&context.ring, TIMED_RING_S, metrics_expire);
+    }
+#endif
+}
+
+// Resolver validation: Every resolver is sent known names, which have to be answered, and names below random labels,
+// which must not exist. Resolvers that pass are sent bursts of increasing size until replies are lost or refused. Once
+// all resolvers are done, their answers to the known names are compared with those of the majority.
+
+dns_name_t *validation_probe_name(resolver_validation_t *state, size_t index)
+{
+    // Bursts repeat the first known name, so that the resolver can answer from its cache.
+    return &context.validation.probes[state->phase == VALIDATION_BURST ? 0 : index];
+}
+
+void validation_send(resolver_validation_t *state, size_t index)
+{
+    static uint8_t query_buffer[0x200];
+
+    ssize_t result = dns_question_create(query_buffer, (char*)validation_probe_name(state, index)->name,
+                                         context.cmd_args.record_type, (uint16_t)(state->base_id + index));
+    if (result < DNS_PACKET_MINIMUM_SIZE)
+    {
+        return;
+    }
+    dns_buf_set_rd(query_buffer, !context.cmd_args.norecurse);
+
+    buffer_t *interfaces = state->resolver->address.ss_family == AF_INET ? &context.sockets.interfaces4
+                                                                         : &context.sockets.interfaces6;
+    socket_info_t *socket = (socket_info_t *) interfaces->data + urandom_size_t() % interfaces->len;
+
+    state->sent_ns[index] = monotonic_ns();
+    errno = 0;
+    ssize_t sent = sendto(socket->descriptor, query_buffer, (size_t) result, 0,
+                          (struct sockaddr *) &state->resolver->address,
+                          sockaddr_storage_size(&state->resolver->address));
+    if(sent != result)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            log_msg("Error sending: %s\n", strerror(errno));
+        }
+    }
+    else
+    {
+        context.stats.qsent++;
+        state->resolver->stats.qsent++;
+    }
+}
+
+void validation_start_phase(resolver_validation_t *state)
+{
+    if(state->phase == VALIDATION_PENDING)
+    {
+        state->phase = VALIDATION_CORRECTNESS;
+        state->probe_count = context.validation.known_count + 3;
     }
     else
     {
-        context.finished++;
-        context.state = (context.finished < context.cmd_args.num_processes ? STATE_WAIT_CHILDREN : STATE_DONE);
+        state->probe_count = state->burst;
+        state->burst_failures = 0;
+    }
+    urandom_get(&state->base_id, sizeof(state->base_id));
+    state->tries = 0;
+    state->active = true;
+    state->outstanding = state->probe_count;
+    context.validation.outstanding += state->probe_count;
+    bzero(state->answered, state->probe_count * sizeof(*state->answered));
+
+    state->phase_start = monotonic_ns();
+    for(size_t i = 0; i < state->probe_count; i++)
+    {
+        validation_send(state, i);
+    }
+    state->ring_entry = timed_ring_add(&context.ring, context.cmd_args.interval_ms * (time_t)TIMED_RING_MS, state);
+}
+
+void validation_enqueue(resolver_validation_t *state)
+{
+    size_t index = (context.validation.queue_head + context.validation.queue_len++) % context.resolvers.len;
+    context.validation.queue[index] = (size_t)(state - context.validation.states);
+}
+
+// Start waiting phases for as long as the number of probes in flight stays within the hash map size.
+void validation_schedule()
+{
+    while(context.validation.queue_len > 0)
+    {
+        resolver_validation_t *state = context.validation.states
+                                       + context.validation.queue[context.validation.queue_head];
+        size_t probes = state->phase == VALIDATION_PENDING ? context.validation.known_count + 3 : state->burst;
+        if(context.validation.outstanding > 0
+           && context.validation.outstanding + probes > context.cmd_args.hashmap_size)
+        {
+            break;
+        }
+        context.validation.queue_head = (context.validation.queue_head + 1) % context.resolvers.len;
+        context.validation.queue_len--;
+        validation_start_phase(state);
+    }
+}
+
+int validation_rank_cmp(const void *a, const void *b)
+{
+    resolver_t *resolver1 = *(resolver_t**)a;
+    resolver_t *resolver2 = *(resolver_t**)b;
+
+    // Resolvers without rate limiting come first, followed by those that tolerated larger bursts.
+    size_t burst1 = resolver1->stats.ratelimit_burst == 0 ? SIZE_MAX : resolver1->stats.ratelimit_burst;
+    size_t burst2 = resolver2->stats.ratelimit_burst == 0 ? SIZE_MAX : resolver2->stats.ratelimit_burst;
+    if(burst1 != burst2)
+    {
+        return burst1 > burst2 ? -1 : 1;
+    }
+    if(resolver1->stats.capacity != resolver2->stats.capacity)
+    {
+        return resolver1->stats.capacity > resolver2->stats.capacity ? -1 : 1;
+    }
+    uint64_t rtt1 = histogram_percentile(&resolver1->rtt, 50);
+    uint64_t rtt2 = histogram_percentile(&resolver2->rtt, 50);
+    return rtt1 < rtt2 ? -1 : (rtt1 > rtt2 ? 1 : 0);
+}
+
+// Write the usable resolvers to the output file, ordered by rate limiting, capacity and median round-trip time.
+void validation_write_results()
+{
+    resolver_t **ranking = safe_malloc(max(context.validation.usable, 1) * sizeof(*ranking));
+    size_t count = 0;
+    for(size_t i = 0; i < context.resolvers.len; i++)
+    {
+        if(context.validation.states[i].correct)
+        {
+            ranking[count++] = context.validation.states[i].resolver;
+        }
+    }
+    qsort(ranking, count, sizeof(*ranking), validation_rank_cmp);
+
+    for(size_t i = 0; i < count; i++)
+    {
+        char *str = sockaddr2str(&ranking[i]->address);
+
+        // Omit the default port, so that the list can be used by other tools as well
+        size_t len = strlen(str);
+        if(endswith(str, ":53", true))
+        {
+            len -= 3;
+            if(str[0] == '[')
+            {
+                str++;
+                len -= 2;
+            }
+        }
+        fprintf(context.outfile, "%.*s\n", (int)len, str);
+    }
+    free(ranking);
+
+    if(!context.cmd_args.quiet)
+    {
+        log_msg("%zu of %zu resolvers are usable.\n", context.validation.usable, context.resolvers.len);
+    }
+}
+
+// Compares the answers of the correct resolvers to each known name with the answer set returned by a strict majority
+// of them, found by the Boyer-Moore majority vote. Resolvers that disagree, such as those redirecting names to their
+// own addresses, are not correct. Names without a majority are not judged, as their answers may depend on the location.
+void validation_judge_answers()
+{
+    uint64_t expected[VALIDATION_MAX_KNOWN];
+    bool judged[VALIDATION_MAX_KNOWN];
+
+    for(size_t name = 0; name < context.validation.known_count; name++)
+    {
+        size_t votes = 0;
+        size_t lead = 0;
+        size_t support = 0;
+        for(size_t i = 0; i < context.resolvers.len; i++)
+        {
+            resolver_validation_t *state = context.validation.states + i;
+            if(!state->correct)
+            {
+                continue;
+            }
+            votes++;
+            if(lead == 0)
+            {
+                expected[name] = state->answers[name];
+            }
+            lead = expected[name] == state->answers[name] ? lead + 1 : lead - 1;
+        }
+        for(size_t i = 0; i < context.resolvers.len && votes > 0; i++)
+        {
+            resolver_validation_t *state = context.validation.states + i;
+            support += state->correct && state->answers[name] == expected[name];
+        }
+        judged[name] = support * 2 > votes;
+    }
+
+    for(size_t i = 0; i < context.resolvers.len; i++)
+    {
+        resolver_validation_t *state = context.validation.states + i;
+        for(size_t name = 0; name < context.validation.known_count && state->correct; name++)
+        {
+            if(judged[name] && state->answers[name] != expected[name])
+            {
+                state->correct = false;
+                state->resolver->stats.fakereplies++;
+                context.validation.usable--;
+            }
+        }
+    }
+}
+
+void validation_done(resolver_validation_t *state)
+{
+    state->phase = VALIDATION_DONE;
+    context.validation.finished++;
+    if(state->correct)
+    {
+        context.validation.usable++;
+    }
+    if(context.validation.finished >= context.resolvers.len)
+    {
+        validation_judge_answers();
+        set_state(STATE_DONE);
+        check_progress();
+        validation_write_results();
+    }
+}
+
+void validation_finish_phase(resolver_validation_t *state)
+{
+    state->active = false;
+    context.validation.outstanding -= state->outstanding;
+
+    if(state->phase == VALIDATION_CORRECTNESS)
+    {
+        // Lost probes cannot be judged, so the resolver is not trusted either.
+        if(state->outstanding > 0)
+        {
+            state->correct = false;
+        }
+        state->outstanding = 0;
+        if(!state->correct)
+        {
+            validation_done(state);
+            return;
+        }
+        state->phase = VALIDATION_BURST;
+        state->burst = min(VALIDATION_FIRST_BURST, context.cmd_args.hashmap_size);
+        validation_enqueue(state);
+        return;
+    }
+
+    size_t replies = state->probe_count - state->outstanding;
+    state->outstanding = 0;
+
+    // Losing more than a tenth of a burst or receiving error codes is considered to be rate limiting.
+    if(replies * 10 < state->probe_count * 9 || state->burst_failures > 0)
+    {
+        state->resolver->stats.ratelimit_burst = state->probe_count;
+        validation_done(state);
+        return;
+    }
+
+    uint64_t duration = max(state->last_reply - state->phase_start, 1);
+    size_t rate = (size_t)(replies * (uint64_t)TIMED_RING_S / duration);
+    state->resolver->stats.capacity = max(state->resolver->stats.capacity, rate);
+
+    if(state->burst * 2 > min(VALIDATION_MAX_BURST, context.cmd_args.hashmap_size))
+    {
+        validation_done(state);
+        return;
+    }
+    state->burst *= 2;
+    validation_enqueue(state);
+}
+
+void validation_timeout(resolver_validation_t *state)
+{
+    state->resolver->stats.timeout += state->outstanding;
+
+    // Retransmit lost correctness probes, unless the resolver appears to be dead.
+    if(state->phase == VALIDATION_CORRECTNESS && state->replied
+       && ++state->tries < min(VALIDATION_MAX_TRIES, context.cmd_args.resolve_count))
+    {
+        for(size_t i = 0; i < state->probe_count; i++)
+        {
+            if(!state->answered[i])
+            {
+                validation_send(state, i);
+            }
+        }
+        state->ring_entry = timed_ring_add(&context.ring, context.cmd_args.interval_ms * (time_t)TIMED_RING_MS,
+                                           state);
+        return;
+    }
+    validation_finish_phase(state);
+    validation_schedule();
+}
+
+bool validation_reply_expected(size_t index, dns_head_t *head, uint8_t *begin, uint8_t *next, uint8_t *end)
+{
+    if(index >= context.validation.known_count)
+    {
+        // Names below random labels do not exist, any answer indicates NXDOMAIN hijacking or a wildcard.
+        return head->header.rcode == DNS_RCODE_NXDOMAIN;
+    }
+    if(head->header.rcode != DNS_RCODE_OK)
+    {
+        return false;
+    }
+    dns_record_iter_t iter;
+    dns_record_view_t rec;
+    dns_record_iter_init(&iter, begin, (size_t)(end - begin), next, &head->header);
+    while(dns_record_iter_next(&iter, &rec) && rec.section == DNS_SECTION_ANSWER)
+    {
+        if(rec.type == head->question.type || rec.type == DNS_REC_CNAME)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void validation_read(uint8_t *offset, size_t len, struct sockaddr_storage *recvaddr)
+{
+    static dns_head_t head;
+    static uint8_t *next;
+
+    resolver_t *resolver = hashmapGet(context.resolver_map, recvaddr);
+    if(resolver == NULL)
+    {
+        return;
+    }
+    if(!dns_parse_question(offset, len, &head, &next))
+    {
+        resolver->stats.numreplies++;
+        resolver->stats.other++;
+        return;
+    }
+    context.stats.numparsed++;
+    context.stats.all_rcodes[head.header.rcode]++;
+    resolver_count_reply(resolver, &head.header);
+
+    // Replies are matched by the transaction ID and question, late replies from previous phases are discarded.
+    resolver_validation_t *state = context.validation.states + (resolver - (resolver_t*)context.resolvers.data);
+    size_t index = (uint16_t)(head.header.id - state->base_id);
+    if(!state->active || index >= state->probe_count || state->answered[index]
+       || head.question.type != context.cmd_args.record_type
+       || !dns_names_eq(&head.question.name, validation_probe_name(state, index)))
+    {
+        context.stats.mismatch++;
+        resolver->stats.mismatch++;
+        return;
+    }
+
+    state->last_reply = monotonic_ns();
+    uint64_t rtt = state->last_reply - state->sent_ns[index];
+    resolver_update_rtt(resolver, rtt);
+    resolver_update_rto(resolver, rtt);
+    histogram_add(&resolver->rtt, rtt / TIMED_RING_US);
+
+    state->answered[index] = true;
+    state->replied = true;
+    state->outstanding--;
+    context.validation.outstanding--;
+
+    if(state->phase == VALIDATION_CORRECTNESS)
+    {
+        if(!validation_reply_expected(index, &head, offset, next, offset + len))
+        {
+            state->correct = false;
+            resolver->stats.fakereplies++;
+        }
+        else if(index < context.validation.known_count)
+        {
+            state->answers[index] = consensus_reply_hash(&head, offset, len, next);
+        }
+    }
+    else if(head.header.rcode != DNS_RCODE_OK)
+    {
+        state->burst_failures++;
+    }
+
+    if(state->outstanding == 0)
+    {
+        timed_ring_remove(&context.ring, state->ring_entry);
+        validation_finish_phase(state);
+        validation_schedule();
+    }
+}
+
+void validation_set_probe(size_t index, const char *name)
+{
+    dns_name_t *probe = &context.validation.probes[index];
+    probe->length = (uint8_t)string_copy((char*)probe->name, name, sizeof(probe->name) - 1);
+    if(probe->length == 0 || probe->name[probe->length - 1] != '.')
+    {
+        probe->name[probe->length] = '.';
+        probe->name[++probe->length] = 0;
+    }
+}
+
+void validation_start()
+{
+    static const char *default_names[] = {"example.com.", "example.net.", "example.org."};
+    static char name[0x100];
+    char *qname;
+
+    // Known names are taken from the domain list if one has been supplied.
+    while(context.domainfile && context.validation.known_count < VALIDATION_MAX_KNOWN && next_query(&qname))
+    {
+        validation_set_probe(context.validation.known_count++, qname);
+    }
+    if(context.validation.known_count == 0)
+    {
+        for(size_t i = 0; i < sizeof(default_names) / sizeof(*default_names); i++)
+        {
+            validation_set_probe(context.validation.known_count++, default_names[i]);
+        }
+    }
+
+    // Random labels below the reserved invalid TLD, below the TLD of the first known name and
+    // below the first known name itself (wildcard check)
+    char *known = (char*)context.validation.probes[0].name;
+    char *tld = known + context.validation.probes[0].length - 1;
+    while(tld > known && *(tld - 1) != '.')
+    {
+        tld--;
+    }
+    const char *parents[] = {"invalid.", tld, known};
+    for(size_t i = 0; i < 3; i++)
+    {
+        uint64_t label;
+        urandom_get(&label, sizeof(label));
+        snprintf(name, sizeof(name), "%016" PRIx64 ".%s", label, parents[i]);
+        validation_set_probe(context.validation.known_count + i, name);
+    }
+
+    context.validation.states = safe_calloc(context.resolvers.len * sizeof(*context.validation.states));
+    context.validation.queue = safe_malloc(context.resolvers.len * sizeof(*context.validation.queue));
+    for(size_t i = 0; i < context.resolvers.len; i++)
+    {
+        context.validation.states[i].resolver = ((resolver_t*)context.resolvers.data) + i;
+        context.validation.states[i].correct = true;
+        validation_enqueue(context.validation.states + i);
+    }
+    validation_schedule();
+}
+
+// Account the latency of a matched reply, which is attributed to the resolver if the reply originates from it. As
+// retries reuse the transaction ID, a reply to a retried lookup may answer any of its transmissions. Following Karn's
+// algorithm, round-trip times are therefore only sampled from lookups that have not been retried, while the latency by
+// try is measured from the first transmission, which is unambiguous.
+void lookup_account_reply(lookup_t *lookup, resolver_t *resolver, struct sockaddr_storage *recvaddr)
+{
+    uint64_t now = monotonic_ns();
+    uint64_t latency = now - lookup->first_sent_ns;
+    context.stats.try_replies[lookup->tries]++;
+    context.stats.try_rtt_sum[lookup->tries] += latency;
+    histogram_add(&context.stats.try_rtt[min(lookup->tries, STATS_RTT_TRIES - 1)], latency / TIMED_RING_US);
+    if(lookup->tries > 0)
+    {
+        return;
     }
-    if(context.cmd_args.num_processes > 1 && context.fork_index != 0)
+
+    uint64_t rtt = now - lookup->sent_ns;
+    histogram_add(&context.stats.rtt, rtt / TIMED_RING_US);
+
+    // Only attribute the round-trip time if the reply originates from the resolver of the latest transmission. Replies
+    // over TCP are left out, as their latency includes establishing the connection, except in TCP mode, where the
+    // connections are long-lived and the timeouts have to account for the queueing on them.
+    if(addresses_equal(recvaddr, &resolver->address) && (!lookup->tcp || context.cmd_args.tcp))
     {
-        send_stats();
+        resolver_update_rtt(resolver, rtt);
+        resolver_update_rto(resolver, rtt);
+        histogram_add(&resolver->rtt, rtt / TIMED_RING_US);
     }
-    check_progress();
 }
 
-void can_send()
+// Handles the OPT record of a reply that originates from the resolver the query has been sent to. Returns true if the
+// query is to be repeated, either without EDNS because the resolver does not implement it or with the server cookie
+// the resolver has sent along with BADCOOKIE.
+bool edns_read(lookup_t *lookup, resolver_t *resolver, dns_head_t *head, uint8_t *begin, size_t len, uint8_t *next)
 {
-    char *qname;
-    bool new;
+    dns_edns_t edns;
 
-    while (hashmapSize(context.map) < context.cmd_args.hashmap_size && context.state <= STATE_QUERYING)
+    if(head->header.tc)
     {
-        if(!next_query(&qname))
+        context.stats.edns_truncated++;
+    }
+    if(!dns_parse_edns(begin, len, next, &head->header, &edns))
+    {
+        return false;
+    }
+    if(!edns.present)
+    {
+        // Servers that do not implement EDNS reply with FORMERR or NOTIMP and without an OPT record (RFC 6891).
+        if(lookup->edns && (head->header.rcode == DNS_RCODE_FORMERR || head->header.rcode == DNS_RCODE_NOTIMP))
         {
-            context.state = STATE_COOLDOWN; // We will not create any new queries
-            break;
+            if(!resolver->no_edns)
+            {
+                resolver->no_edns = true;
+                context.stats.edns_fallbacks++;
+            }
+            return true;
         }
-        context.stats.numdomains++;
-        lookup_t *lookup = new_lookup(qname, context.cmd_args.record_type, &new);
-        if(!new)
+        return false;
+    }
+    context.stats.edns_replies++;
+
+    // Server cookies are only learned from replies that echo the client cookie (RFC 7873).
+    if(edns.cookie_len >= DNS_COOKIE_CLIENT_SIZE + 8 && resolver->cookie_len >= DNS_COOKIE_CLIENT_SIZE
+       && memcmp(edns.cookie, resolver->cookie, DNS_COOKIE_CLIENT_SIZE) == 0)
+    {
+        memcpy(resolver->cookie, edns.cookie, edns.cookie_len);
+        resolver->cookie_len = edns.cookie_len;
+        if(dns_edns_rcode(&head->header, &edns) == DNS_RCODE_BADCOOKIE)
         {
-            continue;
+            context.stats.edns_badcookie++;
+            return true;
         }
-        send_query(lookup);
     }
+    return false;
 }
 
-bool is_unacceptable(dns_pkt_t *packet)
+// Repeat a lookup whose reply has been truncated over TCP to the same resolver. This is not counted as another try.
+void tcp_fallback(lookup_t *lookup)
 {
-    return context.cmd_args.retry_codes[packet->head.header.rcode];
+    lookup->tcp = true;
+    context.stats.tcp_fallbacks++;
+    lookup->ring_entry = timed_ring_add(&context.ring, lookup_timeout(lookup), lookup);
+    lookup_mark_sent(lookup);
+    query_send(lookup, lookup->resolver, lookup->socket, lookup->transaction);
 }
 
-void lookup_done(lookup_t *lookup)
+void lookup_count_success(uint8_t rcode)
 {
-    context.stats.finished++;
+    context.stats.finished_success++;
+    context.stats.final_rcodes[rcode]++;
+    context.stats.success_rate++;
+}
 
-    hashmapRemove(context.map, lookup->key);
+// Handle an acceptable reply to a lookup. Returns false if the lookup goes on with a verification.
+bool lookup_accept(lookup_t *lookup, dns_head_t *head, uint8_t *offset, size_t len, uint8_t *next,
+                   struct sockaddr_storage *recvaddr)
+{
+    if(lookup->wildcard_probe)
+    {
+        wildcard_zone_learn(&context.wildcard, lookup->wildcard_probe, head, offset, len, next);
+        return true;
+    }
+    if(lookup->iterative_child)
+    {
+        cache_store(&context.cache, head, offset, len, next);
+        return true;
+    }
 
-    // Return lookup to pool.
-    // According to ISO/IEC 9899:TC2 §6.7.2.1 (13), structs are not padded at the beginning
-    ((lookup_key_t**)context.lookup_pool.data)[context.lookup_pool.len++] = lookup->key;
+    bool filtered = context.cmd_args.wildcard && wildcard_filter(lookup, head, offset, len, next);
+    if(!filtered && verify_required(lookup, head))
+    {
+        verify_start(lookup);
+        return false;
+    }
+    if(lookup->verifying)
+    {
+        if(head->header.rcode == DNS_RCODE_OK && head->header.ans_count > 0)
+        {
+            context.stats.verified++;
+        }
+        else
+        {
+            context.stats.verify_rejected++;
+        }
+    }
 
+    // We are done with the lookup because we received an acceptable reply. Consensus lookups are accounted once they
+    // are finished, after the remaining votes have been collected.
+    if(!context.cmd_args.consensus)
+    {
+        lookup_count_success(head->header.rcode);
+    }
 
-    // When transmission is not aggressive, we only start a new lookup after another one has finished.
-    // When our transmission is very aggressive, we also start a new lookup, although we listen for EPOLLOUT
-    // events as well.
-    if(context.cmd_args.extreme == 0 || context.cmd_args.extreme == 2)
+    if(!filtered)
     {
-        can_send();
+        output_packet(head, offset, len, next, recvaddr, time(NULL));
+        if(context.cmd_args.cache_size)
+        {
+            cache_store(&context.cache, head, offset, len, next);
+        }
     }
 
-    if(context.state == STATE_COOLDOWN && hashmapSize(context.map) <= 0)
+    // Sometimes, users may want to obtain results immediately.
+    if(context.cmd_args.flush)
     {
-        done();
+        fflush(context.outfile);
     }
+    return true;
 }
 
-bool retry(lookup_t *lookup)
+// Score the resolvers that have voted against the majority and finish the lookup.
+void consensus_finish(lookup_t *lookup)
 {
-    context.stats.timeouts[lookup->tries]--;
-    context.stats.timeouts[++lookup->tries]++;
-    if(lookup->tries < context.cmd_args.resolve_count)
+    for(size_t i = 0; i < context.cmd_args.consensus; i++)
     {
-        lookup->ring_entry = timed_ring_add(&context.ring, context.cmd_args.interval_ms * TIMED_RING_MS, lookup);
-        send_query(lookup);
+        consensus_vote_t *vote = lookup->votes + i;
+        if(vote->state != CONSENSUS_VOTE_ANSWERED)
+        {
+            continue;
+        }
+        resolver_t *resolver = (resolver_t *) context.resolvers.data + vote->resolver;
+        resolver->stats.consensus_votes++;
+        if(lookup->decided && vote->hash != lookup->majority)
+        {
+            resolver->stats.fakereplies++;
+            context.stats.consensus_disagreements++;
+        }
+    }
+    if(lookup->decided)
+    {
+        context.stats.consensus_decided++;
+        lookup_count_success(lookup->majority_rcode);
+    }
+    else
+    {
+        context.stats.consensus_split++;
+    }
+    lookup_done(lookup);
+}
+
+// Votes that have not been answered in time are sent to other resolvers unless the result has already been decided.
+void consensus_timeout(lookup_t *lookup)
+{
+    uint64_t waited = monotonic_ns() - lookup->sent_ns;
+    for(size_t i = 0; i < context.cmd_args.consensus; i++)
+    {
+        consensus_vote_t *vote = lookup->votes + i;
+        if(vote->state != CONSENSUS_VOTE_SENT)
+        {
+            continue;
+        }
+        resolver_t *resolver = (resolver_t *) context.resolvers.data + vote->resolver;
+        resolver_update_rtt(resolver, waited);
+        resolver->stats.timeout++;
+        resolver->inflight--;
+        vote->state = CONSENSUS_VOTE_PENDING;
+    }
+    if(lookup->decided || !retry(lookup))
+    {
+        consensus_finish(lookup);
+    }
+}
+
+// Record the vote of a reply. The reply that completes the majority is written as the result.
+void consensus_read(lookup_t *lookup, dns_head_t *head, uint8_t *offset, size_t len, uint8_t *next,
+                    struct sockaddr_storage *recvaddr)
+{
+    size_t count = context.cmd_args.consensus;
+    size_t index = (uint16_t) (head->header.id - lookup->transaction);
+    if(index >= count || lookup->votes[index].state != CONSENSUS_VOTE_SENT)
+    {
+        context.stats.mismatch_id++;
+        return;
+    }
+
+    // Votes are only accepted from the resolver they have been sent to.
+    consensus_vote_t *vote = lookup->votes + index;
+    resolver_t *resolver = (resolver_t *) context.resolvers.data + vote->resolver;
+    if(!addresses_equal(recvaddr, &resolver->address))
+    {
+        context.stats.mismatch_id++;
+        return;
+    }
+    resolver->inflight--;
+    lookup_account_reply(lookup, resolver, recvaddr);
+
+    // Unacceptable replies are sent again with the next try, as are replies that call for a change of the OPT record.
+    if((context.cmd_args.edns_size && edns_read(lookup, resolver, head, offset, len, next)) || is_unacceptable(head))
+    {
+        vote->state = CONSENSUS_VOTE_PENDING;
+        return;
+    }
+    vote->state = CONSENSUS_VOTE_ANSWERED;
+    vote->hash = consensus_reply_hash(head, offset, len, next);
+    lookup->answered++;
+
+    if(!lookup->decided && consensus_count(lookup->votes, count, vote->hash) > count / 2)
+    {
+        lookup->decided = true;
+        lookup->majority = vote->hash;
+        lookup->majority_rcode = head->header.rcode;
+        lookup_accept(lookup, head, offset, len, next, recvaddr);
+    }
+    if(lookup->answered == count)
+    {
+        timed_ring_remove(&context.ring, lookup->ring_entry);
+        consensus_finish(lookup);
+    }
+}
+
+// Follows a referral within a reply to an iterative lookup. A reply without answers that is not authoritative refers
+// to the zone of its NS records, which has to be below the zone of the server and contain the name. Returns false if
+// the reply is final instead, which includes negative and authoritative replies.
+bool iterative_referral(lookup_t *lookup, dns_head_t *head, uint8_t *begin, size_t len, uint8_t *next)
+{
+    dns_record_iter_t iter;
+    dns_record_view_t rec;
+    uint8_t qname[0xFF];
+    uint8_t zone[0xFF];
+    size_t zone_len = 0;
+    bool lame = false;
+
+    if(head->header.rcode != DNS_RCODE_OK || head->header.ans_count > 0 || head->header.aa)
+    {
+        return false;
+    }
+    ssize_t qname_len = dns_str2namebuf((char *) lookup->key->name.name, qname);
+    if(qname_len <= 0)
+    {
+        return false;
+    }
+    dns_record_iter_init(&iter, begin, len, next, &head->header);
+    while(dns_record_iter_next(&iter, &rec) && rec.section != DNS_SECTION_ADDITIONAL)
+    {
+        if(rec.section != DNS_SECTION_AUTHORITY || rec.type != DNS_REC_NS)
+        {
+            continue;
+        }
+        zone_len = dns_wire_name_expand(begin, begin + len, rec.name, zone, NULL);
+        if(zone_len != 0 && dns_wire_name_labels(zone) > lookup->zone_labels
+           && dns_wire_name_in_zone(qname, (size_t) qname_len, zone, zone_len) != NULL)
+        {
+            break;
+        }
+        zone_len = 0;
+        lame = true; // Upward referrals and referrals to unrelated zones
+    }
+
+    if(zone_len == 0)
+    {
+        if(!lame)
+        {
+            return false;
+        }
+        context.stats.iterative_lame++;
+        if(!retry(lookup))
+        {
+            lookup_done(lookup);
+        }
         return true;
     }
-    return false;
+    if(++lookup->referrals > ITERATIVE_MAX_REFERRALS)
+    {
+        context.stats.iterative_failed++;
+        lookup_done(lookup);
+        return true;
+    }
+
+    // Addresses are accepted for names within the zone of the server that has sent the referral.
+    context.stats.iterative_referrals++;
+    uint8_t *bailiwick = dns_wire_name_suffix(qname, lookup->zone_labels);
+    cache_store_referral(&context.cache, head, begin, len, next, zone, zone_len, bailiwick,
+                         (size_t) (qname + qname_len - bailiwick));
+    lookup->zone_labels = (uint8_t) dns_wire_name_labels(zone);
+    lookup->first_sent_ns = 0;
+    send_query(lookup);
+    return true;
 }
 
 void ring_timeout(void *param)
@@ -898,8 +4049,37 @@ void ring_timeout(void *param)
         check_progress();
         return;
     }
+    if(param == metrics_expire)
+    {
+        metrics_expire();
+        return;
+    }
+    if(param == verify_drain)
+    {
+        verify_drain();
+        return;
+    }
+    if(context.cmd_args.validate_resolvers)
+    {
+        validation_timeout(param);
+        return;
+    }
 
     lookup_t *lookup = param;
+    if(context.cmd_args.consensus)
+    {
+        consensus_timeout(lookup);
+        return;
+    }
+    if(lookup->delayed)
+    {
+        iterative_send(lookup);
+        return;
+    }
+
+    // A timeout counts as a round trip of the time waited, so unresponsive resolvers become less attractive.
+    resolver_update_rtt(lookup->resolver, monotonic_ns() - lookup->sent_ns);
+    lookup->resolver->stats.timeout++;
     if(!retry(lookup))
     {
         lookup_done(lookup);
@@ -908,252 +4088,144 @@ void ring_timeout(void *param)
 
 void do_read(uint8_t *offset, size_t len, struct sockaddr_storage *recvaddr)
 {
-    static dns_pkt_t packet;
+    static dns_head_t head;
     static uint8_t *parse_offset;
     static lookup_t *lookup;
     static resolver_t* resolver;
-    static char json_buffer[0xFFFF];
 
     context.stats.current_rate++;
     context.stats.numreplies++;
 
-    if(context.cmd_args.verify_ip)
+    if(context.cmd_args.validate_resolvers)
+    {
+        validation_read(offset, len, recvaddr);
+        return;
+    }
+
+    resolver = NULL;
+    if(context.resolver_map)
     {
         resolver = hashmapGet(context.resolver_map, recvaddr);
-        if(resolver == NULL)
-        {
-            //log_msg("Fake/NAT reply from %s\n", sockaddr2str(recvaddr));
-            return;
-        }
+    }
+    if(resolver == NULL && context.iterative.index)
+    {
+        resolver = hashmapGet(context.iterative.index, recvaddr);
+    }
+    if(resolver == NULL && context.cmd_args.verify_ip)
+    {
+        //log_msg("Fake/NAT reply from %s\n", sockaddr2str(recvaddr));
+        return;
     }
 
-    if(!dns_parse_question(offset, len, &packet.head, &parse_offset))
+    if(!dns_parse_question(offset, len, &head, &parse_offset))
     {
+        if(resolver)
+        {
+            resolver->stats.numreplies++;
+            resolver->stats.other++;
+        }
         return;
     }
 
     context.stats.numparsed++;
-    context.stats.all_rcodes[packet.head.header.rcode]++;
+    context.stats.all_rcodes[head.header.rcode]++;
+    if(resolver)
+    {
+        resolver_count_reply(resolver, &head.header);
+    }
 
     // TODO: Remove unnecessary copy.
-    //search_key.domain = (char*)packet.head.question.name.name;
-    lookup = hashmapGet(context.map, &packet.head.question);
+    //search_key.domain = (char*)head.question.name.name;
+    lookup = hashmapGet(context.map, &head.question);
     if(!lookup) // Most likely reason: delayed response after duplicate query
     {
         context.stats.mismatch_domain++;
+        if(resolver)
+        {
+            resolver->stats.mismatch++;
+        }
         return;
     }
 
-    if(lookup->transaction != packet.head.header.id)
+    if(context.cmd_args.consensus)
     {
-        context.stats.mismatch_id++;
+        consensus_read(lookup, &head, offset, len, parse_offset, recvaddr);
         return;
     }
 
-    timed_ring_remove(&context.ring, lookup->ring_entry); // Clear timeout trigger
-
-    // Check whether we want to retry resending the packet
-    if(is_unacceptable(&packet))
+    if(lookup->transaction != head.header.id)
     {
-        // We may have tried to many times already.
-        if(!retry(lookup))
+        context.stats.mismatch_id++;
+        if(resolver)
         {
-            // If this is the case, we will not try again.
-            lookup_done(lookup);
+            resolver->stats.mismatch++;
         }
+        return;
     }
-    else
-    {
-        // We are done with the lookup because we received an acceptable reply.
-        context.stats.finished_success++;
-        context.stats.final_rcodes[packet.head.header.rcode]++;
-        context.stats.success_rate++;
-
-        // Print packet
-        time_t now = time(NULL);
-        uint16_t short_len = (uint16_t) len;
-        uint8_t *next = parse_offset;
-        dns_record_t rec;
-        size_t non_add_count = packet.head.header.ans_count + packet.head.header.auth_count;
-        dns_section_t section = DNS_SECTION_ANSWER;
-
-        switch(context.cmd_args.output)
-        {
-            case OUTPUT_BINARY:
-                // The output file is platform dependent for performance reasons.
-                fwrite(&now, sizeof(now), 1, context.outfile);
-                fwrite(recvaddr, sizeof(*recvaddr), 1, context.outfile);
-                fwrite(&short_len, sizeof(short_len), 1, context.outfile);
-                fwrite(offset, short_len, 1, context.outfile);
-                break;
-
-            case OUTPUT_TEXT_FULL: // Print packet similar to dig style
-                // Resolver and timestamp are not part of the packet, we therefore have to print it manually
-                fprintf(context.outfile, ";; Server: %s\n;; Size: %" PRIu16 "\n;; Unix time: %lu\n",
-                        sockaddr2str(recvaddr), short_len, now);
-                dns_print_packet(context.outfile, &packet, offset, len, next);
-                break;
 
-            case OUTPUT_NDJSON: // Only print records from answer section that match the query name (in ndjson)
-
-                for(size_t rec_index = 0; dns_parse_record_raw(offset, next, offset + len, &next, &rec); rec_index++)
-                {
-                    fprintf(context.outfile,
-                            "{\"query_name\":\"%s\",\"query_type\":\"%s\",",
-                            dns_name2str(&packet.head.question.name),
-                            dns_record_type2str((dns_record_type) packet.head.question.type));
-
-                    json_escape(json_buffer, dns_raw_record_data2str(&rec, offset, offset + short_len), sizeof(json_buffer));
-
-                    fprintf(context.outfile,
-                            "\"resp_name\":\"%s\",\"resp_type\":\"%s\",\"data\":\"%s\"}\n",
-                            dns_name2str(&rec.name),
-                            dns_record_type2str((dns_record_type) rec.type),
-                            json_buffer);
-                }
-
-                break;
-
-            case OUTPUT_TEXT_SIMPLE: // Only print records from answer section that match the query name
-                if(context.format.print_question)
-                {
-                    if(!context.format.include_meta)
-                    {
-                        fprintf(context.outfile,
-                                "%s %s %s\n",
-                                dns_name2str(&packet.head.question.name),
-                                context.format.ttl ? dns_class2str((dns_class) packet.head.question.class) : "",
-                                dns_record_type2str((dns_record_type) packet.head.question.type));
-                    }
-                    else
-                    {
-                        fprintf(context.outfile,
-                                "%s %lu %s %s %s %s\n",
-                                sockaddr2str(recvaddr),
-                                now,
-                                dns_rcode2str((dns_rcode)packet.head.header.rcode),
-                                dns_name2str(&packet.head.question.name),
-                                context.format.ttl ? dns_class2str((dns_class) packet.head.question.class) : "",
-                                dns_record_type2str((dns_record_type) packet.head.question.type));
-                    }
-                }
-                for(size_t rec_index = 0; dns_parse_record_raw(offset, next, offset + len, &next, &rec); rec_index++)
-                {
-                    char *section_separator = "";
-                    if(rec_index >= packet.head.header.ans_count)
-                    {
-                        if(rec_index >= non_add_count)
-                        {
-                            // We are entering a new section
-                            if(context.format.separate_sections && section != DNS_SECTION_ADDITIONAL)
-                            {
-                                section_separator = "\n";
-                            }
-                            section = DNS_SECTION_ADDITIONAL;
-                        }
-                        else
-                        {
-                            // We are entering a new section
-                            if(context.format.separate_sections && section != DNS_SECTION_AUTHORITY)
-                            {
-                                section_separator = "\n";
-                            }
-                            section = DNS_SECTION_AUTHORITY;
-                        }
-                    }
+    // Truncated replies that arrive after the lookup has been repeated over TCP are dropped, the reply over TCP is due.
+    if(head.header.tc && lookup->tcp)
+    {
+        return;
+    }
 
-                    if((context.format.match_name && !dns_names_eq(&rec.name, &packet.head.question.name))
-                            || !context.format.sections[section])
-                    {
-                        continue;
-                    }
-                    if(!context.format.ttl)
-                    {
-                        fprintf(context.outfile,
-                                "%s%s%s %s %s\n",
-                                section_separator,
-                                context.format.indent_sections ? "\t" : "",
-                                dns_name2str(&rec.name),
-                                dns_record_type2str((dns_record_type) rec.type),
-                                dns_raw_record_data2str(&rec, offset, offset + short_len));
-                    }
-                    else
-                    {
-                        fprintf(context.outfile,
-                                "%s%s%s %s %" PRIu32 " %s %s\n",
-                                section_separator,
-                                context.format.indent_sections ? "\t" : "",
-                                dns_name2str(&rec.name),
-                                dns_class2str((dns_class)rec.class),
-                                rec.ttl,
-                                dns_record_type2str((dns_record_type) rec.type),
-                                dns_raw_record_data2str(&rec, offset, offset + short_len));
-                    }
-                }
-                if(context.format.separate_queries)
-                {
-                    fprintf(context.outfile, "\n");
-                }
-                break;
-        }
+    timed_ring_remove(&context.ring, lookup->ring_entry); // Clear timeout trigger
+    lookup_account_reply(lookup, lookup->resolver, recvaddr);
+    lookup->delayed = false; // A late reply to a lookup that waits for the rate limit of its next server
 
-        lookup_done(lookup);
-        
-        // Sometimes, users may want to obtain results immediately.
-        if(context.cmd_args.flush)
+    if(context.cmd_args.edns_size && addresses_equal(recvaddr, &lookup->resolver->address)
+       && edns_read(lookup, lookup->resolver, &head, offset, len, parse_offset))
+    {
+        if(!retry(lookup))
         {
-            fflush(context.outfile);
+            lookup_done(lookup);
         }
+        return;
     }
-}
-
-#ifdef PCAP_SUPPORT
-void pcap_callback(u_char *arg, const struct pcap_pkthdr *header, const u_char *packet)
-{
-    static struct sockaddr_storage addr;
-    static size_t len;
-    static const uint8_t *frame;
-    static ssize_t remaining;
 
-    // We expect at least an Ethernet header + IPv4/IPv6 header (>= 20) + UDP header
-    if(header->len < 42)
+    if(head.header.tc && context.cmd_args.tcp_fallback && !lookup->resolver->no_tcp)
     {
+        tcp_fallback(lookup);
         return;
     }
-    frame = ((uint8_t*)packet) + 14;
-    remaining = header->len - 14;
 
-    if(((struct ether_header*)packet)->ether_type == context.ether_type_ip)
+    if(context.cmd_args.iterative && iterative_referral(lookup, &head, offset, len, parse_offset))
     {
-        unsigned int ip_hdr_len = ((struct iphdr *) frame)->ihl * 4;
-        remaining -= ip_hdr_len;
+        return;
+    }
 
-        // Check whether the packet is long enough to still contain a UDP frame
-        if(((struct iphdr *) frame)->protocol != 17
-            || remaining < 0)
-        {
-            return;
-        }
-        frame += ip_hdr_len;
-        len = (size_t)remaining;
-        remaining -= ntohs(((struct udphdr *) frame)->len);
-        if(remaining != 0)
+    // Check whether we want to retry resending the packet
+    if(is_unacceptable(&head))
+    {
+        // We may have tried to many times already.
+        if(!retry(lookup))
         {
-            return;
+            // If this is the case, we will not try again.
+            lookup_done(lookup);
         }
-        frame += 8;
-        addr.ss_family = AF_INET;
     }
-    else
+    else if(lookup_accept(lookup, &head, offset, len, parse_offset, recvaddr))
+    {
+        lookup_done(lookup);
+    }
+}
+
+#ifdef PCAP_SUPPORT
+void pcap_callback(u_char *arg, const struct pcap_pkthdr *header, const u_char *packet)
+{
+    static uint16_t ether_type;
+
+    size_t len = header->caplen;
+    uint8_t *network = raw_frame_strip((uint8_t *) packet, &len, &ether_type);
+    if(network != NULL && (ether_type == context.ether_type_ip || ether_type == context.ether_type_ip6))
     {
-        return;
+        raw_receive(network, len);
     }
-    do_read((uint8_t*)frame, len, &addr);
 }
 
 void pcap_can_read()
 {
-    pcap_dispatch(context.pcap, 1, pcap_callback, NULL);
+    pcap_dispatch(context.pcap, RAW_CAPTURE_BATCH, pcap_callback, NULL);
 }
 #endif
 
@@ -1176,12 +4248,6 @@ void can_read(socket_info_t *info)
     do_read(readbuf, (size_t)num_received, &recvaddr);
 }
 
-bool cmp_lookup(void *lookup1, void *lookup2)
-{
-    return dns_names_eq(&((lookup_key_t *) lookup1)->name, &((lookup_key_t *) lookup2)->name);
-    //return strcasecmp(((lookup_key_t *) lookup1)->domain,((lookup_key_t *) lookup2)->domain) == 0;
-}
-
 void binfile_write_head()
 {
     // Write file type signature including null character
@@ -1306,6 +4372,17 @@ void pcap_setup()
     }
     log_msg(", address: %s\n", mac_readable);
 
+    // Datagrams may carry up to two VLAN tags, the vlan keyword shifts the offsets of the expressions that follow it.
+    char udp_filter[sizeof("udp dst portrange 65535-65535")] = "udp";
+    if(context.cmd_args.raw_prefix4.present || context.cmd_args.raw_prefix6.present)
+    {
+        snprintf(udp_filter, sizeof(udp_filter), "udp dst portrange %" PRIu16 "-%" PRIu16,
+                 context.cmd_args.raw_port_first, context.cmd_args.raw_port_last);
+    }
+    char filter[sizeof(mac_filter) + 3 * sizeof(udp_filter) + sizeof(" and ( or (vlan and ( or (vlan and ))))")];
+    snprintf(filter, sizeof(filter), "%s and (%s or (vlan and (%s or (vlan and %s))))", mac_filter, udp_filter,
+             udp_filter, udp_filter);
+
 
     context.pcap = pcap_create(context.pcap_dev, context.pcap_error);
     if(context.pcap == NULL)
@@ -1335,7 +4412,7 @@ void pcap_setup()
         goto pcap_error_noprint;
     }
 
-    if(pcap_compile(context.pcap, &context.pcap_filter, mac_filter, 0, PCAP_NETMASK_UNKNOWN) != 0)
+    if(pcap_compile(context.pcap, &context.pcap_filter, filter, 0, PCAP_NETMASK_UNKNOWN) != 0)
     {
         log_msg("Error during pcap filter compilation: %s\n", pcap_geterr(context.pcap));
         goto pcap_error_noprint;
@@ -1373,95 +4450,121 @@ pcap_error_noprint:
 }
 #endif
 
-void init_pipes()
+// Opens the raw sockets for the address families with a source prefix and, unless pcap is used, the packet socket
+// capturing the replies. Requires CAP_NET_RAW, so it precedes dropping privileges.
+void raw_setup()
 {
-    // We don't need any pipes if the process is not forked
-    if(context.cmd_args.num_processes <= 1)
+    if(!context.cmd_args.raw_prefix4.present && !context.cmd_args.raw_prefix6.present)
     {
         return;
     }
+    context.raw.enabled = true;
+    context.raw.socket4 = -1;
+    context.raw.socket6 = -1;
+    context.raw.capture.descriptor = -1;
+
+    size_t ports = (size_t) context.cmd_args.raw_port_last - context.cmd_args.raw_port_first + 1;
+    context.raw.port_count = ports / context.cmd_args.num_processes
+                             + (context.fork_index < ports % context.cmd_args.num_processes ? 1 : 0);
 
-    // Otherwise create a unidirectional pipe for reading and writing from every fork
-    context.sockets.pipes = safe_malloc(sizeof(*context.sockets.pipes) * 2 * context.cmd_args.num_processes);
-    for(size_t i = 0; i < context.cmd_args.num_processes; i++)
+    for(size_t i = 0; i < 2; i++)
     {
-        if(pipe(context.sockets.pipes + i * 2) != 0)
+        raw_prefix_t *prefix = i == 0 ? &context.cmd_args.raw_prefix4 : &context.cmd_args.raw_prefix6;
+        if(!prefix->present)
+        {
+            continue;
+        }
+        int fd = raw_socket_open(prefix->family);
+        if(fd < 0)
         {
-            log_msg("Pipe failed: %s\n", strerror(errno));
+            log_msg("Failed to create raw IPv%d socket, which requires CAP_NET_RAW: %s\n", i == 0 ? 4 : 6,
+                    strerror(errno));
             clean_exit(EXIT_FAILURE);
         }
+        set_sndbuf(fd);
+        *(i == 0 ? &context.raw.socket4 : &context.raw.socket6) = fd;
     }
 
-}
-
-void setup_pipes()
-{
-    if(context.fork_index == 0) // We are in the main process
+#ifdef PCAP_SUPPORT
+    if(context.cmd_args.use_pcap)
     {
-        context.sockets.master_pipes_read = safe_calloc(sizeof(socket_info_t) * context.cmd_args.num_processes);
-
-        // Close all pipes that the children use to write
-        for (size_t i = 0; i < context.cmd_args.num_processes; i++)
-        {
-            close(context.sockets.pipes[2 * i + 1]);
-            context.sockets.pipes[2 * i + 1] = -1;
-
-            context.sockets.master_pipes_read[i].descriptor = context.sockets.pipes[2 * i];
-            context.sockets.master_pipes_read[i].type = SOCKET_TYPE_CONTROL;
-            context.sockets.master_pipes_read[i].data = (void*)i;
-
-            if(context.cmd_args.busypoll)
-            {
-                continue;
-            }
-
-#ifdef HAVE_EPOLL
-            // Add all pipes the main process can read from to the epoll descriptor
-            struct epoll_event ev;
-            bzero(&ev, sizeof(ev));
-            ev.data.ptr = &context.sockets.master_pipes_read[i];
-            ev.events = EPOLLIN;
-            if (epoll_ctl(context.epollfd, EPOLL_CTL_ADD, context.sockets.master_pipes_read[i].descriptor, &ev) != 0)
-            {
-                log_msg("Failed to add epoll event: %s\n", strerror(errno));
-                clean_exit(EXIT_FAILURE);
-            }
+        return;
+    }
 #endif
+#ifdef __linux__
+    context.raw.capture.descriptor = raw_capture_open();
+    if(context.raw.capture.descriptor < 0)
+    {
+        log_msg("Failed to create packet socket, which requires CAP_NET_RAW: %s\n", strerror(errno));
+        clean_exit(EXIT_FAILURE);
+    }
+    context.raw.capture.type = SOCKET_TYPE_CAPTURE;
+    socket_noblock(&context.raw.capture);
+    if(!raw_capture_filter(context.raw.capture.descriptor, context.cmd_args.raw_port_first,
+                           context.cmd_args.raw_port_last, (uint16_t) context.cmd_args.num_processes,
+                           (uint16_t) context.fork_index))
+    {
+        log_msg("Failed to attach capture filter: %s\n", strerror(errno));
+    }
+    // The ring is not subject to the receive buffer size.
+    if(!raw_ring_setup(context.raw.capture.descriptor, &context.raw.ring))
+    {
+        if(context.cmd_args.rcvbuf)
+        {
+            set_rcvbuf(context.raw.capture.descriptor);
+        }
+        else
+        {
+            // The default size is too small for bursts of replies, the size is capped by the kernel.
+            int size = RAW_CAPTURE_BUFFER;
+            setsockopt(context.raw.capture.descriptor, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
         }
     }
-    else // It's a child process
+#ifdef HAVE_EPOLL
+    if(!context.cmd_args.busypoll)
     {
-        // Close all pipes except the two belonging to the current process
-        for (size_t i = 0; i < context.cmd_args.num_processes; i++)
+        struct epoll_event ev;
+        bzero(&ev, sizeof(ev));
+        ev.data.ptr = &context.raw.capture;
+        ev.events = EPOLLIN;
+        if (epoll_ctl(context.epollfd, EPOLL_CTL_ADD, context.raw.capture.descriptor, &ev) != 0)
         {
-            if (i == context.fork_index)
-            {
-                continue;
-            }
-            close(context.sockets.pipes[2 * i]);
-            close(context.sockets.pipes[2 * i + 1]);
-            context.sockets.pipes[2 * i] = -1;
-            context.sockets.pipes[2 * i + 1] = -1;
+            log_msg("Failed to add epoll event: %s\n", strerror(errno));
+            clean_exit(EXIT_FAILURE);
         }
-        context.sockets.write_pipe.descriptor = context.sockets.pipes[2 * context.fork_index + 1];
-        context.sockets.write_pipe.type = SOCKET_TYPE_CONTROL;
-        close(context.sockets.pipes[2 * context.fork_index]);
-        context.sockets.pipes[2 * context.fork_index] = -1;
     }
+#endif
+#else
+    log_msg("Raw transmit mode requires pcap on this platform.\n");
+    clean_exit(EXIT_FAILURE);
+#endif
 }
 
-void read_control_message(socket_info_t *socket_info)
+// Every process publishes its stats to its own slot of a shared memory region, which the main process aggregates.
+void stats_shared_init()
 {
-    size_t process = (size_t)socket_info->data;
-    ssize_t read_result = read(socket_info->descriptor, context.stat_messages + process, sizeof(stats_exchange_t));
-    if(read_result > 0 && read_result < sizeof(stats_exchange_t))
+    if(context.cmd_args.num_processes <= 1)
+    {
+        return;
+    }
+
+    void *region = mmap(NULL, context.cmd_args.num_processes * sizeof(*context.stat_messages),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED)
     {
-        log_msg("Atomic read failed: Read %ld bytes.\n", read_result);
+        log_msg("Failed to map shared memory for statistics: %s\n", strerror(errno));
+        clean_exit(EXIT_FAILURE);
     }
-    if(!context.done[process] && context.stat_messages[process].done)
+    context.stat_messages = region;
+}
+
+// Terminate the main process once it is waiting for children that have all finished.
+void check_children()
+{
+    if(context.state == STATE_WAIT_CHILDREN && stats_processes_done())
     {
-        context.finished++;
-        context.done[process] = true;
+        set_state(STATE_DONE);
+        check_progress(); // Print the final stats including those of the children
     }
 }
 
@@ -1477,6 +4580,26 @@ void make_query_sockets_nonblocking()
     }
 }
 
+// Log the resolvers that have frequently disagreed with the majority, which hints at poisoned caches or hijacking.
+void consensus_report()
+{
+    if(!context.cmd_args.consensus)
+    {
+        return;
+    }
+    for(size_t i = 0; i < context.resolvers.len; i++)
+    {
+        resolver_t *resolver = (resolver_t *) context.resolvers.data + i;
+        resolver_stats_t *stats = &resolver->stats;
+        if(stats->consensus_votes >= CONSENSUS_FLAG_MIN_VOTES
+           && stats->fakereplies * 100 >= stats->consensus_votes * CONSENSUS_FLAG_PERCENT)
+        {
+            log_msg("Resolver %s disagreed with the majority in %zu of %zu replies.\n",
+                    sockaddr2str(&resolver->address), stats->fakereplies, stats->consensus_votes);
+        }
+    }
+}
+
 void run()
 {
     static char multiproc_outfile_name[8192];
@@ -1494,6 +4617,18 @@ void run()
         clean_exit(EXIT_FAILURE);
     }
 
+    if(context.cmd_args.wildcard && !wildcard_cache_init(&context.wildcard, context.cmd_args.wildcard_cache_size))
+    {
+        log_msg("Failed to create wildcard cache.\n");
+        clean_exit(EXIT_FAILURE);
+    }
+
+    if(context.cmd_args.cache_size && !cache_init(&context.cache, context.cmd_args.cache_size))
+    {
+        log_msg("Failed to create answer cache.\n");
+        clean_exit(EXIT_FAILURE);
+    }
+
     context.lookup_pool.len = context.cmd_args.hashmap_size;
     context.lookup_pool.data = safe_calloc(context.lookup_pool.len * sizeof(void*));
     context.lookup_space = safe_calloc(context.lookup_pool.len * sizeof(*context.lookup_space));
@@ -1501,19 +4636,37 @@ void run()
     {
         ((lookup_entry_t**)context.lookup_pool.data)[i] = context.lookup_space + i;
     }
+    if(context.cmd_args.consensus)
+    {
+        // The votes of all lookups are allocated up front, so that consensus mode does not allocate while resolving.
+        context.consensus_votes = safe_calloc(context.lookup_pool.len * context.cmd_args.consensus
+                                              * sizeof(*context.consensus_votes));
+    }
 
-    timed_ring_init(&context.ring, max(context.cmd_args.interval_ms, 1000), 2 * TIMED_RING_MS, context.cmd_args.timed_ring_buckets);
+    // The ring has to span the longest possible timeout, it is divided into buckets of two milliseconds. Adaptive
+    // timeouts reach the maximum retransmission timeout plus a jitter of up to a quarter of it.
+    size_t ring_buckets = context.cmd_args.interval_ms / 2 + 1;
+    if(context.cmd_args.adaptive_timeout)
+    {
+        ring_buckets = max(ring_buckets, context.cmd_args.rto_max_ms * 5 / 4 / 2 + 1);
+    }
+    timed_ring_init(&context.ring, max(ring_buckets, 1000), 2 * TIMED_RING_MS, context.cmd_args.timed_ring_buckets);
 
 #ifdef HAVE_EPOLL
-    uint32_t socket_events = EPOLLOUT;
+    // Validation does not send in reaction to writable sockets
+    uint32_t socket_events = context.cmd_args.validate_resolvers ? 0 : EPOLLOUT;
 
     struct epoll_event pevents[100000];
     bzero(pevents, sizeof(pevents));
 #endif
 
-    init_pipes();
+    stats_shared_init();
+    if(context.cmd_args.resolver_stats)
+    {
+        // Installed before forking, so that signalling the process group makes every process write its statistics
+        signal(SIGUSR1, request_resolver_stats);
+    }
     context.pids = safe_calloc(context.cmd_args.num_processes * sizeof(*context.pids));
-    context.done = safe_calloc(context.cmd_args.num_processes * sizeof(*context.done));
     context.fork_index = split_process(context.cmd_args.num_processes, context.pids);
 #ifdef HAVE_EPOLL
     if(!context.cmd_args.busypoll)
@@ -1533,15 +4686,6 @@ void run()
         socket_events |= EPOLLIN;
     }
 #endif
-    if(context.cmd_args.num_processes > 1)
-    {
-        setup_pipes();
-        if(context.fork_index == 0)
-        {
-            context.stat_messages = safe_calloc(context.cmd_args.num_processes * sizeof(stats_exchange_t));
-        }
-    }
-
     if(strcmp(context.cmd_args.outfile_name, "-") != 0)
     {
         if(context.cmd_args.num_processes > 1)
@@ -1569,7 +4713,7 @@ void run()
         }
     }
 
-    if(context.domainfile != stdin)
+    if(context.domainfile != stdin && context.cmd_args.domains)
     {
         context.domainfile = fopen(context.cmd_args.domains, "r");
         if (context.domainfile == NULL)
@@ -1589,7 +4733,47 @@ void run()
     // because that way we can warn if the socket creation for a certain IP protocol failed although a resolver
     // requires the protocol.
     query_sockets_setup();
+    raw_setup();
     context.resolvers = massdns_resolvers_from_file(context.cmd_args.resolvers);
+    resolver_map_add(&context.resolvers);
+    if(context.resolvers.len < context.cmd_args.consensus)
+    {
+        log_msg("Consensus mode requires at least as many resolvers as votes per name.\n");
+        clean_exit(EXIT_FAILURE);
+    }
+    if(context.cmd_args.trusted_resolvers)
+    {
+        context.trusted.resolvers = massdns_resolvers_from_file(context.cmd_args.trusted_resolvers);
+        resolver_map_add(&context.trusted.resolvers);
+
+        // Every process is allotted an equal share of the rate.
+        context.trusted.interval_ns = context.cmd_args.num_processes * (uint64_t)TIMED_RING_S
+                                      / context.cmd_args.trusted_rate;
+    }
+    if(context.cmd_args.iterative)
+    {
+        context.iterative.index = hashmapCreate(ITERATIVE_MAX_SERVERS, hash_address, addresses_equal);
+        if(context.iterative.index == NULL)
+        {
+            log_msg("Failed to create server lookup map: %s\n", strerror(errno));
+            clean_exit(EXIT_FAILURE);
+        }
+        context.iterative.servers.data = safe_calloc(ITERATIVE_MAX_SERVERS * sizeof(resolver_t));
+
+        // Every process is allotted an equal share of the rate of each server.
+        if(context.cmd_args.server_rate)
+        {
+            context.iterative.interval_ns = context.cmd_args.num_processes * (uint64_t)TIMED_RING_S
+                                            / context.cmd_args.server_rate;
+        }
+    }
+    if(context.cmd_args.tcp_fallback || context.cmd_args.tcp)
+    {
+        context.tcp.connections = safe_calloc(TCP_MAX_CONNECTIONS * sizeof(*context.tcp.connections));
+    }
+    resolver_stats_open();
+    summary_open();
+    metrics_setup();
 
     privilege_drop();
 
@@ -1608,6 +4792,10 @@ void run()
 
     clock_gettime(CLOCK_MONOTONIC, &context.stats.start_time);
     check_progress();
+    if(context.cmd_args.validate_resolvers)
+    {
+        validation_start();
+    }
 
     if(!context.cmd_args.busypoll)
     {
@@ -1616,9 +4804,17 @@ void run()
         {
 
             int ready = epoll_wait(context.epollfd, pevents, sizeof(pevents) / sizeof(pevents[0]), 1);
+            if(resolver_stats_requested)
+            {
+                resolver_stats_requested = 0;
+                resolver_stats_write();
+            }
             if (ready < 0)
             {
-                log_msg("Epoll failure: %s\n", strerror(errno));
+                if(errno != EINTR)
+                {
+                    log_msg("Epoll failure: %s\n", strerror(errno));
+                }
             }
             else if (ready == 0) // Epoll timeout
             {
@@ -1638,24 +4834,29 @@ void run()
                     {
                         can_read(socket_info);
                     }
+                    else if(socket_info->type == SOCKET_TYPE_METRICS)
+                    {
+                        metrics_handle(socket_info);
+                    }
+                    else if(socket_info->type == SOCKET_TYPE_TCP)
+                    {
+                        tcp_handle((tcp_connection_t *) socket_info);
+                    }
+                    else if(socket_info->type == SOCKET_TYPE_CAPTURE)
+                    {
+                        raw_capture_read();
+                    }
 #ifdef PCAP_SUPPORT
                         else if((pevents[i].events & EPOLLIN) && socket_info == &context.pcap_info)
                         {
                             pcap_can_read();
                         }
 #endif
-                    else if ((pevents[i].events & EPOLLIN) && socket_info->type == SOCKET_TYPE_CONTROL)
-                    {
-                        read_control_message(socket_info);
-                        if(context.finished >= context.cmd_args.num_processes)
-                        {
-                            context.state = STATE_DONE;
-                            break;
-                        }
-                    }
                 }
                 timed_ring_handle(&context.ring, ring_timeout);
             }
+            tcp_flush_all();
+            check_children();
         }
 #endif
     }
@@ -1663,6 +4864,11 @@ void run()
     {
         while(context.state < STATE_DONE)
         {
+            if(resolver_stats_requested)
+            {
+                resolver_stats_requested = 0;
+                resolver_stats_write();
+            }
             can_send();
             for(size_t i = 0; i < context.sockets.interfaces4.len; i++)
             {
@@ -1672,22 +4878,30 @@ void run()
             {
                 can_read(((socket_info_t*)context.sockets.interfaces6.data) + i);
             }
-            timed_ring_handle(&context.ring, ring_timeout);
-
-            if(context.cmd_args.num_processes > 1 && context.fork_index == 0)
+#ifdef __linux__
+            if(context.raw.enabled && context.raw.capture.descriptor >= 0)
             {
-                for (size_t i = 1; i < context.cmd_args.num_processes; i++)
-                {
-                    read_control_message(context.sockets.master_pipes_read + i);
-                }
-                if(context.finished >= context.cmd_args.num_processes)
-                {
-                    context.state = STATE_DONE;
-                    break;
-                }
+                raw_capture_read();
             }
+#endif
+#ifdef PCAP_SUPPORT
+            if(context.pcap != NULL)
+            {
+                pcap_can_read();
+            }
+#endif
+            timed_ring_handle(&context.ring, ring_timeout);
+            tcp_poll();
+            tcp_flush_all();
+            metrics_poll();
+
+            check_children();
         }
     }
+
+    resolver_stats_write();
+    consensus_report();
+    summary_write();
 }
 
 void use_stdin()
@@ -1732,11 +4946,20 @@ int parse_cmd(int argc, char **argv)
     context.cmd_args.resolve_count = 50;
     context.cmd_args.hashmap_size = 10000;
     context.cmd_args.interval_ms = 500;
+    context.cmd_args.rto_min_ms = 50;
+    context.cmd_args.rto_max_ms = 2000;
     context.cmd_args.timed_ring_buckets = 10000;
     context.cmd_args.output = OUTPUT_TEXT_FULL;
     context.cmd_args.retry_codes[DNS_RCODE_REFUSED] = true;
     context.cmd_args.num_processes = 1;
     context.cmd_args.socket_count = 1;
+    context.cmd_args.wildcard_cache_size = 16384;
+    context.cmd_args.trusted_rate = 1000;
+    context.cmd_args.server_rate = 100;
+    context.cmd_args.tcp_fallback = true;
+    context.cmd_args.tcp_connections = TCP_POOL_SIZE;
+    context.cmd_args.raw_port_first = 1024;
+    context.cmd_args.raw_port_last = UINT16_MAX;
 #ifndef HAVE_EPOLL
     context.cmd_args.busypoll = true;
 #endif
@@ -1765,6 +4988,29 @@ int parse_cmd(int argc, char **argv)
                 clean_exit(EXIT_FAILURE);
             }
         }
+        else if (strcmp(argv[i], "--resolver-stats") == 0)
+        {
+            expect_arg(i);
+            context.cmd_args.resolver_stats = argv[++i];
+        }
+        else if (strcmp(argv[i], "--resolver-stats-format") == 0)
+        {
+            expect_arg(i);
+            i++;
+            if(strcasecmp(argv[i], "csv") == 0)
+            {
+                context.cmd_args.resolver_stats_csv = true;
+            }
+            else if(strcasecmp(argv[i], "ndjson") == 0)
+            {
+                context.cmd_args.resolver_stats_csv = false;
+            }
+            else
+            {
+                log_msg("Unrecognized resolver statistics format: %s\n", argv[i]);
+                clean_exit(EXIT_FAILURE);
+            }
+        }
         else if(strcmp(argv[i], "--retry") == 0)
         {
             expect_arg(i);
@@ -1933,6 +5179,10 @@ int parse_cmd(int argc, char **argv)
             context.cmd_args.use_pcap = true;
         }
 #endif
+        else if (strcmp(argv[i], "--latency-aware") == 0)
+        {
+            context.cmd_args.latency_aware = true;
+        }
         else if (strcmp(argv[i], "--predictable") == 0)
         {
             context.cmd_args.predictable_resolver = true;
@@ -1984,6 +5234,18 @@ int parse_cmd(int argc, char **argv)
         {
             context.cmd_args.interval_ms = (unsigned int) expect_arg_nonneg(i++, 1, UINT_MAX);
         }
+        else if (strcmp(argv[i], "--rto") == 0)
+        {
+            context.cmd_args.adaptive_timeout = true;
+        }
+        else if (strcmp(argv[i], "--rto-min") == 0)
+        {
+            context.cmd_args.rto_min_ms = (unsigned int) expect_arg_nonneg(i++, 1, UINT_MAX);
+        }
+        else if (strcmp(argv[i], "--rto-max") == 0)
+        {
+            context.cmd_args.rto_max_ms = (unsigned int) expect_arg_nonneg(i++, 1, UINT_MAX);
+        }
         else if (strcmp(argv[i], "--sndbuf") == 0)
         {
             context.cmd_args.sndbuf = (int) expect_arg_nonneg(i++, 0, INT_MAX);
@@ -2000,6 +5262,107 @@ int parse_cmd(int argc, char **argv)
         {
             context.cmd_args.verify_ip = true;
         }
+        else if (strcmp(argv[i], "--metrics") == 0)
+        {
+            expect_arg(i);
+            context.cmd_args.metrics = argv[++i];
+        }
+        else if (strcmp(argv[i], "--summary") == 0)
+        {
+            expect_arg(i);
+            context.cmd_args.summary = argv[++i];
+        }
+        else if (strcmp(argv[i], "--validate-resolvers") == 0)
+        {
+            context.cmd_args.validate_resolvers = true;
+        }
+        else if (strcmp(argv[i], "--cache") == 0)
+        {
+            context.cmd_args.cache_size = (size_t) expect_arg_nonneg(i++, 2, SIZE_MAX);
+        }
+        else if (strcmp(argv[i], "--edns") == 0)
+        {
+            context.cmd_args.edns_size = (uint16_t) expect_arg_nonneg(i++, 512, UINT16_MAX);
+        }
+        else if (strcmp(argv[i], "--dnssec") == 0)
+        {
+            context.cmd_args.dnssec_ok = true;
+        }
+        else if (strcmp(argv[i], "--cookies") == 0)
+        {
+            context.cmd_args.cookies = true;
+        }
+        else if (strcmp(argv[i], "--no-tcp-fallback") == 0)
+        {
+            context.cmd_args.tcp_fallback = false;
+        }
+        else if (strcmp(argv[i], "--tcp") == 0)
+        {
+            context.cmd_args.tcp = true;
+        }
+        else if (strcmp(argv[i], "--tcp-connections") == 0)
+        {
+            context.cmd_args.tcp_connections = (size_t) expect_arg_nonneg(i++, 1, TCP_MAX_CONNECTIONS);
+        }
+        else if (strcmp(argv[i], "--raw-source") == 0)
+        {
+            expect_arg(i);
+            raw_prefix_t prefix;
+            if(!raw_prefix_parse(argv[++i], &prefix))
+            {
+                log_msg("Invalid source prefix: %s\n", argv[i]);
+                clean_exit(EXIT_FAILURE);
+            }
+            *(prefix.family == AF_INET ? &context.cmd_args.raw_prefix4 : &context.cmd_args.raw_prefix6) = prefix;
+        }
+        else if (strcmp(argv[i], "--raw-ports") == 0)
+        {
+            expect_arg(i);
+            unsigned int first, last;
+            char end;
+            if(sscanf(argv[++i], "%u-%u%c", &first, &last, &end) != 2 || first == 0 || first > last
+               || last > UINT16_MAX)
+            {
+                log_msg("Invalid source port range: %s\n", argv[i]);
+                clean_exit(EXIT_FAILURE);
+            }
+            context.cmd_args.raw_port_first = (uint16_t) first;
+            context.cmd_args.raw_port_last = (uint16_t) last;
+        }
+        else if (strcmp(argv[i], "--iterative") == 0)
+        {
+            context.cmd_args.iterative = true;
+        }
+        else if (strcmp(argv[i], "--server-rate") == 0)
+        {
+            context.cmd_args.server_rate = (size_t) expect_arg_nonneg(i++, 0, SIZE_MAX);
+        }
+        else if (strcmp(argv[i], "--consensus") == 0)
+        {
+            context.cmd_args.consensus = (size_t) expect_arg_nonneg(i++, 2, CONSENSUS_MAX);
+        }
+        else if (strcmp(argv[i], "--trusted-resolvers") == 0)
+        {
+            expect_arg(i);
+            context.cmd_args.trusted_resolvers = argv[++i];
+        }
+        else if (strcmp(argv[i], "--trusted-rate") == 0)
+        {
+            context.cmd_args.trusted_rate = (size_t) expect_arg_nonneg(i++, 1, SIZE_MAX);
+        }
+        else if (strcmp(argv[i], "--wildcard") == 0)
+        {
+            context.cmd_args.wildcard = true;
+        }
+        else if (strcmp(argv[i], "--wildcard-skip") == 0)
+        {
+            context.cmd_args.wildcard = true;
+            context.cmd_args.wildcard_skip = true;
+        }
+        else if (strcmp(argv[i], "--wildcard-cache") == 0)
+        {
+            context.cmd_args.wildcard_cache_size = (size_t) expect_arg_nonneg(i++, 1, SIZE_MAX);
+        }
         else
         {
             if (context.cmd_args.domains == NULL)
@@ -2056,12 +5419,17 @@ int parse_cmd(int argc, char **argv)
         // https://lists.dns-oarc.net/pipermail/dns-operations/2013-January/009501.html
         log_msg("Note that DNS ANY scans might be unreliable.\n");
     }
+    if (context.cmd_args.rto_min_ms > context.cmd_args.rto_max_ms)
+    {
+        log_msg("The minimum retry interval must not exceed the maximum retry interval.\n");
+        clean_exit(EXIT_FAILURE);
+    }
     if (context.cmd_args.resolvers == NULL)
     {
         log_msg("Resolvers are required to be supplied.\n");
         clean_exit(EXIT_FAILURE);
     }
-    if (!domain_param)
+    if (!domain_param && !context.cmd_args.validate_resolvers)
     {
         if(!isatty(STDIN_FILENO))
         {
@@ -2074,6 +5442,67 @@ int parse_cmd(int argc, char **argv)
         }
     }
 
+    if(context.cmd_args.validate_resolvers && context.cmd_args.num_processes > 1)
+    {
+        log_msg("Resolver validation is only supported within a single process.\n");
+        clean_exit(EXIT_FAILURE);
+    }
+
+    if(context.cmd_args.validate_resolvers && context.cmd_args.trusted_resolvers)
+    {
+        log_msg("Resolver validation does not verify replies with trusted resolvers.\n");
+        clean_exit(EXIT_FAILURE);
+    }
+
+    if(context.cmd_args.consensus && (context.cmd_args.validate_resolvers || context.cmd_args.trusted_resolvers))
+    {
+        log_msg("Consensus mode can neither be combined with resolver validation nor with trusted resolvers.\n");
+        clean_exit(EXIT_FAILURE);
+    }
+
+    if(context.cmd_args.iterative
+       && (context.cmd_args.validate_resolvers || context.cmd_args.trusted_resolvers || context.cmd_args.consensus))
+    {
+        log_msg("Iterative mode can neither be combined with resolver validation, trusted resolvers nor consensus "
+                "mode.\n");
+        clean_exit(EXIT_FAILURE);
+    }
+
+    if((context.cmd_args.raw_prefix4.present || context.cmd_args.raw_prefix6.present)
+       && (size_t) context.cmd_args.raw_port_last - context.cmd_args.raw_port_first + 1 < context.cmd_args.num_processes)
+    {
+        log_msg("Raw transmit mode requires at least one source port per process.\n");
+        clean_exit(EXIT_FAILURE);
+    }
+
+    if(context.cmd_args.tcp && context.cmd_args.validate_resolvers)
+    {
+        log_msg("TCP mode cannot be combined with resolver validation.\n");
+        clean_exit(EXIT_FAILURE);
+    }
+
+    if(context.cmd_args.iterative)
+    {
+        // Delegations are kept within the answer cache and authoritative servers do not recurse.
+        context.cmd_args.norecurse = true;
+        if(context.cmd_args.cache_size == 0)
+        {
+            context.cmd_args.cache_size = ITERATIVE_CACHE_SIZE;
+        }
+    }
+
+    // The DO bit and cookies are carried by the OPT record.
+    if((context.cmd_args.dnssec_ok || context.cmd_args.cookies) && context.cmd_args.edns_size == 0)
+    {
+        context.cmd_args.edns_size = EDNS_DEFAULT_SIZE;
+    }
+
+    if(context.cmd_args.wildcard && context.cmd_args.hashmap_size < 2)
+    {
+        log_msg("Wildcard detection requires a hash map size of at least two.\n");
+        clean_exit(EXIT_FAILURE);
+    }
+
     if(context.domainfile == stdin && context.cmd_args.num_processes > 1)
     {
         log_msg("In order to use multiprocessing, the domain list needs to be supplied as file.\n");
@@ -20,6 +20,13 @@
 #include "hashmap.h"
 #include "dns.h"
 #include "timed_ring.h"
+#include "histogram.h"
+#include "lookup.h"
+#include "wildcard.h"
+#include "consensus.h"
+#include "cache.h"
+#include "tcp.h"
+#include "raw.h"
 
 #define MAXIMUM_MODULE_COUNT 0xFF
 #define COMMON_UNPRIVILEGED_USER "nobody"
@@ -47,22 +54,74 @@ typedef struct
     size_t qsent;
     size_t numreplies;
     size_t fakereplies; // used for resolver plausibility checks (wrong records)
+    size_t consensus_votes; // Replies that have been compared with the replies of other resolvers
+    size_t capacity; // Highest reply rate in replies per second observed during validation
+    size_t ratelimit_burst; // Smallest burst during validation for which replies were lost or refused, zero if none
 } resolver_stats_t;
 
-typedef struct {
-    size_t fork_index;
+typedef enum
+{
+    STATE_WARMUP, // Before the hash map size has been reached
+    STATE_QUERYING,
+    STATE_COOLDOWN,
+    STATE_WAIT_CHILDREN,
+    STATE_DONE
+} state_t;
+
+#define STATS_RCODES 0x10 // Number of response codes that fit into the header
+#define STATS_RTT_TRIES 8 // Number of tries with a separate latency histogram, the last one includes later tries
+
+// Counters of a single process within the statistics region shared between processes. Every process is the only
+// writer of its own slot, which is aligned to a cache line so that publishing does not interfere with other slots.
+typedef struct __attribute__((aligned(64)))
+{
     size_t numdomains;
+    size_t qsent;
     size_t numreplies;
     size_t finished;
     size_t finished_success;
     size_t mismatch_domain;
     size_t mismatch_id;
+    size_t inflight; // Lookups within the hash map
+    size_t pool_free; // Lookups left in the pool
+    size_t timers; // Occupied entries of the timed ring
+    size_t timer_bucket_max; // Occupied entries of the fullest bucket of the timed ring
     size_t timeouts[0x100];
-    size_t all_rcodes[5];
-    size_t final_rcodes[5];
+    size_t try_replies[0x100];
+    uint64_t try_rtt_sum[0x100];
+    histogram_t rtt;
+    histogram_t try_rtt[STATS_RTT_TRIES];
+    size_t all_rcodes[STATS_RCODES];
+    size_t final_rcodes[STATS_RCODES];
     size_t current_rate;
     size_t success_rate;
     size_t numparsed;
+    uint64_t state_cpu_user_us[STATE_DONE]; // CPU time spent in user mode by the state it has been spent in
+    uint64_t state_cpu_system_us[STATE_DONE];
+    size_t maxrss_kb; // Largest maximum resident set size of a single process
+    size_t maxrss_total_kb; // Sum of the maximum resident set sizes
+    wildcard_stats_t wildcard;
+    cache_stats_t cache;
+    size_t verify_started;
+    size_t verified;
+    size_t verify_rejected;
+    size_t verify_failed;
+    size_t consensus_decided;
+    size_t consensus_split;
+    size_t consensus_disagreements;
+    size_t iterative_referrals;
+    size_t iterative_lame;
+    size_t iterative_glueless;
+    size_t iterative_delayed;
+    size_t iterative_failed;
+    size_t edns_replies;
+    size_t edns_truncated;
+    size_t edns_fallbacks;
+    size_t edns_badcookie;
+    size_t tcp_fallbacks;
+    size_t tcp_replies;
+    size_t tcp_connections;
+    size_t tcp_failures;
     bool done;
 } stats_exchange_t;
 
@@ -70,22 +129,84 @@ typedef struct
 {
     struct sockaddr_storage address;
     resolver_stats_t stats; // To be used to track resolver bans or non-replying resolvers
+    size_t inflight; // Number of lookups currently assigned to this resolver
+    uint64_t rtt_ewma; // Exponentially weighted moving average of the round-trip time in nanoseconds
+    uint64_t srtt; // Smoothed round-trip time for the retransmission timeout (RFC 6298), zero without samples
+    uint64_t rttvar; // Round-trip time variation for the retransmission timeout
+    histogram_t rtt; // Round-trip times in microseconds
+    uint64_t next_ns; // Theoretical arrival time of the next query within the rate limit of an authoritative server
+    bool referenced; // Second chance within the clock eviction of authoritative servers
+    bool no_edns; // The resolver has rejected a query with an OPT record, so queries are sent without one
+    uint8_t cookie_len; // Length of the client cookie and the latest server cookie, zero before the first query
+    uint8_t cookie[DNS_COOKIE_MAX_SIZE];
+    bool no_tcp; // The resolver has refused a connection, so truncated replies are accepted
+    tcp_connection_t *tcp; // Pool of connections to the resolver
 } resolver_t;
 
-typedef struct
+#define VALIDATION_MAX_KNOWN 8 // Maximum number of known names probed during resolver validation
+#define VALIDATION_FIRST_BURST 8
+#define VALIDATION_MAX_BURST 128 // Largest burst of queries sent to a single resolver during validation
+#define VALIDATION_MAX_TRIES 3 // Transmissions of a correctness probe before it is considered to be lost
+
+typedef enum
 {
-    dns_name_t name;
-    dns_record_type type;
-} lookup_key_t;
+    VALIDATION_PENDING,
+    VALIDATION_CORRECTNESS, // Known names, NXDOMAIN names and the wildcard check
+    VALIDATION_BURST, // Bursts of increasing size until replies are lost or refused
+    VALIDATION_DONE
+} validation_phase_t;
 
 typedef struct
+{
+    resolver_t *resolver;
+    validation_phase_t phase;
+    bool active; // Whether probes of the current phase are in flight
+    bool replied; // Whether the resolver has replied to any probe
+    bool correct; // Whether all correctness probes have been answered as expected so far
+    uint64_t answers[VALIDATION_MAX_KNOWN]; // Hashes of the answer sets to the known names
+    unsigned char tries;
+    uint16_t base_id; // Transaction ID of the first probe of the current phase, probe i uses base_id + i
+    size_t probe_count; // Number of probes within the current phase
+    size_t outstanding; // Number of probes within the current phase that have not been answered
+    size_t burst; // Size of the current or next burst
+    size_t burst_failures; // Replies within the current burst with a response code other than NOERROR
+    uint64_t phase_start;
+    uint64_t last_reply;
+    void **ring_entry;
+    uint64_t sent_ns[VALIDATION_MAX_BURST];
+    bool answered[VALIDATION_MAX_BURST];
+} resolver_validation_t;
+
+typedef struct lookup
 {
     unsigned char tries;
     uint16_t transaction;
+    uint64_t sent_ns; // Monotonic time of the most recent transmission
+    uint64_t first_sent_ns; // Monotonic time of the first transmission to the current server, zero before it
     void **ring_entry; // pointer to the entry within the timed ring for entry invalidation
     resolver_t *resolver;
     lookup_key_t *key;
     socket_info_t *socket;
+    wildcard_zone_t *wildcard_probe; // Zone whose wildcard is probed by this lookup, NULL for regular lookups
+    struct lookup *wildcard_next; // Next lookup waiting for the same wildcard probe
+    bool verifying; // Whether a positive reply is being verified by the trusted resolvers
+    struct lookup *verify_next; // Next lookup waiting for the rate limit of the trusted resolvers
+    consensus_vote_t *votes; // Votes of the resolvers the name has been sent to in consensus mode
+    uint64_t majority; // Hash of the answer set of the majority once decided
+    uint8_t majority_rcode; // Response code of the majority once decided
+    uint8_t answered; // Number of votes that have been answered
+    bool decided; // Whether a majority has been reached and the result has been written
+    uint8_t zone_labels; // Labels of the zone whose server has been queried most recently in iterative mode
+    uint8_t referrals; // Referrals that have been followed in iterative mode
+    uint8_t iterative_depth; // Nesting of lookups of name servers without glue, zero for regular lookups
+    uint8_t glueless; // Name server lookups that have been started or joined on behalf of this lookup
+    bool iterative_child; // Whether this is a lookup of the address of a name server, which is not written
+    bool delayed; // Whether the timer of the lookup sends it instead of retrying, because of the rate limit
+    bool reserved; // Whether a delayed lookup holds a slot within the rate limit of its server
+    bool edns; // Whether the most recent transmission has carried an OPT record
+    bool tcp; // Whether the lookup is sent over TCP, because of TCP mode or because a reply has been truncated
+    struct lookup *iterative_waiting; // Lookups waiting for this name server lookup to finish
+    struct lookup *iterative_next; // Next lookup waiting for the same name server lookup
 } lookup_t;
 
 typedef struct
@@ -94,14 +215,37 @@ typedef struct
     lookup_t value;
 } lookup_entry_t;
 
-typedef enum
+#define TRUSTED_BURST_MS 10 // Queries to the trusted resolvers may be sent ahead of their rate by up to this time
+
+#define ITERATIVE_MAX_SERVERS 4096 // Authoritative servers whose rate limit and statistics are tracked at once
+#define ITERATIVE_MAX_CANDIDATES 16 // Addresses of a zone that are considered for a single query
+#define ITERATIVE_MAX_REFERRALS 16 // Referrals followed by a single lookup
+#define ITERATIVE_MAX_DEPTH 3 // Nesting of name server lookups for zones delegated without glue
+#define ITERATIVE_MAX_GLUELESS 4 // Name server lookups started or joined by a single lookup
+#define ITERATIVE_BURST_MS 10 // Queries to an authoritative server may be sent ahead of its rate by up to this time
+#define ITERATIVE_MAX_WAIT_MS 1000 // Queries are scheduled up to this time ahead of the rate limit of their server
+#define ITERATIVE_CACHE_SIZE 65536 // Record sets within the cache of delegations unless specified otherwise
+
+#define EDNS_DEFAULT_SIZE 1232 // UDP payload size that avoids IP fragmentation (DNS flag day 2020)
+
+#define TCP_MAX_CONNECTIONS 256 // Connections to all resolvers per process
+#define TCP_POOL_SIZE 2 // Connections to a single resolver unless specified otherwise
+#define TCP_PIPELINE_DEPTH 64 // Unanswered queries on a connection before another one to the same resolver is opened
+
+#define METRICS_MAX_CONNECTIONS 16
+#define METRICS_TIMEOUT_MS 10000 // Connections that have not been served within this time are closed
+
+typedef struct
 {
-    STATE_WARMUP, // Before the hash map size has been reached
-    STATE_QUERYING,
-    STATE_COOLDOWN,
-    STATE_WAIT_CHILDREN,
-    STATE_DONE
-} state_t;
+    socket_info_t info; // Registered with epoll, needs to be the first member
+    bool open;
+    char request[0x1000];
+    size_t request_len;
+    char *response;
+    size_t response_len;
+    size_t response_sent;
+    uint64_t accepted_ns;
+} metrics_connection_t;
 
 typedef enum
 {
@@ -117,6 +261,7 @@ typedef struct
 {
     buffer_t resolvers;
     lookup_entry_t *lookup_space;
+    consensus_vote_t *consensus_votes; // Votes of all lookups in consensus mode, in the order of the lookup space
     buffer_t lookup_pool;
     Hashmap *resolver_map;
 
@@ -169,29 +314,54 @@ typedef struct
         void (*help_function)();
         bool flush;
         bool predictable_resolver;
+        bool latency_aware;
+        bool adaptive_timeout;
+        unsigned int rto_min_ms;
+        unsigned int rto_max_ms;
+        char *resolver_stats;
+        bool resolver_stats_csv;
+        bool validate_resolvers;
+        char *metrics;
+        char *summary;
         bool use_pcap;
         size_t num_processes;
         size_t socket_count;
         bool busypoll;
+        bool wildcard;
+        bool wildcard_skip;
+        size_t wildcard_cache_size;
+        char *trusted_resolvers;
+        size_t trusted_rate;
+        size_t consensus; // Number of resolvers each name is sent to, zero if the consensus mode is disabled
+        size_t cache_size; // Number of record sets within the answer cache, zero if the cache is disabled
+        bool iterative;
+        size_t server_rate; // Queries per second to a single authoritative server in iterative mode, zero if unlimited
+        uint16_t edns_size; // UDP payload size advertised within the OPT record, zero if EDNS is disabled
+        bool dnssec_ok;
+        bool cookies;
+        bool tcp_fallback; // Whether truncated replies are repeated over TCP
+        bool tcp; // Whether all queries are sent over TCP
+        size_t tcp_connections; // Connections to a single resolver per process
+        raw_prefix_t raw_prefix4; // Source prefixes of the raw transmit mode
+        raw_prefix_t raw_prefix6;
+        uint16_t raw_port_first; // Source port range of the raw transmit mode
+        uint16_t raw_port_last;
     } cmd_args;
 
     struct
     {
         buffer_t interfaces4; // Sockets used for receiving queries
         buffer_t interfaces6; // Sockets used for receiving queries
-        int *pipes;
-        socket_info_t write_pipe;
-        socket_info_t *master_pipes_read;
     } sockets;
 
     // Processes
-    size_t finished;
     pid_t *pids;
-    bool *done;
 
     FILE* outfile;
     FILE* logfile;
     FILE* domainfile;
+    FILE* resolver_stats_file;
+    FILE* summary_file;
     ssize_t domainfile_size;
     int epollfd;
     Hashmap *map;
@@ -211,15 +381,96 @@ typedef struct
         struct timespec last_print;
         size_t current_rate;
         size_t success_rate;
+        size_t peak_rate; // Highest incoming rate of all processes in packets per second
+        size_t peak_success_rate;
+        uint64_t state_cpu_user_us[STATE_DONE];
+        uint64_t state_cpu_system_us[STATE_DONE];
+        uint64_t cpu_user_mark_us; // CPU time at the latest state transition
+        uint64_t cpu_system_mark_us;
         size_t timeouts[0x100];
+        size_t try_replies[0x100]; // Number of matched replies by the number of previous transmissions
+        uint64_t try_rtt_sum[0x100]; // Sum of reply latencies in nanoseconds since the first transmission
+        histogram_t rtt; // Round-trip times of matched replies to lookups that have not been retried in microseconds
+        histogram_t try_rtt[STATS_RTT_TRIES]; // Latencies since the first transmission by the number of previous tries
         size_t final_rcodes[0x10000];
         size_t all_rcodes[0x10000];
         size_t finished;
         size_t finished_success;
         size_t mismatch_id;
         size_t mismatch_domain;
+        size_t verify_started; // Positive replies that have been passed on to the trusted resolvers
+        size_t verified; // Verifications with a positive reply
+        size_t verify_rejected; // Verifications with a negative reply
+        size_t verify_failed; // Verifications without an acceptable reply
+        size_t consensus_decided; // Lookups whose result has been agreed on by a majority
+        size_t consensus_split; // Lookups without a majority
+        size_t consensus_disagreements; // Votes that differ from the majority
+        size_t iterative_referrals; // Referrals that have been followed
+        size_t iterative_lame; // Replies of servers that are not authoritative for the zone they have been asked for
+        size_t iterative_glueless; // Name server lookups for delegations without glue that have been started
+        size_t iterative_delayed; // Times queries have been held back by the rate limit of their server
+        size_t iterative_failed; // Lookups that have run out of servers to ask
+        size_t edns_replies; // Replies with an OPT record
+        size_t edns_truncated; // Replies with the TC bit set
+        size_t edns_fallbacks; // Resolvers that have rejected EDNS and are queried without it
+        size_t edns_badcookie; // Replies with the BADCOOKIE response code, which are retried with the new server cookie
+        size_t tcp_fallbacks; // Lookups that have been repeated over TCP because of a truncated reply
+        size_t tcp_replies;
+        size_t tcp_connections; // Connections that have been opened
+        size_t tcp_failures; // Connections that have been refused or closed with unanswered queries
     } stats;
-    stats_exchange_t *stat_messages;
+    stats_exchange_t *stat_messages; // Shared memory region with one slot per process
+    struct
+    {
+        bool listening;
+        socket_info_t listener;
+        char *unix_path; // Path of the listening Unix socket to be removed at exit
+        metrics_connection_t connections[METRICS_MAX_CONNECTIONS];
+    } metrics;
+    struct
+    {
+        resolver_validation_t *states; // One state per resolver, in the same order
+        size_t *queue; // Circular buffer of resolver indices waiting for the start of their next phase
+        size_t queue_head;
+        size_t queue_len;
+        size_t finished;
+        size_t usable;
+        size_t outstanding; // Number of probes in flight over all resolvers
+        dns_name_t probes[VALIDATION_MAX_KNOWN + 3]; // Known names followed by the NXDOMAIN and wildcard probes
+        size_t known_count;
+    } validation;
+    wildcard_cache_t wildcard;
+    cache_t cache;
+    struct
+    {
+        buffer_t resolvers; // Resolvers that positive replies are verified with
+        uint64_t interval_ns; // Interval between two queries to the trusted resolvers according to the rate limit
+        uint64_t next_ns; // Theoretical arrival time of the next query within the rate limit
+        lookup_t *queue_head; // Lookups waiting for the rate limit in order of their arrival
+        lookup_t *queue_tail;
+        bool drain_scheduled;
+    } trusted;
+    struct
+    {
+        buffer_t servers; // Authoritative servers learned from referrals, the starting servers are the resolvers
+        size_t hand; // Next server to be considered for eviction
+        Hashmap *index; // Servers by address
+        uint64_t interval_ns; // Interval between two queries to a single server according to the rate limit
+    } iterative;
+    struct
+    {
+        tcp_connection_t *connections; // Connections of all resolvers, closed ones are reused
+        size_t used; // Connections that have been opened at least once
+    } tcp;
+    struct
+    {
+        bool enabled;
+        int socket4; // Raw sockets for sending, negative if there is no source prefix for the address family
+        int socket6;
+        socket_info_t capture; // Packet socket receiving the replies unless pcap is used
+        raw_ring_t ring; // Receive ring of the packet socket if supported by the kernel
+        size_t port_count; // Source ports of this process, which are those congruent to the process index
+    } raw;
 #ifdef PCAP_SUPPORT
     pcap_t *pcap;
     char pcap_error[PCAP_ERRBUF_SIZE];
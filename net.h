@@ -24,7 +24,9 @@ typedef enum
 {
     SOCKET_TYPE_INTERFACE,
     SOCKET_TYPE_QUERY,
-    SOCKET_TYPE_CONTROL
+    SOCKET_TYPE_METRICS,
+    SOCKET_TYPE_TCP,
+    SOCKET_TYPE_CAPTURE
 } socket_type_t;
 
 typedef enum
@@ -0,0 +1,148 @@
+#ifndef MASSDNS_OUTPUT_H
+#define MASSDNS_OUTPUT_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "massdns.h"
+#include "string.h"
+#include "net.h"
+#include "dns.h"
+
+// Writes an accepted reply to the output file in the format selected by the command line. The question of the packet
+// has already been parsed, next points to the first record following the question section. Records are visited
+// without copying them and owner names are only decompressed for records that pass the filters.
+void output_packet(dns_head_t *head, uint8_t *offset, size_t len, uint8_t *next, struct sockaddr_storage *recvaddr,
+                   time_t now)
+{
+    static char json_buffer[0xFFFF];
+    static dns_name_t name;
+
+    uint16_t short_len = (uint16_t) len;
+    uint8_t *end = offset + len;
+    uint8_t *question_name = offset + DNS_HEADER_SIZE;
+    dns_record_iter_t iter;
+    dns_record_view_t rec;
+    dns_section_t section = DNS_SECTION_ANSWER;
+
+    switch(context.cmd_args.output)
+    {
+        case OUTPUT_BINARY:
+            // The output file is platform dependent for performance reasons.
+            fwrite(&now, sizeof(now), 1, context.outfile);
+            fwrite(recvaddr, sizeof(*recvaddr), 1, context.outfile);
+            fwrite(&short_len, sizeof(short_len), 1, context.outfile);
+            fwrite(offset, short_len, 1, context.outfile);
+            break;
+
+        case OUTPUT_TEXT_FULL: // Print packet similar to dig style
+            // Resolver and timestamp are not part of the packet, we therefore have to print it manually
+            fprintf(context.outfile, ";; Server: %s\n;; Size: %" PRIu16 "\n;; Unix time: %lu\n",
+                    sockaddr2str(recvaddr), short_len, now);
+            dns_print_packet(context.outfile, head, offset, len, next);
+            break;
+
+        case OUTPUT_NDJSON: // Only print records from answer section that match the query name (in ndjson)
+
+            dns_record_iter_init(&iter, offset, len, next, &head->header);
+            while(dns_record_iter_next(&iter, &rec) && dns_record_view_name(&iter, &rec, &name))
+            {
+                if(dns_record_view_is_opt(&rec))
+                {
+                    continue;
+                }
+                fprintf(context.outfile,
+                        "{\"query_name\":\"%s\",\"query_type\":\"%s\",",
+                        dns_name2str(&head->question.name),
+                        dns_record_type2str((dns_record_type) head->question.type));
+
+                json_escape(json_buffer, dns_record_view_data2str(&rec, offset, end), sizeof(json_buffer));
+
+                fprintf(context.outfile,
+                        "\"resp_name\":\"%s\",\"resp_type\":\"%s\",\"data\":\"%s\"}\n",
+                        dns_name2str(&name),
+                        dns_record_type2str((dns_record_type) rec.type),
+                        json_buffer);
+            }
+
+            break;
+
+        case OUTPUT_TEXT_SIMPLE: // Only print records from answer section that match the query name
+            if(context.format.print_question)
+            {
+                if(!context.format.include_meta)
+                {
+                    fprintf(context.outfile,
+                            "%s %s %s\n",
+                            dns_name2str(&head->question.name),
+                            context.format.ttl ? dns_class2str((dns_class) head->question.class) : "",
+                            dns_record_type2str((dns_record_type) head->question.type));
+                }
+                else
+                {
+                    fprintf(context.outfile,
+                            "%s %lu %s %s %s %s\n",
+                            sockaddr2str(recvaddr),
+                            now,
+                            dns_rcode2str((dns_rcode)head->header.rcode),
+                            dns_name2str(&head->question.name),
+                            context.format.ttl ? dns_class2str((dns_class) head->question.class) : "",
+                            dns_record_type2str((dns_record_type) head->question.type));
+                }
+            }
+            dns_record_iter_init(&iter, offset, len, next, &head->header);
+            while(dns_record_iter_next(&iter, &rec))
+            {
+                char *section_separator = "";
+                if(rec.section != section)
+                {
+                    // We are entering a new section
+                    if(context.format.separate_sections)
+                    {
+                        section_separator = "\n";
+                    }
+                    section = rec.section;
+                }
+
+                if(!context.format.sections[section] || dns_record_view_is_opt(&rec)
+                   || (context.format.match_name && !dns_wire_names_eq(offset, end, rec.name, question_name)))
+                {
+                    continue;
+                }
+                if(!dns_record_view_name(&iter, &rec, &name))
+                {
+                    break;
+                }
+                if(!context.format.ttl)
+                {
+                    fprintf(context.outfile,
+                            "%s%s%s %s %s\n",
+                            section_separator,
+                            context.format.indent_sections ? "\t" : "",
+                            dns_name2str(&name),
+                            dns_record_type2str((dns_record_type) rec.type),
+                            dns_record_view_data2str(&rec, offset, end));
+                }
+                else
+                {
+                    fprintf(context.outfile,
+                            "%s%s%s %s %" PRIu32 " %s %s\n",
+                            section_separator,
+                            context.format.indent_sections ? "\t" : "",
+                            dns_name2str(&name),
+                            dns_class2str((dns_class)rec.class),
+                            rec.ttl,
+                            dns_record_type2str((dns_record_type) rec.type),
+                            dns_record_view_data2str(&rec, offset, end));
+                }
+            }
+            if(context.format.separate_queries)
+            {
+                fprintf(context.outfile, "\n");
+            }
+            break;
+    }
+}
+
+#endif //MASSDNS_OUTPUT_H
@@ -0,0 +1,439 @@
+#ifndef MASSDNS_RAW_H
+#define MASSDNS_RAW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#ifdef __linux__
+    #include <sys/mman.h>
+    #include <linux/filter.h>
+    #include <linux/if_ether.h>
+    #include <linux/if_packet.h>
+#endif
+
+// Raw transmit mode: Queries are sent through raw IP sockets with IP and UDP headers that are built here, so that each
+// query leaves from a random address within a source prefix and a random port within a range. The kernel does not
+// deliver replies to these addresses and ports to any socket, they are captured from the interfaces instead, either by
+// a packet socket or by pcap. The packets are parsed here as well.
+//
+// On Linux, the packet socket hands the packets over through a TPACKET_V3 ring that is mapped into memory. The kernel
+// fills blocks of packets and passes a block on once it is full or has timed out, so that reading the replies does not
+// take a system call per packet. A BPF filter on the source ports of the process drops all other traffic within the
+// kernel. A packet socket without a ring is used on kernels that do not support it.
+
+#define RAW_HEADER_SPACE (sizeof(struct ip6_hdr) + sizeof(struct udphdr)) // Headers of a datagram at most
+#define RAW_CAPTURE_SIZE 0x10000 // A captured packet of maximum size including its IP header
+#define RAW_CAPTURE_BATCH 64 // Captured packets that are read per readiness event
+#define RAW_CAPTURE_BUFFER 0x800000 // Receive buffer size of the packet socket unless specified otherwise
+#define RAW_RING_BLOCK_SIZE 0x40000 // Size of a block of the ring, a multiple of the page size
+#define RAW_RING_BLOCKS 32
+#define RAW_RING_FRAME_SIZE 0x800 // Nominal frame size, TPACKET_V3 packs packets of variable size into the blocks
+#define RAW_RING_TIMEOUT_MS 2 // Time after which a block that is not full is passed on
+#define RAW_ETHER_HEADER_SIZE 14
+#define RAW_ETHERTYPE_VLAN 0x8100 // 802.1Q
+#define RAW_ETHERTYPE_QINQ 0x88A8 // 802.1ad, the outer tag of stacked VLAN tags
+#define RAW_VLAN_MAX_TAGS 2
+
+typedef struct
+{
+    bool present;
+    sa_family_t family;
+    uint8_t address[16]; // In network byte order, the bits behind the prefix length are zero
+    uint8_t length; // Prefix length in bits
+} raw_prefix_t;
+
+typedef void (*raw_packet_handler_t)(uint8_t *packet, size_t len);
+
+// Receive ring of a packet socket
+typedef struct
+{
+    uint8_t *map;
+    size_t block; // Block that is read next
+} raw_ring_t;
+
+// A UDP datagram within a captured packet
+typedef struct
+{
+    struct sockaddr_storage source;
+    uint8_t *destination; // Destination address within the packet
+    uint16_t destination_port;
+    uint8_t *payload;
+    size_t payload_len;
+} raw_datagram_t;
+
+static inline size_t raw_address_size(sa_family_t family)
+{
+    return family == AF_INET ? 4 : 16;
+}
+
+// Parses a prefix in the form address/length. A missing length denotes a single address.
+bool raw_prefix_parse(const char *str, raw_prefix_t *prefix)
+{
+    char address[INET6_ADDRSTRLEN];
+    const char *slash = strchr(str, '/');
+    size_t address_len = slash ? (size_t) (slash - str) : strlen(str);
+    if(address_len >= sizeof(address))
+    {
+        return false;
+    }
+    memcpy(address, str, address_len);
+    address[address_len] = 0;
+
+    bzero(prefix, sizeof(*prefix));
+    if(inet_pton(AF_INET, address, prefix->address) == 1)
+    {
+        prefix->family = AF_INET;
+    }
+    else if(inet_pton(AF_INET6, address, prefix->address) == 1)
+    {
+        prefix->family = AF_INET6;
+    }
+    else
+    {
+        return false;
+    }
+
+    unsigned long length = raw_address_size(prefix->family) * 8;
+    if(slash)
+    {
+        char *invalid_char;
+        length = strtoul(slash + 1, &invalid_char, 10);
+        if(slash[1] == 0 || *invalid_char != 0 || length > raw_address_size(prefix->family) * 8)
+        {
+            return false;
+        }
+    }
+    prefix->length = (uint8_t) length;
+    for(size_t i = 0; i < sizeof(prefix->address); i++)
+    {
+        size_t bits = i * 8 >= length ? 0 : length - i * 8;
+        prefix->address[i] &= bits >= 8 ? 0xFF : (uint8_t) (0xFF00 >> bits);
+    }
+    prefix->present = true;
+    return true;
+}
+
+// Fills the bits of the address behind the prefix from the random bytes, of which there are at least 16.
+void raw_prefix_pick(raw_prefix_t *prefix, const uint8_t *random, uint8_t *address)
+{
+    for(size_t i = 0; i < raw_address_size(prefix->family); i++)
+    {
+        size_t bits = i * 8 >= prefix->length ? 0 : prefix->length - i * 8;
+        uint8_t mask = bits >= 8 ? 0xFF : (uint8_t) (0xFF00 >> bits);
+        address[i] = prefix->address[i] | (random[i] & (uint8_t) ~mask);
+    }
+}
+
+bool raw_prefix_contains(raw_prefix_t *prefix, const uint8_t *address)
+{
+    for(size_t i = 0; i < raw_address_size(prefix->family); i++)
+    {
+        size_t bits = i * 8 >= prefix->length ? 0 : prefix->length - i * 8;
+        uint8_t mask = bits >= 8 ? 0xFF : (uint8_t) (0xFF00 >> bits);
+        if((address[i] & mask) != prefix->address[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Adds bytes to a one's complement sum of 16-bit words in network byte order.
+static inline uint32_t raw_checksum_add(uint32_t sum, const uint8_t *data, size_t len)
+{
+    for(size_t i = 0; i + 1 < len; i += 2)
+    {
+        sum += ((uint32_t) data[i] << 8) | data[i + 1];
+    }
+    if(len % 2 != 0)
+    {
+        sum += (uint32_t) data[len - 1] << 8;
+    }
+    return sum;
+}
+
+// Folds a sum into the checksum in network byte order.
+static inline uint16_t raw_checksum_finish(uint32_t sum)
+{
+    while(sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return htons((uint16_t) ~sum);
+}
+
+// Writes the IP and UDP headers for the payload from the source address and port to the destination followed by the
+// payload to the packet, which has room for RAW_HEADER_SPACE bytes plus the payload. Returns the length of the packet.
+size_t raw_packet_build(uint8_t *packet, const uint8_t *source, uint16_t source_port,
+                        struct sockaddr_storage *destination, const uint8_t *payload, size_t len)
+{
+    size_t ip_len;
+    uint32_t sum;
+    uint16_t udp_len = (uint16_t) (sizeof(struct udphdr) + len);
+
+    // The pseudo header of the UDP checksum consists of the addresses, the protocol and the UDP length.
+    if(destination->ss_family == AF_INET)
+    {
+        struct iphdr *ip = (struct iphdr *) packet;
+        ip_len = sizeof(*ip);
+        bzero(ip, sizeof(*ip));
+        ip->version = 4;
+        ip->ihl = sizeof(*ip) / 4;
+        ip->tot_len = htons((uint16_t) (ip_len + udp_len));
+        ip->ttl = 64;
+        ip->protocol = IPPROTO_UDP;
+        memcpy(&ip->saddr, source, 4);
+        memcpy(&ip->daddr, &((struct sockaddr_in *) destination)->sin_addr, 4);
+        ip->check = raw_checksum_finish(raw_checksum_add(0, packet, ip_len));
+        sum = raw_checksum_add(0, (uint8_t *) &ip->saddr, 8);
+    }
+    else
+    {
+        struct ip6_hdr *ip = (struct ip6_hdr *) packet;
+        ip_len = sizeof(*ip);
+        bzero(ip, sizeof(*ip));
+        ip->ip6_vfc = 6 << 4;
+        ip->ip6_plen = htons(udp_len);
+        ip->ip6_nxt = IPPROTO_UDP;
+        ip->ip6_hlim = 64;
+        memcpy(&ip->ip6_src, source, 16);
+        memcpy(&ip->ip6_dst, &((struct sockaddr_in6 *) destination)->sin6_addr, 16);
+        sum = raw_checksum_add(0, (uint8_t *) &ip->ip6_src, 32);
+    }
+    sum += IPPROTO_UDP + udp_len;
+
+    struct udphdr *udp = (struct udphdr *) (packet + ip_len);
+    udp->source = htons(source_port);
+    udp->dest = ((struct sockaddr_in *) destination)->sin_port; // The port is at the same offset for IPv6.
+    udp->len = htons(udp_len);
+    udp->check = 0;
+    memcpy(packet + ip_len + sizeof(*udp), payload, len);
+    sum = raw_checksum_add(sum, packet + ip_len, udp_len);
+    udp->check = raw_checksum_finish(sum);
+    if(udp->check == 0)
+    {
+        udp->check = 0xFFFF; // Zero denotes a missing checksum.
+    }
+    return ip_len + udp_len;
+}
+
+// Locates the UDP datagram within an IPv4 or IPv6 packet. Returns false for other protocols, fragments, IPv6 extension
+// headers and packets that are truncated.
+bool raw_packet_parse(uint8_t *packet, size_t len, raw_datagram_t *datagram)
+{
+    size_t ip_len;
+    if(len < 1)
+    {
+        return false;
+    }
+    if(packet[0] >> 4 == 4)
+    {
+        struct iphdr *ip = (struct iphdr *) packet;
+        ip_len = (size_t) ip->ihl * 4;
+        if(len < sizeof(*ip) || ip_len < sizeof(*ip) || ip->protocol != IPPROTO_UDP
+           || (ntohs(ip->frag_off) & (IP_MF | IP_OFFMASK)) != 0 || ntohs(ip->tot_len) > len)
+        {
+            return false;
+        }
+        len = ntohs(ip->tot_len); // Ethernet frames may be padded.
+        struct sockaddr_in *source = (struct sockaddr_in *) &datagram->source;
+        source->sin_family = AF_INET;
+        memcpy(&source->sin_addr, &ip->saddr, 4);
+        datagram->destination = (uint8_t *) &ip->daddr;
+    }
+    else if(packet[0] >> 4 == 6)
+    {
+        struct ip6_hdr *ip = (struct ip6_hdr *) packet;
+        ip_len = sizeof(*ip);
+        if(len < sizeof(*ip) || ip->ip6_nxt != IPPROTO_UDP || ip_len + ntohs(ip->ip6_plen) > len)
+        {
+            return false;
+        }
+        len = ip_len + ntohs(ip->ip6_plen);
+        struct sockaddr_in6 *source = (struct sockaddr_in6 *) &datagram->source;
+        bzero(source, sizeof(*source));
+        source->sin6_family = AF_INET6;
+        memcpy(&source->sin6_addr, &ip->ip6_src, 16);
+        datagram->destination = (uint8_t *) &ip->ip6_dst;
+    }
+    else
+    {
+        return false;
+    }
+
+    if(len < ip_len + sizeof(struct udphdr))
+    {
+        return false;
+    }
+    struct udphdr *udp = (struct udphdr *) (packet + ip_len);
+    size_t udp_len = ntohs(udp->len);
+    if(udp_len < sizeof(*udp) || ip_len + udp_len > len)
+    {
+        return false;
+    }
+    ((struct sockaddr_in *) &datagram->source)->sin_port = udp->source; // The port is at the same offset for IPv6.
+    datagram->destination_port = ntohs(udp->dest);
+    datagram->payload = (uint8_t *) udp + sizeof(*udp);
+    datagram->payload_len = udp_len - sizeof(*udp);
+    return true;
+}
+
+// Skips the Ethernet header of a frame including up to two VLAN tags. Returns the packet behind it and sets its ether
+// type in network byte order, or returns NULL if the frame is truncated.
+uint8_t *raw_frame_strip(uint8_t *frame, size_t *len, uint16_t *ether_type)
+{
+    size_t offset = RAW_ETHER_HEADER_SIZE - 2;
+    for(size_t tags = 0; ; tags++)
+    {
+        if(*len < offset + 2)
+        {
+            return NULL;
+        }
+        memcpy(ether_type, frame + offset, 2);
+        offset += 2;
+        if((*ether_type != htons(RAW_ETHERTYPE_VLAN) && *ether_type != htons(RAW_ETHERTYPE_QINQ))
+           || tags == RAW_VLAN_MAX_TAGS)
+        {
+            break;
+        }
+        offset += 2; // The tag control information precedes the ether type of the encapsulated frame.
+    }
+    *len -= offset;
+    return frame + offset;
+}
+
+// Opens a raw socket for sending packets with headers that have been built by raw_packet_build.
+int raw_socket_open(sa_family_t family)
+{
+    int fd = socket(family, SOCK_RAW, IPPROTO_RAW);
+    if(fd >= 0 && family == AF_INET)
+    {
+        int enable = 1;
+        setsockopt(fd, IPPROTO_IP, IP_HDRINCL, &enable, sizeof(enable));
+    }
+    return fd;
+}
+
+#ifdef __linux__
+// Opens a packet socket that receives the IP packets of all interfaces without their link-layer headers. VLAN tags
+// have already been removed by the kernel.
+int raw_capture_open()
+{
+    return socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_ALL));
+}
+
+// Attaches a filter that only accepts incoming UDP datagrams that are not fragmented and whose destination port is
+// within the range and congruent to the remainder modulo the modulus, relative to the first port of the range.
+bool raw_capture_filter(int fd, uint16_t first, uint16_t last, uint16_t modulus, uint16_t remainder)
+{
+    // Offsets of the packet are relative to the network header for packet sockets of type SOCK_DGRAM.
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 20, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xF0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x60, 8, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x40, 0, 16),
+        // IPv4: The destination port follows the options.
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 14),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, IP_MF | IP_OFFMASK, 12, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),
+        BPF_STMT(BPF_JMP | BPF_JA, 3),
+        // IPv6: Extension headers are not supported.
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 7),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, sizeof(struct ip6_hdr) + 2),
+        // Destination port
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, first, 0, 5),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, last, 4, 0),
+        BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, first),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, modulus),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, remainder, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, RAW_CAPTURE_SIZE),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog program = {.len = sizeof(code) / sizeof(*code), .filter = code};
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) == 0;
+}
+
+// Switches the packet socket to TPACKET_V3 and maps its receive ring. Returns false if the kernel does not support it,
+// in which case the socket remains usable without a ring.
+bool raw_ring_setup(int fd, raw_ring_t *ring)
+{
+    int version = TPACKET_V3;
+    if(setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0)
+    {
+        return false;
+    }
+    struct tpacket_req3 request;
+    bzero(&request, sizeof(request));
+    request.tp_block_size = RAW_RING_BLOCK_SIZE;
+    request.tp_block_nr = RAW_RING_BLOCKS;
+    request.tp_frame_size = RAW_RING_FRAME_SIZE;
+    request.tp_frame_nr = RAW_RING_BLOCK_SIZE / RAW_RING_FRAME_SIZE * RAW_RING_BLOCKS;
+    request.tp_retire_blk_tov = RAW_RING_TIMEOUT_MS;
+    if(setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &request, sizeof(request)) != 0)
+    {
+        version = TPACKET_V1;
+        setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version));
+        return false;
+    }
+    void *map = mmap(NULL, (size_t) RAW_RING_BLOCK_SIZE * RAW_RING_BLOCKS, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        return false;
+    }
+    ring->map = map;
+    ring->block = 0;
+    return true;
+}
+
+void raw_ring_free(raw_ring_t *ring)
+{
+    if(ring->map != NULL)
+    {
+        munmap(ring->map, (size_t) RAW_RING_BLOCK_SIZE * RAW_RING_BLOCKS);
+        ring->map = NULL;
+    }
+}
+
+// Passes the packets of the blocks that the kernel has passed on to the handler and returns the blocks to the kernel.
+// Returns the number of packets.
+size_t raw_ring_read(raw_ring_t *ring, raw_packet_handler_t handler)
+{
+    size_t packets = 0;
+    for(size_t i = 0; i < RAW_RING_BLOCKS; i++)
+    {
+        struct tpacket_block_desc *block = (struct tpacket_block_desc *) (ring->map
+                                                                          + ring->block * RAW_RING_BLOCK_SIZE);
+        if((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+        {
+            break;
+        }
+        uint8_t *frame = (uint8_t *) block + block->hdr.bh1.offset_to_first_pkt;
+        for(uint32_t j = 0; j < block->hdr.bh1.num_pkts; j++)
+        {
+            struct tpacket3_hdr *header = (struct tpacket3_hdr *) frame;
+            handler(frame + header->tp_net, header->tp_snaplen);
+            frame += header->tp_next_offset;
+        }
+        packets += block->hdr.bh1.num_pkts;
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        ring->block = (ring->block + 1) % RAW_RING_BLOCKS;
+    }
+    return packets;
+}
+#endif
+
+#endif //MASSDNS_RAW_H
@@ -0,0 +1,230 @@
+#ifndef MASSDNS_TCP_H
+#define MASSDNS_TCP_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "net.h"
+#include "security.h"
+
+// DNS over TCP (RFC 7766): Every message is preceded by its length as a two-byte integer in network byte order.
+// Connections are nonblocking and pipelined, several queries are written without waiting for their replies and replies
+// may arrive in any order, so they are matched by their question and transaction ID like replies over UDP. Connection
+// objects are never freed while resolving, a closed connection only releases its descriptor and may be reused.
+
+#define TCP_RECEIVE_SIZE 0x20000 // Received bytes that are buffered, which is at least one message of maximum size
+
+typedef enum
+{
+    TCP_CLOSED,
+    TCP_CONNECTING,
+    TCP_OPEN
+} tcp_state_t;
+
+typedef struct tcp_connection
+{
+    socket_info_t info; // Registered with epoll, needs to be the first member
+    tcp_state_t state;
+    void *owner; // Resolver the connection belongs to
+    struct tcp_connection *next; // Next connection of the same owner
+    size_t pending; // Queries that have been queued and not been answered yet
+    bool watching_writes; // Whether the descriptor is registered for EPOLLOUT
+    bool established; // Whether the connection has been established, which tells refused connections apart
+    uint32_t generation; // Incremented whenever the connection object is reused
+    uint8_t *out; // Queued messages including their length prefixes
+    size_t out_len;
+    size_t out_sent; // Bytes at the beginning of the output buffer that have been written
+    size_t out_capacity;
+    uint8_t *in;
+    size_t in_len;
+} tcp_connection_t;
+
+typedef void (*tcp_message_handler_t)(tcp_connection_t *connection, uint8_t *message, size_t len);
+
+// Starts a nonblocking connection to the address. Returns false if the connection has failed right away.
+bool tcp_connection_open(tcp_connection_t *connection, struct sockaddr_storage *address)
+{
+    int fd = socket(address->ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if(fd < 0)
+    {
+        return false;
+    }
+    connection->info.descriptor = fd;
+    connection->info.type = SOCKET_TYPE_TCP;
+    connection->info.protocol = address->ss_family == AF_INET ? PROTO_IPV4 : PROTO_IPV6;
+    socket_noblock(&connection->info);
+
+    // Queries are written in batches by the caller, which are not to be delayed any further.
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    if(connection->in == NULL)
+    {
+        connection->in = safe_malloc(TCP_RECEIVE_SIZE);
+    }
+    connection->state = TCP_CONNECTING;
+    connection->generation++;
+    connection->pending = 0;
+    connection->watching_writes = false;
+    connection->established = false;
+    connection->out_len = 0;
+    connection->out_sent = 0;
+    connection->in_len = 0;
+    if(connect(fd, (struct sockaddr *) address, sockaddr_storage_size(address)) == 0)
+    {
+        connection->state = TCP_OPEN;
+        connection->established = true;
+    }
+    else if(errno != EINPROGRESS)
+    {
+        close(fd);
+        connection->state = TCP_CLOSED;
+        return false;
+    }
+    return true;
+}
+
+// Releases the descriptor. The buffers are kept, as the connection may be closed while its messages are handled.
+void tcp_connection_close(tcp_connection_t *connection)
+{
+    if(connection->state == TCP_CLOSED)
+    {
+        return;
+    }
+    close(connection->info.descriptor);
+    connection->state = TCP_CLOSED;
+    connection->pending = 0;
+    connection->out_len = 0;
+    connection->out_sent = 0;
+    connection->in_len = 0;
+}
+
+void tcp_connection_free(tcp_connection_t *connection)
+{
+    tcp_connection_close(connection);
+    free(connection->in);
+    free(connection->out);
+    connection->in = NULL;
+    connection->out = NULL;
+    connection->out_capacity = 0;
+}
+
+// Completes a connection that is in progress. Returns false if it has failed, it remains in progress until the peer
+// has accepted it.
+bool tcp_connection_finish(tcp_connection_t *connection)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if(getsockopt(connection->info.descriptor, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0)
+    {
+        return false;
+    }
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    if(getpeername(connection->info.descriptor, (struct sockaddr *) &peer, &peer_len) != 0)
+    {
+        return errno == ENOTCONN;
+    }
+    connection->state = TCP_OPEN;
+    connection->established = true;
+    return true;
+}
+
+// Appends a message to the output buffer, prefixed by its length.
+void tcp_connection_queue(tcp_connection_t *connection, uint8_t *message, size_t len)
+{
+    // Written bytes are dropped from the buffer before it is grown.
+    if(connection->out_len + 2 + len > connection->out_capacity && connection->out_sent > 0)
+    {
+        memmove(connection->out, connection->out + connection->out_sent, connection->out_len - connection->out_sent);
+        connection->out_len -= connection->out_sent;
+        connection->out_sent = 0;
+    }
+    if(connection->out_len + 2 + len > connection->out_capacity)
+    {
+        connection->out_capacity = 2 * (connection->out_len + 2 + len);
+        connection->out = safe_realloc(connection->out, connection->out_capacity);
+    }
+    connection->out[connection->out_len] = (uint8_t) (len >> 8);
+    connection->out[connection->out_len + 1] = (uint8_t) len;
+    memcpy(connection->out + connection->out_len + 2, message, len);
+    connection->out_len += 2 + len;
+    connection->pending++;
+}
+
+// Writes as much of the output buffer as the socket accepts. Returns false if the connection has failed.
+bool tcp_connection_flush(tcp_connection_t *connection)
+{
+    while(connection->out_sent < connection->out_len)
+    {
+        ssize_t sent = send(connection->info.descriptor, connection->out + connection->out_sent,
+                            connection->out_len - connection->out_sent, MSG_NOSIGNAL);
+        if(sent < 0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        connection->out_sent += (size_t) sent;
+    }
+    connection->out_len = 0;
+    connection->out_sent = 0;
+    return true;
+}
+
+// Whether queued messages are waiting for the socket to become writable
+static inline bool tcp_connection_blocked(tcp_connection_t *connection)
+{
+    return connection->state == TCP_CONNECTING || connection->out_sent < connection->out_len;
+}
+
+// Reads the available bytes and passes every complete message to the handler, which may close the connection. Returns
+// false if the peer has closed the connection or if it has failed, in which case it is to be closed by the caller.
+bool tcp_connection_receive(tcp_connection_t *connection, tcp_message_handler_t handler)
+{
+    uint32_t generation = connection->generation;
+    while(connection->state == TCP_OPEN)
+    {
+        ssize_t received = recv(connection->info.descriptor, connection->in + connection->in_len,
+                                TCP_RECEIVE_SIZE - connection->in_len, 0);
+        if(received == 0)
+        {
+            return false;
+        }
+        if(received < 0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        connection->in_len += (size_t) received;
+
+        size_t offset = 0;
+        while(connection->in_len - offset >= 2)
+        {
+            size_t len = ((size_t) connection->in[offset] << 8) | connection->in[offset + 1];
+            if(connection->in_len - offset - 2 < len)
+            {
+                break;
+            }
+            if(connection->pending > 0)
+            {
+                connection->pending--;
+            }
+            handler(connection, connection->in + offset + 2, len);
+            if(connection->state != TCP_OPEN || connection->generation != generation)
+            {
+                return true; // The connection has been closed and possibly been reused by the handler.
+            }
+            offset += 2 + len;
+        }
+        memmove(connection->in, connection->in + offset, connection->in_len - offset);
+        connection->in_len -= offset;
+    }
+    return true;
+}
+
+#endif //MASSDNS_TCP_H
@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+
+# End-to-end throughput benchmark: Runs bin/massdns against bin/responder on loopback for every combination of the
+# supplied parameters and writes a CSV report, which can be compared against the report of a previous build.
+
+import argparse
+import csv
+import itertools
+import json
+import os
+import platform
+import statistics
+import subprocess
+import sys
+import time
+
+DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(DIR)
+KEYS = ["names", "engine", "processes", "hashmap_size", "output"]
+COLUMNS = KEYS + ["wall_s", "qps", "peak_qps", "success_rate", "cpu_us_per_query", "maxrss_kb"]
+
+
+def split_list(value, convert=str):
+	return [convert(x) for x in value.split(",") if x != ""]
+
+
+def generate_names(workdir, count):
+	path = os.path.join(workdir, "names-%d.txt" % count)
+	if os.path.exists(path):
+		return path
+	words = [line.strip() for line in open(os.path.join(ROOT, "lists", "names.txt")) if line.strip() != ""]
+	with open(path + ".tmp", "w") as f:
+		written = 0
+		for zone in itertools.count():
+			for word in words:
+				if written >= count:
+					break
+				f.write("%s.zone%d.example\n" % (word, zone))
+				written += 1
+			if written >= count:
+				break
+	os.rename(path + ".tmp", path)
+	return path
+
+
+def run_massdns(args, workdir, resolvers, names_file, engine, processes, hashmap_size, output):
+	summary = os.path.join(workdir, "summary.json")
+	outfile = os.path.join(workdir, "out")
+	cmd = [args.massdns, "-q", "-r", resolvers, "-o", output, "-w", outfile, "-s", str(hashmap_size),
+		"--processes", str(processes), "--summary", summary]
+	if engine == "busy-poll":
+		cmd.append("--busy-poll")
+	if os.geteuid() == 0:
+		cmd.append("--root")
+	cmd += args.massdns_args.split()
+	cmd.append(names_file)
+	subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+
+	for name in os.listdir(workdir):
+		if name.startswith("out"):
+			os.unlink(os.path.join(workdir, name))
+	with open(summary) as f:
+		result = json.load(f)
+	os.unlink(summary)
+
+	cpu = result["cpu_s"]["total"]["user"] + result["cpu_s"]["total"]["system"]
+	return {
+		"wall_s": result["wall_time_s"],
+		"qps": result["average_pps"],
+		"peak_qps": result["peak_pps"],
+		"success_rate": result["success_rate"],
+		"cpu_us_per_query": cpu * 1000000 / max(result["queries"], 1),
+		"maxrss_kb": result["maxrss_total_kb"],
+	}
+
+
+def benchmark(args):
+	os.makedirs(args.workdir, exist_ok=True)
+	resolvers = os.path.join(args.workdir, "resolvers.txt")
+	with open(resolvers, "w") as f:
+		f.write("127.0.0.1:%d\n" % args.port)
+
+	responder = subprocess.Popen([args.responder, "-q", "-b", "127.0.0.1:%d" % args.port,
+		"--processes", str(args.responder_processes)] + args.responder_args.split())
+	time.sleep(0.5)
+	if responder.poll() is not None:
+		sys.exit("The responder failed to start.")
+
+	rows = []
+	try:
+		for names in split_list(args.names, int):
+			names_file = generate_names(args.workdir, names)
+			for engine, processes, hashmap_size, output in itertools.product(split_list(args.engines),
+					split_list(args.processes, int), split_list(args.hashmap_sizes, int), split_list(args.outputs)):
+				runs = [run_massdns(args, args.workdir, resolvers, names_file, engine, processes, hashmap_size,
+					output) for _ in range(args.repeat)]
+				# The median of each value is reported to reduce the influence of outliers
+				row = {"names": names, "engine": engine, "processes": processes, "hashmap_size": hashmap_size,
+					"output": output}
+				for column in COLUMNS[len(KEYS):]:
+					row[column] = statistics.median(run[column] for run in runs)
+				rows.append(row)
+				print_row(row)
+	finally:
+		responder.terminate()
+		responder.wait()
+	return rows
+
+
+def print_row(row):
+	print("%9s names, %-9s %2s proc., -s %-7s -o %-3s: %10.0f qps (peak %8.0f), success %6.2f%%, "
+		"%7.2f us CPU/query, %8d KiB, %7.2f s" % (row["names"], row["engine"], row["processes"],
+		row["hashmap_size"], row["output"], row["qps"], row["peak_qps"], row["success_rate"] * 100,
+		row["cpu_us_per_query"], row["maxrss_kb"], row["wall_s"]))
+	sys.stdout.flush()
+
+
+def write_report(path, rows):
+	revision = subprocess.run(["git", "-C", ROOT, "describe", "--always", "--dirty"], stdout=subprocess.PIPE,
+		stderr=subprocess.DEVNULL, universal_newlines=True).stdout.strip()
+	with open(path, "w") as f:
+		f.write("# revision: %s, host: %s, kernel: %s, cpus: %d\n" % (revision or "unknown", platform.node(),
+			platform.release(), os.cpu_count()))
+		writer = csv.DictWriter(f, fieldnames=COLUMNS)
+		writer.writeheader()
+		writer.writerows(rows)
+
+
+def read_report(path):
+	with open(path) as f:
+		return list(csv.DictReader(line for line in f if not line.startswith("#")))
+
+
+# Compare the throughput and CPU time per query with a baseline report. Returns whether a regression was found.
+def compare(baseline_path, rows, threshold):
+	baseline = {tuple(str(row[key]) for key in KEYS): row for row in read_report(baseline_path)}
+	regression = False
+	print("\nComparison with %s:" % baseline_path)
+	for row in rows:
+		old = baseline.get(tuple(str(row[key]) for key in KEYS))
+		if old is None:
+			continue
+		qps_change = (float(row["qps"]) / max(float(old["qps"]), 1e-9) - 1) * 100
+		cpu_change = (float(row["cpu_us_per_query"]) / max(float(old["cpu_us_per_query"]), 1e-9) - 1) * 100
+		worse = qps_change < -threshold or cpu_change > threshold
+		regression = regression or worse
+		print("%9s names, %-9s %2s proc., -s %-7s -o %-3s: qps %+7.2f%%, CPU/query %+7.2f%%%s" % (row["names"],
+			row["engine"], row["processes"], row["hashmap_size"], row["output"], qps_change, cpu_change,
+			"  REGRESSION" if worse else ""))
+	return regression
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Benchmark massdns against the local responder.")
+	parser.add_argument("--names", default="1000000", help="Comma-separated numbers of names to resolve.")
+	parser.add_argument("--engines", default="epoll,busy-poll", help="Comma-separated engines: epoll, busy-poll.")
+	parser.add_argument("--processes", default="1,2", help="Comma-separated values for --processes.")
+	parser.add_argument("--hashmap-sizes", default="10000,100000", help="Comma-separated values for -s.")
+	parser.add_argument("--outputs", default="S,J", help="Comma-separated output flags for -o.")
+	parser.add_argument("--repeat", type=int, default=1, help="Runs per combination, the median is reported.")
+	parser.add_argument("--massdns-args", default="", help="Additional arguments for massdns.")
+	parser.add_argument("--responder-processes", type=int, default=max(1, (os.cpu_count() or 2) // 2))
+	parser.add_argument("--responder-args", default="", help="Additional arguments for the responder.")
+	parser.add_argument("--port", type=int, default=5399)
+	parser.add_argument("--massdns", default=os.path.join(ROOT, "bin", "massdns"))
+	parser.add_argument("--responder", default=os.path.join(ROOT, "bin", "responder"))
+	parser.add_argument("--workdir", default=os.path.join("/tmp", "massdns-benchmark"),
+		help="Directory for the generated name lists and temporary output.")
+	parser.add_argument("--report", default="benchmark.csv", help="Path of the CSV report to be written.")
+	parser.add_argument("--compare", help="Report of a previous build to compare the results with.")
+	parser.add_argument("--threshold", type=float, default=5,
+		help="Percentage by which qps may drop or CPU time per query may rise before a regression is reported.")
+	args = parser.parse_args()
+
+	rows = benchmark(args)
+	write_report(args.report, rows)
+	print("Report written to %s." % args.report)
+	if args.compare and compare(args.compare, rows, args.threshold):
+		sys.exit(1)
+
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,35 @@
+// Fuzz target for the answer cache. The reply is stored like an accepted reply and its question is answered from the
+// cache afterwards, which follows the CNAME records that have just been stored.
+
+#define _GNU_SOURCE
+
+#include "../../massdns.h"
+#include "fuzz.h"
+
+static cache_t cache;
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static dns_head_t head;
+    static uint8_t answer[0x1000];
+    uint8_t name[0xFF];
+    uint8_t *buf = fuzz_copy(data, size);
+    uint8_t *body;
+
+    if(cache.index == NULL && !cache_init(&cache, 64))
+    {
+        abort();
+    }
+
+    if(dns_parse_question(buf, size, &head, &body))
+    {
+        cache_store(&cache, &head, buf, size, body);
+        size_t name_len = dns_wire_name_expand(buf, buf + size, buf + DNS_HEADER_SIZE, name, NULL);
+        if(name_len > 0)
+        {
+            cache_answer(&cache, name, name_len, head.question.type, true, answer, sizeof(answer));
+        }
+    }
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,70 @@
+// Common driver of the fuzz targets. With -DFUZZ_LIBFUZZER, libFuzzer supplies the main function and calls
+// LLVMFuzzerTestOneInput directly. Otherwise, every file passed on the command line, or the standard input if there is
+// none, is passed to the target once, which is how AFL runs the targets and how crashes and the seed corpus are
+// replayed with any compiler.
+
+#ifndef MASSDNS_FUZZ_H
+#define MASSDNS_FUZZ_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_MAX_INPUT 0x10000 // Largest DNS message over UDP or TCP
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+// Copies the input into a buffer of exactly the input size, so that the sanitizers catch reads past the packet end.
+static uint8_t *fuzz_copy(const uint8_t *data, size_t size)
+{
+    uint8_t *copy = malloc(size > 0 ? size : 1);
+    if(copy == NULL)
+    {
+        abort();
+    }
+    memcpy(copy, data, size);
+    return copy;
+}
+
+#ifndef FUZZ_LIBFUZZER
+static uint8_t fuzz_input[FUZZ_MAX_INPUT];
+
+static int fuzz_run_file(FILE *f, const char *name)
+{
+    size_t size = fread(fuzz_input, 1, sizeof(fuzz_input), f);
+    if(ferror(f))
+    {
+        fprintf(stderr, "Failed to read %s.\n", name);
+        return 1;
+    }
+    LLVMFuzzerTestOneInput(fuzz_input, size);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2)
+    {
+        return fuzz_run_file(stdin, "standard input");
+    }
+    for(int i = 1; i < argc; i++)
+    {
+        FILE *f = fopen(argv[i], "rb");
+        if(f == NULL)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+        int result = fuzz_run_file(f, argv[i]);
+        fclose(f);
+        if(result != 0)
+        {
+            return result;
+        }
+    }
+    return 0;
+}
+#endif
+
+#endif //MASSDNS_FUZZ_H
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+
+# Writes the seed corpus of the fuzz targets: Replies of common shapes to corpus/packets and the same replies prefixed
+# with an output format selector to corpus/output.
+
+import os
+import struct
+
+DIR = os.path.dirname(os.path.abspath(__file__))
+QNAME_OFFSET = 12
+TYPES = {"A": 1, "NS": 2, "CNAME": 5, "SOA": 6, "PTR": 12, "MX": 15, "TXT": 16, "AAAA": 28, "SRV": 33, "DNAME": 39,
+	"CAA": 257}
+RCODES = {"NOERROR": 0, "SERVFAIL": 2, "NXDOMAIN": 3, "REFUSED": 5}
+
+# Output format selectors of the output target: -o S, -o F, -o J, -o B, and -o S with all sections, TTLs, separators
+# and the question with meta information.
+OUTPUT_FLAGS = [0x00, 0x01, 0x02, 0x03, 0xF8]
+
+
+def name(text):
+	if text == ".":
+		return b"\x00"
+	return b"".join(bytes([len(label)]) + label.encode() for label in text.rstrip(".").split(".")) + b"\x00"
+
+
+def pointer(offset):
+	return struct.pack("!H", 0xC000 | offset)
+
+
+def record(owner, rtype, data, ttl=300):
+	return owner + struct.pack("!HHIH", TYPES[rtype], 1, ttl, len(data)) + data
+
+
+def reply(qname, qtype, answers=(), authority=(), additional=(), rcode="NOERROR"):
+	header = struct.pack("!HHHHHH", 0x1234, 0x8180 | RCODES[rcode], 1, len(answers), len(authority), len(additional))
+	question = name(qname) + struct.pack("!HH", TYPES[qtype], 1)
+	return header + question + b"".join(answers) + b"".join(authority) + b"".join(additional)
+
+
+def soa(mname, rname):
+	return mname + rname + struct.pack("!IIIII", 2024010101, 7200, 3600, 1209600, 300)
+
+
+def txt(*strings):
+	return b"".join(bytes([len(s)]) + s for s in strings)
+
+
+def packets():
+	q = pointer(QNAME_OFFSET)
+	yield "a", reply("www.example.com", "A", [record(q, "A", bytes([192, 0, 2, 1]))])
+	yield "a-multiple", reply("www.example.com", "A", [record(q, "A", bytes([192, 0, 2, i])) for i in range(1, 5)])
+	yield "aaaa", reply("www.example.com", "AAAA", [record(q, "AAAA", bytes.fromhex("20010db8" + "00" * 11 + "01")),
+		record(q, "AAAA", bytes.fromhex("20010db8" + "00" * 11 + "02"))])
+	yield "cname", reply("www.example.com", "A", [record(q, "CNAME", name("cdn.example.net")),
+		record(name("cdn.example.net"), "A", bytes([198, 51, 100, 7]))])
+	yield "cname-compressed", reply("www.example.com", "A", [record(q, "CNAME", b"\x03cdn" + pointer(16)),
+		record(pointer(45), "A", bytes([198, 51, 100, 7]))])
+	yield "nxdomain", reply("nonexistent.example.com", "A", authority=[record(pointer(24), "SOA",
+		soa(b"\x03ns1" + pointer(24), b"\x0ahostmaster" + pointer(24)))], rcode="NXDOMAIN")
+	yield "servfail", reply("www.example.com", "A", rcode="SERVFAIL")
+	yield "refused", reply("www.example.com", "A", rcode="REFUSED")
+	yield "mx", reply("example.com", "MX", [record(q, "MX", struct.pack("!H", 10) + b"\x04mail" + q),
+		record(q, "MX", struct.pack("!H", 20) + name("backup.example.net"))])
+	yield "txt", reply("example.com", "TXT", [record(q, "TXT", txt(b"v=spf1 -all")),
+		record(q, "TXT", txt(b"\"quoted\" \\ and \x01 binary", b"second string"))])
+	yield "ns-glue", reply("example.com", "NS", [record(q, "NS", b"\x03ns1" + q), record(q, "NS", b"\x03ns2" + q)],
+		additional=[record(pointer(41), "A", bytes([192, 0, 2, 53])), record(pointer(59), "A", bytes([192, 0, 2, 54]))])
+	yield "delegation", reply("www.example.com", "A", authority=[record(pointer(16), "NS", name("a.iana-servers.net"))],
+		additional=[record(pointer(45), "AAAA", bytes(16))])
+	yield "ptr", reply("1.2.0.192.in-addr.arpa", "PTR", [record(q, "PTR", name("host.example.com"))])
+	yield "srv", reply("_sip._udp.example.com", "SRV", [record(q, "SRV", struct.pack("!HHH", 10, 60, 5060) +
+		name("sip.example.com"))])
+	yield "dname", reply("www.example.org", "A", [record(pointer(16), "DNAME", name("example.net"))])
+	yield "caa", reply("example.com", "CAA", [record(q, "CAA", b"\x00\x05issue" + b"letsencrypt.org"),
+		record(q, "CAA", b"\x80\x05iodef" + b"mailto:security@example.com")])
+	yield "root", reply(".", "NS", [record(b"\x00", "NS", name("a.root-servers.net"))])
+	# Inputs that used to read past the packet: A compression pointer cut off by the packet end and an SOA record
+	# whose name cannot be parsed.
+	yield "truncated-pointer", reply("www.example.com", "A", [b"\xc0"])
+	yield "soa-invalid-name", reply("example.com", "SOA", [record(q, "SOA", soa(pointer(0x3FFF), pointer(12)))])
+	yield "long-name", reply(".".join(["a" * 63] * 3) + "." + "b" * 60, "A", [record(q, "A", bytes(4))])
+	# A CNAME record with bytes behind its target name, whose length used to be taken as the length of the target name
+	# when the cache followed the CNAME record.
+	yield "cname-trailing", reply("www.example.com", "A", [record(q, "CNAME", name("cdn.example.net") + bytes(0x1C0))])
+
+
+def write(path, data):
+	with open(path, "wb") as f:
+		f.write(data)
+
+
+def main():
+	for directory in ["packets", "output"]:
+		os.makedirs(os.path.join(DIR, "corpus", directory), exist_ok=True)
+	for index, (label, data) in enumerate(packets()):
+		write(os.path.join(DIR, "corpus", "packets", label), data)
+		write(os.path.join(DIR, "corpus", "output", label), bytes([OUTPUT_FLAGS[index % len(OUTPUT_FLAGS)]]) + data)
+
+
+if __name__ == "__main__":
+	main()
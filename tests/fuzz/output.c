@@ -0,0 +1,53 @@
+// Fuzz target for the output formatters. The first byte of the input selects the output format and its flags, the
+// remaining bytes are the reply, which is written in the same way as an accepted reply by massdns.
+
+#define _GNU_SOURCE
+
+#include "../../massdns.h"
+#include "../../output.h"
+#include "fuzz.h"
+
+// Selects the output format and flags similarly to the -o option.
+static void set_format(uint8_t flags)
+{
+    static const output_t outputs[] = {OUTPUT_TEXT_SIMPLE, OUTPUT_TEXT_FULL, OUTPUT_NDJSON, OUTPUT_BINARY};
+
+    context.cmd_args.output = outputs[flags & 0x03];
+    context.format.sections[DNS_SECTION_ANSWER] = !(flags & 0x04);
+    context.format.sections[DNS_SECTION_AUTHORITY] = (bool) (flags & 0x08);
+    context.format.sections[DNS_SECTION_ADDITIONAL] = (bool) (flags & 0x08);
+    context.format.match_name = (bool) (flags & 0x10);
+    context.format.ttl = (bool) (flags & 0x20);
+    context.format.separate_sections = (bool) (flags & 0x40);
+    context.format.separate_queries = (bool) (flags & 0x40);
+    context.format.indent_sections = (bool) (flags & 0x80);
+    context.format.print_question = (bool) (flags & 0x80);
+    context.format.include_meta = (bool) (flags & 0x10);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static dns_head_t head;
+    struct sockaddr_storage addr = {0};
+    uint8_t *buf;
+    uint8_t *body;
+
+    if(size < 1)
+    {
+        return 0;
+    }
+    if(context.outfile == NULL)
+    {
+        context.outfile = fopen("/dev/null", "w");
+    }
+    set_format(data[0]);
+    buf = fuzz_copy(data + 1, size - 1);
+    addr.ss_family = AF_INET;
+
+    if(dns_parse_question(buf, size - 1, &head, &body))
+    {
+        output_packet(&head, buf, size - 1, body, &addr, 0);
+    }
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,25 @@
+// Fuzz target for the parser of the header and question section, which is run on every received packet.
+
+#define _GNU_SOURCE
+
+#include "../../massdns.h"
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    uint8_t *packet = fuzz_copy(data, size);
+    dns_head_t head;
+    uint8_t *body;
+
+    if(dns_parse_question(packet, size, &head, &body))
+    {
+        // The question has to lie within the packet.
+        if(body > packet + size || head.question.name.length >= sizeof(head.question.name.name))
+        {
+            abort();
+        }
+        dns_name2str(&head.question.name);
+    }
+    free(packet);
+    return 0;
+}
@@ -0,0 +1,67 @@
+// Fuzz target for the record parsers, the record iterator and the text representation of record data. The records follow the question if
+// the input starts with a valid header and question. Otherwise, they follow the first twelve bytes, which are treated
+// as the header, so that compression pointers may refer to them.
+
+#define _GNU_SOURCE
+
+#include "../../massdns.h"
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    uint8_t *packet = fuzz_copy(data, size);
+    uint8_t *end = packet + size;
+    uint8_t *first = packet + (size < 12 ? size : 12);
+    uint8_t *next;
+    dns_head_t head = {0};
+    dns_record_t rec;
+    dns_record_iter_t iter;
+    dns_record_view_t view;
+    dns_name_t name;
+
+    bool question = dns_parse_question(packet, size, &head, &first);
+    next = first;
+
+    while(dns_parse_record_raw(packet, next, end, &next, &rec))
+    {
+        if(next > end)
+        {
+            abort();
+        }
+        dns_name2str(&rec.name);
+        dns_raw_record_data2str(&rec, packet, end);
+    }
+
+    next = first;
+    while(dns_parse_record(packet, next, end, &next, &rec))
+    {
+    }
+
+    dns_record_iter_init(&iter, packet, size, first, &head.header);
+    while(dns_record_iter_next(&iter, &view))
+    {
+        if(view.data + view.length > end)
+        {
+            abort();
+        }
+        // The wire format comparison has to agree with the comparison of the decompressed names.
+        bool wire_eq = question && dns_wire_names_eq(packet, end, view.name, packet + DNS_HEADER_SIZE);
+        if(dns_record_view_name(&iter, &view, &name) && wire_eq && !dns_names_eq(&name, &head.question.name))
+        {
+            abort();
+        }
+        dns_record_view_data2str(&view, packet, end);
+
+        // The reentrant formatters have to truncate their output to the size of the caller-owned buffer.
+        size_t small_len = 1 + (size > 0 ? data[size - 1] % 64 : 0);
+        char *small = malloc(small_len);
+        dns_record_view_data2str_r(&view, packet, end, small, small_len);
+        if(dns_record_view_name(&iter, &view, &name))
+        {
+            dns_name2str_r(&name, small, small_len);
+        }
+        free(small);
+    }
+    free(packet);
+    return 0;
+}
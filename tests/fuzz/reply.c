@@ -0,0 +1,28 @@
+// Fuzz target for the parser of complete replies and the dig-style packet printer.
+
+#define _GNU_SOURCE
+
+#include "../../massdns.h"
+#include "fuzz.h"
+
+static dns_pkt_t packet;
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static FILE *null;
+    uint8_t *buf = fuzz_copy(data, size);
+    uint8_t *body;
+
+    if(null == NULL)
+    {
+        null = fopen("/dev/null", "w");
+    }
+
+    dns_parse_reply(buf, size, &packet);
+    if(dns_parse_question(buf, size, &packet.head, &body))
+    {
+        dns_print_packet(null, &packet.head, buf, size, body);
+    }
+    free(buf);
+    return 0;
+}
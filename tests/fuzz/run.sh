@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# Replays the seed corpus through all fuzz targets built with the address and undefined behavior sanitizers.
+
+DIR=$(dirname "$0")
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD"' EXIT
+
+for TARGET in question record reply output cache; do
+  ${CC:-cc} -std=c11 -g -O1 -fsanitize=address,undefined -fno-sanitize=alignment -fno-sanitize-recover=all \
+    "$DIR/$TARGET.c" -o "$BUILD/$TARGET" || exit 1
+done
+
+for TARGET in question record reply cache; do
+  "$BUILD/$TARGET" "$DIR"/corpus/packets/* || exit 1
+done
+"$BUILD/output" "$DIR"/corpus/output/* || exit 1
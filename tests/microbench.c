@@ -0,0 +1,800 @@
+// Microbenchmarks for the primitives on the hot path of MassDNS. The packets are either read from a file written by
+// massdns -o B on the same platform or generated, covering the record types that are most common in replies.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "../massdns.h"
+#include "../string.h"
+
+#define MICROBENCH_MAX_PACKET 0x200
+#define MICROBENCH_RING_PRECISION TIMED_RING_MS
+
+typedef struct
+{
+    uint8_t data[MICROBENCH_MAX_PACKET];
+    uint16_t len;
+} packet_t;
+
+struct
+{
+    char *corpus;
+    char *names;
+    size_t count;
+    double min_seconds; // Minimum measurement time of every benchmark
+    char *filter;
+
+    packet_t *packets;
+    size_t packet_count;
+    char **name_strings; // Query names of the packets in text form
+    char **record_strings; // Record data of all packets in text form
+    size_t record_count;
+} bench;
+
+volatile size_t sink; // Prevents results from being optimized away
+
+void print_help(char *argv0)
+{
+    fprintf(stderr, ""
+                    "Usage: %s [options]\n"
+                    "  -c  --corpus           Binary output of massdns (-o B) written on this platform to take the\n"
+                    "                         packets from instead of generating them.\n"
+                    "  -f  --filter           Only run the benchmarks whose name contains the specified string.\n"
+                    "  -h  --help             Show this help.\n"
+                    "  -n  --count            Number of packets to generate or read at most. (Default: 100000)\n"
+                    "      --names            Names the generated packets are based on. (Default: lists/names.txt)\n"
+                    "  -t  --time             Minimum time in seconds every benchmark is run for. (Default: 1)\n",
+            argv0);
+}
+
+static inline uint64_t now_ns()
+{
+    return monotonic_ns();
+}
+
+// Packet generation
+
+static inline void put_u16(uint8_t **ptr, uint16_t value)
+{
+    (*ptr)[0] = (uint8_t)(value >> 8);
+    (*ptr)[1] = (uint8_t)value;
+    *ptr += 2;
+}
+
+static inline void put_u32(uint8_t **ptr, uint32_t value)
+{
+    put_u16(ptr, (uint16_t)(value >> 16));
+    put_u16(ptr, (uint16_t)value);
+}
+
+static void put_name(uint8_t **ptr, const char *name)
+{
+    ssize_t len = dns_str2namebuf(name, *ptr);
+    *ptr += len > 0 ? len : 0;
+}
+
+// Begin a record with a compressed owner name and return the position of its data length.
+static uint8_t *put_record_head(uint8_t **ptr, uint16_t name_offset, dns_record_type type)
+{
+    put_u16(ptr, (uint16_t)(0xC000 | name_offset));
+    put_u16(ptr, type);
+    put_u16(ptr, DNS_CLS_IN);
+    put_u32(ptr, 3600);
+    uint8_t *length = *ptr;
+    *ptr += 2;
+    return length;
+}
+
+static void finish_record(uint8_t *length, uint8_t *end)
+{
+    uint16_t len = (uint16_t)(end - length - 2);
+    length[0] = (uint8_t)(len >> 8);
+    length[1] = (uint8_t)len;
+}
+
+// Generate a reply to the query for the specified name. The index selects one of several reply shapes.
+void generate_packet(packet_t *packet, const char *name, size_t index)
+{
+    static const dns_record_type question_types[] = {DNS_REC_A, DNS_REC_A, DNS_REC_A, DNS_REC_A, DNS_REC_AAAA,
+                                                     DNS_REC_MX, DNS_REC_TXT, DNS_REC_NS};
+    size_t shape = index % elements(question_types);
+    uint8_t *ptr = packet->data;
+    uint16_t counts[3] = {0, 0, 0};
+    uint8_t *length;
+
+    put_u16(&ptr, (uint16_t)index);
+    put_u16(&ptr, shape == 0 ? 0x8183 : 0x8180);
+    put_u16(&ptr, 1);
+    ptr += 6; // Record counts
+    put_name(&ptr, name);
+    put_u16(&ptr, question_types[shape]);
+    put_u16(&ptr, DNS_CLS_IN);
+    uint16_t zone_offset = 12 + packet->data[12] + 1; // The name without its first label
+
+    switch(shape)
+    {
+        case 0: // NXDOMAIN with the SOA record of the zone
+            length = put_record_head(&ptr, zone_offset, DNS_REC_SOA);
+            put_name(&ptr, "ns1.example.net");
+            put_name(&ptr, "hostmaster.example.net");
+            for(size_t i = 0; i < 5; i++)
+            {
+                put_u32(&ptr, (uint32_t)(2019000000 + i));
+            }
+            finish_record(length, ptr);
+            counts[1]++;
+            break;
+        case 1:
+        case 2:
+            for(size_t i = 0; i < (shape == 1 ? 1 : 4); i++)
+            {
+                length = put_record_head(&ptr, 12, DNS_REC_A);
+                put_u32(&ptr, 0xC0000200 | (uint32_t)((index + i) & 0xFF));
+                finish_record(length, ptr);
+                counts[0]++;
+            }
+            break;
+        case 3: // CNAME to a content delivery network followed by its addresses
+        {
+            length = put_record_head(&ptr, 12, DNS_REC_CNAME);
+            uint16_t target_offset = (uint16_t)(ptr - packet->data);
+            put_name(&ptr, "e1234.dscb.akamaiedge.net");
+            finish_record(length, ptr);
+            counts[0]++;
+            for(size_t i = 0; i < 2; i++)
+            {
+                length = put_record_head(&ptr, target_offset, DNS_REC_A);
+                put_u32(&ptr, 0xC6336400 | (uint32_t)((index + i) & 0xFF));
+                finish_record(length, ptr);
+                counts[0]++;
+            }
+            break;
+        }
+        case 4:
+            for(size_t i = 0; i < 2; i++)
+            {
+                length = put_record_head(&ptr, 12, DNS_REC_AAAA);
+                put_u32(&ptr, 0x20010db8);
+                put_u32(&ptr, 0);
+                put_u32(&ptr, (uint32_t)index);
+                put_u32(&ptr, (uint32_t)i + 1);
+                finish_record(length, ptr);
+                counts[0]++;
+            }
+            break;
+        case 5: // MX records with compressed exchange names
+            for(size_t i = 0; i < 2; i++)
+            {
+                length = put_record_head(&ptr, 12, DNS_REC_MX);
+                put_u16(&ptr, (uint16_t)(10 * (i + 1)));
+                *ptr++ = 3;
+                memcpy(ptr, i == 0 ? "mx1" : "mx2", 3);
+                ptr += 3;
+                put_u16(&ptr, (uint16_t)(0xC000 | zone_offset));
+                finish_record(length, ptr);
+                counts[0]++;
+            }
+            break;
+        case 6: // TXT record with characters requiring escapes
+        {
+            static const char *txt = "v=spf1 include:_spf.example.com ip4:192.0.2.0/24 \"quoted\" \\ ~all";
+            length = put_record_head(&ptr, 12, DNS_REC_TXT);
+            *ptr++ = (uint8_t)strlen(txt);
+            memcpy(ptr, txt, strlen(txt));
+            ptr += strlen(txt);
+            finish_record(length, ptr);
+            counts[0]++;
+            break;
+        }
+        default: // Delegation with glue
+            for(size_t i = 0; i < 2; i++)
+            {
+                length = put_record_head(&ptr, 12, DNS_REC_NS);
+                *ptr++ = 3;
+                memcpy(ptr, i == 0 ? "ns1" : "ns2", 3);
+                ptr += 3;
+                put_u16(&ptr, 0xC000 | 12);
+                finish_record(length, ptr);
+                counts[1]++;
+            }
+            for(size_t i = 0; i < 2; i++)
+            {
+                length = put_record_head(&ptr, 12, DNS_REC_A);
+                put_u32(&ptr, 0xCB007100 | (uint32_t)i);
+                finish_record(length, ptr);
+                counts[2]++;
+            }
+            break;
+    }
+
+    packet->data[6] = 0;
+    packet->data[7] = (uint8_t)counts[0];
+    packet->data[8] = 0;
+    packet->data[9] = (uint8_t)counts[1];
+    packet->data[10] = 0;
+    packet->data[11] = (uint8_t)counts[2];
+    packet->len = (uint16_t)(ptr - packet->data);
+}
+
+void generate_corpus()
+{
+    static char line[0x200];
+    static char name[0x200];
+    static const char *fallback[] = {"www", "mail", "ftp", "webmail", "smtp", "ns1", "vpn", "api", "dev", "cdn"};
+
+    FILE *f = fopen(bench.names, "r");
+    if(!f)
+    {
+        fprintf(stderr, "Failed to open %s, using built-in names.\n", bench.names);
+    }
+    bench.packets = safe_malloc(bench.count * sizeof(*bench.packets));
+    for(size_t i = 0; i < bench.count; i++)
+    {
+        const char *label = fallback[i % elements(fallback)];
+        if(f)
+        {
+            if(!fgets(line, sizeof(line), f))
+            {
+                rewind(f);
+                if(!fgets(line, sizeof(line), f))
+                {
+                    fprintf(stderr, "The names file is empty.\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            trim_end(line);
+            label = line;
+        }
+        snprintf(name, sizeof(name), "%.60s.zone%zu.example.com", label, i % 997);
+        generate_packet(bench.packets + i, name, i);
+    }
+    bench.packet_count = bench.count;
+    if(f)
+    {
+        fclose(f);
+    }
+}
+
+// Read the packets from a file written by massdns -o B on the same platform.
+void read_corpus()
+{
+    FILE *f = fopen(bench.corpus, "rb");
+    if(!f)
+    {
+        fprintf(stderr, "Failed to open corpus %s: %s\n", bench.corpus, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    size_t header = 8 + 4 + 4 + 1 + 5 * sizeof(size_t) + 2 * (sizeof(sa_family_t) + 2 * sizeof(size_t));
+    if(fseek(f, (long)header, SEEK_SET) != 0)
+    {
+        fprintf(stderr, "The corpus is not a binary output file.\n");
+        exit(EXIT_FAILURE);
+    }
+    bench.packets = safe_malloc(bench.count * sizeof(*bench.packets));
+    while(bench.packet_count < bench.count)
+    {
+        time_t timestamp;
+        struct sockaddr_storage address;
+        uint16_t len;
+        if(fread(&timestamp, sizeof(timestamp), 1, f) != 1 || fread(&address, sizeof(address), 1, f) != 1
+           || fread(&len, sizeof(len), 1, f) != 1)
+        {
+            break;
+        }
+        packet_t *packet = bench.packets + bench.packet_count;
+        if(len > sizeof(packet->data))
+        {
+            fseek(f, len, SEEK_CUR);
+            continue;
+        }
+        if(fread(packet->data, len, 1, f) != 1)
+        {
+            break;
+        }
+        packet->len = len;
+        bench.packet_count++;
+    }
+    fclose(f);
+    if(bench.packet_count == 0)
+    {
+        fprintf(stderr, "The corpus does not contain any packets.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Convert the names and records of the corpus to text, which is the input of the string benchmarks.
+void prepare_strings()
+{
+    dns_head_t head;
+    dns_record_t record;
+    uint8_t *next;
+
+    bench.name_strings = safe_calloc(bench.packet_count * sizeof(*bench.name_strings));
+    size_t capacity = bench.packet_count;
+    bench.record_strings = safe_malloc(capacity * sizeof(*bench.record_strings));
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        packet_t *packet = bench.packets + i;
+        if(!dns_parse_question(packet->data, packet->len, &head, &next))
+        {
+            bench.name_strings[i] = strmcpy("invalid.");
+            continue;
+        }
+        bench.name_strings[i] = strmcpy(dns_name2str(&head.question.name));
+        while(dns_parse_record_raw(packet->data, next, packet->data + packet->len, &next, &record))
+        {
+            if(bench.record_count >= capacity)
+            {
+                capacity *= 2;
+                bench.record_strings = safe_realloc(bench.record_strings, capacity * sizeof(*bench.record_strings));
+            }
+            bench.record_strings[bench.record_count++] =
+                    strmcpy(dns_raw_record_data2str(&record, packet->data, packet->data + packet->len));
+        }
+    }
+}
+
+// Benchmarks, each function processes the whole corpus once and returns the number of operations
+
+size_t bench_parse_question()
+{
+    dns_head_t head;
+    uint8_t *next;
+    size_t ok = 0;
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        ok += dns_parse_question(bench.packets[i].data, bench.packets[i].len, &head, &next);
+    }
+    sink += ok;
+    return bench.packet_count;
+}
+
+size_t bench_parse_name()
+{
+    uint8_t name[0xFF];
+    uint8_t len;
+    uint8_t *next;
+    size_t total = 0;
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        packet_t *packet = bench.packets + i;
+        if(parse_name(packet->data, packet->data + 12, packet->data + packet->len, name, &len, &next))
+        {
+            total += len;
+        }
+    }
+    sink += total;
+    return bench.packet_count;
+}
+
+size_t bench_parse_record_raw()
+{
+    dns_head_t head;
+    dns_record_t record;
+    uint8_t *next;
+    size_t records = 0;
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        packet_t *packet = bench.packets + i;
+        if(!dns_parse_question(packet->data, packet->len, &head, &next))
+        {
+            continue;
+        }
+        while(dns_parse_record_raw(packet->data, next, packet->data + packet->len, &next, &record))
+        {
+            records++;
+        }
+    }
+    sink += records;
+    return records;
+}
+
+// Visits the records like the default output format, which only decompresses names matching the question.
+size_t bench_record_iter()
+{
+    dns_head_t head;
+    dns_record_iter_t iter;
+    dns_record_view_t record;
+    dns_name_t name;
+    uint8_t *next;
+    size_t records = 0;
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        packet_t *packet = bench.packets + i;
+        if(!dns_parse_question(packet->data, packet->len, &head, &next))
+        {
+            continue;
+        }
+        dns_record_iter_init(&iter, packet->data, packet->len, next, &head.header);
+        while(dns_record_iter_next(&iter, &record))
+        {
+            if(dns_wire_names_eq(packet->data, packet->data + packet->len, record.name, packet->data + DNS_HEADER_SIZE)
+               && dns_record_view_name(&iter, &record, &name))
+            {
+                sink += name.length;
+            }
+            records++;
+        }
+    }
+    sink += records;
+    return records;
+}
+
+size_t bench_record_data2str()
+{
+    dns_head_t head;
+    dns_record_t record;
+    uint8_t *next;
+    size_t records = 0;
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        packet_t *packet = bench.packets + i;
+        if(!dns_parse_question(packet->data, packet->len, &head, &next))
+        {
+            continue;
+        }
+        while(dns_parse_record_raw(packet->data, next, packet->data + packet->len, &next, &record))
+        {
+            sink += (size_t)dns_raw_record_data2str(&record, packet->data, packet->data + packet->len)[0];
+            records++;
+        }
+    }
+    return records;
+}
+
+// Formats the names and data of all records into a caller-owned buffer as a thread would.
+size_t bench_record_data2str_r()
+{
+    static char buffer[DNS_DATA_STR_SIZE];
+    char name_buffer[DNS_NAME_STR_SIZE];
+    dns_head_t head;
+    dns_record_iter_t iter;
+    dns_record_view_t record;
+    dns_name_t name;
+    uint8_t *next;
+    size_t records = 0;
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        packet_t *packet = bench.packets + i;
+        if(!dns_parse_question(packet->data, packet->len, &head, &next))
+        {
+            continue;
+        }
+        dns_record_iter_init(&iter, packet->data, packet->len, next, &head.header);
+        while(dns_record_iter_next(&iter, &record) && dns_record_view_name(&iter, &record, &name))
+        {
+            sink += (size_t)dns_name2str_r(&name, name_buffer, sizeof(name_buffer))[0];
+            sink += (size_t)dns_record_view_data2str_r(&record, packet->data, packet->data + packet->len, buffer,
+                                                       sizeof(buffer))[0];
+            records++;
+        }
+    }
+    return records;
+}
+
+size_t bench_json_escape()
+{
+    static char buffer[0xFFFF];
+    for(size_t i = 0; i < bench.record_count; i++)
+    {
+        sink += json_escape(buffer, bench.record_strings[i], sizeof(buffer));
+    }
+    return bench.record_count;
+}
+
+size_t bench_str2namebuf()
+{
+    uint8_t buffer[0x100];
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        sink += (size_t)dns_str2namebuf(bench.name_strings[i], buffer);
+    }
+    return bench.packet_count;
+}
+
+// Keys of the query names of all packets, once as received and once with the case of every other letter inverted,
+// which is the worst case for case-insensitive comparisons.
+static lookup_key_t *keys;
+static lookup_key_t *mixed_keys;
+
+void prepare_keys()
+{
+    dns_head_t head;
+
+    if(keys)
+    {
+        return;
+    }
+    keys = safe_calloc(bench.packet_count * sizeof(*keys));
+    mixed_keys = safe_calloc(bench.packet_count * sizeof(*mixed_keys));
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        if(dns_parse_question(bench.packets[i].data, bench.packets[i].len, &head, NULL))
+        {
+            keys[i].name = head.question.name;
+            keys[i].type = head.question.type;
+        }
+        mixed_keys[i] = keys[i];
+        bool invert = true;
+        for(size_t j = 0; j < mixed_keys[i].name.length; j++)
+        {
+            uint8_t c = mixed_keys[i].name.name[j];
+            if(isalpha(c))
+            {
+                mixed_keys[i].name.name[j] = (uint8_t) (invert ? (islower(c) ? toupper(c) : tolower(c)) : c);
+                invert = !invert;
+            }
+        }
+    }
+}
+
+// The implementations preceding the vectorized ones, for reference
+int hash_lookup_key_djb2(void *key)
+{
+    unsigned long hash = 5381;
+    uint8_t *entry = ((lookup_key_t *)key)->name.name;
+    int c;
+    while ((c = *entry++) != 0)
+    {
+        hash = ((hash << 5) + hash) + tolower(c); /* hash * 33 + c */
+    }
+    hash = ((hash << 5) + hash) + ((((lookup_key_t *)key)->type & 0xFF00) >> 8);
+    hash = ((hash << 5) + hash) + (((lookup_key_t *)key)->type & 0x00FF);
+    hash = ((hash << 5) + hash) + ((lookup_key_t *)key)->name.length;
+    return (int)hash;
+}
+
+bool dns_names_eq_tolower(dns_name_t *name1, dns_name_t *name2)
+{
+    if(name1->length != name2->length)
+    {
+        return false;
+    }
+    for(uint8_t i = 0; i < name1->length; i++)
+    {
+        if(tolower(name1->name[i]) != tolower(name2->name[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t bench_casefold()
+{
+    uint8_t folded[0x100];
+    prepare_keys();
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        casefold(folded, mixed_keys[i].name.name, mixed_keys[i].name.length);
+        sink += folded[0];
+    }
+    return bench.packet_count;
+}
+
+size_t bench_hash_lookup_key()
+{
+    prepare_keys();
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        sink += (size_t)hash_lookup_key(keys + i);
+    }
+    return bench.packet_count;
+}
+
+size_t bench_hash_lookup_key_djb2()
+{
+    prepare_keys();
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        sink += (size_t)hash_lookup_key_djb2(keys + i);
+    }
+    return bench.packet_count;
+}
+
+size_t bench_names_eq()
+{
+    prepare_keys();
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        sink += dns_names_eq(&keys[i].name, &mixed_keys[i].name);
+    }
+    return bench.packet_count;
+}
+
+size_t bench_names_eq_tolower()
+{
+    prepare_keys();
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        sink += dns_names_eq_tolower(&keys[i].name, &mixed_keys[i].name);
+    }
+    return bench.packet_count;
+}
+
+// Insert all query names into the lookup map, look each of them up in mixed case and remove them again.
+size_t bench_hashmap()
+{
+    static lookup_entry_t *entries;
+
+    prepare_keys();
+    if(!entries)
+    {
+        entries = safe_calloc(bench.packet_count * sizeof(*entries));
+        for(size_t i = 0; i < bench.packet_count; i++)
+        {
+            entries[i].key = keys[i];
+        }
+    }
+
+    Hashmap *map = hashmapCreate(bench.packet_count, hash_lookup_key, cmp_lookup);
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        hashmapPut(map, &entries[i].key, &entries[i].value);
+    }
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        sink += hashmapGet(map, mixed_keys + i) != NULL;
+    }
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        hashmapRemove(map, keys + i);
+    }
+    hashmapFree(map);
+    return 3 * bench.packet_count;
+}
+
+static size_t ring_handled;
+
+void ring_callback(void *ptr)
+{
+    ring_handled++;
+}
+
+// Add one timer per packet with delays of up to 10 ms and handle them. Only the time within the ring functions counts.
+size_t bench_timed_ring(uint64_t *elapsed)
+{
+    timed_ring_t ring;
+    timed_ring_init(&ring, 1000, MICROBENCH_RING_PRECISION, 0x400);
+    ring_handled = 0;
+
+    uint64_t start = now_ns();
+    for(size_t i = 0; i < bench.packet_count; i++)
+    {
+        timed_ring_add(&ring, (time_t)((i * 7919) % 10 * MICROBENCH_RING_PRECISION), bench.packets + i);
+    }
+    *elapsed = now_ns() - start;
+    while(ring_handled < bench.packet_count)
+    {
+        start = now_ns();
+        timed_ring_handle(&ring, ring_callback);
+        *elapsed += now_ns() - start;
+    }
+    timed_ring_destroy(&ring);
+    return 2 * bench.packet_count;
+}
+
+typedef struct
+{
+    const char *name;
+    size_t (*run)();
+    size_t (*run_timed)(uint64_t *elapsed); // For benchmarks which measure parts of their runs only
+} benchmark_t;
+
+void run_benchmark(benchmark_t *benchmark)
+{
+    if(bench.filter && !strstr(benchmark->name, bench.filter))
+    {
+        return;
+    }
+    uint64_t elapsed = 0;
+    uint64_t deadline = now_ns() + (uint64_t)(bench.min_seconds * TIMED_RING_S);
+    size_t operations = 0;
+    size_t rounds = 0;
+    do
+    {
+        if(benchmark->run_timed)
+        {
+            uint64_t part;
+            operations += benchmark->run_timed(&part);
+            elapsed += part;
+        }
+        else
+        {
+            uint64_t start = now_ns();
+            operations += benchmark->run();
+            elapsed += now_ns() - start;
+        }
+        rounds++;
+    } while(now_ns() < deadline);
+
+    printf("%-24s %12zu ops %10zu rounds %10.2f ns/op %10.3f Mops/s\n", benchmark->name, operations, rounds,
+           operations == 0 ? 0 : elapsed / (double)operations,
+           elapsed == 0 ? 0 : operations * 1000.0 / elapsed);
+}
+
+int main(int argc, char **argv)
+{
+    bench.count = 100000;
+    bench.min_seconds = 1;
+    bench.names = "lists/names.txt";
+
+    for(int i = 1; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        if(strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0)
+        {
+            print_help(argv[0]);
+            return EXIT_SUCCESS;
+        }
+        else if((strcmp(argv[i], "--corpus") == 0 || strcmp(argv[i], "-c") == 0) && has_value)
+        {
+            bench.corpus = argv[++i];
+        }
+        else if((strcmp(argv[i], "--filter") == 0 || strcmp(argv[i], "-f") == 0) && has_value)
+        {
+            bench.filter = argv[++i];
+        }
+        else if((strcmp(argv[i], "--count") == 0 || strcmp(argv[i], "-n") == 0) && has_value)
+        {
+            bench.count = strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--names") == 0 && has_value)
+        {
+            bench.names = argv[++i];
+        }
+        else if((strcmp(argv[i], "--time") == 0 || strcmp(argv[i], "-t") == 0) && has_value)
+        {
+            bench.min_seconds = strtod(argv[++i], NULL);
+        }
+        else
+        {
+            fprintf(stderr, "Invalid argument \"%s\".\n", argv[i]);
+            print_help(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if(bench.count == 0)
+    {
+        fprintf(stderr, "The packet count has to be positive.\n");
+        return EXIT_FAILURE;
+    }
+
+    if(bench.corpus)
+    {
+        read_corpus();
+    }
+    else
+    {
+        generate_corpus();
+    }
+    prepare_strings();
+    printf("Corpus: %zu packets, %zu records\n", bench.packet_count, bench.record_count);
+
+    benchmark_t benchmarks[] = {
+            {"dns_parse_question", bench_parse_question, NULL},
+            {"parse_name", bench_parse_name, NULL},
+            {"dns_parse_record_raw", bench_parse_record_raw, NULL},
+            {"dns_record_iter", bench_record_iter, NULL},
+            {"dns_raw_record_data2str", bench_record_data2str, NULL},
+            {"dns_record_view_data2str_r", bench_record_data2str_r, NULL},
+            {"json_escape", bench_json_escape, NULL},
+            {"dns_str2namebuf", bench_str2namebuf, NULL},
+            {"casefold", bench_casefold, NULL},
+            {"hash_lookup_key", bench_hash_lookup_key, NULL},
+            {"hash_lookup_key_djb2", bench_hash_lookup_key_djb2, NULL},
+            {"dns_names_eq", bench_names_eq, NULL},
+            {"dns_names_eq_tolower", bench_names_eq_tolower, NULL},
+            {"hashmap_lookup", bench_hashmap, NULL},
+            {"timed_ring", NULL, bench_timed_ring},
+    };
+    for(size_t i = 0; i < elements(benchmarks); i++)
+    {
+        run_benchmark(benchmarks + i);
+    }
+    return EXIT_SUCCESS;
+}
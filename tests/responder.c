@@ -0,0 +1,1108 @@
+// Benchmark responder: Answers DNS queries at high rates so that MassDNS can be measured end to end on loopback.
+// Several processes may answer on the same address using SO_REUSEPORT, replies can be delayed, lost and rate limited.
+// Names below delegated zones are answered with referrals, so that several responders on loopback addresses can stand
+// in for a hierarchy of authoritative servers. Queries with an OPT record are answered with one, including a cookie.
+// Queries over TCP are answered on pipelined connections, which are served by the same processes.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../security.h"
+#include "../list.h"
+#include "../net.h"
+#include "../dns.h"
+#include "../timed_ring.h"
+
+#define RESPONDER_BATCH 256 // Maximum number of datagrams received or sent by a single system call
+#define RESPONDER_PACKET_SIZE 0x200
+#define RESPONDER_REPLY_SIZE (RESPONDER_PACKET_SIZE + 0x140) // Room for the question, a referral with glue and OPT
+#define RESPONDER_MAX_DELEGATIONS 64
+#define RESPONDER_RATE_TABLE_SIZE 0x10000 // Sources sharing a slot share their rate limit
+#define RESPONDER_RING_PRECISION (100 * TIMED_RING_US)
+#define RESPONDER_MAX_STREAMS 64 // TCP connections per process
+#define RESPONDER_STREAM_SIZE 0x10000 // Buffered bytes of a TCP connection per direction
+#define RESPONDER_TTL 300
+#define RESPONDER_EDNS_SIZE 1232
+#define RESPONDER_SERVER_COOKIE_SIZE 8
+#define RESPONDER_COOKIE_SECRET 0x5EC12E7C00C1E5ULL // Shared by all processes, so that any of them accepts a cookie
+
+typedef enum
+{
+    PROFILE_ANSWER, // An A or AAAA record depending on the question, no records for other types
+    PROFILE_NXDOMAIN,
+    PROFILE_SERVFAIL,
+    PROFILE_REFUSED,
+    PROFILE_COUNT
+} profile_t;
+
+const char *profile_names[] = {"A", "NXDOMAIN", "SERVFAIL", "REFUSED"};
+
+// A zone that is delegated to a name server, names are in wire format
+typedef struct
+{
+    uint8_t zone[0xFF];
+    size_t zone_len;
+    uint8_t server[0xFF];
+    size_t server_len;
+    bool glue; // Whether the referral includes the address of the name server
+    struct in_addr address;
+} delegation_t;
+
+// A TCP connection, whose replies are buffered until the socket accepts them
+typedef struct
+{
+    int descriptor; // Negative if the connection is not in use
+    struct sockaddr_storage address;
+    uint8_t in[RESPONDER_STREAM_SIZE];
+    size_t in_len;
+    uint8_t out[RESPONDER_STREAM_SIZE];
+    size_t out_len;
+} stream_t;
+
+// Counters of a single process, published to the parent through shared memory
+typedef struct __attribute__((aligned(64)))
+{
+    size_t received;
+    size_t replied;
+    size_t lost; // Dropped on purpose according to the loss rate
+    size_t limited; // Exceeding the rate limit of their source
+    size_t invalid;
+    size_t overflow; // Dropped because the maximum number of delayed replies has been reached
+} responder_stats_t;
+
+// A reply that is sent once its delay has passed
+typedef struct pending_reply
+{
+    struct pending_reply *next_free;
+    struct sockaddr_storage address;
+    size_t len;
+    uint8_t data[RESPONDER_REPLY_SIZE];
+} pending_reply_t;
+
+struct
+{
+    struct
+    {
+        struct sockaddr_storage bind_addr;
+        size_t processes;
+        unsigned int weights[PROFILE_COUNT];
+        unsigned int weight_sum;
+        uint64_t latency_ns;
+        uint64_t jitter_ns;
+        double loss;
+        uint32_t rate_limit;
+        bool refuse_limited;
+        size_t max_pending;
+        int rcvbuf;
+        int sndbuf;
+        bool quiet;
+        bool authoritative;
+        bool badcookie;
+        bool no_edns;
+        bool tcp;
+        bool truncate;
+        delegation_t delegations[RESPONDER_MAX_DELEGATIONS];
+        size_t delegation_count;
+        int argc;
+        char **argv;
+    } cmd_args;
+
+    int descriptor;
+    int listener; // TCP socket, negative unless answering over TCP
+    stream_t *streams;
+    pid_t *pids;
+    responder_stats_t *stats; // Shared memory region with one slot per process
+    uint64_t *rate_table; // Shared memory region, each slot holds the current second and the number of queries within
+    responder_stats_t local;
+    timed_ring_t ring;
+    pending_reply_t *pending_space;
+    pending_reply_t *pending_free;
+    size_t pending_used; // Number of entries of the pending space that have been used at least once
+    size_t pending_count;
+    uint64_t random_state;
+} responder;
+
+volatile sig_atomic_t responder_stop = 0;
+
+void print_help()
+{
+    fprintf(stderr, ""
+                    "Usage: %s [options]\n"
+                    "      --authoritative    Set the authoritative answer flag within replies that are no referrals.\n"
+                    "      --badcookie        Reply with BADCOOKIE to queries with a client cookie but without a valid\n"
+                    "                         server cookie.\n"
+                    "  -b  --bindto           Address and port to answer queries on. (Default: 127.0.0.1:5353)\n"
+                    "      --delegate         Answer names within a zone with a referral to a name server, specified\n"
+                    "                         as ZONE=SERVER or ZONE=SERVER@IPv4 in order to include glue. May be\n"
+                    "                         repeated, the longest matching zone is used.\n"
+                    "  -h  --help             Show this help.\n"
+                    "      --jitter           Maximum random delay in milliseconds that is added to the latency.\n"
+                    "                         (Default: 0)\n"
+                    "      --latency          Delay of every reply in milliseconds. (Default: 0)\n"
+                    "      --loss             Percentage of queries that are not answered. (Default: 0)\n"
+                    "      --max-pending      Maximum number of delayed replies per process. (Default: 1000000)\n"
+                    "      --no-edns          Reply with FORMERR and without an OPT record to queries with one, like\n"
+                    "                         servers that do not implement EDNS.\n"
+                    "  -p  --profile          Comma-separated reply profiles with optional weights, e.g. A=90,NXDOMAIN=10.\n"
+                    "                         Supported profiles are A, NXDOMAIN, SERVFAIL and REFUSED. A answers\n"
+                    "                         A and AAAA questions with a record and other questions without one.\n"
+                    "                         (Default: A)\n"
+                    "      --processes        Number of processes answering on sockets bound to the same address.\n"
+                    "                         (Default: 1)\n"
+                    "  -q  --quiet            Do not print the rates every second.\n"
+                    "      --rate-limit       Maximum number of queries per second from a single source address,\n"
+                    "                         exceeding queries are dropped. (Default: 0, unlimited)\n"
+                    "      --rcvbuf           Size of the receive buffer in bytes.\n"
+                    "      --refuse-limited   Answer queries exceeding the rate limit with REFUSED.\n"
+                    "      --sndbuf           Size of the send buffer in bytes.\n"
+                    "      --tcp              Answer queries over TCP on the same address as well, replies over TCP are\n"
+                    "                         not delayed.\n"
+                    "      --truncate         Set the TC bit within replies over UDP and leave out their records.\n",
+            responder.cmd_args.argv[0] ? responder.cmd_args.argv[0] : "responder"
+    );
+}
+
+void expect_arg(int i)
+{
+    if (i + 1 >= responder.cmd_args.argc)
+    {
+        fprintf(stderr, "Missing argument value for %s.\n", responder.cmd_args.argv[i]);
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+}
+
+double expect_arg_double(int i, double min, double max)
+{
+    expect_arg(i);
+    char *endptr;
+    double result = strtod(responder.cmd_args.argv[i + 1], &endptr);
+    if(*endptr != 0 || result < min || result > max)
+    {
+        fprintf(stderr, "The argument %s requires a value between %g and %g.\n",
+                responder.cmd_args.argv[i], min, max);
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+void parse_profiles(char *str)
+{
+    bzero(responder.cmd_args.weights, sizeof(responder.cmd_args.weights));
+    responder.cmd_args.weight_sum = 0;
+    for(char *token = strtok(str, ","); token != NULL; token = strtok(NULL, ","))
+    {
+        unsigned long weight = 1;
+        char *equals = strchr(token, '=');
+        if(equals)
+        {
+            char *endptr;
+            *equals = 0;
+            weight = strtoul(equals + 1, &endptr, 10);
+            if(*endptr != 0 || weight > 1000000)
+            {
+                fprintf(stderr, "Invalid profile weight: %s\n", equals + 1);
+                exit(EXIT_FAILURE);
+            }
+        }
+        size_t profile;
+        for(profile = 0; profile < PROFILE_COUNT; profile++)
+        {
+            if(strcasecmp(token, profile_names[profile]) == 0)
+            {
+                break;
+            }
+        }
+        if(profile == PROFILE_COUNT)
+        {
+            fprintf(stderr, "Unknown reply profile: %s\n", token);
+            exit(EXIT_FAILURE);
+        }
+        responder.cmd_args.weights[profile] += weight;
+        responder.cmd_args.weight_sum += weight;
+    }
+    if(responder.cmd_args.weight_sum == 0)
+    {
+        fprintf(stderr, "At least one reply profile requires a positive weight.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void parse_delegation(char *str)
+{
+    if(responder.cmd_args.delegation_count >= RESPONDER_MAX_DELEGATIONS)
+    {
+        fprintf(stderr, "At most %d delegations are supported.\n", RESPONDER_MAX_DELEGATIONS);
+        exit(EXIT_FAILURE);
+    }
+    delegation_t *delegation = responder.cmd_args.delegations + responder.cmd_args.delegation_count++;
+    char *server = strchr(str, '=');
+    if(server == NULL)
+    {
+        fprintf(stderr, "Invalid delegation: %s\n", str);
+        exit(EXIT_FAILURE);
+    }
+    *server++ = 0;
+    char *address = strchr(server, '@');
+    if(address != NULL)
+    {
+        *address++ = 0;
+        delegation->glue = true;
+        if(inet_pton(AF_INET, address, &delegation->address) != 1)
+        {
+            fprintf(stderr, "Invalid address of a name server: %s\n", address);
+            exit(EXIT_FAILURE);
+        }
+    }
+    ssize_t zone_len = dns_str2namebuf(str, delegation->zone);
+    ssize_t server_len = dns_str2namebuf(server, delegation->server);
+    if(zone_len <= 0 || server_len <= 0)
+    {
+        fprintf(stderr, "Invalid name within delegation: %s=%s\n", str, server);
+        exit(EXIT_FAILURE);
+    }
+    delegation->zone_len = (size_t) zone_len;
+    delegation->server_len = (size_t) server_len;
+}
+
+void parse_cmd(int argc, char **argv)
+{
+    responder.cmd_args.argc = argc;
+    responder.cmd_args.argv = argv;
+    responder.cmd_args.processes = 1;
+    responder.cmd_args.max_pending = 1000000;
+    responder.cmd_args.weights[PROFILE_ANSWER] = 1;
+    responder.cmd_args.weight_sum = 1;
+    str_to_addr("127.0.0.1", 5353, &responder.cmd_args.bind_addr);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0)
+        {
+            print_help();
+            exit(EXIT_SUCCESS);
+        }
+        else if (strcmp(argv[i], "--bindto") == 0 || strcmp(argv[i], "-b") == 0)
+        {
+            expect_arg(i);
+            if (!str_to_addr(argv[++i], 5353, &responder.cmd_args.bind_addr))
+            {
+                fprintf(stderr, "Invalid address for binding: %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "--authoritative") == 0)
+        {
+            responder.cmd_args.authoritative = true;
+        }
+        else if (strcmp(argv[i], "--badcookie") == 0)
+        {
+            responder.cmd_args.badcookie = true;
+        }
+        else if (strcmp(argv[i], "--no-edns") == 0)
+        {
+            responder.cmd_args.no_edns = true;
+        }
+        else if (strcmp(argv[i], "--delegate") == 0)
+        {
+            expect_arg(i);
+            parse_delegation(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--profile") == 0 || strcmp(argv[i], "-p") == 0)
+        {
+            expect_arg(i);
+            parse_profiles(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--latency") == 0)
+        {
+            responder.cmd_args.latency_ns = (uint64_t)(expect_arg_double(i++, 0, 60000) * TIMED_RING_MS);
+        }
+        else if (strcmp(argv[i], "--jitter") == 0)
+        {
+            responder.cmd_args.jitter_ns = (uint64_t)(expect_arg_double(i++, 0, 60000) * TIMED_RING_MS);
+        }
+        else if (strcmp(argv[i], "--loss") == 0)
+        {
+            responder.cmd_args.loss = expect_arg_double(i++, 0, 100) / 100;
+        }
+        else if (strcmp(argv[i], "--max-pending") == 0)
+        {
+            responder.cmd_args.max_pending = (size_t)expect_arg_double(i++, 1, 100000000);
+        }
+        else if (strcmp(argv[i], "--processes") == 0)
+        {
+            responder.cmd_args.processes = (size_t)expect_arg_double(i++, 1, 1024);
+        }
+        else if (strcmp(argv[i], "--rate-limit") == 0)
+        {
+            responder.cmd_args.rate_limit = (uint32_t)expect_arg_double(i++, 0, UINT32_MAX - 1);
+        }
+        else if (strcmp(argv[i], "--refuse-limited") == 0)
+        {
+            responder.cmd_args.refuse_limited = true;
+        }
+        else if (strcmp(argv[i], "--rcvbuf") == 0)
+        {
+            responder.cmd_args.rcvbuf = (int)expect_arg_double(i++, 1, INT32_MAX);
+        }
+        else if (strcmp(argv[i], "--sndbuf") == 0)
+        {
+            responder.cmd_args.sndbuf = (int)expect_arg_double(i++, 1, INT32_MAX);
+        }
+        else if (strcmp(argv[i], "--tcp") == 0)
+        {
+            responder.cmd_args.tcp = true;
+        }
+        else if (strcmp(argv[i], "--truncate") == 0)
+        {
+            responder.cmd_args.truncate = true;
+        }
+        else if (strcmp(argv[i], "--quiet") == 0 || strcmp(argv[i], "-q") == 0)
+        {
+            responder.cmd_args.quiet = true;
+        }
+        else
+        {
+            fprintf(stderr, "Invalid argument \"%s\".\n", argv[i]);
+            print_help();
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// xorshift64*, seeded per process
+static inline uint64_t random_next()
+{
+    responder.random_state ^= responder.random_state >> 12;
+    responder.random_state ^= responder.random_state << 25;
+    responder.random_state ^= responder.random_state >> 27;
+    return responder.random_state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline double random_unit()
+{
+    return (random_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+profile_t random_profile()
+{
+    if(responder.cmd_args.weights[PROFILE_ANSWER] == responder.cmd_args.weight_sum)
+    {
+        return PROFILE_ANSWER;
+    }
+    uint64_t value = random_next() % responder.cmd_args.weight_sum;
+    for(profile_t profile = 0; profile < PROFILE_COUNT; profile++)
+    {
+        if(value < responder.cmd_args.weights[profile])
+        {
+            return profile;
+        }
+        value -= responder.cmd_args.weights[profile];
+    }
+    return PROFILE_ANSWER;
+}
+
+// Whether a query from the address is within the rate limit. Every slot of the table holds the second and the number
+// of queries within that second, so that all processes can share the table without locking.
+bool rate_limit_allow(struct sockaddr_storage *address, uint32_t now)
+{
+    uint64_t hash;
+    if(address->ss_family == AF_INET)
+    {
+        hash = ((struct sockaddr_in*)address)->sin_addr.s_addr;
+    }
+    else
+    {
+        uint64_t parts[2];
+        memcpy(parts, &((struct sockaddr_in6*)address)->sin6_addr, sizeof(parts));
+        hash = parts[0] ^ parts[1];
+    }
+    uint64_t *slot = responder.rate_table + ((hash * 0x9E3779B97F4A7C15ULL) >> 48) % RESPONDER_RATE_TABLE_SIZE;
+    uint64_t old = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    while(true)
+    {
+        uint32_t count = (uint32_t)(old >> 32) == now ? (uint32_t)old : 0;
+        if(count >= responder.cmd_args.rate_limit)
+        {
+            return false;
+        }
+        uint64_t new = ((uint64_t)now << 32) | (count + 1);
+        if(__atomic_compare_exchange_n(slot, &old, new, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            return true;
+        }
+    }
+}
+
+// Writes a compression pointer to the name at the specified offset of the reply
+static inline void name_pointer(uint8_t *pointer, size_t offset)
+{
+    pointer[0] = (uint8_t) (0xC0 | (offset >> 8));
+    pointer[1] = (uint8_t) offset;
+}
+
+// Returns the delegation of the longest zone containing the question name, or NULL if the name is not delegated.
+// Sets suffix to the part of the name that equals the zone.
+delegation_t *find_delegation(uint8_t *qname, size_t qname_len, uint8_t **suffix)
+{
+    delegation_t *result = NULL;
+    for(size_t i = 0; i < responder.cmd_args.delegation_count; i++)
+    {
+        delegation_t *delegation = responder.cmd_args.delegations + i;
+        uint8_t *match = dns_wire_name_in_zone(qname, qname_len, delegation->zone, delegation->zone_len);
+        if(match != NULL && (result == NULL || delegation->zone_len > result->zone_len))
+        {
+            result = delegation;
+            *suffix = match;
+        }
+    }
+    return result;
+}
+
+// Appends a referral to the delegated zone, whose owner name refers to the question name. Returns the new length of the
+// reply or -1 if it does not fit.
+ssize_t append_referral(uint8_t *reply, size_t len, delegation_t *delegation, uint8_t *suffix)
+{
+    uint8_t owner[2];
+    name_pointer(owner, (size_t) (suffix - reply));
+    ssize_t result = dns_message_add_record(reply, len, RESPONDER_REPLY_SIZE, DNS_SECTION_AUTHORITY, owner,
+                                            sizeof(owner), DNS_REC_NS, DNS_CLS_IN, RESPONDER_TTL, delegation->server,
+                                            (uint16_t) delegation->server_len);
+    if(result < 0 || !delegation->glue)
+    {
+        return result;
+    }
+
+    // The owner of the glue refers to the name server within the data of the NS record.
+    name_pointer(owner, (size_t) result - delegation->server_len);
+    return dns_message_add_record(reply, (size_t) result, RESPONDER_REPLY_SIZE, DNS_SECTION_ADDITIONAL, owner,
+                                  sizeof(owner), DNS_REC_A, DNS_CLS_IN, RESPONDER_TTL,
+                                  (uint8_t *) &delegation->address, sizeof(delegation->address));
+}
+
+// The server cookie is derived from the client cookie, so that the responder does not keep any state per client.
+void server_cookie(uint8_t *client_cookie, uint8_t *result)
+{
+    uint64_t hash = hash_bytes(client_cookie, DNS_COOKIE_CLIENT_SIZE, RESPONDER_COOKIE_SECRET);
+    memcpy(result, &hash, RESPONDER_SERVER_COOKIE_SIZE);
+}
+
+// Whether the cookie of a query consists of a client cookie and the server cookie that belongs to it
+bool server_cookie_valid(dns_edns_t *edns)
+{
+    uint8_t expected[RESPONDER_SERVER_COOKIE_SIZE];
+    if(edns->cookie_len != DNS_COOKIE_CLIENT_SIZE + RESPONDER_SERVER_COOKIE_SIZE)
+    {
+        return false;
+    }
+    server_cookie(edns->cookie, expected);
+    return memcmp(edns->cookie + DNS_COOKIE_CLIENT_SIZE, expected, sizeof(expected)) == 0;
+}
+
+// Appends the OPT record of a reply to a query with an OPT record. The DO bit is echoed and the cookie consists of the
+// client cookie of the query followed by the server cookie. Returns the new length of the reply or -1 if it does not fit.
+ssize_t append_opt(uint8_t *reply, size_t len, dns_edns_t *query_edns, uint8_t extended_rcode)
+{
+    static const uint8_t root = 0;
+    uint8_t option[4 + DNS_COOKIE_CLIENT_SIZE + RESPONDER_SERVER_COOKIE_SIZE];
+    uint16_t option_len = 0;
+
+    if(query_edns->cookie_len >= DNS_COOKIE_CLIENT_SIZE)
+    {
+        *((uint16_t *) option) = htons(DNS_EDNS_OPTION_COOKIE);
+        *((uint16_t *) (option + 2)) = htons(DNS_COOKIE_CLIENT_SIZE + RESPONDER_SERVER_COOKIE_SIZE);
+        memcpy(option + 4, query_edns->cookie, DNS_COOKIE_CLIENT_SIZE);
+        server_cookie(query_edns->cookie, option + 4 + DNS_COOKIE_CLIENT_SIZE);
+        option_len = sizeof(option);
+    }
+
+    // The TTL holds the upper bits of the extended response code, the version and the flags.
+    uint32_t ttl = ((uint32_t) extended_rcode << 24) | (query_edns->dnssec_ok ? DNS_EDNS_FLAG_DO : 0);
+    return dns_message_add_record(reply, len, RESPONDER_REPLY_SIZE, DNS_SECTION_ADDITIONAL, &root, sizeof(root),
+                                  DNS_REC_OPT, RESPONDER_EDNS_SIZE, ttl, option, option_len);
+}
+
+dns_rcode profile_rcode(profile_t profile)
+{
+    switch(profile)
+    {
+        case PROFILE_ANSWER:
+            return DNS_RCODE_OK;
+        case PROFILE_NXDOMAIN:
+            return DNS_RCODE_NXDOMAIN;
+        case PROFILE_SERVFAIL:
+            return DNS_RCODE_SERVFAIL;
+        default:
+            return DNS_RCODE_REFUSED;
+    }
+}
+
+// Build the reply to a query within the reply buffer. Returns zero if the query is not to be answered.
+size_t create_reply(uint8_t *query, size_t len, uint8_t *reply, struct sockaddr_storage *source, uint32_t now,
+                    bool udp)
+{
+    static const uint8_t ipv4[4] = {192, 0, 2, 1};
+    static const uint8_t ipv6[16] = {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    dns_head_t head;
+    dns_edns_t edns;
+    uint8_t *body;
+
+    if (!dns_parse_question(query, len, &head, &body) || head.header.qr || body > query + len
+        || !dns_parse_edns(query, len, body, &head.header, &edns))
+    {
+        responder.local.invalid++;
+        return 0;
+    }
+
+    profile_t profile = random_profile();
+    if(responder.cmd_args.rate_limit > 0 && !rate_limit_allow(source, now))
+    {
+        responder.local.limited++;
+        if(!responder.cmd_args.refuse_limited)
+        {
+            return 0;
+        }
+        profile = PROFILE_REFUSED;
+    }
+    else if(responder.cmd_args.loss > 0 && random_unit() < responder.cmd_args.loss)
+    {
+        responder.local.lost++;
+        return 0;
+    }
+
+    // The reply repeats the question, records following the question are left out.
+    size_t question_len;
+    if(!dns_create_reply(reply, &question_len, (char *) head.question.name.name, head.question.type, head.header.id,
+                         profile_rcode(profile)))
+    {
+        responder.local.invalid++;
+        return 0;
+    }
+    dns_buf_set_rd(reply, head.header.rd);
+    dns_buf_set_ra(reply, true);
+
+    ssize_t reply_len = (ssize_t) question_len;
+    if(edns.present && responder.cmd_args.no_edns)
+    {
+        dns_buf_set_rcode(reply, DNS_RCODE_FORMERR);
+        return question_len;
+    }
+    if(edns.present && responder.cmd_args.badcookie && edns.cookie_len > 0 && !server_cookie_valid(&edns))
+    {
+        dns_buf_set_rcode(reply, DNS_RCODE_BADCOOKIE & 0xF);
+        reply_len = append_opt(reply, question_len, &edns, DNS_RCODE_BADCOOKIE >> 4);
+        return reply_len < 0 ? 0 : (size_t) reply_len;
+    }
+    if(udp && responder.cmd_args.truncate)
+    {
+        dns_buf_set_tc(reply, true);
+        dns_buf_set_rcode(reply, DNS_RCODE_OK);
+        if(edns.present)
+        {
+            reply_len = append_opt(reply, question_len, &edns, 0);
+        }
+        return reply_len < 0 ? 0 : (size_t) reply_len;
+    }
+
+    uint8_t *suffix;
+    delegation_t *delegation = NULL;
+    if(profile == PROFILE_ANSWER && responder.cmd_args.delegation_count > 0)
+    {
+        delegation = find_delegation(reply + DNS_HEADER_SIZE, question_len - DNS_HEADER_SIZE - 4, &suffix);
+    }
+    if(delegation != NULL)
+    {
+        reply_len = append_referral(reply, question_len, delegation, suffix);
+    }
+    else
+    {
+        dns_buf_set_aa(reply, responder.cmd_args.authoritative);
+        if(profile == PROFILE_ANSWER && (head.question.type == DNS_REC_A || head.question.type == DNS_REC_AAAA))
+        {
+            static const uint8_t owner[2] = {0xC0, 0x0C}; // Pointer to the question name behind the header
+            bool v4 = head.question.type == DNS_REC_A;
+            reply_len = dns_message_add_record(reply, question_len, RESPONDER_REPLY_SIZE, DNS_SECTION_ANSWER, owner,
+                                               sizeof(owner), head.question.type, DNS_CLS_IN, RESPONDER_TTL,
+                                               v4 ? ipv4 : ipv6, v4 ? sizeof(ipv4) : sizeof(ipv6));
+        }
+    }
+    if(reply_len >= 0 && edns.present)
+    {
+        reply_len = append_opt(reply, (size_t) reply_len, &edns, 0);
+    }
+    return reply_len < 0 ? 0 : (size_t) reply_len;
+}
+
+void send_delayed(void *ptr)
+{
+    pending_reply_t *pending = ptr;
+    dns_send_reply(pending->data, pending->len, responder.descriptor, &pending->address);
+    responder.local.replied++;
+    pending->next_free = responder.pending_free;
+    responder.pending_free = pending;
+    responder.pending_count--;
+}
+
+void delay_reply(uint8_t *reply, size_t len, struct sockaddr_storage *address)
+{
+    // Entries are taken from the free list first, so that only the memory for the largest backlog is touched.
+    pending_reply_t *pending = responder.pending_free;
+    if(pending != NULL)
+    {
+        responder.pending_free = pending->next_free;
+    }
+    else if(responder.pending_used < responder.cmd_args.max_pending)
+    {
+        pending = responder.pending_space + responder.pending_used++;
+    }
+    else
+    {
+        responder.local.overflow++;
+        return;
+    }
+    responder.pending_count++;
+    memcpy(pending->data, reply, len);
+    pending->len = len;
+    pending->address = *address;
+
+    uint64_t delay = responder.cmd_args.latency_ns;
+    if(responder.cmd_args.jitter_ns > 0)
+    {
+        delay += random_next() % (responder.cmd_args.jitter_ns + 1);
+    }
+    timed_ring_add(&responder.ring, (time_t)delay, pending);
+}
+
+void publish_stats(responder_stats_t *slot)
+{
+    __atomic_store_n(&slot->received, responder.local.received, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->replied, responder.local.replied, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->lost, responder.local.lost, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->limited, responder.local.limited, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->invalid, responder.local.invalid, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->overflow, responder.local.overflow, __ATOMIC_RELAXED);
+}
+
+void stream_close(stream_t *stream)
+{
+    close(stream->descriptor);
+    stream->descriptor = -1;
+}
+
+// Answer the complete queries within the input buffer as long as the output buffer has room for their replies.
+// Returns false if the connection is to be closed.
+bool stream_answer(stream_t *stream, uint32_t now)
+{
+    size_t offset = 0;
+    while(stream->in_len - offset >= 2 && stream->out_len + 2 + RESPONDER_REPLY_SIZE <= sizeof(stream->out))
+    {
+        size_t len = ((size_t)stream->in[offset] << 8) | stream->in[offset + 1];
+        if(len > RESPONDER_PACKET_SIZE)
+        {
+            responder.local.invalid++;
+            return false;
+        }
+        if(stream->in_len - offset - 2 < len)
+        {
+            break;
+        }
+        responder.local.received++;
+        uint8_t *reply = stream->out + stream->out_len + 2;
+        size_t reply_len = create_reply(stream->in + offset + 2, len, reply, &stream->address, now, false);
+        if(reply_len > 0)
+        {
+            reply[-2] = (uint8_t)(reply_len >> 8);
+            reply[-1] = (uint8_t)reply_len;
+            stream->out_len += 2 + reply_len;
+            responder.local.replied++;
+        }
+        offset += 2 + len;
+    }
+    memmove(stream->in, stream->in + offset, stream->in_len - offset);
+    stream->in_len -= offset;
+    return true;
+}
+
+// Write as many buffered replies as the socket accepts. Returns false if the connection has failed.
+bool stream_flush(stream_t *stream)
+{
+    size_t written = 0;
+    while(written < stream->out_len)
+    {
+        ssize_t sent = send(stream->descriptor, stream->out + written, stream->out_len - written,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(sent < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                return false;
+            }
+            break;
+        }
+        written += (size_t)sent;
+    }
+    memmove(stream->out, stream->out + written, stream->out_len - written);
+    stream->out_len -= written;
+    return true;
+}
+
+// Answer buffered queries and read further ones until the socket has no more data or does not accept more replies.
+void stream_serve(stream_t *stream, uint32_t now)
+{
+    while(true)
+    {
+        if(!stream_answer(stream, now) || !stream_flush(stream))
+        {
+            stream_close(stream);
+            return;
+        }
+        if(stream->out_len > 0)
+        {
+            return; // Continued once the client has read replies
+        }
+        ssize_t received = recv(stream->descriptor, stream->in + stream->in_len, sizeof(stream->in) - stream->in_len,
+                                MSG_DONTWAIT);
+        if(received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            stream_close(stream);
+            return;
+        }
+        if(received < 0)
+        {
+            return;
+        }
+        stream->in_len += (size_t)received;
+    }
+}
+
+// Accept new connections and serve the open ones. Connections exceeding the maximum number are closed right away.
+void serve_streams(uint32_t now)
+{
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof(address);
+    int fd;
+    while((fd = accept4(responder.listener, (struct sockaddr*)&address, &address_len, SOCK_NONBLOCK)) >= 0)
+    {
+        stream_t *stream = NULL;
+        for(size_t i = 0; i < RESPONDER_MAX_STREAMS && stream == NULL; i++)
+        {
+            stream = responder.streams[i].descriptor < 0 ? responder.streams + i : NULL;
+        }
+        if(stream == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        stream->descriptor = fd;
+        stream->address = address;
+        stream->in_len = 0;
+        stream->out_len = 0;
+        address_len = sizeof(address);
+    }
+    for(size_t i = 0; i < RESPONDER_MAX_STREAMS; i++)
+    {
+        if(responder.streams[i].descriptor >= 0)
+        {
+            stream_serve(responder.streams + i, now);
+        }
+    }
+}
+
+// Wait for queries over UDP or TCP, or for connections with buffered replies to become writable.
+void wait_readable(int timeout)
+{
+    static struct pollfd pfds[2 + RESPONDER_MAX_STREAMS];
+    nfds_t count = 0;
+    pfds[count++] = (struct pollfd){.fd = responder.descriptor, .events = POLLIN};
+    if(responder.listener >= 0)
+    {
+        pfds[count++] = (struct pollfd){.fd = responder.listener, .events = POLLIN};
+        for(size_t i = 0; i < RESPONDER_MAX_STREAMS; i++)
+        {
+            stream_t *stream = responder.streams + i;
+            if(stream->descriptor >= 0)
+            {
+                pfds[count++] = (struct pollfd){.fd = stream->descriptor,
+                                                .events = (short)(POLLIN | (stream->out_len > 0 ? POLLOUT : 0))};
+            }
+        }
+    }
+    poll(pfds, count, timeout);
+}
+
+void serve(size_t index)
+{
+    static uint8_t queries[RESPONDER_BATCH][RESPONDER_PACKET_SIZE];
+    static uint8_t replies[RESPONDER_BATCH][RESPONDER_REPLY_SIZE];
+    static struct sockaddr_storage sources[RESPONDER_BATCH];
+    static struct mmsghdr in[RESPONDER_BATCH];
+    static struct mmsghdr out[RESPONDER_BATCH];
+    static struct iovec in_iov[RESPONDER_BATCH];
+    static struct iovec out_iov[RESPONDER_BATCH];
+
+    bool delayed = responder.cmd_args.latency_ns > 0 || responder.cmd_args.jitter_ns > 0;
+    responder.random_state = monotonic_ns() ^ ((uint64_t)getpid() << 32) ^ 0x9E3779B97F4A7C15ULL;
+    if(delayed)
+    {
+        uint64_t span = responder.cmd_args.latency_ns + responder.cmd_args.jitter_ns;
+        timed_ring_init(&responder.ring, span / RESPONDER_RING_PRECISION + 2, RESPONDER_RING_PRECISION, 0x400);
+        responder.pending_space = safe_malloc(responder.cmd_args.max_pending * sizeof(*responder.pending_space));
+    }
+
+    for(size_t i = 0; i < RESPONDER_BATCH; i++)
+    {
+        in_iov[i].iov_base = queries[i];
+        in_iov[i].iov_len = sizeof(queries[i]);
+        in[i].msg_hdr.msg_iov = in_iov + i;
+        in[i].msg_hdr.msg_iovlen = 1;
+        in[i].msg_hdr.msg_name = sources + i;
+        out_iov[i].iov_base = replies[i];
+        out[i].msg_hdr.msg_iov = out_iov + i;
+        out[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if(responder.listener >= 0)
+    {
+        responder.streams = safe_malloc(RESPONDER_MAX_STREAMS * sizeof(*responder.streams));
+        for(size_t i = 0; i < RESPONDER_MAX_STREAMS; i++)
+        {
+            responder.streams[i].descriptor = -1;
+        }
+    }
+
+    responder_stats_t *slot = responder.stats + index;
+    while(!responder_stop)
+    {
+        if(responder.listener >= 0)
+        {
+            serve_streams((uint32_t)(monotonic_ns() / TIMED_RING_S));
+        }
+        for(size_t i = 0; i < RESPONDER_BATCH; i++)
+        {
+            in[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+        }
+        int count = recvmmsg(responder.descriptor, in, RESPONDER_BATCH, MSG_DONTWAIT, NULL);
+        if(count <= 0)
+        {
+            if(count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("Failed to receive queries");
+                break;
+            }
+            publish_stats(slot);
+            wait_readable(responder.pending_count > 0 ? 1 : 100);
+        }
+        else
+        {
+            uint32_t now = (uint32_t)(monotonic_ns() / TIMED_RING_S);
+            unsigned int replies_count = 0;
+            if(delayed)
+            {
+                // Delays are relative to the time the ring has been handled last
+                timed_ring_handle(&responder.ring, send_delayed);
+            }
+            responder.local.received += count;
+            for(int i = 0; i < count; i++)
+            {
+                size_t len = create_reply(queries[i], in[i].msg_len, replies[replies_count], sources + i, now,
+                                          true);
+                if(len == 0)
+                {
+                    continue;
+                }
+                if(delayed)
+                {
+                    delay_reply(replies[replies_count], len, sources + i);
+                    continue;
+                }
+                out_iov[replies_count].iov_len = len;
+                out[replies_count].msg_hdr.msg_name = sources + i;
+                out[replies_count].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+                replies_count++;
+            }
+            for(unsigned int sent = 0; sent < replies_count;)
+            {
+                int result = sendmmsg(responder.descriptor, out + sent, replies_count - sent, 0);
+                if(result <= 0)
+                {
+                    break; // Replies that cannot be sent are lost like on a congested network
+                }
+                sent += result;
+                responder.local.replied += result;
+            }
+        }
+        if(delayed)
+        {
+            timed_ring_handle(&responder.ring, send_delayed);
+        }
+    }
+    publish_stats(slot);
+}
+
+void socket_setup()
+{
+    struct sockaddr_storage *addr = &responder.cmd_args.bind_addr;
+    responder.descriptor = socket(addr->ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if(responder.descriptor < 0)
+    {
+        perror("Failed to create socket");
+        exit(EXIT_FAILURE);
+    }
+    int reuse = 1;
+    if(setsockopt(responder.descriptor, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0)
+    {
+        perror("Failed to enable port reuse");
+        exit(EXIT_FAILURE);
+    }
+    if(responder.cmd_args.rcvbuf > 0)
+    {
+        setsockopt(responder.descriptor, SOL_SOCKET, SO_RCVBUF, &responder.cmd_args.rcvbuf,
+                   sizeof(responder.cmd_args.rcvbuf));
+    }
+    if(responder.cmd_args.sndbuf > 0)
+    {
+        setsockopt(responder.descriptor, SOL_SOCKET, SO_SNDBUF, &responder.cmd_args.sndbuf,
+                   sizeof(responder.cmd_args.sndbuf));
+    }
+    if(bind(responder.descriptor, (struct sockaddr*)addr, sockaddr_storage_size(addr)) != 0)
+    {
+        fprintf(stderr, "Failed to bind to %s: %s\n", sockaddr2str(addr), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    responder.listener = -1;
+    if(!responder.cmd_args.tcp)
+    {
+        return;
+    }
+    responder.listener = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if(responder.listener < 0
+       || setsockopt(responder.listener, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0
+       || bind(responder.listener, (struct sockaddr*)addr, sockaddr_storage_size(addr)) != 0
+       || listen(responder.listener, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Failed to listen on %s: %s\n", sockaddr2str(addr), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void handle_signal(int signum)
+{
+    responder_stop = 1;
+}
+
+void print_stats(responder_stats_t *total, responder_stats_t *previous, double elapsed, bool final)
+{
+    bzero(total, sizeof(*total));
+    for(size_t i = 0; i < responder.cmd_args.processes; i++)
+    {
+        responder_stats_t *slot = responder.stats + i;
+        total->received += __atomic_load_n(&slot->received, __ATOMIC_RELAXED);
+        total->replied += __atomic_load_n(&slot->replied, __ATOMIC_RELAXED);
+        total->lost += __atomic_load_n(&slot->lost, __ATOMIC_RELAXED);
+        total->limited += __atomic_load_n(&slot->limited, __ATOMIC_RELAXED);
+        total->invalid += __atomic_load_n(&slot->invalid, __ATOMIC_RELAXED);
+        total->overflow += __atomic_load_n(&slot->overflow, __ATOMIC_RELAXED);
+    }
+    if(final)
+    {
+        fprintf(stderr, "Received: %zu, replied: %zu, lost: %zu, limited: %zu, invalid: %zu, overflow: %zu\n",
+                total->received, total->replied, total->lost, total->limited, total->invalid, total->overflow);
+    }
+    else if(!responder.cmd_args.quiet)
+    {
+        fprintf(stderr, "Received: %.0f qps, replied: %.0f qps, lost: %zu, limited: %zu, invalid: %zu, overflow: %zu\n",
+                (total->received - previous->received) / elapsed, (total->replied - previous->replied) / elapsed,
+                total->lost, total->limited, total->invalid, total->overflow);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    parse_cmd(argc, argv);
+
+    size_t stats_size = responder.cmd_args.processes * sizeof(*responder.stats);
+    size_t rate_table_size = RESPONDER_RATE_TABLE_SIZE * sizeof(*responder.rate_table);
+    void *region = mmap(NULL, stats_size + rate_table_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED)
+    {
+        perror("Failed to map shared memory");
+        exit(EXIT_FAILURE);
+    }
+    responder.stats = region;
+    responder.rate_table = (uint64_t*)((uint8_t*)region + stats_size);
+
+    struct sigaction action;
+    bzero(&action, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // Every process binds its own socket, the kernel distributes queries among them by their source address and port.
+    responder.pids = safe_calloc(responder.cmd_args.processes * sizeof(*responder.pids));
+    for(size_t i = 0; i < responder.cmd_args.processes; i++)
+    {
+        pid_t pid = fork();
+        if(pid < 0)
+        {
+            perror("Failed to fork");
+            exit(EXIT_FAILURE);
+        }
+        if(pid == 0)
+        {
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            socket_setup();
+            serve(i);
+            exit(EXIT_SUCCESS);
+        }
+        responder.pids[i] = pid;
+    }
+
+    if(!responder.cmd_args.quiet)
+    {
+        fprintf(stderr, "Answering on %s with %zu process(es).\n", sockaddr2str(&responder.cmd_args.bind_addr),
+                responder.cmd_args.processes);
+    }
+
+    responder_stats_t total, previous;
+    bzero(&previous, sizeof(previous));
+    uint64_t last = monotonic_ns();
+    while(!responder_stop)
+    {
+        sleep(1);
+        uint64_t now = monotonic_ns();
+        print_stats(&total, &previous, (now - last) / (double)TIMED_RING_S, false);
+        previous = total;
+        last = now;
+
+        // Terminate if a process has failed, e.g. because the address could not be bound
+        if(waitpid(-1, NULL, WNOHANG) > 0)
+        {
+            responder_stop = 1;
+        }
+    }
+
+    for(size_t i = 0; i < responder.cmd_args.processes; i++)
+    {
+        kill(responder.pids[i], SIGTERM);
+    }
+    while(wait(NULL) > 0);
+    print_stats(&total, &previous, 0, true);
+
+    munmap(region, stats_size + rate_table_size);
+    free(responder.pids);
+    return EXIT_SUCCESS;
+}
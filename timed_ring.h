@@ -15,6 +15,14 @@
 #define TIMED_RING_US 1000
 #define TIMED_RING_NS 1
 
+// Monotonic timestamp in nanoseconds, e.g. for measuring round-trip times
+static inline uint64_t monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * TIMED_RING_S + (uint64_t)now.tv_nsec;
+}
+
 typedef struct
 {
     void **data;
@@ -106,6 +114,19 @@ void **timed_ring_add(timed_ring_t *ring, time_t in, void *ptr)
     }
 }
 
+// Number of entries within all buckets, including removed entries which are only discarded once their bucket is handled
+size_t timed_ring_occupancy(timed_ring_t *ring, size_t *bucket_max)
+{
+    size_t total = 0;
+    *bucket_max = 0;
+    for(size_t i = 0; i < ring->bucket_count; i++)
+    {
+        total += ring->buckets[i].count;
+        *bucket_max = max(*bucket_max, ring->buckets[i].count);
+    }
+    return total;
+}
+
 static inline void timed_ring_handle_helper(timed_ring_t *ring, timed_ring_bucket_t *bucket, void (*callback)(void*))
 {
     // Copy everything because the callback function might add another entry to the same bucket
@@ -0,0 +1,247 @@
+#ifndef MASSDNS_WILDCARD_H
+#define MASSDNS_WILDCARD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "casefold.h"
+#include "dns.h"
+#include "hashmap.h"
+#include "security.h"
+
+// Wildcard detection: Every name below a zone with a wildcard record resolves to the records of the wildcard. The
+// parent zone of each name is therefore probed once with a random label and the answers to the probe are remembered
+// as hashes of their type and data. Replies whose answers are all contained within that set are wildcard answers.
+// The zones are kept within a cache of fixed capacity, evicting zones by the clock algorithm.
+
+#define WILDCARD_MAX_ANSWERS 16 // Answer records of a wildcard that are remembered, further ones are ignored
+
+typedef enum
+{
+    WILDCARD_PROBING, // The probe of the zone is in flight
+    WILDCARD_NONE, // The zone does not have a wildcard or the probe has failed
+    WILDCARD_FOUND
+} wildcard_state_t;
+
+typedef struct
+{
+    size_t hits; // New lookups whose zone is within the cache, which spares a probe
+    size_t misses; // New lookups whose zone is not within the cache
+    size_t evictions;
+    size_t uncached; // Names that have not been checked because every zone within the cache was being probed
+    size_t probes;
+    size_t found; // Probes that have revealed a wildcard
+    size_t filtered; // Replies that have been dropped because they only consist of wildcard answers
+    size_t skipped; // Names that have not been resolved because their zone has a wildcard
+} wildcard_stats_t;
+
+typedef struct
+{
+    dns_name_t zone; // Case-folded name of the zone, which is the key within the index
+    wildcard_state_t state;
+    bool referenced; // Second chance within the clock eviction
+    size_t answer_count;
+    uint64_t answers[WILDCARD_MAX_ANSWERS];
+    void *waiting; // Lookups waiting for the probe to finish, linked by the owner of the cache
+} wildcard_zone_t;
+
+typedef struct
+{
+    wildcard_zone_t *zones;
+    size_t capacity;
+    size_t used;
+    size_t hand; // Next zone to be considered for eviction
+    Hashmap *index;
+    wildcard_stats_t stats;
+} wildcard_cache_t;
+
+int wildcard_hash_zone(void *key)
+{
+    dns_name_t *zone = key;
+    return (int) hash_bytes(zone->name, zone->length, 0);
+}
+
+bool wildcard_zones_eq(void *key1, void *key2)
+{
+    dns_name_t *zone1 = key1;
+    dns_name_t *zone2 = key2;
+    return zone1->length == zone2->length && memcmp(zone1->name, zone2->name, zone1->length) == 0;
+}
+
+// Writes the case-folded parent zone of a name in text form to zone. Returns false if the name has a single label,
+// as wildcards directly below the root zone are not checked.
+bool wildcard_parent(dns_name_t *zone, dns_name_t *name)
+{
+    size_t i = 0;
+    while(i < name->length && name->name[i] != '.')
+    {
+        // Escaped dots do not end the label
+        i += name->name[i] == '\\' ? 2 : 1;
+    }
+    if(i + 2 >= name->length)
+    {
+        return false;
+    }
+    zone->length = (uint8_t) (name->length - i - 1);
+    casefold(zone->name, name->name + i + 1, zone->length);
+    zone->name[zone->length] = 0;
+    return true;
+}
+
+bool wildcard_cache_init(wildcard_cache_t *cache, size_t capacity)
+{
+    bzero(cache, sizeof(*cache));
+    cache->index = hashmapCreate(capacity, wildcard_hash_zone, wildcard_zones_eq);
+    if(cache->index == NULL)
+    {
+        return false;
+    }
+    cache->zones = safe_calloc(capacity * sizeof(*cache->zones));
+    cache->capacity = capacity;
+    return true;
+}
+
+void wildcard_cache_free(wildcard_cache_t *cache)
+{
+    if(cache->index)
+    {
+        hashmapFree(cache->index);
+    }
+    free(cache->zones);
+    cache->index = NULL;
+    cache->zones = NULL;
+}
+
+// Looks up a zone without accounting it as a hit or miss, such as for filtering replies.
+wildcard_zone_t *wildcard_cache_find(wildcard_cache_t *cache, dns_name_t *zone)
+{
+    return hashmapGet(cache->index, zone);
+}
+
+// Looks up the zone of a new lookup, a hit spares a probe.
+wildcard_zone_t *wildcard_cache_get(wildcard_cache_t *cache, dns_name_t *zone)
+{
+    wildcard_zone_t *entry = wildcard_cache_find(cache, zone);
+    if(entry == NULL)
+    {
+        cache->stats.misses++;
+        return NULL;
+    }
+    cache->stats.hits++;
+    entry->referenced = true;
+    return entry;
+}
+
+// Adds a zone that is about to be probed. Zones are evicted by the clock algorithm, skipping zones that are being
+// probed. Returns NULL if every zone is being probed.
+wildcard_zone_t *wildcard_cache_insert(wildcard_cache_t *cache, dns_name_t *zone)
+{
+    wildcard_zone_t *entry = NULL;
+    if(cache->used < cache->capacity)
+    {
+        entry = cache->zones + cache->used++;
+    }
+    else
+    {
+        // Two rounds suffice for finding a zone whose second chance has been used up within the first round.
+        for(size_t i = 0; i < 2 * cache->capacity; i++)
+        {
+            wildcard_zone_t *candidate = cache->zones + cache->hand;
+            cache->hand = (cache->hand + 1) % cache->capacity;
+            if(candidate->state == WILDCARD_PROBING)
+            {
+                continue;
+            }
+            if(candidate->referenced)
+            {
+                candidate->referenced = false;
+                continue;
+            }
+            hashmapRemove(cache->index, &candidate->zone);
+            cache->stats.evictions++;
+            entry = candidate;
+            break;
+        }
+        if(entry == NULL)
+        {
+            cache->stats.uncached++;
+            return NULL;
+        }
+    }
+
+    entry->zone = *zone;
+    entry->state = WILDCARD_PROBING;
+    entry->referenced = false;
+    entry->answer_count = 0;
+    entry->waiting = NULL;
+    hashmapPut(cache->index, &entry->zone, entry);
+    cache->stats.probes++;
+    return entry;
+}
+
+bool wildcard_zone_contains(wildcard_zone_t *zone, uint64_t hash)
+{
+    for(size_t i = 0; i < zone->answer_count; i++)
+    {
+        if(zone->answers[i] == hash)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Finishes the probe of a zone with its reply, which has been parsed up to the first record at next.
+void wildcard_zone_learn(wildcard_cache_t *cache, wildcard_zone_t *zone, dns_head_t *head, uint8_t *begin,
+                         size_t len, uint8_t *next)
+{
+    dns_record_iter_t iter;
+    dns_record_view_t rec;
+
+    zone->answer_count = 0;
+    if(head->header.rcode == DNS_RCODE_OK)
+    {
+        dns_record_iter_init(&iter, begin, len, next, &head->header);
+        while(zone->answer_count < WILDCARD_MAX_ANSWERS && dns_record_iter_next(&iter, &rec)
+              && rec.section == DNS_SECTION_ANSWER)
+        {
+            uint64_t hash = dns_record_view_hash(&rec, begin, begin + len);
+            if(!wildcard_zone_contains(zone, hash))
+            {
+                zone->answers[zone->answer_count++] = hash;
+            }
+        }
+    }
+    zone->state = zone->answer_count > 0 ? WILDCARD_FOUND : WILDCARD_NONE;
+    if(zone->state == WILDCARD_FOUND)
+    {
+        cache->stats.found++;
+    }
+}
+
+// Whether a reply has at least one answer and only consists of answers of the wildcard of the zone.
+bool wildcard_zone_matches(wildcard_zone_t *zone, dns_head_t *head, uint8_t *begin, size_t len, uint8_t *next)
+{
+    dns_record_iter_t iter;
+    dns_record_view_t rec;
+    bool answered = false;
+
+    if(zone->state != WILDCARD_FOUND)
+    {
+        return false;
+    }
+    dns_record_iter_init(&iter, begin, len, next, &head->header);
+    while(dns_record_iter_next(&iter, &rec) && rec.section == DNS_SECTION_ANSWER)
+    {
+        if(!wildcard_zone_contains(zone, dns_record_view_hash(&rec, begin, begin + len)))
+        {
+            return false;
+        }
+        answered = true;
+    }
+    return answered;
+}
+
+#endif //MASSDNS_WILDCARD_H